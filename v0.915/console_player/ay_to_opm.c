@@ -1,27 +1,15 @@
 #include "ay_to_opm.h"
-#include "spfm.h"
 #include "chiptype.h"
 #include <math.h>
 #include <stdio.h>
 #include <string.h>
 
 // --- Internal State ---
-static uint8_t _regs[16];
-static double _clock_ratio;
-static uint32_t _source_clock;
-static chip_type_t _source_chip;
-static uint8_t _opm_slot;
-static int _fdiv;
-static opm_write_func_t _write_func;
+static YASP_THREAD_LOCAL ay_to_opm_state_t _st = {.envelope_period = 1};
+static YASP_THREAD_LOCAL reg_batch_t* _out;
+// A player setting, shared by all threads
 static ay_stereo_mode_t _current_stereo_mode = AY_STEREO_ABC; // Default stereo mode
 
-// Envelope state
-static int _envelope_counter = 0;
-static int _envelope_period = 1;
-static int _envelope_shape = 0;
-static int _envelope_segment = 0;
-static int _envelope_value = 0;
-
 typedef enum {
     CSlideUp,
     CSlideDown,
@@ -53,8 +41,8 @@ static const char* STEREO_MODE_NAMES[] = {
 
 // --- Helper Functions ---
 static void _y(uint8_t addr, uint8_t data) {
-    if (_write_func) {
-        _write_func(addr, data);
+    if (_out) {
+        REG_BATCH_ADD(_out, REG_BATCH_CMD_OPM, addr, data);
     }
 }
 
@@ -62,6 +50,32 @@ static int toOpmCh(int psgCh) {
     return psgCh + OPM_CH_BASE;
 }
 
+// Pan for AY channels A, B, C in the given stereo mode
+static void _get_channel_pans(ay_stereo_mode_t mode, uint8_t ch_pan[3]) {
+    switch (mode) {
+        case AY_STEREO_ABC:
+            ch_pan[0] = OPM_PAN_LEFT; ch_pan[1] = OPM_PAN_CENTER; ch_pan[2] = OPM_PAN_RIGHT;
+            break;
+        case AY_STEREO_ACB:
+            ch_pan[0] = OPM_PAN_LEFT; ch_pan[2] = OPM_PAN_CENTER; ch_pan[1] = OPM_PAN_RIGHT;
+            break;
+        case AY_STEREO_BAC:
+            ch_pan[1] = OPM_PAN_LEFT; ch_pan[0] = OPM_PAN_CENTER; ch_pan[2] = OPM_PAN_RIGHT;
+            break;
+        case AY_STEREO_MONO:
+        default:
+            ch_pan[0] = OPM_PAN_CENTER; ch_pan[1] = OPM_PAN_CENTER; ch_pan[2] = OPM_PAN_CENTER;
+            break;
+    }
+}
+
+// Panning depends on the stereo mode setting, so leave it to the player
+static void _write_pan(int opmCh, uint8_t ay_mask) {
+    if (_out) {
+        REG_BATCH_ADD(_out, VGM_CMD_OPM_AY_PAN, 0x20 + opmCh, ay_mask);
+    }
+}
+
 // Re-implement freqToOPMNote from opm_freq.ts logic
 static void freqToOPMNote(double freq, double clockRatio, uint8_t* kc, uint8_t* kf) {
     const double BASE_FREQ_OPM = 277.2; // C#4 = 60
@@ -81,69 +95,41 @@ static void freqToOPMNote(double freq, double clockRatio, uint8_t* kc, uint8_t*
 }
 
 static void _updateFreq(int ch, double freq) {
+    if (!_out) return;
     uint8_t kc, kf;
-    freqToOPMNote(freq, _clock_ratio, &kc, &kf);
+    freqToOPMNote(freq, _st.clock_ratio, &kc, &kf);
     int opmCh = toOpmCh(ch);
     _y(0x28 + opmCh, kc);
     _y(0x30 + opmCh, kf << 2);
 }
 
 static void _updateNoise() {
+    if (!_out) return;
     int nVol = 0;
-    bool noise_on_left = false;
-    bool noise_on_right = false;
-
-    uint8_t ch_pan_map[3]; // Pan for AY channels A, B, C
-    // This logic duplicates the start of ay_to_opm_set_stereo_mode to get the current pan map
-    switch (_current_stereo_mode) {
-        case AY_STEREO_ABC: ch_pan_map[0] = OPM_PAN_LEFT; ch_pan_map[1] = OPM_PAN_CENTER; ch_pan_map[2] = OPM_PAN_RIGHT; break;
-        case AY_STEREO_ACB: ch_pan_map[0] = OPM_PAN_LEFT; ch_pan_map[2] = OPM_PAN_CENTER; ch_pan_map[1] = OPM_PAN_RIGHT; break;
-        case AY_STEREO_BAC: ch_pan_map[1] = OPM_PAN_LEFT; ch_pan_map[0] = OPM_PAN_CENTER; ch_pan_map[2] = OPM_PAN_RIGHT; break;
-        default: /* MONO */ ch_pan_map[0] = OPM_PAN_CENTER; ch_pan_map[1] = OPM_PAN_CENTER; ch_pan_map[2] = OPM_PAN_CENTER; break;
-    }
+    uint8_t noise_mask = 0; // AY channels with noise enabled
 
     for (int i = 0; i < 3; i++) {
         // Check if noise is enabled for this AY channel
-        if ((_regs[7] & (0x8 << i)) == 0) {
+        if ((_st.regs[7] & (0x8 << i)) == 0) {
             // Aggregate the max volume from all enabled channels
-            nVol = fmax(nVol, _regs[8 + i] & 0xf);
-            
-            // Determine the stereo position based on the channel's panning
-            uint8_t pan = ch_pan_map[i];
-            if (pan == OPM_PAN_LEFT || pan == OPM_PAN_CENTER) {
-                noise_on_left = true;
-            }
-            if (pan == OPM_PAN_RIGHT || pan == OPM_PAN_CENTER) {
-                noise_on_right = true;
-            }
+            nVol = fmax(nVol, _st.regs[8 + i] & 0xf);
+            // The noise is heard wherever these channels are panned
+            noise_mask |= 1 << i;
         }
     }
 
-    // Determine final noise panning
-    uint8_t final_noise_pan = 0;
-    if (noise_on_left && noise_on_right) {
-        final_noise_pan = OPM_PAN_CENTER;
-    } else if (noise_on_left) {
-        final_noise_pan = OPM_PAN_LEFT;
-    } else if (noise_on_right) {
-        final_noise_pan = OPM_PAN_RIGHT;
-    } else {
-        // If no channels have noise, volume will be 0, effectively muting it.
-        // We can set pan to center as a default.
-        final_noise_pan = OPM_PAN_CENTER;
-    }
-
-    int nfreq = _regs[6] & 0x1f;
+    int nfreq = _st.regs[6] & 0x1f;
     const int opmNoiseCh = 7;
     _y(0x0f, 0x80 | (0x1f - nfreq)); // Set noise frequency for OPM
-    _y(0x20 + opmNoiseCh, (final_noise_pan & 0xC0) | 0x3C); // Set noise channel panning
+    _write_pan(opmNoiseCh, noise_mask); // Set noise channel panning
     _y(0x78 + opmNoiseCh, fmin(127, N_VOL_TO_TL[nVol])); // Set noise volume on C2 of channel 8
 }
 
 static void _updateTone(int ch) {
-    const int v = _regs[8 + ch];
-    const int tone_enabled = ((1 << ch) & _regs[7]) == 0;
-    const int envelope_as_waveform = (v & 0x10) && (_envelope_period < 200);
+    if (!_out) return;
+    const int v = _st.regs[8 + ch];
+    const int tone_enabled = ((1 << ch) & _st.regs[7]) == 0;
+    const int envelope_as_waveform = (v & 0x10) && (_st.envelope_period < 200);
 
     int opmCh = toOpmCh(ch);
 
@@ -155,7 +141,7 @@ static void _updateTone(int ch) {
                 tVol = 15; 
             } else {
                 // When envelope is just for volume, use its current value.
-                tVol = _envelope_value >> 1;
+                tVol = _st.envelope_value >> 1;
             }
         } else {
             // Fixed volume.
@@ -169,30 +155,30 @@ static void _updateTone(int ch) {
 }
 
 static void _reset_envelope_segment() {
-    envelope_proc_t proc = ENVELOPE_SHAPES[_envelope_shape][_envelope_segment];
+    envelope_proc_t proc = ENVELOPE_SHAPES[_st.envelope_shape][_st.envelope_segment];
     if (proc == CSlideDown || proc == CHoldTop) {
-        _envelope_value = 31;
+        _st.envelope_value = 31;
     } else {
-        _envelope_value = 0;
+        _st.envelope_value = 0;
     }
 }
 
 void ay_to_opm_update_envelope(void) {
-    _envelope_counter++;
-    if (_envelope_counter >= _envelope_period) {
-        _envelope_counter = 0;
-        switch (ENVELOPE_SHAPES[_envelope_shape][_envelope_segment]) {
+    _st.envelope_counter++;
+    if (_st.envelope_counter >= _st.envelope_period) {
+        _st.envelope_counter = 0;
+        switch (ENVELOPE_SHAPES[_st.envelope_shape][_st.envelope_segment]) {
             case CSlideUp:
-                _envelope_value++;
-                if (_envelope_value > 31) {
-                    _envelope_segment ^= 1;
+                _st.envelope_value++;
+                if (_st.envelope_value > 31) {
+                    _st.envelope_segment ^= 1;
                     _reset_envelope_segment();
                 }
                 break;
             case CSlideDown:
-                _envelope_value--;
-                if (_envelope_value < 0) {
-                    _envelope_segment ^= 1;
+                _st.envelope_value--;
+                if (_st.envelope_value < 0) {
+                    _st.envelope_segment ^= 1;
                     _reset_envelope_segment();
                 }
                 break;
@@ -203,37 +189,70 @@ void ay_to_opm_update_envelope(void) {
         }
         // Update tone volumes if they are in envelope mode
         for (int i = 0; i < 3; i++) {
-            if (_regs[8 + i] & 0x10) {
+            if (_st.regs[8 + i] & 0x10) {
                 _updateTone(i);
             }
         }
     }
 }
 
+void ay_to_opm_skip_envelope(uint32_t samples) {
+    // The first step comes when the counter reaches the period, then one every period
+    uint32_t period = _st.envelope_period > 1 ? (uint32_t)_st.envelope_period : 1;
+    uint32_t to_first = (uint32_t)_st.envelope_counter + 1 >= period ? 1 : period - (uint32_t)_st.envelope_counter;
+    if (samples < to_first) {
+        _st.envelope_counter += samples;
+        return;
+    }
+    uint32_t steps = 1 + (samples - to_first) / period;
+    _st.envelope_counter = (samples - to_first) % period;
+
+    while (steps > 0) {
+        envelope_proc_t proc = ENVELOPE_SHAPES[_st.envelope_shape][_st.envelope_segment];
+        if (proc == CHoldTop || proc == CHoldBottom) break;
+        // Steps until the slide runs past its end and the segment changes
+        int left = (proc == CSlideUp) ? 32 - _st.envelope_value : _st.envelope_value + 1;
+        if (left < 1) left = 1;
+        if (steps < (uint32_t)left) {
+            _st.envelope_value += (proc == CSlideUp) ? (int)steps : -(int)steps;
+            break;
+        }
+        steps -= left;
+        _st.envelope_segment ^= 1;
+        _reset_envelope_segment();
+        // Two slides repeat every 64 steps from the start of a segment
+        envelope_proc_t other = ENVELOPE_SHAPES[_st.envelope_shape][_st.envelope_segment ^ 1];
+        if (other == CSlideUp || other == CSlideDown) steps %= 64;
+    }
+}
 
 // --- Public API ---
 
-void ay_to_opm_init(chip_type_t source_chip_type, uint32_t source_clock, opm_write_func_t write_func) {
-    _source_chip = source_chip_type;
-    _source_clock = source_clock;
-    _opm_slot = get_slot_for_chip(CHIP_TYPE_YM2151); // Still useful for direct hardware access if needed
-    _write_func = write_func;
+void ay_to_opm_init(chip_type_t source_chip_type, uint32_t source_clock, reg_batch_t* out) {
+    memset(&_st, 0, sizeof(_st));
+    _st.envelope_period = 1;
+    _st.source_chip = source_chip_type;
+    _st.source_clock = source_clock;
+    _st.opm_slot = get_slot_for_chip(CHIP_TYPE_YM2151); // Still useful for direct hardware access if needed
+    _out = out;
 
     const double OPM_CLOCK = get_chip_default_clock(CHIP_TYPE_YM2151);
-    _clock_ratio = (double)source_clock / OPM_CLOCK;
-    // _fdiv is no longer used in frequency calculation, but we keep it for historical context or future use.
-    _fdiv = (_source_chip == CHIP_TYPE_AY8910) ? 2 : 4;
+    _st.clock_ratio = (double)source_clock / OPM_CLOCK;
+    // _st.fdiv is no longer used in frequency calculation, but we keep it for historical context or future use.
+    _st.fdiv = (_st.source_chip == CHIP_TYPE_AY8910) ? 2 : 4;
 
-    memset(_regs, 0, sizeof(_regs));
 
     // --- Initial Commands ---
-    // Set initial panning and other channel params
-    ay_to_opm_set_stereo_mode(_current_stereo_mode);
+    // Set initial panning for the tone channels 4, 5, 6 and the noise channel
+    for (int i = 0; i < 3; i++) {
+        _write_pan(toOpmCh(i), 1 << i);
+    }
+    _updateNoise();
 
     // PSG TONE Channels (4, 5, 6)
     for (int i = 0; i < 3; i++) {
         int opmCh = toOpmCh(i);
-        // Panning is now set by ay_to_opm_set_stereo_mode, which is called right before this loop.
+        // Panning is set right before this loop.
         // The following writes initialize the voice properties.
         _y(0x40 + opmCh, 0x02); // M1: DT=0 ML=2
         _y(0x50 + opmCh, 0x01); // C1: DT=0 ML=1
@@ -265,14 +284,14 @@ void ay_to_opm_init(chip_type_t source_chip_type, uint32_t source_clock, opm_wri
 }
 
 static void _recalculate_freq(int ch) {
-    const int v = _regs[8 + ch];
+    const int v = _st.regs[8 + ch];
     // Check if channel is in envelope mode and envelope period is short
-    if ((v & 0x10) && _envelope_period < 200) {
+    if ((v & 0x10) && _st.envelope_period < 200) {
         // Shapes 8, 9, 11, 12, 13, 15 are single-cycle (32 steps)
         // Shapes 10, 14 are dual-cycle (64 steps)
         // Other shapes are one-shot, don't treat as waveform
         int steps = 0;
-        switch (_envelope_shape) {
+        switch (_st.envelope_shape) {
             case 8: case 11: case 12: case 13: // Sawtooth waves
                 steps = 32;
                 break;
@@ -292,18 +311,18 @@ static void _recalculate_freq(int ch) {
         }
 
         if (steps > 0) {
-            const double freq = (double)_source_clock / (16.0 * _envelope_period * steps);
+            const double freq = (double)_st.source_clock / (16.0 * _st.envelope_period * steps);
             _updateFreq(ch, freq);
             return; // Use envelope frequency
         }
     }
 
     // Default to tone period frequency
-    const int tp = ((_regs[ch * 2 + 1] & 0x0F) << 8) | _regs[ch * 2];
+    const int tp = ((_st.regs[ch * 2 + 1] & 0x0F) << 8) | _st.regs[ch * 2];
     if (tp == 0) {
         _updateFreq(ch, 0);
     } else {
-        const double freq = (double)_source_clock / (16.0 * tp);
+        const double freq = (double)_st.source_clock / (16.0 * tp);
         _updateFreq(ch, freq);
     }
 }
@@ -311,8 +330,8 @@ static void _recalculate_freq(int ch) {
 void ay_to_opm_write_reg(uint8_t addr, uint8_t data) {
     if (addr > 15) return;
 
-    uint8_t old_data = _regs[addr];
-    _regs[addr] = data;
+    uint8_t old_data = _st.regs[addr];
+    _st.regs[addr] = data;
 
     if (addr <= 5) { // Tone period
         int ch = addr >> 1;
@@ -320,11 +339,11 @@ void ay_to_opm_write_reg(uint8_t addr, uint8_t data) {
         _updateTone(ch); // FIX: Ensure volume is updated on frequency change to prevent dropped notes in fast arpeggios.
 
         // FIX: Re-trigger one-shot envelopes on note change to prevent fade-out on fast arpeggios.
-        if ((_regs[8 + ch] & 0x10)) { // If channel uses envelope
+        if ((_st.regs[8 + ch] & 0x10)) { // If channel uses envelope
             // Repeating shapes are 8, 10, 12, 14. All others are one-shot and need reset.
-            if (!(_envelope_shape == 8 || _envelope_shape == 10 || _envelope_shape == 12 || _envelope_shape == 14)) {
-                _envelope_counter = 0;
-                _envelope_segment = 0;
+            if (!(_st.envelope_shape == 8 || _st.envelope_shape == 10 || _st.envelope_shape == 12 || _st.envelope_shape == 14)) {
+                _st.envelope_counter = 0;
+                _st.envelope_segment = 0;
                 _reset_envelope_segment();
             }
         }
@@ -347,10 +366,10 @@ void ay_to_opm_write_reg(uint8_t addr, uint8_t data) {
                 _y(0x08, (0xf << 3) | opmCh); // KEY ON all slots
 
                 // If this channel uses a one-shot envelope, reset it.
-                if ((_regs[8 + i] & 0x10)) {
-                    if (!(_envelope_shape == 8 || _envelope_shape == 10 || _envelope_shape == 12 || _envelope_shape == 14)) {
-                        _envelope_counter = 0;
-                        _envelope_segment = 0;
+                if ((_st.regs[8 + i] & 0x10)) {
+                    if (!(_st.envelope_shape == 8 || _st.envelope_shape == 10 || _st.envelope_shape == 12 || _st.envelope_shape == 14)) {
+                        _st.envelope_counter = 0;
+                        _st.envelope_segment = 0;
                         _reset_envelope_segment();
                     }
                 }
@@ -364,16 +383,16 @@ void ay_to_opm_write_reg(uint8_t addr, uint8_t data) {
         _updateTone(2);
         _updateNoise();
     } else if (addr == 11 || addr == 12) { // Envelope period
-        _envelope_period = (_regs[12] << 8) | _regs[11];
-        if (_envelope_period == 0) _envelope_period = 1;
+        _st.envelope_period = (_st.regs[12] << 8) | _st.regs[11];
+        if (_st.envelope_period == 0) _st.envelope_period = 1;
         // Recalculate freq for all channels as envelope period affects them
         _recalculate_freq(0);
         _recalculate_freq(1);
         _recalculate_freq(2);
     } else if (addr == 13) { // Envelope shape
-        _envelope_shape = data & 0x0f;
-        _envelope_counter = 0;
-        _envelope_segment = 0;
+        _st.envelope_shape = data & 0x0f;
+        _st.envelope_counter = 0;
+        _st.envelope_segment = 0;
         _reset_envelope_segment();
         // Recalculate freq for all channels as envelope shape affects them
         _recalculate_freq(0);
@@ -382,6 +401,24 @@ void ay_to_opm_write_reg(uint8_t addr, uint8_t data) {
     }
 }
 
+void ay_to_opm_write_batch(const reg_batch_t* in) {
+    for (size_t i = 0; i < in->count; i++) {
+        const reg_write_t* w = &in->writes[i];
+        if (w->cmd != REG_BATCH_CMD_AY) continue;
+        if (_out) _out->time = w->time; // Keep the source time through the chain
+        ay_to_opm_write_reg(w->addr, w->data);
+    }
+}
+
+void ay_to_opm_save(ay_to_opm_state_t* state) {
+    memcpy(state, &_st, sizeof(_st));
+}
+
+void ay_to_opm_restore(const ay_to_opm_state_t* state, reg_batch_t* out) {
+    memcpy(&_st, state, sizeof(_st));
+    _out = out;
+}
+
 const char* ay_to_opm_get_stereo_mode_name(ay_stereo_mode_t mode) {
     if (mode >= 0 && mode < AY_STEREO_MODE_COUNT) {
         return STEREO_MODE_NAMES[mode];
@@ -389,35 +426,23 @@ const char* ay_to_opm_get_stereo_mode_name(ay_stereo_mode_t mode) {
     return "Invalid";
 }
 
+// Only records the mode. The player applies it to the tagged pan writes of the track
+// being played (see opm_param_sync), so changing it does not need a reconversion.
 void ay_to_opm_set_stereo_mode(ay_stereo_mode_t mode) {
     _current_stereo_mode = mode;
-    if (!_write_func) return; // Don't do anything if not initialized
-
-    uint8_t ch_pan[3]; // Pan for AY channels A, B, C
+}
 
-    switch (mode) {
-        case AY_STEREO_ABC:
-            ch_pan[0] = OPM_PAN_LEFT; ch_pan[1] = OPM_PAN_CENTER; ch_pan[2] = OPM_PAN_RIGHT;
-            break;
-        case AY_STEREO_ACB:
-            ch_pan[0] = OPM_PAN_LEFT; ch_pan[2] = OPM_PAN_CENTER; ch_pan[1] = OPM_PAN_RIGHT;
-            break;
-        case AY_STEREO_BAC:
-            ch_pan[1] = OPM_PAN_LEFT; ch_pan[0] = OPM_PAN_CENTER; ch_pan[2] = OPM_PAN_RIGHT;
-            break;
-        case AY_STEREO_MONO:
-        default:
-            ch_pan[0] = OPM_PAN_CENTER; ch_pan[1] = OPM_PAN_CENTER; ch_pan[2] = OPM_PAN_CENTER;
-            break;
-    }
+ay_stereo_mode_t ay_to_opm_get_stereo_mode(void) {
+    return _current_stereo_mode;
+}
 
-    // Apply panning to OPM channels 4, 5, 6
+uint8_t ay_to_opm_get_pan(uint8_t ay_mask) {
+    uint8_t ch_pan[3];
+    uint8_t pan = 0;
+    _get_channel_pans(_current_stereo_mode, ch_pan);
     for (int i = 0; i < 3; i++) {
-        int opmCh = toOpmCh(i);
-        // RL bits are the top 2. FB=7, CON=4. So 0x3C is the base.
-        _y(0x20 + opmCh, (ch_pan[i] & 0xC0) | 0x3C);
+        if (ay_mask & (1 << i)) pan |= ch_pan[i];
     }
-    
-    // Update noise panning as well, since it depends on the tone channels' panning
-    _updateNoise();
+    // If no channels sound through it, its volume is 0 anyway. Use center as a default.
+    return pan ? pan : OPM_PAN_CENTER;
 }
@@ -3,6 +3,9 @@
 
 #include <stdint.h>
 #include "chiptype.h"
+#include "opm_param.h"
+#include "reg_batch.h"
+#include "thread.h"
 
 // AY Stereo Panning Modes
 typedef enum {
@@ -13,14 +16,41 @@ typedef enum {
     AY_STEREO_MODE_COUNT
 } ay_stereo_mode_t;
 
-// Callback function pointer for writing OPM data
-typedef void (*opm_write_func_t)(uint8_t addr, uint8_t data);
+// Converter state. Each thread has its own, so tracks can be converted on several threads at once.
+typedef struct {
+    uint8_t regs[16];
+    double clock_ratio;
+    uint32_t source_clock;
+    chip_type_t source_chip;
+    uint8_t opm_slot;
+    int fdiv;
+    // Envelope state
+    int envelope_counter;
+    int envelope_period;
+    int envelope_shape;
+    int envelope_segment;
+    int envelope_value;
+} ay_to_opm_state_t;
 
-void ay_to_opm_init(chip_type_t source_chip_type, uint32_t source_clock, opm_write_func_t write_func);
+// Converted writes are appended to out. Without an output batch only the state is updated.
+void ay_to_opm_init(chip_type_t source_chip_type, uint32_t source_clock, reg_batch_t* out);
 void ay_to_opm_write_reg(uint8_t addr, uint8_t data);
+// Converts every AY write in a batch produced by an earlier stage (sn_to_ay)
+void ay_to_opm_write_batch(const reg_batch_t* in);
 void ay_to_opm_update_envelope(void);
+// Leaves the envelope where that many ay_to_opm_update_envelope() calls would, without
+// the volume writes. Only for a converter that tracks the state alone.
+void ay_to_opm_skip_envelope(uint32_t samples);
+// Copies the state of this thread's converter, or replaces it and sets where its writes go.
+void ay_to_opm_save(ay_to_opm_state_t* state);
+void ay_to_opm_restore(const ay_to_opm_state_t* state, reg_batch_t* out);
 void ay_to_opm_set_stereo_mode(ay_stereo_mode_t mode);
+ay_stereo_mode_t ay_to_opm_get_stereo_mode(void);
 const char* ay_to_opm_get_stereo_mode_name(ay_stereo_mode_t mode);
 
+// OPM RL bits for an OPM channel sounding for the given AY channels (bit0=A ... bit2=C).
+// Panning is emitted as tagged VGM_CMD_OPM_AY_PAN commands and resolved by whoever sends them.
+uint8_t ay_to_opm_get_pan(uint8_t ay_mask);
+
 
 #endif /* AY_TO_OPM_H */
@@ -0,0 +1,884 @@
+// Converter regression and throughput bench.
+//
+// Runs every OPM converter over a small corpus of VGM files, decodes the
+// converted stream into (time, addr, data) lines and compares them with the
+// golden files next to each VGM. Any difference means the converted sound
+// changed. Each file is also converted on a worker thread while being read
+// back progressively, the way the player consumes a conversion in progress.
+// Conversion throughput is reported per converter, and the time of a conversion in
+// one piece against one split into segments per file. The cache optimiser is run
+// over every result and must leave the OPM register state the same at every
+// point in time; the size it saves is reported per file. It must also pass DAC
+// stream commands through without moving writes across them, and PCM writes must
+// convert to their waits. The optimised stream
+// is then written to a compressed cache container and read back through it,
+// and the compression ratio and decompression throughput are reported.
+// Last, the virtual SPFM device is fed fixed byte patterns, and the times at
+// which it applies each write must match its serial line and FIFO model, and an
+// S98v3 file is loaded and its header, devices and sync index are checked.
+//
+// Usage: conv_bench [--update] [--iterations N] [corpus_dir]
+//   --update      rewrite the golden files from the current converters
+//   --iterations  number of timed conversion runs per file (default 20)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "../error.h"
+#include "../util.h"
+#include "../vgm.h"
+#include "../vgm_convert.h"
+#include "../opm_param.h"
+#include "../vgm_stream.h"
+#include "../thread.h"
+#include "../file_window.h"
+#include "../opm_peephole.h"
+#include "../cache_pack.h"
+#include "../lz.h"
+#include "../spfm_virtual.h"
+#include "../s98.h"
+
+// util.c reads these, normally owned by main.c.
+volatile double g_speed_multiplier = 1.0;
+volatile int g_timer_mode = 0;
+
+// The bench links only the hardware-independent modules, so it supplies its own logger.
+void logging(enum loglevel_t loglevel, const char *format, ...) {
+    va_list arg;
+    if (loglevel < LOG_LEVEL_WARN) return;
+    va_start(arg, format);
+    vfprintf(stderr, format, arg);
+    va_end(arg);
+    fputc('\n', stderr);
+}
+
+typedef struct {
+    const char* converter;  // Converter chain the file must exercise
+    chip_type_t chip;       // Primary chip expected in the header
+    const char* file;       // VGM file in the corpus directory
+} bench_case_t;
+
+static const bench_case_t CASES[] = {
+    {"opn_to_opm",          CHIP_TYPE_YM2612,  "opn2_logo.vgm"},
+    {"opn_to_opm",          CHIP_TYPE_YM2612,  "opn2_energy_orb_loop.vgm"},
+    {"opn_to_opm",          CHIP_TYPE_YM2608,  "opna_treasure_chest.vgm"},
+    {"ay_to_opm",           CHIP_TYPE_AY8910,  "ay_red_cap.vgm"},
+    {"sn_to_ay->ay_to_opm", CHIP_TYPE_SN76489, "sn_level_start.vgm"},
+    {"sn_to_ay->ay_to_opm", CHIP_TYPE_SN76489, "sn_game_over.vgm"},
+    {"ws_to_opm",           CHIP_TYPE_WSWAN,   "ws_key_item.vgm"},
+};
+#define NUM_CASES (sizeof(CASES) / sizeof(CASES[0]))
+
+typedef struct {
+    const char* converter;
+    uint64_t source_bytes;
+    uint64_t opm_writes;
+    uint64_t elapsed_us;
+} bench_total_t;
+
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+} text_buf_t;
+
+static void text_printf(text_buf_t* t, const char* format, ...) {
+    char line[128];
+    va_list arg;
+    va_start(arg, format);
+    int n = vsnprintf(line, sizeof(line), format, arg);
+    va_end(arg);
+    if (n < 0) return;
+    if (t->len + n + 1 > t->cap) {
+        t->cap = (t->cap + n + 1) * 2;
+        t->data = realloc(t->data, t->cap);
+    }
+    memcpy(t->data + t->len, line, n + 1);
+    t->len += n;
+}
+
+static uint8_t* read_file(const char* path, size_t* size) {
+    FILE* fp = fopen(path, "rb");
+    if (!fp) return NULL;
+    fseek(fp, 0, SEEK_END);
+    long len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    uint8_t* data = malloc(len > 0 ? len : 1);
+    if (data && fread(data, 1, len, fp) != (size_t)len) {
+        free(data);
+        data = NULL;
+    }
+    fclose(fp);
+    *size = (size_t)len;
+    return data;
+}
+
+// Runs one conversion into stream, which the caller frees.
+static bool convert_once(const uint8_t* file_data, const vgm_header_t* header, vgm_stream_t* stream, uint32_t* loop_offset) {
+    if (!vgm_stream_init(stream, 0)) return false;
+    file_window_t in;
+    file_window_open_mem(&in, file_data + header->vgm_data_offset, (header->eof_offset + 4) - header->vgm_data_offset);
+    bool ok = vgm_convert_to_opm(stream, &in, header, loop_offset);
+    file_window_close(&in);
+    return ok;
+}
+
+// Window size for the progressive check. Kept tiny so the window slides
+// many times, even over the small corpus files.
+#define BENCH_WINDOW_SIZE 256
+
+typedef struct {
+    file_window_t in;
+    const vgm_header_t* header;
+    vgm_stream_t stream;
+    uint32_t loop_offset;
+} progressive_job_t;
+
+static void progressive_thread(void* arg) {
+    progressive_job_t* job = (progressive_job_t*)arg;
+    vgm_convert_to_opm(&job->stream, &job->in, job->header, &job->loop_offset);
+}
+
+// Converts on a worker thread, reading the source file through a window and the stream
+// in small pieces, as the player does, and checks the reader sees exactly the in-memory result.
+static bool check_progressive(const char* path, const vgm_header_t* header, const uint8_t* expected, size_t expected_size) {
+    progressive_job_t job = {{0}, header, {0}, 0};
+    FILE* fp = fopen(path, "rb");
+    if (!fp) return false;
+    if (!file_window_open(&job.in, fp, header->vgm_data_offset, (header->eof_offset + 4) - header->vgm_data_offset, BENCH_WINDOW_SIZE)) {
+        fclose(fp);
+        return false;
+    }
+    if (!vgm_stream_init(&job.stream, 0)) {
+        file_window_close(&job.in);
+        fclose(fp);
+        return false;
+    }
+    yasp_thread_t thread;
+    if (!yasp_thread_start(&thread, progressive_thread, &job)) {
+        vgm_stream_free(&job.stream);
+        file_window_close(&job.in);
+        fclose(fp);
+        return false;
+    }
+    bool same = true;
+    size_t pos = 0;
+    uint8_t buf[3];
+    size_t n;
+    while ((n = vgm_stream_read(&job.stream, pos, buf, sizeof(buf))) > 0) {
+        if (pos + n > expected_size || memcmp(buf, expected + pos, n) != 0) same = false;
+        pos += n;
+    }
+    yasp_thread_join(&thread);
+    vgm_stream_free(&job.stream);
+    file_window_close(&job.in);
+    fclose(fp);
+    return same && pos == expected_size;
+}
+
+// Converts split into segments on several threads and checks the result is identical
+// to the conversion in one piece, loop point included.
+static bool check_segmented(const uint8_t* file_data, const vgm_header_t* header, const uint8_t* expected, size_t expected_size, uint32_t expected_loop_offset) {
+    static const int segment_counts[] = {2, 3, 8};
+    for (size_t i = 0; i < sizeof(segment_counts) / sizeof(segment_counts[0]); i++) {
+        vgm_stream_t stream = {0};
+        uint32_t loop_offset = 0;
+        file_window_t in;
+        if (!vgm_stream_init(&stream, 0)) return false;
+        file_window_open_mem(&in, file_data + header->vgm_data_offset, (header->eof_offset + 4) - header->vgm_data_offset);
+        bool ok = vgm_convert_to_opm_segmented(&stream, &in, header, &loop_offset, segment_counts[i]);
+        ok = ok && stream.size == expected_size && memcmp(stream.data, expected, expected_size) == 0 && loop_offset == expected_loop_offset;
+        file_window_close(&in);
+        vgm_stream_free(&stream);
+        if (!ok) return false;
+    }
+    return true;
+}
+
+// Segments the timed segmented conversion is split into
+#define BENCH_SEGMENTS 4
+
+typedef struct {
+    double serial_ms;      // Per conversion in one piece
+    double segmented_ms;   // Per conversion in BENCH_SEGMENTS segments
+} bench_segmented_t;
+
+// Times the conversion in one piece against the segmented one, wall time per run.
+static void time_segmented(const uint8_t* file_data, const vgm_header_t* header, int iterations, bench_segmented_t* result) {
+    for (int pass = 0; pass < 2; pass++) {
+        int segments = pass == 0 ? 1 : BENCH_SEGMENTS;
+        uint64_t start = get_current_time_us();
+        for (int i = 0; i < iterations; i++) {
+            vgm_stream_t stream = {0};
+            uint32_t loop_offset = 0;
+            file_window_t in;
+            if (!vgm_stream_init(&stream, 0)) return;
+            file_window_open_mem(&in, file_data + header->vgm_data_offset, (header->eof_offset + 4) - header->vgm_data_offset);
+            vgm_convert_to_opm_segmented(&stream, &in, header, &loop_offset, segments);
+            file_window_close(&in);
+            vgm_stream_free(&stream);
+        }
+        double ms = (double)(get_current_time_us() - start) / 1000.0 / iterations;
+        if (pass == 0) result->serial_ms = ms;
+        else result->segmented_ms = ms;
+    }
+}
+
+// Decodes a converted stream to one line per command, with the sample time it is sent at.
+static uint64_t dump_stream(text_buf_t* t, const uint8_t* s, size_t size, uint32_t loop_offset) {
+    uint64_t time = 0;
+    uint64_t writes = 0;
+    size_t pos = 0;
+    while (pos < size) {
+        if (loop_offset > 0 && pos == loop_offset) {
+            text_printf(t, "%llu loop\n", (unsigned long long)time);
+        }
+        uint8_t op = s[pos++];
+        switch (op) {
+            case 0x54:
+                if (pos + 2 > size) return writes;
+                text_printf(t, "%llu %02X %02X\n", (unsigned long long)time, s[pos], s[pos + 1]);
+                writes++;
+                pos += 2;
+                break;
+            case VGM_CMD_OPM_PMS: case VGM_CMD_OPM_AY_PAN:
+                // Tagged writes are kept unresolved so the goldens don't depend on settings
+                if (pos + 2 > size) return writes;
+                text_printf(t, "%llu %02X %02X %s\n", (unsigned long long)time, s[pos], s[pos + 1],
+                    op == VGM_CMD_OPM_PMS ? "pms" : "pan");
+                writes++;
+                pos += 2;
+                break;
+            case 0x52: case 0x53: case 0x55: case 0x56: case 0x57: case 0xBC:
+                if (pos + 2 > size) return writes;
+                text_printf(t, "%llu cmd %02X %02X %02X\n", (unsigned long long)time, op, s[pos], s[pos + 1]);
+                pos += 2;
+                break;
+            case 0x61:
+                if (pos + 2 > size) return writes;
+                time += s[pos] | (s[pos + 1] << 8);
+                pos += 2;
+                break;
+            case 0x62: time += VGM_DEFAULT_WAIT1; break;
+            case 0x63: time += VGM_DEFAULT_WAIT2; break;
+            case 0x66:
+                text_printf(t, "%llu end\n", (unsigned long long)time);
+                break;
+            default: {
+                if (op >= 0x70 && op <= 0x7F) {
+                    time += (op & 0x0F) + 1;
+                    break;
+                }
+                // DAC stream control and other passed-through commands, with their operands
+                size_t n = vgm_command_size(s + pos - 1, size - pos + 1);
+                if (n == 0) {
+                    text_printf(t, "%llu unknown %02X\n", (unsigned long long)time, op);
+                    break;
+                }
+                text_printf(t, "%llu %s %02X", (unsigned long long)time, op >= 0x90 && op <= 0x95 ? "dac" : "cmd", op);
+                for (size_t i = 0; i + 1 < n; i++) text_printf(t, " %02X", s[pos + i]);
+                text_printf(t, "\n");
+                pos += n - 1;
+                break;
+            }
+        }
+    }
+    return writes;
+}
+
+// Returns the 1-based line number of the first difference, or 0 if equal.
+static int first_diff_line(const char* a, size_t a_len, const char* b, size_t b_len, size_t* a_at, size_t* b_at) {
+    int line = 1;
+    size_t i = 0;
+    size_t line_start = 0;
+    while (i < a_len && i < b_len && a[i] == b[i]) {
+        if (a[i] == '\n') {
+            line++;
+            line_start = i + 1;
+        }
+        i++;
+    }
+    if (i == a_len && i == b_len) return 0;
+    *a_at = line_start;
+    *b_at = line_start;
+    return line;
+}
+
+static void print_line(const char* label, const char* s, size_t len, size_t at) {
+    size_t end = at;
+    while (end < len && s[end] != '\n') end++;
+    printf("    %s: %.*s\n", label, (int)(end - at), s + at);
+}
+
+// FNV-1a over the modelled OPM register file
+static unsigned long long model_hash(const uint16_t* regs) {
+    unsigned long long h = 14695981039346656037ULL;
+    for (int i = 0; i < 257; i++) {
+        h = (h ^ (regs[i] & 0xFF)) * 1099511628211ULL;
+        h = (h ^ (regs[i] >> 8)) * 1099511628211ULL;
+    }
+    return h;
+}
+
+// Plays a stream into a model of the OPM registers and writes down what the chip goes
+// through: the register state each time time moves on, and every key on/off, LFO reset
+// or timer write together with the state it happens in. Streams that produce the same
+// lines sound the same.
+static void model_stream(text_buf_t* t, const uint8_t* s, size_t size, uint32_t loop_offset) {
+    uint16_t regs[257]; // (command << 8) | data, 0 if never written. PMD is kept at 256.
+    memset(regs, 0, sizeof(regs));
+    unsigned long long time = 0;
+    bool dirty = false;
+    size_t pos = 0;
+    while (pos < size) {
+        if (loop_offset > 0 && pos == loop_offset) {
+            text_printf(t, "%llu loop %016llx\n", time, model_hash(regs));
+            dirty = false;
+        }
+        uint8_t op = s[pos++];
+        uint32_t wait = 0;
+        switch (op) {
+            case 0x54: case VGM_CMD_OPM_PMS: case VGM_CMD_OPM_AY_PAN: {
+                if (pos + 2 > size) return;
+                uint8_t addr = s[pos], data = s[pos + 1];
+                pos += 2;
+                if (op == 0x54 && (addr == 0x01 || addr == 0x08 || (addr >= 0x10 && addr <= 0x14))) {
+                    text_printf(t, "%llu event %02X %02X %016llx\n", time, addr, data, model_hash(regs));
+                    break;
+                }
+                int slot = (addr == 0x19 && (data & 0x80)) ? 256 : addr;
+                uint16_t value = (uint16_t)((op << 8) | data);
+                if (regs[slot] != value) dirty = true;
+                regs[slot] = value;
+                break;
+            }
+            case 0x52: case 0x53: case 0x55: case 0x56: case 0x57: case 0xBC:
+                if (pos + 2 > size) return;
+                text_printf(t, "%llu cmd %02X %02X %02X\n", time, op, s[pos], s[pos + 1]);
+                pos += 2;
+                break;
+            case 0x61:
+                if (pos + 2 > size) return;
+                wait = s[pos] | (s[pos + 1] << 8);
+                pos += 2;
+                break;
+            case 0x62: wait = VGM_DEFAULT_WAIT1; break;
+            case 0x63: wait = VGM_DEFAULT_WAIT2; break;
+            case 0x66:
+                text_printf(t, "%llu end %016llx\n", time, model_hash(regs));
+                dirty = false;
+                break;
+            default: {
+                if (op >= 0x70 && op <= 0x7F) {
+                    wait = (op & 0x0F) + 1;
+                    break;
+                }
+                // Passed-through commands leave the OPM alone; their place in time is written down
+                size_t n = vgm_command_size(s + pos - 1, size - pos + 1);
+                if (n == 0) return;
+                text_printf(t, "%llu %s %02X", time, op >= 0x90 && op <= 0x95 ? "dac" : "cmd", op);
+                for (size_t i = 0; i + 1 < n; i++) text_printf(t, " %02X", s[pos + i]);
+                text_printf(t, "\n");
+                pos += n - 1;
+                if (op >= 0x80 && op <= 0x8F) wait = op & 0x0F;
+                break;
+            }
+        }
+        if (wait > 0) {
+            if (dirty) text_printf(t, "%llu state %016llx\n", time, model_hash(regs));
+            dirty = false;
+            time += wait;
+        }
+    }
+    text_printf(t, "%llu done %016llx\n", time, model_hash(regs));
+}
+
+// Runs the cache optimiser over a conversion and checks the chip goes through the
+// same states at the same times with and without it.
+// The optimised stream is handed back in optimized_out, for the caller to free.
+static bool check_peephole(const char* file, const uint8_t* data, size_t size, uint32_t loop_offset, opm_peephole_stats_t* stats,
+                           uint8_t** optimized_out, size_t* optimized_size_out) {
+    uint32_t optimized_loop = loop_offset;
+    size_t optimized_size = 0;
+    uint8_t* optimized = opm_peephole_optimize(data, size, 0, &optimized_loop, &optimized_size, stats);
+    *optimized_out = NULL;
+    if (!optimized) return false;
+    text_buf_t before = {0}, after = {0};
+    model_stream(&before, data, size, loop_offset);
+    model_stream(&after, optimized, optimized_size, optimized_loop);
+    size_t a_at = 0, b_at = 0;
+    int line = first_diff_line(before.data, before.len, after.data, after.len, &a_at, &b_at);
+    if (line != 0) {
+        printf("FAIL %-28s optimised stream differs at line %d\n", file, line);
+        print_line("converted", before.data, before.len, a_at);
+        print_line("optimised", after.data, after.len, b_at);
+    }
+    free(before.data);
+    free(after.data);
+    *optimized_out = optimized;
+    *optimized_size_out = optimized_size;
+    return line == 0;
+}
+
+// A stream with DAC stream commands (0x90-0x95) between OPM writes. The commands are
+// copied, and the writes around them are neither merged nor dropped: the first write to
+// 0x28 would be dead without the 0x90 after it, the second 0x28 = 0x11 redundant without
+// the 0x92 before it. Other commands the converter does not write (0x4F, 0xE0) go
+// through the same way.
+static bool check_peephole_dac(void) {
+    static const uint8_t stream[] = {
+        0x54, 0x28, 0x10,
+        0x90, 0x00, 0x02, 0x00, 0x2A,
+        0x54, 0x28, 0x11,
+        0x91, 0x00, 0x00, 0x01, 0x00,
+        0x92, 0x00, 0x44, 0xAC, 0x00, 0x00,
+        0x54, 0x28, 0x11,
+        0x93, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00,
+        0x94, 0x00,
+        0x95, 0x00, 0x00, 0x00, 0x00,
+        0x4F, 0xFF,
+        0xE0, 0x00, 0x10, 0x00, 0x00,
+        0x61, 0x34, 0x12,
+        0x66,
+    };
+    opm_peephole_stats_t stats;
+    uint32_t loop = 0;
+    size_t optimized_size = 0;
+    uint8_t* optimized = opm_peephole_optimize(stream, sizeof(stream), 0, &loop, &optimized_size, &stats);
+    bool ok = optimized && optimized_size == sizeof(stream) && memcmp(optimized, stream, sizeof(stream)) == 0;
+    if (!ok) printf("FAIL cache optimiser: DAC stream commands were not passed through\n");
+    text_buf_t dump = {0};
+    dump_stream(&dump, stream, sizeof(stream), 0);
+    if (!dump.data || strstr(dump.data, "unknown") || !strstr(dump.data, "0 dac 93 00 00 00 00 00 01 00 00 00 00\n")) {
+        printf("FAIL bench: DAC stream commands are not decoded\n");
+        ok = false;
+    }
+    free(dump.data);
+    free(optimized);
+    return ok;
+}
+
+// A YM2612 file with PCM writes (0x8n). They have no operand, so the three of them wait
+// 1 + 2 + 3 samples and the file ends at sample 6.
+static bool check_pcm_wait(void) {
+    uint8_t file[0x40 + 7] = {
+        'V', 'g', 'm', ' ', 0x43, 0x00, 0x00, 0x00, 0x50, 0x01, 0x00, 0x00,
+    };
+    file[0x2C] = 0xB5; file[0x2D] = 0x0A; file[0x2E] = 0x75; // YM2612 at 7670453 Hz
+    file[0x34] = 0x0C;                                          // Data at 0x40
+    static const uint8_t data[] = {0x81, 0x82, 0x83, 0x52, 0x28, 0x00, 0x66};
+    memcpy(file + 0x40, data, sizeof(data));
+
+    vgm_header_t* header = calloc(1, sizeof(vgm_header_t));
+    if (!header) return false;
+    vgm_parse_header_fields(file, header);
+    vgm_stream_t stream = {0};
+    uint32_t loop_offset = 0;
+    bool ok = convert_once(file, header, &stream, &loop_offset);
+    text_buf_t dump = {0};
+    if (ok) dump_stream(&dump, stream.data, stream.size, loop_offset);
+    ok = ok && dump.data && strstr(dump.data, "\n6 end\n");
+    if (!ok) printf("FAIL converter: PCM write waits (0x8n) are wrong\n");
+    free(dump.data);
+    vgm_stream_free(&stream);
+    free(header);
+    return ok;
+}
+
+typedef struct {
+    size_t raw_size;
+    size_t packed_size;
+    double decode_mb_s;
+} bench_pack_t;
+
+// Writes data to a compressed cache container and reads it back through the block reader,
+// front to back in small pieces and then from the middle, as a loop does. Also times the
+// decompression of every block.
+static bool check_pack(const char* corpus_dir, const uint8_t* data, size_t size, int iterations, bench_pack_t* result) {
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/pack_check.tmp", corpus_dir);
+    FILE* fp = fopen(path, "w+b");
+    if (!fp) return false;
+    cache_pack_stats_t stats;
+    bool ok = cache_pack_write(fp, data, size, &stats) && fflush(fp) == 0;
+    cache_pack_reader_t reader;
+    if (ok && cache_pack_open(&reader, fp)) {
+        uint8_t buf[3];
+        size_t pos = 0, n;
+        while ((n = cache_pack_read(&reader, pos, buf, sizeof(buf))) > 0) {
+            if (pos + n > size || memcmp(buf, data + pos, n) != 0) ok = false;
+            pos += n;
+        }
+        ok = ok && pos == size;
+        size_t mid = size / 2;
+        n = cache_pack_read(&reader, mid, buf, sizeof(buf));
+        ok = ok && n == (size - mid < sizeof(buf) ? size - mid : sizeof(buf)) && memcmp(buf, data + mid, n) == 0;
+        cache_pack_close(&reader);
+    } else {
+        ok = false;
+    }
+    fclose(fp);
+    remove(path);
+    result->raw_size = stats.raw_size;
+    result->packed_size = stats.packed_size;
+
+    // Codec alone, without the file and the helper thread
+    size_t block_count = (size + CACHE_PACK_BLOCK_SIZE - 1) / CACHE_PACK_BLOCK_SIZE;
+    size_t bound = lz_compress_bound(CACHE_PACK_BLOCK_SIZE);
+    uint8_t* packed = malloc(block_count * bound + 1);
+    size_t* packed_len = malloc(sizeof(size_t) * (block_count + 1));
+    uint8_t* out = malloc(CACHE_PACK_BLOCK_SIZE);
+    if (!packed || !packed_len || !out) ok = false;
+    for (size_t b = 0; ok && b < block_count; b++) {
+        size_t len = size - b * CACHE_PACK_BLOCK_SIZE < CACHE_PACK_BLOCK_SIZE ? size - b * CACHE_PACK_BLOCK_SIZE : CACHE_PACK_BLOCK_SIZE;
+        packed_len[b] = lz_compress(data + b * CACHE_PACK_BLOCK_SIZE, len, packed + b * bound, bound);
+    }
+    int runs = iterations * 50;
+    uint64_t start = get_current_time_us();
+    for (int i = 0; ok && i < runs; i++) {
+        for (size_t b = 0; ok && b < block_count; b++) {
+            size_t len = size - b * CACHE_PACK_BLOCK_SIZE < CACHE_PACK_BLOCK_SIZE ? size - b * CACHE_PACK_BLOCK_SIZE : CACHE_PACK_BLOCK_SIZE;
+            ok = lz_decompress(packed + b * bound, packed_len[b], out, len) && memcmp(out, data + b * CACHE_PACK_BLOCK_SIZE, len) == 0;
+        }
+    }
+    uint64_t elapsed = get_current_time_us() - start;
+    result->decode_mb_s = (double)size * runs / (elapsed ? elapsed : 1);
+    free(packed);
+    free(packed_len);
+    free(out);
+    return ok;
+}
+
+// --- Virtual device ---
+#define VIRTUAL_BYTE_NS (10ull * 1000000000ull / SPFM_VIRTUAL_BAUD_RATE)
+#define VIRTUAL_WAIT_NS (1000000000ull / 44100)
+#define VIRTUAL_EVENTS 8
+
+typedef struct {
+    spfm_virtual_event_t events[VIRTUAL_EVENTS];
+    int count;
+} virtual_trace_t;
+
+static void virtual_trace(void* ctx, const spfm_virtual_event_t* event) {
+    virtual_trace_t* t = (virtual_trace_t*)ctx;
+    if (t->count < VIRTUAL_EVENTS) t->events[t->count] = *event;
+    t->count++;
+}
+
+static bool virtual_expect(const char* name, bool ok) {
+    if (!ok) printf("FAIL virtual device: %s\n", name);
+    return ok;
+}
+
+static bool check_virtual_device(void) {
+    bool ok = true;
+    virtual_trace_t t;
+    spfm_virtual_stats_t stats;
+
+    // SPFM_Light: a write is applied when its last byte is in, and each wait holds the unit one sample
+    static const uint8_t light[] = { 0x00, 0x00, 0x28, 0xF0, 0x80, 0x80, 0x01, 0x02, 0x11, 0x22, 0x01, 0x20, 0x9F };
+    memset(&t, 0, sizeof(t));
+    spfm_virtual_t* v = spfm_virtual_open(true, SPFM_VIRTUAL_FIFO_DEPTH, virtual_trace, &t);
+    spfm_virtual_write(v, 0, light, sizeof(light));
+    uint64_t done_ns = spfm_virtual_finish(v);
+    spfm_virtual_get_stats(v, &stats);
+    spfm_virtual_close(v);
+    ok &= virtual_expect("light write count", t.count == 3 && stats.writes == 3 && stats.waits == 2);
+    ok &= virtual_expect("light write time", t.events[0].time_ns == 4 * VIRTUAL_BYTE_NS && t.events[0].addr == 0x28 && t.events[0].data == 0xF0);
+    ok &= virtual_expect("light wait time", t.events[1].time_ns == 5 * VIRTUAL_BYTE_NS + 2 * VIRTUAL_WAIT_NS
+                         && t.events[1].slot == 1 && t.events[1].port == 1 && t.events[1].addr == 0x11);
+    ok &= virtual_expect("light data-only", t.events[2].port == SPFM_VIRTUAL_DATA_ONLY && t.events[2].data == 0x9F
+                         && t.events[2].time_ns == done_ns && stats.underruns == 0 && stats.overruns == 0);
+
+    // SPFM: three-byte writes, and a reset
+    static const uint8_t spfm[] = { 0x71, 0xB4, 0xC0, 0xFF };
+    memset(&t, 0, sizeof(t));
+    v = spfm_virtual_open(false, SPFM_VIRTUAL_FIFO_DEPTH, virtual_trace, &t);
+    spfm_virtual_write(v, 1000, spfm, sizeof(spfm));
+    spfm_virtual_finish(v);
+    spfm_virtual_get_stats(v, &stats);
+    spfm_virtual_close(v);
+    ok &= virtual_expect("spfm write", t.count == 2 && t.events[0].slot == 7 && t.events[0].port == 1 && t.events[0].addr == 0xB4
+                         && t.events[0].time_ns == 1000 + 3 * VIRTUAL_BYTE_NS);
+    ok &= virtual_expect("spfm reset", t.events[1].port == SPFM_VIRTUAL_RESET && stats.resets == 1);
+
+    // Underrun: the host sends the next write a millisecond after a wait
+    static const uint8_t wait[] = { 0x80 };
+    static const uint8_t write[] = { 0x00, 0x00, 0x10, 0x01 };
+    v = spfm_virtual_open(true, SPFM_VIRTUAL_FIFO_DEPTH, NULL, NULL);
+    spfm_virtual_write(v, 0, wait, sizeof(wait));
+    spfm_virtual_write(v, 1000000, write, sizeof(write));
+    spfm_virtual_finish(v);
+    spfm_virtual_get_stats(v, &stats);
+    spfm_virtual_close(v);
+    ok &= virtual_expect("underrun", stats.underruns == 1 && stats.starved_ns == 1000000 + VIRTUAL_BYTE_NS - (VIRTUAL_BYTE_NS + VIRTUAL_WAIT_NS));
+
+    // Overrun: waits come in faster than they are played, and a small FIFO fills up
+    uint8_t waits[64];
+    memset(waits, 0x80, sizeof(waits));
+    v = spfm_virtual_open(true, 8, NULL, NULL);
+    spfm_virtual_write(v, 0, waits, sizeof(waits));
+    spfm_virtual_finish(v);
+    spfm_virtual_get_stats(v, &stats);
+    spfm_virtual_close(v);
+    ok &= virtual_expect("overrun", stats.overruns > 0 && stats.fifo_peak == 8 && stats.waits + stats.overruns == sizeof(waits));
+
+    if (ok) printf("\nVirtual SPFM device: timing and FIFO model ok.\n");
+    return ok;
+}
+
+static bool s98_expect(const char* name, bool ok) {
+    if (!ok) printf("FAIL S98: %s\n", name);
+    return ok;
+}
+
+// opna_lm_01.s98: S98v3 without device info, so one YM2608. The tag is at the end of the
+// file, the dump right after the header, and there is no loop. 242384 syncs of 1 ms.
+static bool check_s98(const char* corpus_dir) {
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/opna_lm_01.s98", corpus_dir);
+    FILE* fp = fopen(path, "rb");
+    S98 s98;
+    memset(&s98, 0, sizeof(s98));
+    if (!s98_expect("load", fp && s98_load(&s98, fp))) {
+        if (fp) fclose(fp);
+        return false;
+    }
+    bool ok = true;
+    ok &= s98_expect("header", s98.version == '3' && s98.sync_us == 1000 && s98.offset_to_tag == 0x71632
+                     && s98.offset_to_dump == 0x20 && s98.offset_to_loop == 0 && s98.device_count == 0);
+    ok &= s98_expect("devices", s98.commands[0].chip == CHIP_TYPE_YM2608 && s98.commands[1].chip == CHIP_TYPE_YM2608
+                     && s98.commands[1].port == 1 && s98.commands[2].chip == CHIP_TYPE_NONE
+                     && s98.chips == (1u << CHIP_TYPE_YM2608));
+    ok &= s98_expect("index", s98.total_us == 242384000ull && s98.syncs[s98.sync_count - 1].pos == s98.offset_to_tag - 1);
+    s98_release(&s98);
+    fclose(fp);
+
+    // A looped v3 file with one device: 10 ms syncs, a write, a sync, the loop point, a
+    // write to port 1, a sync, then three syncs and the loop command
+    static const uint8_t looped[] = {
+        'S', '9', '8', '3', 10, 0, 0, 0, 0xE8, 0x03, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0x30, 0, 0, 0, 0x34, 0, 0, 0, 1, 0, 0, 0,
+        4, 0, 0, 0, 0x00, 0xE0, 0x79, 0x00, 0, 0, 0, 0, 0, 0, 0, 0,
+        0x00, 0x28, 0x00, 0xFF, 0x01, 0x10, 0x01, 0xFF, 0xFE, 0x01, 0xFD,
+    };
+    fp = tmpfile();
+    memset(&s98, 0, sizeof(s98));
+    if (!s98_expect("load looped", fp && fwrite(looped, 1, sizeof(looped), fp) == sizeof(looped) && s98_load(&s98, fp))) {
+        if (fp) fclose(fp);
+        return false;
+    }
+    ok &= s98_expect("looped header", s98.offset_to_dump == 0x30 && s98.offset_to_loop == 0x34 && s98.device_count == 1
+                     && s98.clocks[CHIP_TYPE_YM2608] == 7987200 && s98.commands[1].chip == CHIP_TYPE_YM2608);
+    ok &= s98_expect("looped index", s98.sync_count == 3 && s98.total_us == 50000 && s98.loop_us == 10000);
+    s98_release(&s98);
+    fclose(fp);
+    if (ok) printf("\nS98: header, devices and sync index ok.\n");
+    return ok;
+}
+
+static bench_total_t* find_total(bench_total_t* totals, int* count, const char* converter) {
+    for (int i = 0; i < *count; i++) {
+        if (strcmp(totals[i].converter, converter) == 0) return &totals[i];
+    }
+    totals[*count].converter = converter;
+    return &totals[(*count)++];
+}
+
+int main(int argc, char* argv[]) {
+    const char* corpus_dir = "bench/corpus";
+    bool update = false;
+    int iterations = 20;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--update") == 0) update = true;
+        else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) iterations = atoi(argv[++i]);
+        else corpus_dir = argv[i];
+    }
+    if (iterations < 1) iterations = 1;
+
+    yasp_timer_init();
+
+    bench_total_t totals[NUM_CASES];
+    int total_count = 0;
+    memset(totals, 0, sizeof(totals));
+    int failures = 0;
+    opm_peephole_stats_t peephole_stats[NUM_CASES];
+    memset(peephole_stats, 0, sizeof(peephole_stats));
+    bench_pack_t pack_results[NUM_CASES];
+    memset(pack_results, 0, sizeof(pack_results));
+    bench_segmented_t segmented_results[NUM_CASES];
+    memset(segmented_results, 0, sizeof(segmented_results));
+
+    for (size_t c = 0; c < NUM_CASES; c++) {
+        const bench_case_t* bc = &CASES[c];
+        char path[MAX_PATH_LEN], golden_path[MAX_PATH_LEN];
+        snprintf(path, sizeof(path), "%s/%s", corpus_dir, bc->file);
+        snprintf(golden_path, sizeof(golden_path), "%s/%s.golden", corpus_dir, bc->file);
+
+        vgm_header_t* header = calloc(1, sizeof(vgm_header_t));
+        FILE* fp = fopen(path, "rb");
+        if (!fp || !vgm_parse_header(fp, header)) {
+            printf("FAIL %-28s cannot read VGM\n", bc->file);
+            if (fp) fclose(fp);
+            free(header);
+            failures++;
+            continue;
+        }
+        fclose(fp);
+
+        chip_type_t chip = vgm_get_primary_chip(header);
+        if (chip != bc->chip) {
+            printf("FAIL %-28s primary chip is %s, expected %s\n", bc->file, chip_type_to_string(chip), chip_type_to_string(bc->chip));
+            free(header);
+            failures++;
+            continue;
+        }
+
+        size_t file_size = 0;
+        uint8_t* file_data = read_file(path, &file_size);
+        vgm_stream_t out_stream = {0};
+        uint32_t loop_offset = 0;
+        if (!file_data || !convert_once(file_data, header, &out_stream, &loop_offset)) {
+            printf("FAIL %-28s conversion failed\n", bc->file);
+            vgm_stream_free(&out_stream);
+            free(file_data);
+            free(header);
+            failures++;
+            continue;
+        }
+        const uint8_t* out = out_stream.data;
+        size_t out_size = out_stream.size;
+
+        text_buf_t dump = {0};
+        text_printf(&dump, "# %s via %s\n", bc->file, bc->converter);
+        uint64_t writes = dump_stream(&dump, out, out_size, loop_offset);
+
+        // --- Golden comparison ---
+        const char* result = "ok";
+        bool passed = true;
+        if (update) {
+            FILE* gf = fopen(golden_path, "wb");
+            if (gf) {
+                fwrite(dump.data, 1, dump.len, gf);
+                fclose(gf);
+                result = "updated";
+            } else {
+                result = "cannot write golden";
+                passed = false;
+            }
+        } else {
+            size_t golden_size = 0;
+            char* golden = (char*)read_file(golden_path, &golden_size);
+            size_t a_at = 0, b_at = 0;
+            int line;
+            if (!golden) {
+                result = "no golden, run --update";
+                passed = false;
+            } else if ((line = first_diff_line(golden, golden_size, dump.data, dump.len, &a_at, &b_at)) != 0) {
+                printf("FAIL %-28s OPM stream differs from golden at line %d\n", bc->file, line);
+                print_line("golden", golden, golden_size, a_at);
+                print_line("actual", dump.data, dump.len, b_at);
+                result = NULL;
+                passed = false;
+            }
+            free(golden);
+        }
+        if (result && !check_progressive(path, header, out, out_size)) {
+            result = "progressive read differs";
+            passed = false;
+        }
+        if (result && !check_segmented(file_data, header, out, out_size, loop_offset)) {
+            result = "segmented conversion differs";
+            passed = false;
+        }
+        opm_peephole_stats_t* ps = &peephole_stats[c];
+        uint8_t* optimized = NULL;
+        size_t optimized_size = 0;
+        if (result && !check_peephole(bc->file, out, out_size, loop_offset, ps, &optimized, &optimized_size)) {
+            result = NULL;
+            passed = false;
+        }
+        if (result && !check_pack(corpus_dir, optimized, optimized_size, iterations, &pack_results[c])) {
+            result = "compressed cache differs";
+            passed = false;
+        }
+        free(optimized);
+
+        // --- Throughput ---
+        uint64_t start = get_current_time_us();
+        for (int i = 0; i < iterations; i++) {
+            vgm_stream_t stream = {0};
+            uint32_t lo = 0;
+            convert_once(file_data, header, &stream, &lo);
+            vgm_stream_free(&stream);
+        }
+        uint64_t elapsed = get_current_time_us() - start;
+        if (elapsed == 0) elapsed = 1;
+        time_segmented(file_data, header, iterations, &segmented_results[c]);
+
+        bench_total_t* total = find_total(totals, &total_count, bc->converter);
+        total->source_bytes += (uint64_t)file_size * iterations;
+        total->opm_writes += writes * iterations;
+        total->elapsed_us += elapsed;
+
+        if (result) {
+            printf("%-4s %-28s %-20s %7llu writes %8.2f MB/s\n", passed ? "PASS" : "FAIL", bc->file, result,
+                (unsigned long long)writes, (double)file_size * iterations / elapsed);
+        }
+
+        if (!passed) failures++;
+
+        free(dump.data);
+        vgm_stream_free(&out_stream);
+        free(file_data);
+        free(header);
+    }
+
+    printf("\n%-22s %12s %14s\n", "converter", "source MB/s", "OPM writes/s");
+    for (int i = 0; i < total_count; i++) {
+        printf("%-22s %12.2f %14.0f\n", totals[i].converter,
+            (double)totals[i].source_bytes / totals[i].elapsed_us,
+            (double)totals[i].opm_writes * 1000000.0 / totals[i].elapsed_us);
+    }
+
+    printf("\n%-28s %17s %17s %17s\n", "cache optimiser", "bytes", "writes", "waits");
+    for (size_t c = 0; c < NUM_CASES; c++) {
+        const opm_peephole_stats_t* ps = &peephole_stats[c];
+        if (ps->bytes_in == 0) continue;
+        printf("%-28s %8u -> %-6u %8u -> %-6u %8u -> %-6u\n", CASES[c].file,
+            (unsigned)ps->bytes_in, (unsigned)ps->bytes_out, ps->writes_in, ps->writes_out, ps->waits_in, ps->waits_out);
+    }
+
+    printf("\n%-28s %17s %7s %12s\n", "compressed cache", "bytes", "ratio", "decode MB/s");
+    for (size_t c = 0; c < NUM_CASES; c++) {
+        const bench_pack_t* pr = &pack_results[c];
+        if (pr->raw_size == 0) continue;
+        printf("%-28s %8u -> %-6u %6.1f%% %12.0f\n", CASES[c].file, (unsigned)pr->raw_size, (unsigned)pr->packed_size,
+            100.0 * pr->packed_size / pr->raw_size, pr->decode_mb_s);
+    }
+
+    printf("\n%-28s %10s %12s\n", "segmented conversion", "serial ms", "segmented ms");
+    for (size_t c = 0; c < NUM_CASES; c++) {
+        const bench_segmented_t* sr = &segmented_results[c];
+        if (sr->serial_ms == 0) continue;
+        printf("%-28s %10.3f %12.3f\n", CASES[c].file, sr->serial_ms, sr->segmented_ms);
+    }
+
+    bool dac_ok = check_peephole_dac();
+    bool pcm_ok = check_pcm_wait();
+    bool virtual_ok = check_virtual_device();
+    bool s98_ok = check_s98(corpus_dir);
+
+    if (failures) {
+        printf("\n%d of %d files failed.\n", failures, (int)NUM_CASES);
+        return 1;
+    }
+    if (!dac_ok || !pcm_ok || !virtual_ok || !s98_ok) return 1;
+    printf("\nAll %d files match their golden OPM streams.\n", (int)NUM_CASES);
+    return 0;
+}
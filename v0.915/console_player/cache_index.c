@@ -0,0 +1,359 @@
+#include "cache_index.h"
+#include "error.h"
+#include "util.h"
+#include "thread.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+// index.bin layout, little endian:
+//   "YCIX", u32 format, u32 entry count,
+//   per entry: u16 name length, name, u16 source length, source,
+//              u64 size, u64 last access (time_t), u32 converter version,
+//   u32 FNV-1a of everything before it.
+#define CACHE_INDEX_MAGIC "YCIX"
+#define CACHE_INDEX_FORMAT 1
+#define CACHE_INDEX_TEMP_FILENAME "index.tmp"
+
+#define CACHE_NAME_LEN 256
+
+typedef struct {
+    char name[CACHE_NAME_LEN];    // File name in the cache directory
+    char source[MAX_PATH_LEN];    // Source file it was converted from, empty if unknown
+    uint64_t size;
+    uint64_t last_access;
+    uint32_t version;
+} cache_entry_t;
+
+static char _dir[MAX_PATH_LEN];
+static uint64_t _max_bytes = 0;
+static cache_entry_t* _entries = NULL;
+static size_t _count = 0;
+static size_t _capacity = 0;
+static bool _open = false;
+static yasp_mutex_t _lock;
+
+// --- Serialisation ---
+typedef struct {
+    uint8_t* data;
+    size_t len, cap;
+} index_buf_t;
+
+static bool buf_put(index_buf_t* b, const void* p, size_t n) {
+    if (b->len + n > b->cap) {
+        size_t cap = (b->cap + n) * 2;
+        uint8_t* data = realloc(b->data, cap);
+        if (!data) return false;
+        b->data = data;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+    return true;
+}
+
+static bool buf_put_uint(index_buf_t* b, uint64_t v, int bytes) {
+    uint8_t tmp[8];
+    for (int i = 0; i < bytes; i++) tmp[i] = (uint8_t)(v >> (8 * i));
+    return buf_put(b, tmp, bytes);
+}
+
+static uint64_t get_uint(const uint8_t* p, int bytes) {
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; i++) v |= (uint64_t)p[i] << (8 * i);
+    return v;
+}
+
+static uint32_t index_checksum(const uint8_t* p, size_t n) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < n; i++) h = (h ^ p[i]) * 16777619u;
+    return h;
+}
+
+// --- Entries ---
+static const char* base_name(const char* path) {
+    const char* slash = strrchr(path, '/');
+    const char* backslash = strrchr(path, '\\');
+    if (backslash > slash) slash = backslash;
+    return slash ? slash + 1 : path;
+}
+
+static cache_entry_t* find_entry(const char* name) {
+    for (size_t i = 0; i < _count; i++) {
+        if (strcmp(_entries[i].name, name) == 0) return &_entries[i];
+    }
+    return NULL;
+}
+
+static cache_entry_t* add_entry(const char* name) {
+    if (_count == _capacity) {
+        size_t cap = _capacity ? _capacity * 2 : 64;
+        cache_entry_t* entries = realloc(_entries, cap * sizeof(cache_entry_t));
+        if (!entries) return NULL;
+        _entries = entries;
+        _capacity = cap;
+    }
+    cache_entry_t* e = &_entries[_count++];
+    memset(e, 0, sizeof(cache_entry_t));
+    snprintf(e->name, sizeof(e->name), "%s", name);
+    return e;
+}
+
+// Removes the entry and, if delete_file is set, its file.
+static void drop_entry(cache_entry_t* e, bool delete_file) {
+    if (delete_file) {
+        char path[MAX_PATH_LEN];
+        cache_index_path(e->name, path, sizeof(path));
+        if (remove(path) == 0) logging(LOG_LEVEL_INFO, "Removed from cache: %s", e->name);
+    }
+    *e = _entries[--_count];
+}
+
+static bool is_index_file(const char* name) {
+    return strcmp(name, CACHE_INDEX_FILENAME) == 0 || strcmp(name, CACHE_INDEX_TEMP_FILENAME) == 0;
+}
+
+// Files being written, such as the VGM version of a playing S98 song. They are not cache
+// entries, but a clear still deletes them.
+static bool is_temp_file(const char* name) {
+    size_t len = strlen(name);
+    return len >= 4 && strcmp(name + len - 4, ".tmp") == 0;
+}
+
+// --- Load / save ---
+static bool index_load(void) {
+    char path[MAX_PATH_LEN];
+    cache_index_path(CACHE_INDEX_FILENAME, path, sizeof(path));
+    FILE* fp = fopen(path, "rb");
+    if (!fp) return false;
+    fseek(fp, 0, SEEK_END);
+    long len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    uint8_t* data = (len >= 16) ? malloc(len) : NULL;
+    bool ok = data && fread(data, 1, len, fp) == (size_t)len;
+    fclose(fp);
+    ok = ok && memcmp(data, CACHE_INDEX_MAGIC, 4) == 0 && get_uint(data + 4, 4) == CACHE_INDEX_FORMAT
+            && get_uint(data + len - 4, 4) == index_checksum(data, len - 4);
+
+    size_t pos = 12;
+    size_t end = ok ? (size_t)len - 4 : 0;
+    uint32_t count = ok ? (uint32_t)get_uint(data + 8, 4) : 0;
+    for (uint32_t i = 0; ok && i < count; i++) {
+        size_t name_len, source_len;
+        ok = pos + 2 <= end && (name_len = get_uint(data + pos, 2)) < CACHE_NAME_LEN && pos + 2 + name_len + 2 <= end;
+        if (!ok) break;
+        const uint8_t* name = data + pos + 2;
+        pos += 2 + name_len;
+        ok = (source_len = get_uint(data + pos, 2)) < MAX_PATH_LEN && pos + 2 + source_len + 20 <= end;
+        if (!ok) break;
+        const uint8_t* source = data + pos + 2;
+        pos += 2 + source_len;
+
+        cache_entry_t* e = add_entry("");
+        ok = e != NULL;
+        if (!ok) break;
+        memcpy(e->name, name, name_len);
+        e->name[name_len] = '\0';
+        memcpy(e->source, source, source_len);
+        e->source[source_len] = '\0';
+        e->size = get_uint(data + pos, 8);
+        e->last_access = get_uint(data + pos + 8, 8);
+        e->version = (uint32_t)get_uint(data + pos + 16, 4);
+        pos += 20;
+    }
+    ok = ok && pos == end;
+    free(data);
+    if (!ok) _count = 0;
+    return ok;
+}
+
+static void index_save(void) {
+    index_buf_t b = {0};
+    bool ok = buf_put(&b, CACHE_INDEX_MAGIC, 4) && buf_put_uint(&b, CACHE_INDEX_FORMAT, 4) && buf_put_uint(&b, _count, 4);
+    for (size_t i = 0; ok && i < _count; i++) {
+        const cache_entry_t* e = &_entries[i];
+        size_t name_len = strlen(e->name), source_len = strlen(e->source);
+        ok = buf_put_uint(&b, name_len, 2) && buf_put(&b, e->name, name_len)
+            && buf_put_uint(&b, source_len, 2) && buf_put(&b, e->source, source_len)
+            && buf_put_uint(&b, e->size, 8) && buf_put_uint(&b, e->last_access, 8) && buf_put_uint(&b, e->version, 4);
+    }
+    ok = ok && buf_put_uint(&b, index_checksum(b.data, b.len), 4);
+
+    // Written aside and renamed, so a crash never leaves a half-written index
+    char path[MAX_PATH_LEN], temp_path[MAX_PATH_LEN];
+    cache_index_path(CACHE_INDEX_FILENAME, path, sizeof(path));
+    cache_index_path(CACHE_INDEX_TEMP_FILENAME, temp_path, sizeof(temp_path));
+    FILE* fp = ok ? fopen(temp_path, "wb") : NULL;
+    if (fp) {
+        ok = fwrite(b.data, 1, b.len, fp) == b.len;
+        ok = (fclose(fp) == 0) && ok;
+        remove(path);
+        ok = ok && rename(temp_path, path) == 0;
+    } else {
+        ok = false;
+    }
+    if (!ok) logging(LOG_LEVEL_WARN, "Failed to save the cache index: %s", path);
+    free(b.data);
+}
+
+// Lists the files in the cache directory, or deletes them.
+static void index_scan(bool delete_files) {
+    DIR* dir = opendir(_dir);
+    if (!dir) {
+        logging(LOG_LEVEL_ERROR, "Could not open cache directory: %s", _dir);
+        return;
+    }
+    struct dirent* ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (is_index_file(ent->d_name) || strlen(ent->d_name) >= CACHE_NAME_LEN) continue;
+        char path[MAX_PATH_LEN];
+        struct stat st;
+        cache_index_path(ent->d_name, path, sizeof(path));
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+        if (delete_files) {
+            if (remove(path) != 0) logging(LOG_LEVEL_ERROR, "Failed to remove: %s", path);
+            continue;
+        }
+        if (is_temp_file(ent->d_name)) continue;
+        cache_entry_t* e = add_entry(ent->d_name);
+        if (!e) break;
+        e->size = (uint64_t)st.st_size;
+        e->last_access = (uint64_t)st.st_mtime;
+        e->version = CACHE_VERSION_UNKNOWN;
+    }
+    closedir(dir);
+}
+
+static uint64_t total_size(void) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < _count; i++) total += _entries[i].size;
+    return total;
+}
+
+// True if the entry belongs to the track source_path: it was converted from it, or it
+// came from a scan and is named after it.
+static bool is_entry_of(const cache_entry_t* e, const char* source_path) {
+    if (e->source[0]) return strcmp(e->source, source_path) == 0;
+    const char* base = base_name(source_path);
+    size_t len = strlen(base);
+    return strncmp(e->name, base, len) == 0 && e->name[len] == '.';
+}
+
+// Deletes least recently played entries until the cache fits, sparing keep and, if
+// source_path is given, every entry of that track.
+static void evict(const char* keep, const char* source_path) {
+    if (_max_bytes == 0) return;
+    uint64_t total = total_size();
+    while (total > _max_bytes) {
+        cache_entry_t* oldest = NULL;
+        for (size_t i = 0; i < _count; i++) {
+            if (strcmp(_entries[i].name, keep) == 0) continue;
+            if (source_path && is_entry_of(&_entries[i], source_path)) continue;
+            if (!oldest || _entries[i].last_access < oldest->last_access) oldest = &_entries[i];
+        }
+        if (!oldest) break;
+        total -= oldest->size;
+        drop_entry(oldest, true);
+    }
+}
+
+// --- Public API ---
+bool cache_index_open(const char* cache_dir, uint64_t max_bytes) {
+    if (_open) cache_index_close();
+    snprintf(_dir, sizeof(_dir), "%s", cache_dir);
+    _max_bytes = max_bytes;
+    _count = 0;
+    yasp_mutex_init(&_lock);
+    _open = true;
+
+    if (!index_load()) {
+        logging(LOG_LEVEL_INFO, "Cache index missing or damaged, rebuilding it from %s", _dir);
+        index_scan(false);
+        evict("", NULL);
+        index_save();
+    }
+    logging(LOG_LEVEL_INFO, "Cache index: %u files, %llu bytes", (unsigned)_count, (unsigned long long)total_size());
+    return true;
+}
+
+void cache_index_close(void) {
+    if (!_open) return;
+    index_save();
+    free(_entries);
+    _entries = NULL;
+    _count = _capacity = 0;
+    yasp_mutex_destroy(&_lock);
+    _open = false;
+}
+
+void cache_index_path(const char* name, char* path, size_t path_size) {
+    snprintf(path, path_size, "%s/%s", _dir, name);
+}
+
+void cache_index_name(const char* source_path, const char* suffix, char* name, size_t name_size) {
+    uint32_t hash = index_checksum((const uint8_t*)source_path, strlen(source_path));
+    snprintf(name, name_size, "%s.%08x.%s", base_name(source_path), (unsigned)hash, suffix);
+}
+
+bool cache_index_lookup(const char* cache_path, const char* source_path, uint32_t version) {
+    if (!_open) return false;
+    yasp_mutex_lock(&_lock);
+    cache_entry_t* e = find_entry(base_name(cache_path));
+    bool hit = false;
+    if (e) {
+        bool same_source = e->source[0] == '\0' || strcmp(e->source, source_path) == 0;
+        bool same_version = e->version == CACHE_VERSION_UNKNOWN || e->version == version;
+        if (same_source && same_version) {
+            // A rebuilt entry learns its source the first time it is played
+            if (e->source[0] == '\0') snprintf(e->source, sizeof(e->source), "%s", source_path);
+            e->last_access = (uint64_t)time(NULL);
+            hit = true;
+        } else {
+            logging(LOG_LEVEL_INFO, "Cache file %s is out of date, converting again.", e->name);
+            drop_entry(e, true);
+        }
+    }
+    yasp_mutex_unlock(&_lock);
+    return hit;
+}
+
+void cache_index_add(const char* cache_path, const char* source_path, uint32_t version) {
+    if (!_open) return;
+    struct stat st;
+    if (stat(cache_path, &st) != 0) return;
+    yasp_mutex_lock(&_lock);
+    const char* name = base_name(cache_path);
+    cache_entry_t* e = find_entry(name);
+    if (!e) e = add_entry(name);
+    if (e) {
+        snprintf(e->source, sizeof(e->source), "%s", source_path);
+        e->size = (uint64_t)st.st_size;
+        e->last_access = (uint64_t)time(NULL);
+        e->version = version;
+        evict(name, source_path);
+        index_save();
+    }
+    yasp_mutex_unlock(&_lock);
+}
+
+void cache_index_remove(const char* cache_path) {
+    if (!_open) return;
+    yasp_mutex_lock(&_lock);
+    cache_entry_t* e = find_entry(base_name(cache_path));
+    if (e) drop_entry(e, true);
+    yasp_mutex_unlock(&_lock);
+}
+
+void cache_index_clear(void) {
+    if (!_open) return;
+    yasp_mutex_lock(&_lock);
+    logging(LOG_LEVEL_INFO, "Clearing cache directory: %s", _dir);
+    index_scan(true);
+    _count = 0;
+    index_save();
+    yasp_mutex_unlock(&_lock);
+}
@@ -0,0 +1,45 @@
+#ifndef CACHE_INDEX_H
+#define CACHE_INDEX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Index of the conversion cache.
+// Kept in memory and saved as a small binary file in the cache directory. Each entry
+// records the cache file name, the source file it was converted from, its size, when it
+// was last played and the converter version that wrote it. The cache is kept under a
+// size cap by deleting the least recently played files. A missing or damaged index is
+// rebuilt by scanning the directory. Files ending in .tmp are left out of it.
+
+#define CACHE_INDEX_FILENAME "index.bin"
+
+// Default size cap, overridden by [cache] max_size_mb in config.ini
+#define CACHE_INDEX_DEFAULT_MAX_MB 512
+
+// Converter version of entries found by a directory scan. Accepted by any lookup.
+#define CACHE_VERSION_UNKNOWN 0
+
+// Loads the index of cache_dir, or rebuilds it. max_bytes of 0 means no cap.
+bool cache_index_open(const char* cache_dir, uint64_t max_bytes);
+// Saves the index. Lookups only update it in memory.
+void cache_index_close(void);
+
+// Full path of the cache file named name.
+void cache_index_path(const char* name, char* path, size_t path_size);
+// Cache file name for source_path: its base name, a hash of the full path and suffix, so
+// tracks of the same name in different folders do not share a file.
+void cache_index_name(const char* source_path, const char* suffix, char* name, size_t name_size);
+
+// True if cache_path holds a conversion of source_path by converter version. Marks it as used.
+// Entries of another source or version are dropped together with their file.
+bool cache_index_lookup(const char* cache_path, const char* source_path, uint32_t version);
+// Records a cache file that was just written, then evicts entries over the cap. The other
+// entries of source_path are kept, since the track is playing.
+void cache_index_add(const char* cache_path, const char* source_path, uint32_t version);
+// Forgets an entry whose file turned out to be unusable, and deletes the file.
+void cache_index_remove(const char* cache_path);
+// Deletes every cache file.
+void cache_index_clear(void);
+
+#endif // CACHE_INDEX_H
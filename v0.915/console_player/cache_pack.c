@@ -0,0 +1,248 @@
+#include "cache_pack.h"
+#include "lz.h"
+#include "error.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHE_PACK_FORMAT 1
+#define CACHE_PACK_HEADER_SIZE 24
+#define CACHE_PACK_STORED 0x80000000u
+// A damaged file must not make the reader allocate without bound
+#define CACHE_PACK_MAX_BLOCK_SIZE (1024 * 1024)
+
+static void put_le32(uint8_t* p, uint32_t v) {
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = (v >> 24) & 0xFF;
+}
+
+static uint32_t get_le32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+bool cache_pack_detect(FILE* fp) {
+    char magic[4];
+    bool found = fseek(fp, 0, SEEK_SET) == 0 && fread(magic, 1, 4, fp) == 4 && memcmp(magic, CACHE_PACK_MAGIC, 4) == 0;
+    fseek(fp, 0, SEEK_SET);
+    return found;
+}
+
+// --- Writer ---
+bool cache_pack_write(FILE* fp, const uint8_t* data, size_t size, cache_pack_stats_t* stats) {
+    uint32_t block_count = (uint32_t)((size + CACHE_PACK_BLOCK_SIZE - 1) / CACHE_PACK_BLOCK_SIZE);
+    size_t head_size = CACHE_PACK_HEADER_SIZE + (size_t)block_count * 8;
+    uint8_t* head = calloc(1, head_size);
+    uint8_t* packed = malloc(lz_compress_bound(CACHE_PACK_BLOCK_SIZE));
+    bool ok = head && packed && fwrite(head, 1, head_size, fp) == head_size;
+
+    size_t offset = head_size;
+    for (uint32_t i = 0; ok && i < block_count; i++) {
+        const uint8_t* block = data + (size_t)i * CACHE_PACK_BLOCK_SIZE;
+        size_t block_len = size - (size_t)i * CACHE_PACK_BLOCK_SIZE;
+        if (block_len > CACHE_PACK_BLOCK_SIZE) block_len = CACHE_PACK_BLOCK_SIZE;
+        size_t packed_len = lz_compress(block, block_len, packed, lz_compress_bound(CACHE_PACK_BLOCK_SIZE));
+        uint32_t size_field = (uint32_t)packed_len;
+        if (packed_len == 0 || packed_len >= block_len) {
+            // Not worth compressing, store it as it is
+            ok = fwrite(block, 1, block_len, fp) == block_len;
+            packed_len = block_len;
+            size_field = (uint32_t)block_len | CACHE_PACK_STORED;
+        } else {
+            ok = fwrite(packed, 1, packed_len, fp) == packed_len;
+        }
+        put_le32(head + CACHE_PACK_HEADER_SIZE + i * 8, (uint32_t)offset);
+        put_le32(head + CACHE_PACK_HEADER_SIZE + i * 8 + 4, size_field);
+        offset += packed_len;
+    }
+
+    if (ok) {
+        memcpy(head, CACHE_PACK_MAGIC, 4);
+        put_le32(head + 4, CACHE_PACK_FORMAT);
+        put_le32(head + 8, CACHE_PACK_BLOCK_SIZE);
+        put_le32(head + 12, block_count);
+        put_le32(head + 16, (uint32_t)((uint64_t)size & 0xFFFFFFFF));
+        put_le32(head + 20, (uint32_t)((uint64_t)size >> 32));
+        ok = fseek(fp, 0, SEEK_SET) == 0 && fwrite(head, 1, head_size, fp) == head_size && fseek(fp, 0, SEEK_END) == 0;
+    }
+    if (stats) {
+        stats->raw_size = size;
+        stats->packed_size = offset;
+    }
+    free(head);
+    free(packed);
+    return ok;
+}
+
+// --- Reader ---
+static bool cache_pack_decode(cache_pack_reader_t* r, uint32_t block, uint8_t* packed, uint8_t* out) {
+    uint64_t start = (uint64_t)block * r->block_size;
+    size_t block_len = (size_t)(r->raw_size - start < r->block_size ? r->raw_size - start : r->block_size);
+    uint32_t size_field = r->block_sizes[block];
+    size_t packed_len = size_field & ~CACHE_PACK_STORED;
+    if (packed_len > lz_compress_bound(r->block_size)) return false;
+    if (fseek(r->fp, (long)r->block_offsets[block], SEEK_SET) != 0 || fread(packed, 1, packed_len, r->fp) != packed_len) return false;
+    if (size_field & CACHE_PACK_STORED) {
+        if (packed_len != block_len) return false;
+        memcpy(out, packed, block_len);
+        return true;
+    }
+    return lz_decompress(packed, packed_len, out, block_len);
+}
+
+static bool cache_pack_holds(const cache_pack_reader_t* r, int64_t block) {
+    for (int s = 0; s < CACHE_PACK_AHEAD; s++) {
+        if (r->slot_block[s] == block) return true;
+    }
+    return false;
+}
+
+// Helper thread: keeps the blocks from the cursor on decompressed
+static void cache_pack_thread(void* arg) {
+    cache_pack_reader_t* r = (cache_pack_reader_t*)arg;
+    uint8_t* packed = malloc(lz_compress_bound(r->block_size));
+
+    yasp_mutex_lock(&r->lock);
+    if (!packed) r->failed = true;
+    while (!r->stop) {
+        int64_t cursor = r->cursor_block;
+        int64_t want = -1;
+        for (int64_t b = cursor; b < cursor + CACHE_PACK_AHEAD && b < r->block_count; b++) {
+            if (!cache_pack_holds(r, b)) {
+                want = b;
+                break;
+            }
+        }
+        if (want < 0 || r->failed) {
+            yasp_cond_wait(&r->cond, &r->lock, 100);
+            continue;
+        }
+        // A slot outside the window is free to reuse. The reader only uses the block at the cursor.
+        int slot = 0;
+        for (int s = 0; s < CACHE_PACK_AHEAD; s++) {
+            if (r->slot_block[s] < cursor || r->slot_block[s] >= cursor + CACHE_PACK_AHEAD) {
+                slot = s;
+                break;
+            }
+        }
+        r->slot_block[slot] = -1;
+        yasp_mutex_unlock(&r->lock);
+
+        bool ok = cache_pack_decode(r, (uint32_t)want, packed, r->slots[slot]);
+
+        yasp_mutex_lock(&r->lock);
+        if (ok) {
+            r->slot_block[slot] = want;
+        } else {
+            logging(LOG_LEVEL_ERROR, "Compressed cache block %u is damaged.", (unsigned)want);
+            r->failed = true;
+        }
+        yasp_cond_broadcast(&r->cond);
+    }
+    yasp_mutex_unlock(&r->lock);
+    free(packed);
+}
+
+bool cache_pack_open(cache_pack_reader_t* r, FILE* fp) {
+    memset(r, 0, sizeof(cache_pack_reader_t));
+    r->current_block = -1;
+
+    uint8_t head[CACHE_PACK_HEADER_SIZE];
+    if (fseek(fp, 0, SEEK_SET) != 0 || fread(head, 1, sizeof(head), fp) != sizeof(head)
+        || memcmp(head, CACHE_PACK_MAGIC, 4) != 0 || get_le32(head + 4) != CACHE_PACK_FORMAT) {
+        return false;
+    }
+    r->block_size = get_le32(head + 8);
+    r->block_count = get_le32(head + 12);
+    r->raw_size = get_le32(head + 16) | ((uint64_t)get_le32(head + 20) << 32);
+    if (r->block_size == 0 || r->block_size > CACHE_PACK_MAX_BLOCK_SIZE
+        || r->block_count != (r->raw_size + r->block_size - 1) / r->block_size) {
+        return false;
+    }
+
+    size_t index_size = (size_t)r->block_count * 8;
+    uint8_t* index = malloc(index_size ? index_size : 1);
+    r->block_offsets = malloc(sizeof(uint32_t) * (r->block_count ? r->block_count : 1));
+    r->block_sizes = malloc(sizeof(uint32_t) * (r->block_count ? r->block_count : 1));
+    bool ok = index && r->block_offsets && r->block_sizes && fread(index, 1, index_size, fp) == index_size;
+    for (uint32_t i = 0; ok && i < r->block_count; i++) {
+        r->block_offsets[i] = get_le32(index + i * 8);
+        r->block_sizes[i] = get_le32(index + i * 8 + 4);
+    }
+    free(index);
+    for (int s = 0; ok && s < CACHE_PACK_AHEAD; s++) {
+        r->slot_block[s] = -1;
+        r->slots[s] = malloc(r->block_size);
+        ok = r->slots[s] != NULL;
+    }
+    if (ok) {
+        r->fp = fp; // Only the helper thread reads it from here on
+        yasp_mutex_init(&r->lock);
+        yasp_cond_init(&r->cond);
+        ok = yasp_thread_start(&r->thread, cache_pack_thread, r);
+        if (!ok) {
+            yasp_cond_destroy(&r->cond);
+            yasp_mutex_destroy(&r->lock);
+        }
+    }
+    if (!ok) {
+        for (int s = 0; s < CACHE_PACK_AHEAD; s++) free(r->slots[s]);
+        free(r->block_offsets);
+        free(r->block_sizes);
+        memset(r, 0, sizeof(cache_pack_reader_t));
+    }
+    return ok;
+}
+
+void cache_pack_close(cache_pack_reader_t* r) {
+    if (!r->fp) return;
+    yasp_mutex_lock(&r->lock);
+    r->stop = true;
+    yasp_cond_broadcast(&r->cond);
+    yasp_mutex_unlock(&r->lock);
+    yasp_thread_join(&r->thread);
+    yasp_cond_destroy(&r->cond);
+    yasp_mutex_destroy(&r->lock);
+    for (int s = 0; s < CACHE_PACK_AHEAD; s++) free(r->slots[s]);
+    free(r->block_offsets);
+    free(r->block_sizes);
+    memset(r, 0, sizeof(cache_pack_reader_t));
+}
+
+// Moves the cursor to block and waits until the helper has it ready
+static const uint8_t* cache_pack_block(cache_pack_reader_t* r, uint32_t block) {
+    const uint8_t* data = NULL;
+    yasp_mutex_lock(&r->lock);
+    r->cursor_block = block;
+    yasp_cond_broadcast(&r->cond);
+    while (!data && !r->failed) {
+        for (int s = 0; s < CACHE_PACK_AHEAD; s++) {
+            if (r->slot_block[s] == block) data = r->slots[s];
+        }
+        if (!data) yasp_cond_wait(&r->cond, &r->lock, 100);
+    }
+    yasp_mutex_unlock(&r->lock);
+    return data;
+}
+
+size_t cache_pack_read(cache_pack_reader_t* r, size_t offset, void* buf, size_t size) {
+    size_t done = 0;
+    while (done < size && offset < r->raw_size) {
+        uint32_t block = (uint32_t)(offset / r->block_size);
+        if (block != r->current_block) {
+            r->current = cache_pack_block(r, block);
+            r->current_block = r->current ? (int64_t)block : -1;
+            if (!r->current) break;
+        }
+        size_t in_block = offset % r->block_size;
+        size_t block_len = (size_t)(r->raw_size - (uint64_t)block * r->block_size);
+        if (block_len > r->block_size) block_len = r->block_size;
+        size_t n = block_len - in_block;
+        if (n > size - done) n = size - done;
+        memcpy((uint8_t*)buf + done, r->current + in_block, n);
+        done += n;
+        offset += n;
+    }
+    return done;
+}
@@ -0,0 +1,69 @@
+#ifndef CACHE_PACK_H
+#define CACHE_PACK_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "thread.h"
+
+// Compressed container for cache files.
+// The file is cut into blocks that are compressed one by one (lz.c), with an index of
+// where each block starts, so playback can start anywhere and jump back to the loop
+// point without decompressing everything before it. The content is the complete
+// .opm.vgm cache file, header and GD3 included.
+//
+// Layout, little endian:
+//   "YCPK", u32 format, u32 block size, u32 block count, u64 content size,
+//   per block: u32 file offset, u32 packed size (bit 31 set: stored uncompressed),
+//   the blocks.
+
+#define CACHE_PACK_MAGIC "YCPK"
+#define CACHE_PACK_BLOCK_SIZE (64 * 1024)
+// Blocks kept decompressed ahead of the playback position, the current one included
+#define CACHE_PACK_AHEAD 4
+
+typedef struct {
+    size_t raw_size;
+    size_t packed_size;
+} cache_pack_stats_t;
+
+// True if fp holds a compressed cache file. Leaves fp at the start.
+bool cache_pack_detect(FILE* fp);
+
+// Compresses data into fp as a cache container.
+bool cache_pack_write(FILE* fp, const uint8_t* data, size_t size, cache_pack_stats_t* stats);
+
+// Reads a compressed cache file. A helper thread decompresses the blocks ahead of the
+// read position, so the player only copies bytes out of blocks that are ready.
+typedef struct cache_pack_reader {
+    FILE* fp;
+    uint32_t block_size;
+    uint32_t block_count;
+    uint64_t raw_size;
+    uint32_t* block_offsets;
+    uint32_t* block_sizes;
+
+    // Shared with the helper thread, under lock
+    uint8_t* slots[CACHE_PACK_AHEAD];
+    int64_t slot_block[CACHE_PACK_AHEAD]; // Block held by each slot, -1 if none
+    uint32_t cursor_block;                // Block the reader is in
+    bool stop;
+    bool failed;                          // A block could not be read or decompressed
+    yasp_mutex_t lock;
+    yasp_cond_t cond;
+    yasp_thread_t thread;
+
+    // Reader side only: the block being read, which the helper never evicts
+    const uint8_t* current;
+    int64_t current_block;
+} cache_pack_reader_t;
+
+// Opens the container in fp, which stays owned by the caller, and starts the helper thread.
+bool cache_pack_open(cache_pack_reader_t* reader, FILE* fp);
+void cache_pack_close(cache_pack_reader_t* reader);
+// Copies up to size bytes from offset of the content. Returns fewer only at the end,
+// or if the file turns out to be damaged.
+size_t cache_pack_read(cache_pack_reader_t* reader, size_t offset, void* buf, size_t size);
+
+#endif // CACHE_PACK_H
@@ -0,0 +1,156 @@
+#include "chip_driver.h"
+#include "spfm.h"
+#include "ym2151.h"
+#include "ym2612.h"
+#include "ym2203.h"
+#include "ym2413.h"
+#include "ym2608.h"
+#include "ym3526.h"
+#include "ym3812.h"
+#include "y8950.h"
+#include "ymf262.h"
+#include "ay8910.h"
+#include "sn76489.h"
+
+// --- Writes ---
+static void write_ym2151(const route_t* r, uint8_t addr, uint8_t data) { ym2151_write_reg(r->slot, addr, data); }
+static void write_ym2203(const route_t* r, uint8_t addr, uint8_t data) { ym2203_write_reg(r->slot, addr, data); }
+static void write_ym2413(const route_t* r, uint8_t addr, uint8_t data) { ym2413_write_reg(r->slot, addr, data); }
+static void write_ym3526(const route_t* r, uint8_t addr, uint8_t data) { ym3526_write_reg(r->slot, addr, data); }
+static void write_ym3812(const route_t* r, uint8_t addr, uint8_t data) { ym3812_write_reg(r->slot, addr, data); }
+static void write_y8950(const route_t* r, uint8_t addr, uint8_t data) { y8950_write_reg(r->slot, addr, data); }
+static void write_ay8910(const route_t* r, uint8_t addr, uint8_t data) { ay8910_write_reg(r->slot, addr, data); }
+static void write_ym2612(const route_t* r, uint8_t addr, uint8_t data) { ym2612_write_reg(r->slot, r->port, addr, data); }
+static void write_ym2608(const route_t* r, uint8_t addr, uint8_t data) { ym2608_write_reg(r->slot, r->port, addr, data); }
+static void write_ymf262(const route_t* r, uint8_t addr, uint8_t data) { ymf262_write_reg(r->slot, r->port, addr, data); }
+static void write_sn76489(const route_t* r, uint8_t addr, uint8_t data) { (void)addr; sn76489_write_reg(r->slot, data); }
+
+// --- Bus timing ---
+// OPN: the SSG registers take no wait, the FM channel registers a shorter one than the rest
+static uint16_t data_cycles_opn(uint8_t port, uint8_t addr) {
+    if (port == 0 && addr < 0x10) return 0;
+    if (addr >= 0xA0 && addr <= 0xB6) return 47;
+    return 83;
+}
+
+// --- Replay ---
+// OPM: the key-on register goes last, once the voices are set up. 0xFF is not used.
+static int replay_addr_opm(uint8_t port, uint16_t i) {
+    (void)port;
+    return i == 0x08 ? 0xFF : i == 0xFF ? 0x08 : i;
+}
+
+// OPN: the same for the key-on register. The frequency high byte is latched and only
+// taken with the low byte, so each 0xA4-0xA7 and 0xAC-0xAF block goes before the block
+// it belongs to.
+static int replay_addr_opn(uint8_t port, uint16_t i) {
+    if (port == 0 && i == 0x28) return 0xFF;
+    if (port == 0 && i == 0xFF) return 0x28;
+    if ((i >= 0xA0 && i <= 0xA3) || (i >= 0xA8 && i <= 0xAB)) return i + 4;
+    if ((i >= 0xA4 && i <= 0xA7) || (i >= 0xAC && i <= 0xAF)) return i - 4;
+    return i;
+}
+
+// YM2608: a rhythm key-on or an ADPCM-B start would play a sound, and the ADPCM data
+// port writes to the RAM, so those are not repeated
+static int replay_addr_ym2608(uint8_t port, uint16_t i) {
+    if (port == 0 && i == 0x10) return -1;
+    if (port == 1 && (i == 0x00 || i == 0x08)) return -1;
+    return replay_addr_opn(port, i);
+}
+
+// Y8950: the same for the ADPCM control and data registers
+static int replay_addr_y8950(uint8_t port, uint16_t i) {
+    (void)port;
+    return i == 0x07 || i == 0x0F ? -1 : i;
+}
+
+static const chip_driver_t s_drivers[CHIP_TYPE_COUNT] = {
+    // Then the bus timing: address cycles, data cycles and the per-register data cycles,
+    // and the register order of a replay
+    [CHIP_TYPE_YM2151]  = { CHIP_TYPE_YM2151,  1, 256, false, ym2151_init,  ym2151_mute,  ym2151_start, write_ym2151,  0,  64, NULL, replay_addr_opm },
+    [CHIP_TYPE_YM2203]  = { CHIP_TYPE_YM2203,  1, 256, false, ym2203_init,  ym2203_mute,  NULL, write_ym2203,          17, 83, data_cycles_opn, replay_addr_opn },
+    [CHIP_TYPE_YM2612]  = { CHIP_TYPE_YM2612,  2, 256, false, ym2612_init,  ym2612_mute,  NULL, write_ym2612,          17, 83, data_cycles_opn, replay_addr_opn },
+    [CHIP_TYPE_YM2608]  = { CHIP_TYPE_YM2608,  2, 256, false, ym2608_init,  ym2608_mute,  NULL, write_ym2608,          17, 83, data_cycles_opn, replay_addr_ym2608 },
+    [CHIP_TYPE_YM2413]  = { CHIP_TYPE_YM2413,  1, 64,  false, ym2413_init,  ym2413_mute,  NULL, write_ym2413,          12, 84, NULL, NULL },
+    [CHIP_TYPE_YM3526]  = { CHIP_TYPE_YM3526,  1, 256, false, ym3526_init,  ym3526_mute,  NULL, write_ym3526,          12, 84, NULL, NULL },
+    [CHIP_TYPE_YM3812]  = { CHIP_TYPE_YM3812,  1, 256, false, ym3812_init,  ym3812_mute,  NULL, write_ym3812,          12, 84, NULL, NULL },
+    [CHIP_TYPE_Y8950]   = { CHIP_TYPE_Y8950,   1, 256, false, y8950_init,   y8950_mute,   NULL, write_y8950,           12, 84, NULL, replay_addr_y8950 },
+    [CHIP_TYPE_YMF262]  = { CHIP_TYPE_YMF262,  2, 256, false, ymf262_init,  ymf262_mute,  NULL, write_ymf262,          32, 32, NULL, NULL },
+    [CHIP_TYPE_AY8910]  = { CHIP_TYPE_AY8910,  1, 16,  false, ay8910_init,  ay8910_mute,  NULL, write_ay8910,           0,  0, NULL, NULL },
+    [CHIP_TYPE_SN76489] = { CHIP_TYPE_SN76489, 1, 0,   true,  sn76489_init, sn76489_mute, NULL, write_sn76489,          0, 32, NULL, NULL },
+};
+
+const chip_driver_t* chip_driver_get(chip_type_t type) {
+    if (type <= CHIP_TYPE_NONE || type >= CHIP_TYPE_COUNT || !s_drivers[type].init) return NULL;
+    return &s_drivers[type];
+}
+
+uint16_t chip_driver_data_cycles(const chip_driver_t* driver, uint8_t port, uint8_t addr) {
+    return driver->data_cycles_for ? driver->data_cycles_for(port, addr) : driver->data_cycles;
+}
+
+int chip_driver_replay_addr(const chip_driver_t* driver, uint8_t port, uint16_t i) {
+    return driver->replay_addr ? driver->replay_addr(port, i) : i;
+}
+
+// --- Encoded sequences ---
+typedef struct {
+    spfm_blob_t blob;
+    bool valid;
+    uint8_t slot;           // Slot and device type the bytes were encoded for
+    SPFM_TYPE device;
+} chip_sequence_t;
+
+static chip_sequence_t s_init_sequences[CHIP_TYPE_COUNT];
+static chip_sequence_t s_mute_sequences[CHIP_TYPE_COUNT];
+
+// Sends a sequence, encoding it first if it is not there yet for this slot and device
+static void chip_driver_send(chip_sequence_t* seq, void (*build)(uint8_t slot), uint8_t slot) {
+    if (spfm_get_device_count() == 0) return;
+    SPFM_TYPE device = spfm_get_device_type(SPFM_SLOT_DEVICE(slot));
+    if (!seq->valid || seq->slot != slot || seq->device != device) {
+        spfm_blob_free(&seq->blob);
+        spfm_record(&seq->blob);
+        build(slot);
+        spfm_record(NULL);
+        seq->valid = !seq->blob.failed;
+        seq->slot = slot;
+        seq->device = device;
+        if (!seq->valid) {
+            // Out of memory: send it the slow way
+            spfm_blob_free(&seq->blob);
+            build(slot);
+            return;
+        }
+    }
+    spfm_write_raw_slot(slot, seq->blob.data, seq->blob.size);
+}
+
+void chip_driver_init(chip_type_t type, uint8_t slot) {
+    const chip_driver_t* driver = chip_driver_get(type);
+    if (!driver) return;
+    chip_driver_send(&s_init_sequences[type], driver->init, slot);
+    if (driver->start) driver->start(slot);
+}
+
+void chip_driver_reset(chip_type_t type, uint8_t slot) {
+    const chip_driver_t* driver = chip_driver_get(type);
+    if (!driver) return;
+    chip_driver_send(&s_init_sequences[type], driver->init, slot);
+}
+
+void chip_driver_mute(chip_type_t type, uint8_t slot) {
+    const chip_driver_t* driver = chip_driver_get(type);
+    if (!driver) return;
+    chip_driver_send(&s_mute_sequences[type], driver->mute, slot);
+}
+
+void chip_driver_release(void) {
+    for (int i = 0; i < CHIP_TYPE_COUNT; i++) {
+        spfm_blob_free(&s_init_sequences[i].blob);
+        spfm_blob_free(&s_mute_sequences[i].blob);
+        s_init_sequences[i].valid = false;
+        s_mute_sequences[i].valid = false;
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef CHIP_DRIVER_H
+#define CHIP_DRIVER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "chiptype.h"
+#include "route.h"
+
+// Chip driver registry.
+// Every chip the player can drive directly has one entry here: how to bring it to a
+// clean state, how to silence it, how to send it a write, and the shape of its
+// register map. spfm.c and the routing work through this table, so a new chip only
+// needs its driver file and an entry.
+//
+// The init and mute sequences do not change between tracks. They are encoded once per
+// device type and slot into ready-to-send device bytes, and sent as one block after that.
+
+typedef struct {
+    chip_type_t type;
+    uint8_t ports;              // Register ports, selected with the A1 line
+    uint16_t registers;         // Addresses per port
+    bool data_only;             // Written with data bytes only, no address (SN76489)
+    void (*init)(uint8_t slot); // Full reset to a silent state. Recorded, so it must not depend on the track.
+    void (*mute)(uint8_t slot); // Silences all channels. Recorded like init.
+    void (*start)(uint8_t slot); // Sets up per-track state after init, or NULL
+    route_write_func_t write;
+    // Bus timing from the datasheet, in cycles of the chip clock
+    uint16_t addr_cycles;       // After the address, before the data
+    uint16_t data_cycles;       // After the data, before the next address. The longest if it depends on the register.
+    uint16_t (*data_cycles_for)(uint8_t port, uint8_t addr); // Per register, or NULL for data_cycles
+    // Register written at step i when the chip state is put back after a reconnect, -1 to
+    // skip the step. NULL writes every register in address order.
+    int (*replay_addr)(uint8_t port, uint16_t i);
+} chip_driver_t;
+
+// Driver of a chip type, NULL if the player cannot drive it.
+const chip_driver_t* chip_driver_get(chip_type_t type);
+
+// Cycles the chip needs after a data write to this register before it takes the next address
+uint16_t chip_driver_data_cycles(const chip_driver_t* driver, uint8_t port, uint8_t addr);
+
+// Register a replay writes at step i, -1 if none (see replay_addr)
+int chip_driver_replay_addr(const chip_driver_t* driver, uint8_t port, uint16_t i);
+
+// Sends the init or mute sequence to the chip in slot.
+void chip_driver_init(chip_type_t type, uint8_t slot);
+void chip_driver_mute(chip_type_t type, uint8_t slot);
+
+// Sends the init sequence only, without start, so the per-track state on the host is left
+// as it is. Used when the chip state is put back from the shadow.
+void chip_driver_reset(chip_type_t type, uint8_t slot);
+
+// Forgets the encoded sequences, when the device is closed.
+void chip_driver_release(void);
+
+#endif // CHIP_DRIVER_H
@@ -2,7 +2,8 @@
 #include <string.h>
 #include <stdlib.h>
 
-chip_config_t g_chip_config[CHIP_TYPE_COUNT];
+chip_config_t g_chip_config[CHIP_CONFIG_MAX];
+int g_chip_config_count = 0;
 
 // Map chip type enum to string representation
 const char* chip_type_to_string(chip_type_t type) {
@@ -72,11 +73,35 @@ uint32_t get_chip_default_clock(chip_type_t type) {
     }
 }
 
-uint8_t get_slot_for_chip(chip_type_t type) {
-    for (int i = 0; i < CHIP_TYPE_COUNT; i++) {
-        if (g_chip_config[i].type == type) {
+void init_chip_config() {
+    g_chip_config_count = 0;
+}
+
+bool chip_config_add(chip_type_t type, uint8_t slot, uint32_t clock) {
+    if (g_chip_config_count == CHIP_CONFIG_MAX || type <= CHIP_TYPE_NONE || type >= CHIP_TYPE_COUNT) return false;
+    chip_config_t* chip = &g_chip_config[g_chip_config_count++];
+    chip->type = type;
+    chip->slot = slot;
+    chip->clock = clock ? clock : get_chip_default_clock(type);
+    return true;
+}
+
+uint8_t get_slot_for_chip_instance(chip_type_t type, int instance) {
+    for (int i = 0; i < g_chip_config_count; i++) {
+        if (g_chip_config[i].type == type && instance-- == 0) {
             return g_chip_config[i].slot;
         }
     }
     return 0xFF; // Return invalid slot if not found
 }
+
+uint8_t get_slot_for_chip(chip_type_t type) {
+    return get_slot_for_chip_instance(type, 0);
+}
+
+uint32_t get_clock_for_chip(chip_type_t type) {
+    for (int i = 0; i < g_chip_config_count; i++) {
+        if (g_chip_config[i].type == type) return g_chip_config[i].clock;
+    }
+    return get_chip_default_clock(type);
+}
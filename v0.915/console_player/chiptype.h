@@ -25,17 +25,30 @@ typedef enum {
     CHIP_TYPE_COUNT
 } chip_type_t;
 
+// One installed chip. The same type can be installed more than once, for tracks that
+// use two of it.
 typedef struct {
     chip_type_t type;
-    uint8_t slot;
+    uint8_t slot;      // SPFM_SLOT(device, slot)
+    uint32_t clock;    // Clock of the chip on the module
 } chip_config_t;
 
-// Global chip configuration
+#define CHIP_CONFIG_MAX 32
+
+// Global chip configuration, in the order the chips were added
 // This will be populated at runtime based on user input or a config file.
-extern chip_config_t g_chip_config[CHIP_TYPE_COUNT];
+extern chip_config_t g_chip_config[CHIP_CONFIG_MAX];
+extern int g_chip_config_count;
+
+// Adds a chip. A clock of 0 takes the default clock of the type.
+bool chip_config_add(chip_type_t type, uint8_t slot, uint32_t clock);
 
 // Function to get the slot for a given chip type
 uint8_t get_slot_for_chip(chip_type_t type);
+// Slot of the n-th installed chip of a type (0: the first), 0xFF if there are fewer
+uint8_t get_slot_for_chip_instance(chip_type_t type, int instance);
+// Clock of the first installed chip of a type, or its default clock if there is none
+uint32_t get_clock_for_chip(chip_type_t type);
 
 // Function to convert chip type to string
 const char* chip_type_to_string(chip_type_t type);
@@ -45,7 +58,7 @@ chip_type_t get_chip_type_from_string(const char* s); // Alias for string_to_chi
 // Function to get the default clock for a chip
 uint32_t get_chip_default_clock(chip_type_t type);
 
-// Function to initialize the chip configuration
+// Function to initialize the chip configuration: removes every chip
 void init_chip_config();
 
 #endif // CHIPTYPE_H
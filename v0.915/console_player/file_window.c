@@ -0,0 +1,67 @@
+#include "file_window.h"
+#include "error.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+bool file_window_open(file_window_t* w, FILE* fp, long base, size_t size, size_t window_size) {
+    memset(w, 0, sizeof(file_window_t));
+    w->buf = malloc(window_size);
+    if (!w->buf) return false;
+    w->fp = fp;
+    w->base = base;
+    w->size = size;
+    w->buf_size = window_size;
+    return true;
+}
+
+void file_window_open_mem(file_window_t* w, const uint8_t* data, size_t size) {
+    memset(w, 0, sizeof(file_window_t));
+    w->data = data;
+    w->size = size;
+}
+
+bool file_window_open_copy(file_window_t* w, const file_window_t* src) {
+    if (src->data) {
+        file_window_open_mem(w, src->data, src->size);
+        return true;
+    }
+    return file_window_open(w, src->fp, src->base, src->size, src->buf_size);
+}
+
+void file_window_close(file_window_t* w) {
+    free(w->buf);
+    w->buf = NULL;
+}
+
+const uint8_t* file_window_get(file_window_t* w, size_t pos, size_t len) {
+    if (pos > w->size || len > w->size - pos) return NULL;
+    if (w->data) return w->data + pos;
+
+    if (pos < w->buf_start || pos + len > w->buf_start + w->buf_len) {
+        // Slide the window to start at pos
+        if (len > w->buf_size) return NULL;
+        size_t to_read = w->size - pos;
+        if (to_read > w->buf_size) to_read = w->buf_size;
+        // Other windows may read the same file from other threads, so seek and read in one go
+#ifdef _WIN32
+        _lock_file(w->fp);
+#else
+        flockfile(w->fp);
+#endif
+        bool ok = fseek(w->fp, w->base + (long)pos, SEEK_SET) == 0 && fread(w->buf, 1, to_read, w->fp) == to_read;
+#ifdef _WIN32
+        _unlock_file(w->fp);
+#else
+        funlockfile(w->fp);
+#endif
+        if (!ok) {
+            logging(LOG_LEVEL_ERROR, "Failed to read file at offset %ld.", w->base + (long)pos);
+            w->buf_len = 0;
+            return NULL;
+        }
+        w->buf_start = pos;
+        w->buf_len = to_read;
+    }
+    return w->buf + (pos - w->buf_start);
+}
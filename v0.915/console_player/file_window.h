@@ -0,0 +1,38 @@
+#ifndef FILE_WINDOW_H
+#define FILE_WINDOW_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Sliding read window over a file, so large files can be walked with a fixed amount of memory.
+// Data that is never asked for (e.g. skipped PCM blocks) is never read.
+// A window can also wrap data that is already in memory.
+
+#define FILE_WINDOW_DEFAULT_SIZE (64 * 1024)
+
+typedef struct {
+    const uint8_t* data;   // In-memory data, or NULL when reading from fp
+    FILE* fp;
+    long base;             // File offset of position 0
+    size_t size;           // Bytes available from position 0
+    uint8_t* buf;
+    size_t buf_size;
+    size_t buf_start;      // Position of buf[0]
+    size_t buf_len;        // Valid bytes in buf
+} file_window_t;
+
+// The window does not own fp. It must stay open while the window is used.
+// Several windows can read the same file, also from different threads.
+bool file_window_open(file_window_t* w, FILE* fp, long base, size_t size, size_t window_size);
+void file_window_open_mem(file_window_t* w, const uint8_t* data, size_t size);
+// Opens another window over the same data as src, e.g. for another thread.
+bool file_window_open_copy(file_window_t* w, const file_window_t* src);
+void file_window_close(file_window_t* w);
+
+// Returns a pointer to len bytes at pos, valid until the next call.
+// Returns NULL if they are past the end or do not fit in the window.
+const uint8_t* file_window_get(file_window_t* w, size_t pos, size_t len);
+
+#endif // FILE_WINDOW_H
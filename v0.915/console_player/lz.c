@@ -0,0 +1,130 @@
+#include "lz.h"
+
+#include <string.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+// The format ends every block with literals: no match starts in the last
+// LZ_MATCH_LIMIT bytes and no match covers the last LZ_LAST_LITERALS bytes.
+#define LZ_MATCH_LIMIT 12
+#define LZ_LAST_LITERALS 5
+
+size_t lz_compress_bound(size_t n) {
+    return n + n / 255 + 16;
+}
+
+static uint32_t lz_hash(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Lengths of 15 and more continue in extra bytes of 255 each, ended by a byte below 255
+static uint8_t* lz_put_length(uint8_t* op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+static uint8_t* lz_put_sequence(uint8_t* op, const uint8_t* literals, size_t literal_len) {
+    uint8_t* token = op++;
+    *token = (uint8_t)((literal_len < 15 ? literal_len : 15) << 4);
+    if (literal_len >= 15) op = lz_put_length(op, literal_len - 15);
+    memcpy(op, literals, literal_len);
+    return op + literal_len;
+}
+
+size_t lz_compress(const uint8_t* src, size_t n, uint8_t* dst, size_t dst_capacity) {
+    if (dst_capacity < lz_compress_bound(n)) return 0;
+
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    const uint8_t* ip = src;
+    const uint8_t* anchor = src;
+    const uint8_t* end = src + n;
+    uint8_t* op = dst;
+
+    if (n > LZ_MATCH_LIMIT) {
+        const uint8_t* match_limit = end - LZ_MATCH_LIMIT;
+        const uint8_t* extend_limit = end - LZ_LAST_LITERALS;
+        while (ip < match_limit) {
+            uint32_t h = lz_hash(ip);
+            const uint8_t* ref = src + table[h];
+            table[h] = (uint32_t)(ip - src);
+            if (ref >= ip || ip - ref > LZ_MAX_OFFSET || memcmp(ref, ip, LZ_MIN_MATCH) != 0) {
+                ip++;
+                continue;
+            }
+            size_t len = LZ_MIN_MATCH;
+            while (ip + len < extend_limit && ref[len] == ip[len]) len++;
+
+            uint8_t* token = op;
+            op = lz_put_sequence(op, anchor, ip - anchor);
+            size_t offset = ip - ref;
+            *op++ = (uint8_t)(offset & 0xFF);
+            *op++ = (uint8_t)(offset >> 8);
+            size_t match_code = len - LZ_MIN_MATCH;
+            *token |= (uint8_t)(match_code < 15 ? match_code : 15);
+            if (match_code >= 15) op = lz_put_length(op, match_code - 15);
+
+            ip += len;
+            anchor = ip;
+        }
+    }
+    op = lz_put_sequence(op, anchor, end - anchor);
+    return op - dst;
+}
+
+static bool lz_get_length(const uint8_t** ip, const uint8_t* end, size_t* len) {
+    uint8_t b;
+    do {
+        if (*ip >= end) return false;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+bool lz_decompress(const uint8_t* src, size_t n, uint8_t* dst, size_t out_size) {
+    const uint8_t* ip = src;
+    const uint8_t* end = src + n;
+    uint8_t* op = dst;
+    uint8_t* out_end = dst + out_size;
+
+    while (ip < end) {
+        uint8_t token = *ip++;
+
+        size_t literal_len = token >> 4;
+        if (literal_len == 15 && !lz_get_length(&ip, end, &literal_len)) return false;
+        if (literal_len > (size_t)(end - ip) || literal_len > (size_t)(out_end - op)) return false;
+        memcpy(op, ip, literal_len);
+        ip += literal_len;
+        op += literal_len;
+        if (ip == end) break; // The last sequence has no match
+
+        if (end - ip < 2) return false;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) return false;
+
+        size_t len = token & 0x0F;
+        if (len == 15 && !lz_get_length(&ip, end, &len)) return false;
+        len += LZ_MIN_MATCH;
+        if (len > (size_t)(out_end - op)) return false;
+
+        const uint8_t* ref = op - offset;
+        if (offset >= len) {
+            memcpy(op, ref, len);
+            op += len;
+        } else {
+            // Overlapping match repeats the last offset bytes
+            while (len--) *op++ = *ref++;
+        }
+    }
+    return op == out_end;
+}
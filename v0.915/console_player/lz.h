@@ -0,0 +1,24 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Small LZ77 block codec in the LZ4 block format: a token with literal and match
+// lengths, the literals, then a 16-bit match offset. Greedy, one hash probe per byte,
+// so it compresses quickly, and decompression is little more than memcpy.
+// Converted OPM streams repeat the same register writes and waits all the time,
+// which this format handles well.
+
+// Largest output lz_compress can produce for n input bytes
+size_t lz_compress_bound(size_t n);
+
+// Compresses src into dst, which must hold lz_compress_bound(n) bytes. Returns the compressed size.
+size_t lz_compress(const uint8_t* src, size_t n, uint8_t* dst, size_t dst_capacity);
+
+// Decompresses a block into exactly out_size bytes. Returns false if the block is damaged.
+// Never reads or writes outside the given buffers.
+bool lz_decompress(const uint8_t* src, size_t n, uint8_t* dst, size_t out_size);
+
+#endif // LZ_H
@@ -13,6 +13,8 @@
 #include "browser.h"
 #include "util.h"
 #include "ay_to_opm.h"
+#include "cache_index.h"
+#include "spfm_calibrate.h"
 
 #define INI_IMPLEMENTATION
 #include "ini.h"
@@ -34,6 +36,7 @@
 
 #define MAX_PLAYLIST_SIZE 512
 #define CONFIG_FILENAME "config.ini"
+#define VIRTUAL_TRACE_FILENAME "spfm_trace.txt"
 #define MAX_PATH_LEN 1024
 
 // --- Application State ---
@@ -61,7 +64,7 @@ volatile bool g_replay_track_flag = false;
 volatile play_mode_t g_play_mode = PLAY_MODE_SEQUENTIAL;
 volatile int g_vgm_loop_count = 2;
 volatile double g_speed_multiplier = 1.0;
-volatile int g_flush_mode = 2; // 1: Register-level, 2: Command-level (default)
+volatile int g_flush_mode = 0; // 0: Per-tick (default), 2: Command-level. Register-level (1) is retired, the bus timing in spfm.c spaces the writes.
 volatile int g_timer_mode = 0; // 0: Default, 1: Hybrid Sleep, 2: Multimedia Timer
 volatile bool g_ui_refresh_request = false;
 char g_current_song_name[MAX_FILENAME_LEN] = "None";
@@ -73,6 +76,15 @@ volatile bool g_stop_current_song = false;
 char g_info_message[256] = {0};
 volatile ay_stereo_mode_t g_ay_stereo_mode = AY_STEREO_ABC;
 volatile cache_mode_t g_cache_mode = CACHE_MODE_UPDATE;
+int g_cache_max_mb = CACHE_INDEX_DEFAULT_MAX_MB; // 0: no limit
+int g_cache_compress = 1; // Write new cache files compressed
+int g_cache_compiled = 0; // Record the device stream of each track and replay it next time
+int g_pacing_lead_ms = 20; // Most device time left queued in the USB driver while playing, 0: pace by the clock alone
+
+// Devices opened at startup, saved so the next start can open them without asking
+static char g_device_serial[SPFM_MAX_DEVICES][16];
+static SPFM_TYPE g_device_type[SPFM_MAX_DEVICES];
+static int g_device_count = 0;
 
 
 // --- Externs ---
@@ -89,21 +101,26 @@ pthread_mutex_t g_playlist_lock;
 // --- Configuration Struct ---
 typedef struct {
     int device_index;
-    char slot0_chip[50];
-    char slot1_chip[50];
+    char device_serial[SPFM_MAX_DEVICES][16]; // serial<n>: device n of the last start
+    SPFM_TYPE device_type[SPFM_MAX_DEVICES];  // type<n>: its type, so the handshake can be skipped
+    char slot_chip[SPFM_MAX_DEVICES * 8][50]; // By slot number, SPFM_SLOT(device, slot)
+    uint32_t slot_clock[SPFM_MAX_DEVICES * 8]; // 0: default clock of the chip
     double speed_multiplier;
     int flush_mode;
     int timer_mode;
     char last_file[MAX_FILENAME_LEN];
     int vgm_loop_count;
+    int lead_ms;
+    int cache_max_mb;
+    int cache_compress;
+    int cache_compiled;
 } configuration;
 
 // --- Function Prototypes ---
 void scan_music_directory(const char* path);
 int get_next_song_index();
 static int config_handler(void* user, const char* section, const char* name, const char* value, int lineno);
-void save_configuration(int dev_idx, const char* slot0, const char* slot1, double speed, int flush_mode, int timer_mode, const char* last_file, int vgm_loop_count);
-void clear_cache(const char* cache_path);
+void save_configuration(int dev_idx, double speed, int flush_mode, int timer_mode, const char* last_file, int vgm_loop_count, int lead_ms, int cache_max_mb, int cache_compress, int cache_compiled);
 
 #ifdef _WIN32
 DWORD WINAPI keyboard_thread_func(LPVOID lpParam);
@@ -170,10 +187,32 @@ static int config_handler(void* user, const char* section, const char* name, con
     #define MATCH(s, n) strcmp(section, s) == 0 && strcmp(name, n) == 0
     if (MATCH("device", "index")) {
         pconfig->device_index = atoi(value);
-    } else if (MATCH("chips", "slot0")) {
-        strncpy(pconfig->slot0_chip, value, sizeof(pconfig->slot0_chip) - 1);
-    } else if (MATCH("chips", "slot1")) {
-        strncpy(pconfig->slot1_chip, value, sizeof(pconfig->slot1_chip) - 1);
+    } else if (strcmp(section, "device") == 0 && strncmp(name, "serial", 6) == 0) {
+        int device = atoi(name + 6);
+        if (device < 0 || device >= SPFM_MAX_DEVICES) return 0;
+        strncpy(pconfig->device_serial[device], value, sizeof(pconfig->device_serial[device]) - 1);
+    } else if (strcmp(section, "device") == 0 && strncmp(name, "type", 4) == 0) {
+        int device = atoi(name + 4);
+        if (device < 0 || device >= SPFM_MAX_DEVICES) return 0;
+        if (strcmp(value, "SPFM_Light") == 0) pconfig->device_type[device] = SPFM_TYPE_SPFM_LIGHT;
+        else if (strcmp(value, "SPFM") == 0) pconfig->device_type[device] = SPFM_TYPE_SPFM;
+    } else if (strcmp(section, "chips") == 0 && strncmp(name, "slot", 4) == 0) {
+        // slot<n> = chip[, clock], where n is the slot number across devices
+        int slot = atoi(name + 4);
+        if (slot < 0 || slot >= SPFM_MAX_DEVICES * 8) return 0;
+        strncpy(pconfig->slot_chip[slot], value, sizeof(pconfig->slot_chip[slot]) - 1);
+        char* comma = strchr(pconfig->slot_chip[slot], ',');
+        if (comma) {
+            pconfig->slot_clock[slot] = (uint32_t)strtoul(comma + 1, NULL, 10);
+            while (comma > pconfig->slot_chip[slot] && comma[-1] == ' ') comma--;
+            *comma = '\0';
+        }
+    } else if (strcmp(section, "transport") == 0) {
+        // <serial> = chunk size, latency timer, hardware wait threshold (spfm_calibrate.h)
+        unsigned chunk_size, latency_ms, hw_wait_threshold;
+        if (sscanf(value, "%u , %u , %u", &chunk_size, &latency_ms, &hw_wait_threshold) != 3) return 0;
+        spfm_transport_t transport = { chunk_size, (uint8_t)latency_ms, hw_wait_threshold };
+        spfm_transport_remember(name, &transport);
     } else if (MATCH("playback", "speed")) {
         pconfig->speed_multiplier = atof(value);
     } else if (MATCH("playback", "flush_mode")) {
@@ -184,13 +223,21 @@ static int config_handler(void* user, const char* section, const char* name, con
         strncpy(pconfig->last_file, value, sizeof(pconfig->last_file) - 1);
     } else if (MATCH("playback", "vgm_loop_count")) {
         pconfig->vgm_loop_count = atoi(value);
+    } else if (MATCH("playback", "lead_ms")) {
+        pconfig->lead_ms = atoi(value);
+    } else if (MATCH("cache", "max_size_mb")) {
+        pconfig->cache_max_mb = atoi(value);
+    } else if (MATCH("cache", "compress")) {
+        pconfig->cache_compress = atoi(value);
+    } else if (MATCH("cache", "compiled")) {
+        pconfig->cache_compiled = atoi(value);
     } else {
         return 0;  // unknown section/name, error
     }
     return 1;
 }
 
-void save_configuration(int dev_idx, const char* slot0, const char* slot1, double speed, int flush_mode, int timer_mode, const char* last_file, int vgm_loop_count) {
+void save_configuration(int dev_idx, double speed, int flush_mode, int timer_mode, const char* last_file, int vgm_loop_count, int lead_ms, int cache_max_mb, int cache_compress, int cache_compiled) {
     FILE* file = fopen(CONFIG_FILENAME, "w");
     if (!file) {
         logging(LOG_LEVEL_ERROR, "Could not open %s for writing.\n", CONFIG_FILENAME);
@@ -198,17 +245,42 @@ void save_configuration(int dev_idx, const char* slot0, const char* slot1, doubl
     }
     fprintf(file, "[device]\n");
     fprintf(file, "index = %d\n", dev_idx);
+    for (int i = 0; i < g_device_count; i++) {
+        fprintf(file, "serial%d = %s\n", i, g_device_serial[i]);
+        fprintf(file, "type%d = %s\n", i, g_device_type[i] == SPFM_TYPE_SPFM ? "SPFM" : "SPFM_Light");
+    }
     fprintf(file, "\n[chips]\n");
-    fprintf(file, "slot0 = %s\n", slot0 ? slot0 : "NONE");
-    fprintf(file, "slot1 = %s\n", slot1 ? slot1 : "NONE");
+    for (int slot = 0; slot < SPFM_MAX_DEVICES * 8; slot++) {
+        const chip_config_t* chip = NULL;
+        for (int i = 0; i < g_chip_config_count; i++) {
+            if (g_chip_config[i].slot == slot) chip = &g_chip_config[i];
+        }
+        if (chip && chip->clock != get_chip_default_clock(chip->type)) {
+            fprintf(file, "slot%d = %s, %u\n", slot, chip_type_to_string(chip->type), (unsigned)chip->clock);
+        } else if (chip || slot < 2) {
+            // Slots 0 and 1 of the first device are always written, as before
+            fprintf(file, "slot%d = %s\n", slot, chip ? chip_type_to_string(chip->type) : "NONE");
+        }
+    }
     fprintf(file, "\n[playback]\n");
     fprintf(file, "speed = %.2f\n", speed);
     fprintf(file, "flush_mode = %d\n", flush_mode);
     fprintf(file, "timer_mode = %d\n", timer_mode);
     fprintf(file, "vgm_loop_count = %d\n", vgm_loop_count);
+    fprintf(file, "lead_ms = %d\n", lead_ms);
     if (last_file) {
         fprintf(file, "last_file = %s\n", last_file);
     }
+    fprintf(file, "\n[cache]\n");
+    fprintf(file, "max_size_mb = %d\n", cache_max_mb);
+    fprintf(file, "compress = %d\n", cache_compress);
+    fprintf(file, "compiled = %d\n", cache_compiled);
+    const char* serial;
+    spfm_transport_t transport;
+    for (int i = 0; spfm_transport_profile(i, &serial, &transport); i++) {
+        if (i == 0) fprintf(file, "\n[transport]\n");
+        fprintf(file, "%s = %u, %d, %u\n", serial, (unsigned)transport.chunk_size, transport.latency_ms, (unsigned)transport.hw_wait_threshold);
+    }
     fclose(file);
 }
 
@@ -259,8 +331,8 @@ DWORD WINAPI keyboard_thread_func(LPVOID lpParam) {
                     if (g_speed_multiplier < 0.01) g_speed_multiplier = 0.01; 
                     g_ui_refresh_request = true;
                     break;
-                case '1': g_flush_mode = 1; g_ui_refresh_request = true; break;
-                case '2': g_flush_mode = 2; g_ui_refresh_request = true; break;
+                case '0': g_flush_mode = 0; g_ui_refresh_request = true; break; // Per-Tick
+                case '2': g_flush_mode = 2; g_ui_refresh_request = true; break; // Command-Level
                 case '3': g_timer_mode = 0; g_ui_refresh_request = true; break; // High-Precision Sleep
                 case '4': g_timer_mode = 1; g_ui_refresh_request = true; break; // Hybrid Sleep
                 case '5': g_timer_mode = 2; g_ui_refresh_request = true; break; // Multimedia Timer
@@ -371,13 +443,7 @@ DWORD WINAPI player_thread_func(LPVOID lpParam) {
             
             // Save current song to config
             int dev_idx = spfm_get_dev_index();
-            const char* slot0_name = "NONE";
-            const char* slot1_name = "NONE";
-            for(int i=1; i < CHIP_TYPE_COUNT; ++i) {
-                if(g_chip_config[i].slot == 0) slot0_name = chip_type_to_string((chip_type_t)i);
-                if(g_chip_config[i].slot == 1) slot1_name = chip_type_to_string((chip_type_t)i);
-            }
-            save_configuration(dev_idx, slot0_name, slot1_name, g_speed_multiplier, g_flush_mode, g_timer_mode, g_current_song_name, g_vgm_loop_count);
+            save_configuration(dev_idx, g_speed_multiplier, g_flush_mode, g_timer_mode, g_current_song_name, g_vgm_loop_count, g_pacing_lead_ms, g_cache_max_mb, g_cache_compress, g_cache_compiled);
             
             LeaveCriticalSection(&g_playlist_lock);
 
@@ -420,34 +486,127 @@ void ensure_directory_exists(const char* path) {
     }
 }
 
-void clear_cache(const char* cache_path) {
-    DIR *dir;
-    struct dirent *entry;
-    char filepath[MAX_PATH_LEN];
+// Finds the SPFM units, lets the user pick them unless the saved ones are all there,
+// and opens them. Returns the FTDI index of the first, -1 on failure.
+static int open_hardware_devices(const configuration* config, bool setup, bool* warm) {
+    FT_STATUS ftStatus;
+    DWORD numDevs;
 
-    if (!(dir = opendir(cache_path))) {
-        logging(LOG_LEVEL_ERROR, "Could not open cache directory: %s", cache_path);
-        return;
+    ftStatus = FT_CreateDeviceInfoList(&numDevs);
+    if (ftStatus != FT_OK) {
+        logging(LOG_LEVEL_ERROR, "FT_CreateDeviceInfoList failed, error code: %d\n", (int)ftStatus);
+        return -1;
+    }
+
+    if (numDevs == 0) {
+        logging(LOG_LEVEL_ERROR, "No FTDI devices found.\n");
+        return -1;
     }
 
-    logging(LOG_LEVEL_INFO, "Clearing cache directory: %s", cache_path);
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
+    int spfm_dev_count = 0;
+    int spfm_dev_indices[MAX_PLAYLIST_SIZE];
+    char spfm_dev_serials[MAX_PLAYLIST_SIZE][16];
+
+    printf("Scanning for SPFM devices...\n");
+    for (DWORD i = 0; i < numDevs && spfm_dev_count < MAX_PLAYLIST_SIZE; i++) {
+        char serial_number[16], description[64];
+        if (FT_GetDeviceInfoDetail(i, NULL, NULL, NULL, NULL, serial_number, description, NULL) == FT_OK) {
+            if (strstr(description, "SPFM") != NULL || strstr(description, "USB UART") != NULL) {
+                 printf("Found SPFM compatible device at index %lu: %s, SN: %s\n", i, description, serial_number);
+                 strcpy(spfm_dev_serials[spfm_dev_count], serial_number);
+                 spfm_dev_indices[spfm_dev_count++] = i;
+            }
         }
-        snprintf(filepath, sizeof(filepath), "%s/%s", cache_path, entry->d_name);
-        if (remove(filepath) == 0) {
-            logging(LOG_LEVEL_INFO, "Removed: %s", filepath);
+    }
+
+    if (spfm_dev_count == 0) {
+        logging(LOG_LEVEL_ERROR, "No SPFM devices found.\n");
+        return -1;
+    }
+
+    // Devices to open, in the order they get their device numbers
+    int open_indices[SPFM_MAX_DEVICES];
+    SPFM_TYPE open_types[SPFM_MAX_DEVICES];
+    int open_count = 0;
+
+    // Warm start: every device of the last start is connected again. They are opened
+    // with their saved types and chips, without the handshake or any prompt.
+    if (!setup && config->device_serial[0][0]) {
+        *warm = true;
+        for (int d = 0; d < SPFM_MAX_DEVICES && config->device_serial[d][0] && *warm; d++) {
+            *warm = false;
+            for (int i = 0; i < spfm_dev_count; i++) {
+                if (strcmp(spfm_dev_serials[i], config->device_serial[d]) == 0) {
+                    open_indices[open_count] = spfm_dev_indices[i];
+                    open_types[open_count++] = config->device_type[d];
+                    *warm = true;
+                    break;
+                }
+            }
+        }
+        if (!*warm) open_count = 0;
+    }
+
+    if (*warm) {
+        printf("Using the saved devices and chips (start with --setup to change them).\n");
+    } else if (spfm_dev_count > 1) {
+        printf("\nAvailable SPFM devices:\n");
+        for (int i = 0; i < spfm_dev_count; i++) {
+            char serial_number[16], description[64];
+            FT_GetDeviceInfoDetail(spfm_dev_indices[i], NULL, NULL, NULL, NULL, serial_number, description, NULL);
+            printf("[%d] %s, SN: %s\n", i, description, serial_number);
+        }
+
+        printf("Select device ([a] all): ");
+        int choice_char = get_single_char();
+        printf("%c\n", choice_char);
+
+        if (choice_char == 'a' || choice_char == 'A') {
+            for (int i = 0; i < spfm_dev_count && open_count < SPFM_MAX_DEVICES; i++) {
+                open_indices[open_count++] = spfm_dev_indices[i];
+            }
         } else {
-            logging(LOG_LEVEL_ERROR, "Failed to remove: %s", filepath);
+            int choice = choice_char - '0';
+            if (choice < 0 || choice >= spfm_dev_count) {
+                logging(LOG_LEVEL_ERROR, "Invalid device selection.\n");
+                return -1;
+            }
+            open_indices[open_count++] = spfm_dev_indices[choice];
         }
+    } else {
+        open_indices[open_count++] = spfm_dev_indices[0];
     }
-    closedir(dir);
-    printf("Cache cleared.\n");
+
+    if (!*warm) {
+        for (int i = 0; i < open_count; i++) open_types[i] = SPFM_TYPE_UNKNOWN;
+    }
+    if (spfm_open_devices(open_indices, open_types, open_count) != 0) {
+        logging(LOG_LEVEL_ERROR, "Failed to initialize SPFM device.\n");
+        spfm_cleanup();
+        return -1;
+    }
+    return open_indices[0];
+}
+
+static void calibrate_progress(int step, int steps, const spfm_calibration_t* result) {
+    printf("[%2d/%2d] chunk %5u, latency %2d ms, waits below %2u: %6u bytes/s, %5u us pacing error\n", step, steps,
+           (unsigned)result->transport.chunk_size, result->transport.latency_ms, (unsigned)result->transport.hw_wait_threshold,
+           (unsigned)result->bytes_per_sec, (unsigned)result->pacing_error_us);
 }
 
 int main(int argc, char *argv[]) {
-    (void)argc;
+    // --setup asks for the devices and chips again instead of using the saved ones.
+    // --calibrate measures the transport settings of every device, saves them and quits.
+    // --virtual[=spfm] plays on a virtual SPFM_Light (or SPFM) instead of the hardware.
+    bool setup = false;
+    bool calibrate = false;
+    SPFM_TYPE virtual_type = SPFM_TYPE_UNKNOWN;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--setup") == 0) setup = true;
+        else if (strcmp(argv[i], "--calibrate") == 0) calibrate = true;
+        else if (strcmp(argv[i], "--virtual") == 0) virtual_type = SPFM_TYPE_SPFM_LIGHT;
+        else if (strcmp(argv[i], "--virtual=spfm") == 0) virtual_type = SPFM_TYPE_SPFM;
+    }
     srand(time(NULL));
 
     char exe_path[MAX_PATH_LEN];
@@ -479,140 +638,149 @@ int main(int argc, char *argv[]) {
     yasp_timer_init();
 
     // ... (Device and Chip Configuration remains the same) ...
-    FT_STATUS ftStatus;
-    DWORD numDevs;
     int selected_dev_idx = -1;
     
     configuration config;
     config.device_index = -1;
-    strcpy(config.slot0_chip, "NONE");
-    strcpy(config.slot1_chip, "NONE");
+    for (int i = 0; i < SPFM_MAX_DEVICES; i++) {
+        config.device_serial[i][0] = '\0';
+        config.device_type[i] = SPFM_TYPE_UNKNOWN;
+    }
+    for (int i = 0; i < SPFM_MAX_DEVICES * 8; i++) {
+        strcpy(config.slot_chip[i], "NONE");
+        config.slot_clock[i] = 0;
+    }
     config.speed_multiplier = 1.0;
-    config.flush_mode = 2;
+    config.flush_mode = 0;
     config.timer_mode = 0;
     config.last_file[0] = '\0';
     config.vgm_loop_count = 2;
+    config.lead_ms = 20;
+    config.cache_max_mb = CACHE_INDEX_DEFAULT_MAX_MB;
+    config.cache_compress = 1;
+    config.cache_compiled = 0;
 
     if (ini_parse(CONFIG_FILENAME, config_handler, &config) < 0) {
         printf("Can't load '%s', using defaults.\n", CONFIG_FILENAME);
     }
     g_speed_multiplier = config.speed_multiplier;
     g_flush_mode = config.flush_mode;
+    if (g_flush_mode == 1) {
+        logging(LOG_LEVEL_INFO, "Register-level flushing is no longer needed, using per-tick.\n");
+        g_flush_mode = 0;
+    }
     g_timer_mode = config.timer_mode;
     g_vgm_loop_count = config.vgm_loop_count;
-
-    ftStatus = FT_CreateDeviceInfoList(&numDevs);
-    if (ftStatus != FT_OK) {
-        logging(LOG_LEVEL_ERROR, "FT_CreateDeviceInfoList failed, error code: %d\n", (int)ftStatus);
-        return 1;
+    g_pacing_lead_ms = config.lead_ms > 0 ? config.lead_ms : 0;
+    g_cache_max_mb = config.cache_max_mb > 0 ? config.cache_max_mb : 0;
+    g_cache_compress = config.cache_compress;
+    g_cache_compiled = config.cache_compiled;
+    cache_index_open(cache_path, (uint64_t)g_cache_max_mb * 1024 * 1024);
+
+    bool warm = false;
+    if (virtual_type != SPFM_TYPE_UNKNOWN) {
+        // A virtual device in place of the hardware. The saved chips are used if it was the last device.
+        if (spfm_open_virtual(virtual_type, VIRTUAL_TRACE_FILENAME) != 0) {
+            logging(LOG_LEVEL_ERROR, "Failed to open the virtual SPFM device.\n");
+            return 1;
+        }
+        warm = !setup && strcmp(config.device_serial[0], spfm_get_device_serial(0)) == 0 && config.device_type[0] == virtual_type
+               && !config.device_serial[1][0];
+        printf("Playing on a virtual %s, trace in %s.\n", virtual_type == SPFM_TYPE_SPFM ? "SPFM" : "SPFM_Light", VIRTUAL_TRACE_FILENAME);
+    } else {
+        selected_dev_idx = open_hardware_devices(&config, setup, &warm);
+        if (selected_dev_idx < 0) return 1;
     }
-
-    if (numDevs == 0) {
-        logging(LOG_LEVEL_ERROR, "No FTDI devices found.\n");
-        return 1;
+    g_device_count = spfm_get_device_count();
+    for (int i = 0; i < g_device_count; i++) {
+        strncpy(g_device_serial[i], spfm_get_device_serial(i), sizeof(g_device_serial[i]) - 1);
+        g_device_type[i] = spfm_get_device_type(i);
     }
 
-    int spfm_dev_count = 0;
-    int spfm_dev_indices[MAX_PLAYLIST_SIZE];
+    init_chip_config();
 
-    printf("Scanning for SPFM devices...\n");
-    for (DWORD i = 0; i < numDevs; i++) {
-        char serial_number[16], description[64];
-        if (FT_GetDeviceInfoDetail(i, NULL, NULL, NULL, NULL, serial_number, description, NULL) == FT_OK) {
-            if (strstr(description, "SPFM") != NULL || strstr(description, "USB UART") != NULL) {
-                 printf("Found SPFM compatible device at index %lu: %s, SN: %s\n", i, description, serial_number);
-                 spfm_dev_indices[spfm_dev_count++] = i;
+    if (warm) {
+        for (int device = 0; device < spfm_get_device_count(); device++) {
+            for (int index = 0; index < spfm_get_device_slots(device); index++) {
+                uint8_t slot = SPFM_SLOT(device, index);
+                chip_type_t chip = string_to_chip_type(config.slot_chip[slot]);
+                if (chip != CHIP_TYPE_NONE) chip_config_add(chip, slot, config.slot_clock[slot]);
             }
         }
+    } else {
+        printf("\n--- Chip Configuration ---\n");
     }
 
-    if (spfm_dev_count == 0) {
-        logging(LOG_LEVEL_ERROR, "No SPFM devices found.\n");
-        return 1;
-    }
-
-    if (spfm_dev_count > 1) {
-        printf("\nAvailable SPFM devices:\n");
-        for (int i = 0; i < spfm_dev_count; i++) {
-            char serial_number[16], description[64];
-            FT_GetDeviceInfoDetail(spfm_dev_indices[i], NULL, NULL, NULL, NULL, serial_number, description, NULL);
-            printf("[%d] %s, SN: %s\n", i, description, serial_number);
-        }
-
-        printf("Select device: ");
-        int choice_char = get_single_char();
-        printf("%c\n", choice_char);
-        int choice = choice_char - '0';
+    for (int device = 0; device < spfm_get_device_count() && !warm; device++) {
+        for (int index = 0; index < spfm_get_device_slots(device); index++) {
+            uint8_t slot = SPFM_SLOT(device, index);
+            if (spfm_get_device_count() > 1) {
+                printf("\nSelect chip for device %d, slot %d (Enter to use saved: %s):\n", device, index, config.slot_chip[slot]);
+            } else {
+                printf("\nSelect chip for slot %d (Enter to use saved: %s):\n", index, config.slot_chip[slot]);
+            }
+            for (int i = 1; i < CHIP_TYPE_COUNT; i++) {
+                if (i < 10) {
+                    printf("[%d] %s\n", i, chip_type_to_string((chip_type_t)i));
+                } else {
+                    printf("[%c] %s\n", 'a' + (i - 10), chip_type_to_string((chip_type_t)i));
+                }
+            }
+            printf("Enter chip choice (0 to skip): ");
+            int choice_char = get_single_char();
+            printf("%c\n", choice_char);
+
+            int chip_choice = -1;
+            if (choice_char == '\r' || choice_char == '\n') {
+                chip_choice = string_to_chip_type(config.slot_chip[slot]);
+            } else if (choice_char >= '1' && choice_char <= '9') {
+                chip_choice = choice_char - '0';
+            } else if (choice_char >= 'a' && choice_char <= 'z') {
+                chip_choice = choice_char - 'a' + 10;
+            } else if (choice_char == '0') {
+                chip_choice = 0;
+            }
 
-        if (choice < 0 || choice >= spfm_dev_count) {
-            logging(LOG_LEVEL_ERROR, "Invalid device selection.\n");
-            return 1;
+            if (chip_choice > 0 && chip_choice < CHIP_TYPE_COUNT) {
+                // The saved clock stays with the chip it was set for
+                uint32_t clock = chip_choice == (int)string_to_chip_type(config.slot_chip[slot]) ? config.slot_clock[slot] : 0;
+                chip_config_add((chip_type_t)chip_choice, slot, clock);
+            } else {
+                printf("Invalid choice or 0. Skipping slot.\n");
+            }
         }
-        selected_dev_idx = spfm_dev_indices[choice];
-    } else {
-        selected_dev_idx = spfm_dev_indices[0];
     }
 
-    if (spfm_init(selected_dev_idx) != 0) {
-        logging(LOG_LEVEL_ERROR, "Failed to initialize SPFM device.\n");
-        return 1;
-    }
+    save_configuration(selected_dev_idx, g_speed_multiplier, g_flush_mode, g_timer_mode, config.last_file[0] ? config.last_file : NULL, g_vgm_loop_count, g_pacing_lead_ms, g_cache_max_mb, g_cache_compress, g_cache_compiled);
 
-    printf("\n--- Chip Configuration ---\n");
-    int saved_slot0_idx = string_to_chip_type(config.slot0_chip);
-    int saved_slot1_idx = string_to_chip_type(config.slot1_chip);
-
-    for (int i = 0; i < CHIP_TYPE_COUNT; i++) {
-        g_chip_config[i].type = (chip_type_t)i;
-        g_chip_config[i].slot = 0xFF;
-    }
+    spfm_init_chips();
 
-    for (int slot = 0; slot < 2; slot++) {
-        printf("\nSelect chip for slot %d (Enter to use saved: %s):\n", slot, (slot == 0) ? config.slot0_chip : config.slot1_chip);
-        for (int i = 1; i < CHIP_TYPE_COUNT; i++) {
-            if (i < 10) {
-                printf("[%d] %s\n", i, chip_type_to_string((chip_type_t)i));
+    if (calibrate) {
+        for (int device = 0; device < spfm_get_device_count(); device++) {
+            spfm_calibration_t best;
+            printf("\nCalibrating SPFM device %d (SN: %s)...\n", device, spfm_get_device_serial(device));
+            if (spfm_calibrate(device, &best, calibrate_progress)) {
+                printf("Best: chunk %u bytes, latency %d ms, hardware waits below %u samples (%u bytes/s, %u us pacing error)\n",
+                       (unsigned)best.transport.chunk_size, best.transport.latency_ms, (unsigned)best.transport.hw_wait_threshold,
+                       (unsigned)best.bytes_per_sec, (unsigned)best.pacing_error_us);
+                spfm_transport_remember(spfm_get_device_serial(device), &best.transport);
             } else {
-                printf("[%c] %s\n", 'a' + (i - 10), chip_type_to_string((chip_type_t)i));
+                printf("Device %d could not be calibrated, its settings are kept.\n", device);
             }
         }
-        printf("Enter chip choice (0 to skip): ");
-        int choice_char = get_single_char();
-        printf("%c\n", choice_char);
-
-        int chip_choice = -1;
-        if (choice_char == '\r' || choice_char == '\n') {
-            chip_choice = (slot == 0) ? saved_slot0_idx : saved_slot1_idx;
-        } else if (choice_char >= '1' && choice_char <= '9') {
-            chip_choice = choice_char - '0';
-        } else if (choice_char >= 'a' && choice_char <= 'z') {
-            chip_choice = choice_char - 'a' + 10;
-        } else if (choice_char == '0') {
-            chip_choice = 0;
-        }
-
-        if (chip_choice > 0 && chip_choice < CHIP_TYPE_COUNT) {
-            g_chip_config[chip_choice].slot = slot;
-        } else {
-            printf("Invalid choice or 0. Skipping slot.\n");
-        }
-    }
-
-    const char* slot0_name = "NONE";
-    const char* slot1_name = "NONE";
-    for(int i=1; i < CHIP_TYPE_COUNT; ++i) {
-        if(g_chip_config[i].slot == 0) slot0_name = chip_type_to_string((chip_type_t)i);
-        if(g_chip_config[i].slot == 1) slot1_name = chip_type_to_string((chip_type_t)i);
+        save_configuration(selected_dev_idx, g_speed_multiplier, g_flush_mode, g_timer_mode, config.last_file[0] ? config.last_file : NULL, g_vgm_loop_count, g_pacing_lead_ms, g_cache_max_mb, g_cache_compress, g_cache_compiled);
+        spfm_cleanup();
+        return 0;
     }
-    save_configuration(selected_dev_idx, slot0_name, slot1_name, g_speed_multiplier, g_flush_mode, g_timer_mode, config.last_file[0] ? config.last_file : NULL, g_vgm_loop_count);
 
-    spfm_init_chips();
-
-    printf("\nClear cache? (y/n): ");
-    int choice = get_single_char();
-    printf("%c\n", choice);
-    if (choice == 'y' || choice == 'Y') {
-        clear_cache(cache_path);
+    if (!warm) {
+        printf("\nClear cache? (y/n): ");
+        int choice = get_single_char();
+        printf("%c\n", choice);
+        if (choice == 'y' || choice == 'Y') {
+            cache_index_clear();
+            printf("Cache cleared.\n");
+        }
     }
 
     // From now on, redirect logging to file
@@ -747,6 +915,7 @@ int main(int argc, char *argv[]) {
 
     spfm_chip_reset();
     spfm_cleanup();
+    cache_index_close();
     printf("\nPlayback finished.\n");
 
 #ifdef _WIN32
@@ -0,0 +1,52 @@
+#include "opm_param.h"
+#include "opn_to_opm.h"
+#include "ay_to_opm.h"
+
+#include <string.h>
+
+extern volatile double g_opn_lfo_amplitude;
+
+// --- Internal State ---
+static uint8_t _cmd[256];  // Tagged command last sent to each OPM register, 0 if none
+static uint8_t _data[256]; // Its unresolved operand
+static double _applied_lfo_amplitude;
+static ay_stereo_mode_t _applied_stereo_mode;
+
+uint8_t opm_param_resolve(uint8_t cmd, uint8_t data) {
+    switch (cmd) {
+        case VGM_CMD_OPM_PMS:
+            return (opn_to_opm_scale_pms((data >> 4) & 0x7) << 4) | (data & 0x3);
+        case VGM_CMD_OPM_AY_PAN:
+            // RL bits are the top 2. FB=7, CON=4. So 0x3C is the base.
+            return ay_to_opm_get_pan(data) | 0x3C;
+        default:
+            return data;
+    }
+}
+
+void opm_param_reset(void) {
+    memset(_cmd, 0, sizeof(_cmd));
+    memset(_data, 0, sizeof(_data));
+    _applied_lfo_amplitude = g_opn_lfo_amplitude;
+    _applied_stereo_mode = ay_to_opm_get_stereo_mode();
+}
+
+void opm_param_write(uint8_t cmd, uint8_t addr, uint8_t data, opm_write_func_t write_func) {
+    _cmd[addr] = cmd;
+    _data[addr] = data;
+    write_func(addr, opm_param_resolve(cmd, data));
+}
+
+void opm_param_sync(opm_write_func_t write_func) {
+    double lfo_amplitude = g_opn_lfo_amplitude;
+    ay_stereo_mode_t stereo_mode = ay_to_opm_get_stereo_mode();
+    if (lfo_amplitude == _applied_lfo_amplitude && stereo_mode == _applied_stereo_mode) return;
+
+    _applied_lfo_amplitude = lfo_amplitude;
+    _applied_stereo_mode = stereo_mode;
+    for (int addr = 0; addr < 256; addr++) {
+        if (_cmd[addr]) {
+            write_func((uint8_t)addr, opm_param_resolve(_cmd[addr], _data[addr]));
+        }
+    }
+}
@@ -0,0 +1,31 @@
+#ifndef OPM_PARAM_H
+#define OPM_PARAM_H
+
+#include <stdint.h>
+
+// Parameterised OPM writes.
+// Some converted register values depend on settings that can be changed during
+// playback (OPN LFO amplitude, AY stereo mode). Converters emit these as tagged
+// commands, the cache stores them as they are, and the player resolves them with
+// the current settings when they are sent.
+
+// Tagged commands in the converted stream, taken from the reserved two-operand range 0x41-0x4E.
+#define VGM_CMD_OPM_PMS    0x41 // aa dd: OPM 0x38+ch write, dd = unscaled OPN PMS << 4 | AMS
+#define VGM_CMD_OPM_AY_PAN 0x42 // aa mm: OPM 0x20+ch write, mm = AY channels it sounds for (bit0=A ... bit2=C)
+
+// Callback function pointer for writing converted OPM data
+typedef void (*opm_write_func_t)(uint8_t addr, uint8_t data);
+
+// Returns the OPM register value of a tagged write for the current settings.
+uint8_t opm_param_resolve(uint8_t cmd, uint8_t data);
+
+// Forgets all tagged writes. Called at the start of every track.
+void opm_param_reset(void);
+
+// Resolves a tagged write, sends it and remembers it for opm_param_sync.
+void opm_param_write(uint8_t cmd, uint8_t addr, uint8_t data, opm_write_func_t write_func);
+
+// Re-sends the remembered tagged writes if a setting changed since they were sent.
+void opm_param_sync(opm_write_func_t write_func);
+
+#endif // OPM_PARAM_H
@@ -0,0 +1,291 @@
+#include "opm_peephole.h"
+#include "opm_param.h"
+#include "vgm.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+// Register slots the optimiser keeps track of. 0x19 is AMD or PMD depending on bit 7,
+// so PMD gets a slot of its own.
+#define SLOT_PMD 256
+#define NUM_SLOTS 257
+
+// Write commands that target OPM registers: plain 0x54 and the two tagged ones
+#define NUM_WRITE_TYPES 3
+
+typedef struct {
+    uint8_t cmd; // 0 once the write is found dead
+    uint8_t addr;
+    uint8_t data;
+} peephole_cmd_t;
+
+typedef struct {
+    uint8_t* buf;
+    size_t len, cap;
+    bool failed;
+
+    // Writes since the last wait, and the wait before them
+    peephole_cmd_t* slice;
+    size_t slice_len, slice_cap;
+    uint32_t pending_wait;
+
+    // Values the chip is known to have, from writes already sent
+    bool known[NUM_SLOTS];
+    uint8_t known_cmd[NUM_SLOTS];
+    uint8_t known_data[NUM_SLOTS];
+
+    // Dead store scan: generation in which a later write to the slot was seen
+    uint32_t seen[NUM_WRITE_TYPES][NUM_SLOTS];
+    uint32_t generation;
+
+    opm_peephole_stats_t* stats;
+} peephole_t;
+
+// Slot a write sets, or -1 if it must always be sent as it is.
+static int peephole_slot(uint8_t cmd, uint8_t addr, uint8_t data) {
+    if (cmd == VGM_CMD_OPM_PMS || cmd == VGM_CMD_OPM_AY_PAN) return addr;
+    if (cmd != 0x54) return -1; // Other chips are passed through untouched
+    if (addr >= 0x20) return addr;
+    switch (addr) {
+        case 0x0F: // NE, NFRQ
+        case 0x18: // LFRQ
+        case 0x1B: // CT, W
+            return addr;
+        case 0x19: // AMD/PMD
+            return (data & 0x80) ? SLOT_PMD : addr;
+        default: // Test/LFO reset, key on/off, timers
+            return -1;
+    }
+}
+
+static int peephole_write_type(uint8_t cmd) {
+    switch (cmd) {
+        case VGM_CMD_OPM_PMS: return 1;
+        case VGM_CMD_OPM_AY_PAN: return 2;
+        default: return 0;
+    }
+}
+
+static void peephole_emit(peephole_t* p, const uint8_t* bytes, size_t n) {
+    if (p->len + n > p->cap) {
+        size_t cap = p->cap * 2 + n;
+        uint8_t* buf = realloc(p->buf, cap);
+        if (!buf) {
+            p->failed = true;
+            return;
+        }
+        p->buf = buf;
+        p->cap = cap;
+    }
+    memcpy(p->buf + p->len, bytes, n);
+    p->len += n;
+}
+
+// One-byte wait command for exactly samples, or 0 if there is none
+static uint8_t peephole_short_wait(uint32_t samples) {
+    if (samples >= 1 && samples <= 16) return 0x70 | (samples - 1);
+    if (samples == VGM_DEFAULT_WAIT1) return 0x62;
+    if (samples == VGM_DEFAULT_WAIT2) return 0x63;
+    return 0;
+}
+
+// Writes a wait in as few bytes as possible: one short wait, two short waits, or 0x61.
+static void peephole_emit_wait(peephole_t* p, uint32_t samples) {
+    static const uint32_t SHORT_WAITS[] = {VGM_DEFAULT_WAIT2, VGM_DEFAULT_WAIT1, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1};
+    while (samples > 0) {
+        uint32_t chunk = samples > 0xFFFF ? 0xFFFF : samples;
+        samples -= chunk;
+        uint8_t op = peephole_short_wait(chunk);
+        if (op) {
+            peephole_emit(p, &op, 1);
+            p->stats->waits_out++;
+            continue;
+        }
+        bool done = false;
+        for (size_t i = 0; i < sizeof(SHORT_WAITS) / sizeof(SHORT_WAITS[0]) && !done; i++) {
+            if (chunk > SHORT_WAITS[i] && peephole_short_wait(chunk - SHORT_WAITS[i])) {
+                uint8_t ops[2] = {peephole_short_wait(SHORT_WAITS[i]), peephole_short_wait(chunk - SHORT_WAITS[i])};
+                peephole_emit(p, ops, 2);
+                p->stats->waits_out += 2;
+                done = true;
+            }
+        }
+        if (!done) {
+            uint8_t bytes[3] = {0x61, chunk & 0xFF, chunk >> 8};
+            peephole_emit(p, bytes, 3);
+            p->stats->waits_out++;
+        }
+    }
+}
+
+// Sends the pending wait and the writes of the slice after it.
+static void peephole_flush(peephole_t* p) {
+    if (p->pending_wait > 0) {
+        peephole_emit_wait(p, p->pending_wait);
+        p->pending_wait = 0;
+    }
+
+    // Walk backwards to find writes overwritten later in the slice. A key on/off write
+    // starts a new generation, so nothing is dropped in favour of a write after it.
+    p->generation++;
+    for (size_t i = p->slice_len; i-- > 0;) {
+        peephole_cmd_t* c = &p->slice[i];
+        if (c->cmd == 0x54 && c->addr == 0x08) {
+            p->generation++;
+            continue;
+        }
+        int slot = peephole_slot(c->cmd, c->addr, c->data);
+        if (slot < 0) continue;
+        uint32_t* seen = &p->seen[peephole_write_type(c->cmd)][slot];
+        if (*seen == p->generation) {
+            c->cmd = 0;
+        } else {
+            *seen = p->generation;
+        }
+    }
+
+    for (size_t i = 0; i < p->slice_len; i++) {
+        const peephole_cmd_t* c = &p->slice[i];
+        if (!c->cmd) continue;
+        int slot = peephole_slot(c->cmd, c->addr, c->data);
+        if (slot >= 0) {
+            if (p->known[slot] && p->known_cmd[slot] == c->cmd && p->known_data[slot] == c->data) continue;
+            p->known[slot] = true;
+            p->known_cmd[slot] = c->cmd;
+            p->known_data[slot] = c->data;
+        }
+        uint8_t bytes[3] = {c->cmd, c->addr, c->data};
+        peephole_emit(p, bytes, 3);
+        p->stats->writes_out++;
+    }
+    p->slice_len = 0;
+}
+
+static void peephole_add_write(peephole_t* p, uint8_t cmd, uint8_t addr, uint8_t data) {
+    if (p->slice_len == p->slice_cap) {
+        size_t cap = p->slice_cap ? p->slice_cap * 2 : 64;
+        peephole_cmd_t* slice = realloc(p->slice, cap * sizeof(peephole_cmd_t));
+        if (!slice) {
+            p->failed = true;
+            return;
+        }
+        p->slice = slice;
+        p->slice_cap = cap;
+    }
+    peephole_cmd_t* c = &p->slice[p->slice_len++];
+    c->cmd = cmd;
+    c->addr = addr;
+    c->data = data;
+}
+
+static void peephole_add_wait(peephole_t* p, uint32_t samples) {
+    if (p->slice_len > 0) peephole_flush(p);
+    p->pending_wait += samples;
+    p->stats->waits_in++;
+}
+
+// The chip state is unknown where playback can jump to
+static void peephole_forget(peephole_t* p) {
+    memset(p->known, 0, sizeof(p->known));
+}
+
+// A command copied as it is. Writes are neither dropped nor moved across it, and values
+// known from before it are not relied on after it.
+static void peephole_barrier(peephole_t* p, const uint8_t* bytes, size_t n) {
+    peephole_flush(p);
+    peephole_emit(p, bytes, n);
+    peephole_forget(p);
+}
+
+uint8_t* opm_peephole_optimize(const uint8_t* data, size_t size, size_t start, uint32_t* loop_offset,
+                               size_t* out_size, opm_peephole_stats_t* stats) {
+    memset(stats, 0, sizeof(opm_peephole_stats_t));
+    if (start > size) return NULL;
+    peephole_t* p = calloc(1, sizeof(peephole_t));
+    if (!p) return NULL;
+    p->stats = stats;
+    p->cap = size + 16;
+    p->buf = malloc(p->cap);
+    if (!p->buf) {
+        free(p);
+        return NULL;
+    }
+    peephole_emit(p, data, start);
+
+    size_t loop_in = *loop_offset;
+    size_t loop_out = 0;
+    size_t pos = start;
+    while (pos < size && !p->failed) {
+        if (loop_in > 0 && pos == loop_in) {
+            peephole_flush(p);
+            loop_out = p->len;
+            peephole_forget(p);
+        }
+        uint8_t op = data[pos];
+        switch (op) {
+            case 0x54: case VGM_CMD_OPM_PMS: case VGM_CMD_OPM_AY_PAN:
+            case 0x52: case 0x53: case 0x55: case 0x56: case 0x57: case 0xBC:
+                if (pos + 3 > size) {
+                    p->failed = true;
+                    break;
+                }
+                peephole_add_write(p, op, data[pos + 1], data[pos + 2]);
+                stats->writes_in++;
+                pos += 3;
+                break;
+            case 0x61:
+                if (pos + 3 > size) {
+                    p->failed = true;
+                    break;
+                }
+                peephole_add_wait(p, data[pos + 1] | (data[pos + 2] << 8));
+                pos += 3;
+                break;
+            case 0x62:
+                peephole_add_wait(p, VGM_DEFAULT_WAIT1);
+                pos++;
+                break;
+            case 0x63:
+                peephole_add_wait(p, VGM_DEFAULT_WAIT2);
+                pos++;
+                break;
+            case 0x66:
+                peephole_flush(p);
+                peephole_emit(p, &op, 1);
+                peephole_forget(p);
+                pos++;
+                break;
+            default:
+                if (op >= 0x70 && op <= 0x7F) {
+                    peephole_add_wait(p, (op & 0x0F) + 1);
+                    pos++;
+                } else {
+                    // DAC stream control and anything else of known size is passed through
+                    size_t n = vgm_command_size(data + pos, size - pos);
+                    if (n == 0) {
+                        p->failed = true;
+                        break;
+                    }
+                    peephole_barrier(p, data + pos, n);
+                    pos += n;
+                }
+                break;
+        }
+    }
+    peephole_flush(p);
+
+    uint8_t* result = p->buf;
+    if (p->failed || (loop_in > 0 && loop_out == 0)) {
+        free(result);
+        result = NULL;
+    } else {
+        *loop_offset = (uint32_t)loop_out;
+        *out_size = p->len;
+        stats->bytes_in = size - start;
+        stats->bytes_out = p->len - start;
+    }
+    free(p->slice);
+    free(p);
+    return result;
+}
@@ -0,0 +1,31 @@
+#ifndef OPM_PEEPHOLE_H
+#define OPM_PEEPHOLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Peephole optimiser for converted OPM streams.
+// Runs over a finished conversion before it is written to the cache:
+//  - merges consecutive waits and re-encodes them in the shortest form,
+//  - drops register writes overwritten later in the same zero-time slice
+//    (key on/off writes to 0x08 are never dropped or moved across),
+//  - drops writes that set a register to the value it already has.
+// Other commands, such as DAC stream control (0x90-0x95), are copied as they are, and
+// nothing is dropped or moved across them.
+// The result plays exactly like the input, with fewer bytes to read and send.
+
+typedef struct {
+    size_t bytes_in, bytes_out;
+    uint32_t writes_in, writes_out; // Register write commands
+    uint32_t waits_in, waits_out;   // Wait commands
+} opm_peephole_stats_t;
+
+// Optimises data[start..size). The bytes before start (the header) are copied as they are.
+// loop_offset is the offset of the loop point in data (0 if none) and receives the offset
+// in the result. Returns a buffer the caller frees, or NULL if the stream contains a command
+// whose size is not known (vgm_command_size) or is cut short, in which case the input
+// should be used as it is.
+uint8_t* opm_peephole_optimize(const uint8_t* data, size_t size, size_t start, uint32_t* loop_offset,
+                               size_t* out_size, opm_peephole_stats_t* stats);
+
+#endif // OPM_PEEPHOLE_H
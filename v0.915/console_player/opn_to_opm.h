@@ -3,14 +3,34 @@
 
 #include <stdint.h>
 #include "chiptype.h"
+#include "opm_param.h"
+#include "reg_batch.h"
+#include "thread.h"
 
-// Callback function pointer for writing converted OPM data
-typedef void (*opm_write_func_t)(uint8_t addr, uint8_t data);
+// Converter state. Each thread has its own, so tracks can be converted on several threads at once.
+typedef struct {
+    uint8_t regs[2][256]; // Registers for 2 ports
+    double clock_ratio;
+    double clock_div;
+    uint32_t source_clock;
+    chip_type_t source_chip;
+    uint8_t opm_slot; // This is now only used for spfm_flush, can be removed later
+    uint8_t lr_cache[8];
+} opn_to_opm_state_t;
 
-// Initializes the converter for a specific OPN chip type
-void opn_to_opm_init(chip_type_t source_chip_type, uint32_t source_clock, opm_write_func_t write_func);
+// Initializes the converter for a specific OPN chip type. Converted writes are appended to out.
+void opn_to_opm_init(chip_type_t source_chip_type, uint32_t source_clock, reg_batch_t* out);
 
-// Converts and processes an OPN register write
+// Converts and processes an OPN register write.
+// Without an output batch only the converter state is updated.
 void opn_to_opm_write_reg(uint8_t addr, uint8_t data, uint8_t port);
 
+// Copies the state of this thread's converter, or replaces it and sets where its writes go.
+void opn_to_opm_save(opn_to_opm_state_t* state);
+void opn_to_opm_restore(const opn_to_opm_state_t* state, reg_batch_t* out);
+
+// Scales an OPN PMS value by the current LFO amplitude setting.
+// PMS writes are emitted as tagged VGM_CMD_OPM_PMS commands and scaled by whoever sends them.
+uint8_t opn_to_opm_scale_pms(uint8_t pms);
+
 #endif // OPN_TO_OPM_H
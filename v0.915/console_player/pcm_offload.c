@@ -0,0 +1,350 @@
+#include "pcm_offload.h"
+#include "ym2608_upload.h"
+#include "adpcm.h"
+#include "route.h"
+#include "chiptype.h"
+#include "cache_index.h"
+#include "vgm_convert.h"
+#include "play.h"
+#include "util.h"
+#include "error.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define PCM_DATA_YM2612   0x00 // 8-bit unsigned PCM
+#define PCM_DATA_OKIM6258 0x04 // OKI ADPCM, two samples per byte
+
+#define PCM_CHIP_YM2612   0x02 // Chip types of command 0x90
+#define PCM_CHIP_OKIM6258 0x17
+
+#define PCM_OFFLOAD_MAX_BLOCKS 256
+#define PCM_OFFLOAD_RAM_SIZE 0x40000
+#define PCM_OFFLOAD_LEVEL 0xC0 // ADPCM-B output level
+
+// Cache file: magic, format, block count, image size, the blocks, the RAM image
+#define PCM_OFFLOAD_MAGIC "YADP"
+#define PCM_OFFLOAD_FORMAT 2 // 2: skipped blocks have an entry
+#define PCM_OFFLOAD_HEADER_SIZE 16
+#define PCM_OFFLOAD_BLOCK_SIZE 20
+
+// A PCM data block and where its encoded samples are in ADPCM RAM
+typedef struct {
+    uint32_t type;          // VGM data block type
+    uint32_t bank_offset;   // Offset in the data bank of its type. Blocks of one type are concatenated.
+    uint32_t size;          // Bytes in the data bank
+    uint32_t address;       // Byte address in ADPCM RAM
+    uint32_t encoded_size;  // 0 if it did not fit
+} pcm_block_t;
+
+// DAC stream settings, from commands 0x90-0x92
+typedef struct {
+    uint8_t chip;
+    uint8_t bank;
+    uint8_t step;
+    uint32_t frequency;
+    uint32_t offset;        // Data offset of the last start, for starts that keep it
+} pcm_stream_t;
+
+static pcm_block_t s_blocks[PCM_OFFLOAD_MAX_BLOCKS];
+static int s_block_count = 0;
+static pcm_stream_t s_streams[256];
+static route_t s_route;            // ADPCM-B registers of the YM2608, port 1
+static uint32_t s_ym2608_clock;
+static bool s_active = false;
+static int s_playing = -1;         // Stream on the ADPCM-B channel, -1 if none
+
+static void put_le32(uint8_t* p, uint32_t v) {
+    p[0] = v & 0xFF; p[1] = (v >> 8) & 0xFF; p[2] = (v >> 16) & 0xFF; p[3] = v >> 24;
+}
+
+static uint32_t pcm_samples_per_byte(uint32_t type) {
+    return type == PCM_DATA_OKIM6258 ? 2 : 1;
+}
+
+// --- Encoding ---
+// Encodes one data block to YM2608 ADPCM. Returns NULL for types that are not offloaded.
+static uint8_t* pcm_encode_block(uint32_t type, uint8_t* data, uint32_t size, int* encoded_size) {
+    int16_t* pcm = NULL;
+    int pcm_len = 0;
+    if (type == PCM_DATA_YM2612) {
+        pcm = malloc(size * sizeof(int16_t));
+        if (!pcm) return NULL;
+        for (uint32_t i = 0; i < size; i++) pcm[i] = (int16_t)((data[i] - 0x80) << 8);
+        pcm_len = (int)size;
+    } else if (type == PCM_DATA_OKIM6258) {
+        pcm = okim6258_adpcm_decode(data, (int)size, &pcm_len);
+        if (!pcm) return NULL;
+    } else {
+        return NULL;
+    }
+    uint8_t* adpcm = ym2608_adpcm_encode(pcm, pcm_len, encoded_size);
+    free(pcm);
+    return adpcm;
+}
+
+// Reads the data blocks at the start of the command stream and lays out their encoded
+// samples in a RAM image. Blocks that are empty, too large or do not fit in RAM are left
+// out of the image.
+static uint8_t* pcm_build_image(FILE* fp, const vgm_header_t* header, uint32_t* image_size) {
+    uint32_t bank_size[256] = {0};
+    uint8_t* image = NULL;
+    uint32_t used = 0;
+    uint32_t pos = header->vgm_data_offset;
+    uint8_t head[7];
+
+    while (fseek(fp, (long)pos, SEEK_SET) == 0 && fread(head, 1, sizeof(head), fp) == sizeof(head)
+           && head[0] == 0x67 && head[1] == 0x66) {
+        uint8_t type = head[2];
+        uint32_t size = read_le32(head + 3);
+        pos += sizeof(head) + size;
+        if (type != PCM_DATA_YM2612 && type != PCM_DATA_OKIM6258) {
+            bank_size[type] += size;
+            continue;
+        }
+        if (s_block_count == PCM_OFFLOAD_MAX_BLOCKS) break;
+
+        // Every block of an offloaded type gets an entry, so block ids (0x95) count as in
+        // the VGM bank. One that is not encoded keeps an encoded size of 0.
+        pcm_block_t* b = &s_blocks[s_block_count++];
+        memset(b, 0, sizeof(*b));
+        b->type = type;
+        b->bank_offset = bank_size[type];
+        b->size = size;
+        bank_size[type] += size;
+        if (size == 0 || size > YM2608_UPLOAD_MAX_BLOCK) continue;
+
+        uint8_t* data = malloc(size);
+        if (!data || fread(data, 1, size, fp) != size) {
+            free(data);
+            continue;
+        }
+        int encoded_size = 0;
+        uint8_t* encoded = pcm_encode_block(type, data, size, &encoded_size);
+        free(data);
+        // Addresses are in units of 4 bytes
+        uint32_t address = (used + 3) & ~3u;
+        if (encoded && encoded_size > 0 && address + (uint32_t)encoded_size <= PCM_OFFLOAD_RAM_SIZE) {
+            uint8_t* grown = realloc(image, address + encoded_size);
+            if (grown) {
+                image = grown;
+                memset(image + used, 0, address - used);
+                memcpy(image + address, encoded, encoded_size);
+                used = address + encoded_size;
+                b->address = address;
+                b->encoded_size = (uint32_t)encoded_size;
+            }
+        }
+        free(encoded);
+    }
+    *image_size = used;
+    return image;
+}
+
+// --- Cache ---
+static bool pcm_cache_load(const char* path, uint8_t** image, uint32_t* image_size) {
+    FILE* fp = fopen(path, "rb");
+    if (!fp) return false;
+    uint8_t head[PCM_OFFLOAD_HEADER_SIZE];
+    bool ok = fread(head, 1, sizeof(head), fp) == sizeof(head) && memcmp(head, PCM_OFFLOAD_MAGIC, 4) == 0
+              && read_le32(head + 4) == PCM_OFFLOAD_FORMAT;
+    uint32_t count = ok ? read_le32(head + 8) : 0;
+    uint32_t size = ok ? read_le32(head + 12) : 0;
+    ok = ok && count <= PCM_OFFLOAD_MAX_BLOCKS && size <= PCM_OFFLOAD_RAM_SIZE;
+    for (uint32_t i = 0; ok && i < count; i++) {
+        uint8_t rec[PCM_OFFLOAD_BLOCK_SIZE];
+        pcm_block_t* b = &s_blocks[i];
+        ok = fread(rec, 1, sizeof(rec), fp) == sizeof(rec);
+        b->type = read_le32(rec);
+        b->bank_offset = read_le32(rec + 4);
+        b->size = read_le32(rec + 8);
+        b->address = read_le32(rec + 12);
+        b->encoded_size = read_le32(rec + 16);
+        ok = ok && b->type < 256 && b->address + b->encoded_size <= size;
+    }
+    uint8_t* data = ok ? malloc(size ? size : 1) : NULL;
+    ok = data && fread(data, 1, size, fp) == size;
+    fclose(fp);
+    if (!ok) {
+        free(data);
+        return false;
+    }
+    s_block_count = (int)count;
+    *image = data;
+    *image_size = size;
+    return true;
+}
+
+static bool pcm_cache_save(const char* path, const uint8_t* image, uint32_t image_size) {
+    FILE* fp = fopen(path, "wb");
+    if (!fp) return false;
+    uint8_t head[PCM_OFFLOAD_HEADER_SIZE];
+    memcpy(head, PCM_OFFLOAD_MAGIC, 4);
+    put_le32(head + 4, PCM_OFFLOAD_FORMAT);
+    put_le32(head + 8, (uint32_t)s_block_count);
+    put_le32(head + 12, image_size);
+    bool ok = fwrite(head, 1, sizeof(head), fp) == sizeof(head);
+    for (int i = 0; ok && i < s_block_count; i++) {
+        uint8_t rec[PCM_OFFLOAD_BLOCK_SIZE];
+        const pcm_block_t* b = &s_blocks[i];
+        put_le32(rec, b->type);
+        put_le32(rec + 4, b->bank_offset);
+        put_le32(rec + 8, b->size);
+        put_le32(rec + 12, b->address);
+        put_le32(rec + 16, b->encoded_size);
+        ok = fwrite(rec, 1, sizeof(rec), fp) == sizeof(rec);
+    }
+    ok = ok && fwrite(image, 1, image_size, fp) == image_size;
+    fclose(fp);
+    if (!ok) remove(path);
+    return ok;
+}
+
+bool pcm_offload_open(FILE* fp, const vgm_header_t* header, const char* filename, bool use_cache) {
+    s_active = false;
+    s_block_count = 0;
+    s_playing = -1;
+    memset(s_streams, 0, sizeof(s_streams));
+
+    // The ADPCM-B channel is free only if the track does not use the YM2608 itself
+    if (header->ym2608_clock || (!header->ym2612_clock && !header->okim6258_clock)) return false;
+    s_route = route_to_chip(CHIP_TYPE_YM2608, 1);
+    if (s_route.slot == 0xFF) return false;
+    s_ym2608_clock = get_clock_for_chip(CHIP_TYPE_YM2608);
+
+    char cache_name[MAX_PATH_LEN];
+    char cache_path[MAX_PATH_LEN];
+    cache_index_name(filename, "adpcm", cache_name, sizeof(cache_name));
+    cache_index_path(cache_name, cache_path, sizeof(cache_path));
+
+    long saved = ftell(fp);
+    uint8_t* image = NULL;
+    uint32_t image_size = 0;
+    bool cached = use_cache && cache_index_lookup(cache_path, filename, VGM_CONVERTER_VERSION)
+                  && pcm_cache_load(cache_path, &image, &image_size);
+    if (!cached) {
+        s_block_count = 0;
+        image = pcm_build_image(fp, header, &image_size);
+        if (image && pcm_cache_save(cache_path, image, image_size)) {
+            cache_index_add(cache_path, filename, VGM_CONVERTER_VERSION);
+        }
+    }
+    fseek(fp, saved, SEEK_SET);
+    if (!image) return false;
+
+    // Upload as a 0x81 data block payload: RAM size, start address, data
+    uint8_t* payload = malloc(8 + image_size);
+    if (payload) {
+        put_le32(payload, PCM_OFFLOAD_RAM_SIZE);
+        put_le32(payload + 4, 0);
+        memcpy(payload + 8, image, image_size);
+        ym2608_upload_block(s_route.slot, payload, 8 + image_size, update_upload_progress);
+        s_active = true;
+    }
+    free(payload);
+    free(image);
+    if (!s_active) return false;
+
+    s_route.write(&s_route, 0x0C, 0xFF); // Limit address: all of RAM
+    s_route.write(&s_route, 0x0D, 0xFF);
+    logging(LOG_LEVEL_INFO, "Offloading %d PCM blocks (%u bytes of ADPCM) to the YM2608.%s", s_block_count, image_size, cached ? " (Cached)" : "");
+    return true;
+}
+
+// --- Playback ---
+static void pcm_stop(void) {
+    s_route.write(&s_route, 0x00, 0x01); // Reset stops the channel
+    s_route.write(&s_route, 0x00, 0x00);
+    s_playing = -1;
+}
+
+// Plays samples bytes of the bank from offset on the ADPCM-B channel
+static void pcm_start(uint8_t id, uint32_t offset, uint32_t bytes, bool loop) {
+    const pcm_stream_t* st = &s_streams[id];
+    const pcm_block_t* b = NULL;
+    for (int i = 0; i < s_block_count && !b; i++) {
+        const pcm_block_t* c = &s_blocks[i];
+        if (c->type == st->bank && c->bank_offset <= offset && offset < c->bank_offset + c->size) b = c;
+    }
+    if (!b || b->encoded_size == 0 || st->frequency == 0) return;
+
+    // A start inside a block begins with the decoder reset, so the first samples are rough
+    uint32_t per_byte = pcm_samples_per_byte(b->type);
+    uint32_t start = b->address + (((offset - b->bank_offset) * per_byte / 2) & ~3u);
+    uint32_t end = b->address + b->encoded_size;
+    if (bytes > 0 && start + bytes * per_byte / 2 < end) end = start + bytes * per_byte / 2;
+    if (end <= start) return;
+
+    uint64_t delta_n = (uint64_t)st->frequency * per_byte * 65536 * 144 / s_ym2608_clock;
+    if (delta_n > 0xFFFF) delta_n = 0xFFFF;
+    uint32_t start_unit = start >> 2;
+    uint32_t stop_unit = (end - 1) >> 2;
+
+    s_route.write(&s_route, 0x00, 0x01);
+    s_route.write(&s_route, 0x01, 0xC0); // Both outputs, 1-bit RAM
+    s_route.write(&s_route, 0x02, start_unit & 0xFF);
+    s_route.write(&s_route, 0x03, (start_unit >> 8) & 0xFF);
+    s_route.write(&s_route, 0x04, stop_unit & 0xFF);
+    s_route.write(&s_route, 0x05, (stop_unit >> 8) & 0xFF);
+    s_route.write(&s_route, 0x09, delta_n & 0xFF);
+    s_route.write(&s_route, 0x0A, (delta_n >> 8) & 0xFF);
+    s_route.write(&s_route, 0x0B, PCM_OFFLOAD_LEVEL);
+    s_route.write(&s_route, 0x00, loop ? 0xB0 : 0xA0); // Start from RAM
+    s_playing = id;
+}
+
+// Number of bank bytes a start covers, 0 for all of the block
+static uint32_t pcm_start_length(const pcm_stream_t* st, uint8_t mode, uint32_t length) {
+    switch (mode & 0x03) {
+        case 1: return length * (st->step ? st->step : 1);
+        case 2: return (uint32_t)((uint64_t)length * st->frequency / 1000);
+        default: return 0;
+    }
+}
+
+void pcm_offload_command(uint8_t op, const uint8_t* args) {
+    if (!s_active) return;
+    uint8_t id = args[0];
+    pcm_stream_t* st = &s_streams[id];
+
+    switch (op) {
+        case 0x90: // Setup: chip type, port, register
+            st->chip = args[1] & 0x7F;
+            break;
+        case 0x91: // Data: bank, step size, step base
+            st->bank = args[1];
+            st->step = args[2];
+            break;
+        case 0x92: // Frequency
+            st->frequency = read_le32(args + 1);
+            break;
+        case 0x93: { // Start: offset, length mode, length
+            uint32_t offset = read_le32(args + 1);
+            uint8_t mode = args[5];
+            if (offset != 0xFFFFFFFF) st->offset = offset;
+            if ((mode & 0x03) == 0 || (mode & 0x10)) break; // Position only, or reversed
+            if (st->chip != PCM_CHIP_YM2612 && st->chip != PCM_CHIP_OKIM6258) break;
+            if (st->step > 1) break;
+            pcm_start(id, st->offset, pcm_start_length(st, mode, read_le32(args + 6)), (mode & 0x80) != 0);
+            break;
+        }
+        case 0x94: // Stop
+            if (s_playing >= 0 && (id == 0xFF || id == s_playing)) pcm_stop();
+            break;
+        case 0x95: { // Start a block: block id, flags
+            uint16_t block_id = (uint16_t)(args[1] | (args[2] << 8));
+            uint8_t flags = args[3];
+            if ((flags & 0x10) || (st->chip != PCM_CHIP_YM2612 && st->chip != PCM_CHIP_OKIM6258)) break;
+            int n = 0;
+            for (int i = 0; i < s_block_count; i++) {
+                if (s_blocks[i].type != st->bank) continue;
+                if (n++ == block_id) {
+                    st->offset = s_blocks[i].bank_offset;
+                    pcm_start(id, st->offset, 0, (flags & 0x01) != 0);
+                    break;
+                }
+            }
+            break;
+        }
+    }
+}
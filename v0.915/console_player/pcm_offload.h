@@ -0,0 +1,27 @@
+#ifndef PCM_OFFLOAD_H
+#define PCM_OFFLOAD_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "vgm.h"
+
+// PCM offload to the YM2608 ADPCM-B channel.
+// Samples played through VGM DAC streams (commands 0x90-0x95) for the YM2612 DAC or an
+// OKIM6258 would need one register write per sample. When a YM2608 is installed and the
+// track does not use it, the PCM data blocks are encoded to YM2608 ADPCM once, cached,
+// and uploaded to its RAM before the track starts. Starting and stopping a stream then
+// becomes a few register writes on the ADPCM-B channel.
+//
+// The ADPCM-B channel plays one sample at a time, so a stream that starts cuts off the
+// one playing. Samples written one byte at a time with 0x8n are not offloaded.
+
+// Prepares the offload for a track: encodes the PCM data blocks at the start of fp, or
+// loads them from the cache, and uploads them. The position of fp is kept.
+// Returns true if DAC streams of this track will be played on the YM2608.
+bool pcm_offload_open(FILE* fp, const vgm_header_t* header, const char* filename, bool use_cache);
+
+// Plays a DAC stream control command (0x90-0x95). args holds the bytes after op.
+void pcm_offload_command(uint8_t op, const uint8_t* args);
+
+#endif // PCM_OFFLOAD_H
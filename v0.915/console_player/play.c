@@ -5,6 +5,7 @@
 #include "chiptype.h"
 #include "util.h"
 #include "spfm.h"
+#include "cache_index.h"
 
 #include <string.h>
 
@@ -96,7 +97,6 @@ const char* get_timer_mode_string() {
 void update_ui(uint32_t total_samples, const char* song_name, bool paused, int play_mode, ay_stereo_mode_t ay_stereo_mode, cache_mode_t cache_mode) {
     extern volatile int g_flush_mode;
     extern volatile double g_speed_multiplier;
-    extern chip_config_t g_chip_config[CHIP_TYPE_COUNT];
 
     if (!g_ui_initialized) {
         init_ui();
@@ -192,6 +192,11 @@ void update_ui(uint32_t total_samples, const char* song_name, bool paused, int p
         else if (display_chip == CHIP_TYPE_AY8910) clock = g_vgm_header.ay8910_clock;
         else if (display_chip == CHIP_TYPE_SN76489) clock = g_vgm_header.sn76489_clock;
         else if (display_chip == CHIP_TYPE_WSWAN) clock = g_vgm_header.wonderswan_clock;
+        else if (display_chip == CHIP_TYPE_YM2413) clock = g_vgm_header.ym2413_clock;
+        else if (display_chip == CHIP_TYPE_YMF262) clock = g_vgm_header.ymf262_clock;
+        else if (display_chip == CHIP_TYPE_YM3812) clock = g_vgm_header.ym3812_clock;
+        else if (display_chip == CHIP_TYPE_YM3526) clock = g_vgm_header.ym3526_clock;
+        else if (display_chip == CHIP_TYPE_Y8950) clock = g_vgm_header.y8950_clock;
         // Add other chips here
     }
 
@@ -203,7 +208,9 @@ void update_ui(uint32_t total_samples, const char* song_name, bool paused, int p
     if (g_vgm_header.ym2612_clock == 0 && g_vgm_header.ym2151_clock == 0 &&
         g_vgm_header.ym2203_clock == 0 && g_vgm_header.ym2608_clock == 0 &&
         g_vgm_header.sn76489_clock == 0 && g_vgm_header.ay8910_clock == 0 &&
-        g_vgm_header.ym2413_clock == 0 && g_vgm_header.wonderswan_clock == 0) {
+        g_vgm_header.ym2413_clock == 0 && g_vgm_header.wonderswan_clock == 0 &&
+        g_vgm_header.ymf262_clock == 0 && g_vgm_header.ym3812_clock == 0 &&
+        g_vgm_header.ym3526_clock == 0 && g_vgm_header.y8950_clock == 0) {
         snprintf(buffer, sizeof(buffer), "VGM Chip: Invalid/Unsupported");
     } else {
         snprintf(buffer, sizeof(buffer), "VGM Chip: %s (%.2fMHz)", chip_type_to_string(display_chip), clock / 1000000.0);
@@ -227,8 +234,8 @@ void update_ui(uint32_t total_samples, const char* song_name, bool paused, int p
         clear_line(10);
     }
 
-    const char* flush_mode_str = (g_flush_mode == 1) ? "Register-Level" : "Command-Level";
-    snprintf(buffer, sizeof(buffer), "Flush Mode (1,2): %s", flush_mode_str);
+    const char* flush_mode_str = (g_flush_mode == 2) ? "Command-Level" : "Per-Tick";
+    snprintf(buffer, sizeof(buffer), "Flush Mode (0,2): %s", flush_mode_str);
     clear_line(11); print_at(0, 11, buffer);
 
     snprintf(buffer, sizeof(buffer), "Timer (3-7): %s", get_timer_mode_string());
@@ -249,15 +256,24 @@ void update_ui(uint32_t total_samples, const char* song_name, bool paused, int p
         clear_line(14);
     }
 
-    const char* slot0_name = "NONE";
-    const char* slot1_name = "NONE";
-    for (int i = 1; i < CHIP_TYPE_COUNT; i++) {
-        if (g_chip_config[i].slot == 0) slot0_name = chip_type_to_string((chip_type_t)i);
-        if (g_chip_config[i].slot == 1) slot1_name = chip_type_to_string((chip_type_t)i);
+    // One entry per installed chip, in slot order. With several devices the device is shown too.
+    size_t len = 0;
+    buffer[0] = '\0';
+    for (int slot = 0; slot < SPFM_MAX_DEVICES * 8; slot++) {
+        for (int i = 0; i < g_chip_config_count && len < sizeof(buffer); i++) {
+            const chip_config_t* chip = &g_chip_config[i];
+            if (chip->slot != slot) continue;
+            const char* sep = len ? " | " : "";
+            if (spfm_get_device_count() > 1) {
+                len += (size_t)snprintf(buffer + len, sizeof(buffer) - len, "%sD%d Slot %d: %s", sep,
+                    SPFM_SLOT_DEVICE(slot), SPFM_SLOT_INDEX(slot), chip_type_to_string(chip->type));
+            } else {
+                len += (size_t)snprintf(buffer + len, sizeof(buffer) - len, "%sSlot %d: %s (%.2fMHz)", sep,
+                    slot, chip_type_to_string(chip->type), chip->clock / 1000000.0);
+            }
+        }
     }
-    snprintf(buffer, sizeof(buffer), "Slot 0: %s (%.2fMHz) | Slot 1: %s (%.2fMHz)", 
-        slot0_name, get_chip_default_clock(get_chip_type_from_string(slot0_name)) / 1000000.0,
-        slot1_name, get_chip_default_clock(get_chip_type_from_string(slot1_name)) / 1000000.0);
+    if (len == 0) snprintf(buffer, sizeof(buffer), "Slots: NONE");
     clear_line(15); print_at(0, 15, buffer);
 
     if (g_is_playing_from_cache) {
@@ -279,7 +295,7 @@ void update_ui(uint32_t total_samples, const char* song_name, bool paused, int p
         snprintf(buffer, sizeof(buffer), "Conversion: %s (%.2fMHz) -> YM2151 (%.2fMHz)", 
             chip_type_to_string(g_original_vgm_chip_type), 
             conv_clock / 1000000.0,
-            get_chip_default_clock(CHIP_TYPE_YM2151) / 1000000.0);
+            get_clock_for_chip(CHIP_TYPE_YM2151) / 1000000.0);
         clear_line(16); print_at(0, 16, buffer);
     } else {
         snprintf(buffer, sizeof(buffer), "Conversion: Direct Play");
@@ -289,6 +305,143 @@ void update_ui(uint32_t total_samples, const char* song_name, bool paused, int p
     fflush(stdout);
 }
 
+// Shown on the status line while ADPCM data is sent to the YM2608
+void update_upload_progress(uint32_t done, uint32_t total, uint32_t bytes_per_sec) {
+    if (!g_ui_initialized) return;
+    char buffer[128];
+    snprintf(buffer, sizeof(buffer), "Status: Loading ADPCM %u/%u KB (%u KB/s)", done / 1024, (total + 1023) / 1024, bytes_per_sec / 1024);
+    clear_line(9); print_at(0, 9, buffer);
+    fflush(stdout);
+}
+
+// --- Sample Clock ---
+// Deadlines are kept in samples against the performance counter, so time spent sending
+// writes is never added to the waits.
+
+// True if a device was reconnected since the last call. The track then goes on from where
+// it stopped rather than rushing through the writes of the outage.
+static bool play_clock_outage(uint32_t* seen) {
+    spfm_telemetry_t telemetry;
+    spfm_get_telemetry(&telemetry);
+    bool outage = telemetry.reconnects != *seen;
+    *seen = telemetry.reconnects;
+    return outage;
+}
+
+// Samples the track may run ahead of the clock, or -1 to hold off. Bytes sent now wait
+// behind what the USB driver still queues, so while it holds some, running that far ahead
+// gets the writes to the chips on time. When it holds more than the target lead, nothing
+// more goes out until it drains: that bounds how late a pause or a skip is heard.
+static double play_clock_lead(void) {
+    extern int g_pacing_lead_ms;
+    extern volatile double g_speed_multiplier;
+    if (g_pacing_lead_ms <= 0) return 0;
+    uint32_t queued_us = spfm_get_queued_us();
+    if (queued_us > (uint32_t)g_pacing_lead_ms * 1000) return -1;
+    return queued_us * ((double)VGM_SAMPLE_RATE / 1000000) * g_speed_multiplier;
+}
+
+bool play_clock_run(play_step_func_t step, void* ctx) {
+    extern volatile int g_timer_mode;
+    extern volatile bool g_is_paused, g_next_track_flag, g_prev_track_flag, g_quit_flag, g_stop_current_song;
+    extern volatile double g_speed_multiplier;
+    uint32_t outages = 0;
+    play_clock_outage(&outages);
+
+    // VGMPlay Mode (most accurate, uses multimedia timer)
+    if (g_timer_mode == 3) {
+        LARGE_INTEGER g_freq, g_last_counter;
+        QueryPerformanceFrequency(&g_freq);
+        
+        HANDLE mm_timer_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+        MMRESULT timer_id = timeSetEvent(1, 1, (LPTIMECALLBACK)mm_timer_event, 0, TIME_PERIODIC | TIME_CALLBACK_EVENT_SET);
+        if (timer_id == 0) {
+            logging(LOG_LEVEL_ERROR, "Failed to create multimedia timer for VGMPlay mode.\n");
+            if(mm_timer_event) CloseHandle(mm_timer_event);
+            g_is_playing = false;
+            return false;
+        }
+
+        QueryPerformanceCounter(&g_last_counter);
+        double samples_per_tick = (double)VGM_SAMPLE_RATE / g_freq.QuadPart;
+        double samples_to_process = 0;
+
+        while (g_is_playing && !g_next_track_flag && !g_prev_track_flag && !g_stop_current_song && !g_quit_flag) {
+            WaitForSingleObject(mm_timer_event, INFINITE);
+
+            while (g_is_paused && !g_next_track_flag && !g_prev_track_flag && !g_stop_current_song && !g_quit_flag) {
+                yasp_usleep(100000);
+                QueryPerformanceCounter(&g_last_counter);
+            }
+
+            LARGE_INTEGER current_counter;
+            QueryPerformanceCounter(&current_counter);
+            samples_to_process += (current_counter.QuadPart - g_last_counter.QuadPart) * samples_per_tick * g_speed_multiplier;
+            g_last_counter = current_counter;
+
+            double lead = play_clock_lead();
+            if (lead < 0) continue;
+
+            int samples_processed_this_loop = 0;
+            while (samples_processed_this_loop < (int)(samples_to_process + lead)) {
+                int samples = step(ctx);
+                if (samples > 0) {
+                    samples_processed_this_loop += samples;
+                }
+                if (!g_is_playing) break;
+            }
+            samples_to_process -= samples_processed_this_loop;
+            spfm_flush();
+            if (play_clock_outage(&outages)) QueryPerformanceCounter(&g_last_counter);
+        }
+
+        timeKillEvent(timer_id);
+        CloseHandle(mm_timer_event);
+    } 
+    // Compensated Sleep Mode (less accurate but good fallback for other modes)
+    else {
+        LARGE_INTEGER g_freq, g_last_counter;
+        QueryPerformanceFrequency(&g_freq);
+        QueryPerformanceCounter(&g_last_counter);
+        double samples_per_tick = (double)VGM_SAMPLE_RATE / g_freq.QuadPart;
+        double samples_to_process = 0;
+
+        while (g_is_playing && !g_next_track_flag && !g_prev_track_flag && !g_stop_current_song && !g_quit_flag) {
+            while (g_is_paused && !g_next_track_flag && !g_prev_track_flag && !g_stop_current_song && !g_quit_flag) {
+                yasp_usleep(100000);
+                QueryPerformanceCounter(&g_last_counter); // Reset timer after pause
+            }
+
+            LARGE_INTEGER current_counter;
+            QueryPerformanceCounter(&current_counter);
+            samples_to_process += (current_counter.QuadPart - g_last_counter.QuadPart) * samples_per_tick * g_speed_multiplier;
+            g_last_counter = current_counter;
+
+            double lead = play_clock_lead();
+            int samples_to_run = lead < 0 ? 0 : (int)(samples_to_process + lead);
+            if (samples_to_run > 0) {
+                int samples_run_this_cycle = 0;
+                while(samples_run_this_cycle < samples_to_run) {
+                    int s = step(ctx);
+                    if (s > 0) {
+                        samples_run_this_cycle += s;
+                    }
+                    if (!g_is_playing) break;
+                }
+                samples_to_process -= samples_run_this_cycle;
+                spfm_flush();
+                if (play_clock_outage(&outages)) QueryPerformanceCounter(&g_last_counter);
+            }
+            
+            yasp_usleep(1000); // Sleep 1ms to yield CPU
+        }
+    }
+
+    spfm_flush();
+    g_is_playing = false;
+    return true;
+}
+
 static enum filetype_t get_filetype(const char *filename) {
     const char *ext = strrchr(filename, '.');
     if (!ext) return FILETYPE_UNKNOWN;
@@ -304,12 +457,14 @@ bool play_file(const char *filename, bool force_reconvert) {
     logging(LOG_LEVEL_DEBUG, "Attempting to play file: %s", filename);
 
     char cache_filename[MAX_PATH_LEN] = {0};
+    char cache_name[MAX_PATH_LEN];
     const char *base_name = strrchr(filename, '/');
     if (base_name == NULL) base_name = strrchr(filename, '\\');
     base_name = (base_name == NULL) ? filename : base_name + 1;
 
     // This is a potential cache name, vgm.c will decide if it's needed
-    snprintf(cache_filename, sizeof(cache_filename), "console_player/cache/%s.opm.vgm", base_name);
+    snprintf(cache_name, sizeof(cache_name), "%s.opm.vgm", base_name);
+    cache_index_path(cache_name, cache_filename, sizeof(cache_filename));
 
     FILE *fp = fopen(filename, "rb");
     if (!fp) {
@@ -321,44 +476,19 @@ bool play_file(const char *filename, bool force_reconvert) {
     enum filetype_t type = get_filetype(filename);
 
     // --- Update total samples for UI ---
+    // S98 is loaded once here; the sync index built by s98_load gives the duration and drives playback
+    S98 s98 = {0};
+    bool s98_loaded = false;
+    g_current_song_total_samples = 0;
     if (type == FILETYPE_S98) {
-        S98 s98 = {0};
-        if (s98_load(&s98, fp)) {
-            // Calculate total samples for S98
-            uint32_t total_samples = 0;
-            uint32_t pos = s98.offset_to_dump;
-            while (pos < s98.size) {
-                uint8_t op = s98.buffer[pos++];
-                if (op == 0x00) { // SYNC
-                    total_samples++;
-                } else if (op == 0x01) { // SYNC(n)
-                    uint8_t n = 1;
-                    while (s98.buffer[pos] == 0x01) {
-                        n++;
-                        pos++;
-                    }
-                    total_samples += n;
-                } else if (op >= 0x80) { // FM/SSG/etc
-                    pos += 2;
-                } else if (op == 0xFF) { // END
-                    break;
-                }
-            }
-            g_current_song_total_samples = (uint32_t)(((double)total_samples / 1000.0) * 44100.0);
-            s98_release(&s98);
-            fseek(fp, 0, SEEK_SET); // Rewind
-        }
-    } else {
-        g_current_song_total_samples = 0;
+        s98_loaded = s98_load(&s98, fp);
+        if (s98_loaded) g_current_song_total_samples = s98_total_samples(&s98);
     }
 
     g_ui_refresh_request = true; // Request UI refresh now that we have the total samples
 
     // For VGM, header parsing and sample count is handled inside vgm_play
     // to correctly deal with cached files.
-    if (type != FILETYPE_VGM) {
-        g_current_song_total_samples = 0; // Reset for non-VGM files initially
-    }
 
     switch (type) {
         case FILETYPE_VGM: {
@@ -373,8 +503,11 @@ bool play_file(const char *filename, bool force_reconvert) {
             return result; // Return early to avoid double-closing fp
         }
         case FILETYPE_S98: {
-            S98 s98 = {0};
-            if (s98_load(&s98, fp)) {
+            if (s98_loaded && s98_plays_as_vgm(&s98)) {
+                // Converted and cached, or compiled, through the VGM path like VGMs for the same chips
+                result = s98_play_converted(&s98, filename, cache_filename, force_reconvert);
+                s98_release(&s98);
+            } else if (s98_loaded) {
                 logging(LOG_LEVEL_DEBUG, "Calling s98_play for %s", filename);
                 result = s98_play(&s98, filename);
                 s98_release(&s98);
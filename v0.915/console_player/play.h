@@ -27,6 +27,15 @@ extern volatile bool g_stop_current_song;
 bool play_file(const char *path, bool force_reconvert);
 void update_ui(uint32_t total_samples, const char* song_name, bool paused, int play_mode, ay_stereo_mode_t ay_stereo_mode, cache_mode_t cache_mode);
 bool vgm_play_vgmplay_mode(FILE *fp, const char *filename);
+// Shows how much of a YM2608 ADPCM upload has been sent
+void update_upload_progress(uint32_t done, uint32_t total, uint32_t bytes_per_sec);
+
+// Sends the next command of a song and returns the samples (44.1 kHz) to wait after it
+typedef int (*play_step_func_t)(void* ctx);
+// Runs step on the sample clock until the song ends or is stopped. Steps run as soon as
+// their deadline has passed, and the writes of all steps due in one timer tick go out in
+// one flush. Returns false if the timer could not be set up.
+bool play_clock_run(play_step_func_t step, void* ctx);
 
 // UI utility functions
 void init_ui();
@@ -0,0 +1,15 @@
+#include "reg_batch.h"
+
+void reg_batch_init(reg_batch_t* batch, reg_write_t* storage, size_t capacity, reg_batch_sink_t sink) {
+    batch->writes = storage;
+    batch->capacity = capacity;
+    batch->count = 0;
+    batch->time = 0;
+    batch->sink = sink;
+}
+
+void reg_batch_flush(reg_batch_t* batch) {
+    if (batch->count == 0) return;
+    if (batch->sink) batch->sink(batch);
+    batch->count = 0;
+}
@@ -0,0 +1,52 @@
+#ifndef REG_BATCH_H
+#define REG_BATCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Batched converter output.
+// Converters append their register writes to a caller-provided array instead of
+// calling a function per write. The owner of the batch hands it to the next stage
+// (another converter, the cache writer, the SPFM encoder) once per source command.
+
+// VGM command a batched write is sent with, if it is not a tagged VGM_CMD_OPM_* command
+#define REG_BATCH_CMD_OPM 0x54 // YM2151
+#define REG_BATCH_CMD_AY  0xA0 // AY8910
+
+typedef struct {
+    uint32_t time; // Sample time of the source command that produced the write
+    uint8_t cmd;
+    uint8_t addr;
+    uint8_t data;
+} reg_write_t;
+
+typedef struct reg_batch reg_batch_t;
+
+// Consumes all writes in the batch. Called by reg_batch_flush, and when the batch is full.
+typedef void (*reg_batch_sink_t)(reg_batch_t* batch);
+
+struct reg_batch {
+    reg_write_t* writes;   // Caller-provided storage
+    size_t capacity;
+    size_t count;
+    uint32_t time;         // Stamped on every write appended
+    reg_batch_sink_t sink;
+};
+
+void reg_batch_init(reg_batch_t* batch, reg_write_t* storage, size_t capacity, reg_batch_sink_t sink);
+
+// Hands the pending writes to the sink and empties the batch.
+void reg_batch_flush(reg_batch_t* batch);
+
+// Appends a write. The sink is only called when the storage is full.
+#define REG_BATCH_ADD(batch, c, a, d) do { \
+    reg_batch_t* _b = (batch); \
+    if (_b->count == _b->capacity) reg_batch_flush(_b); \
+    reg_write_t* _w = &_b->writes[_b->count++]; \
+    _w->time = _b->time; \
+    _w->cmd = (c); \
+    _w->addr = (a); \
+    _w->data = (d); \
+} while (0)
+
+#endif // REG_BATCH_H
@@ -0,0 +1,47 @@
+#include "route.h"
+#include "chip_driver.h"
+#include "opn_to_opm.h"
+#include "ay_to_opm.h"
+#include "sn_to_ay.h"
+#include "ws_to_opm.h"
+
+// --- Converters ---
+static void route_opn_to_opm(const route_t* r, uint8_t addr, uint8_t data) { opn_to_opm_write_reg(addr, data, r->port); }
+static void route_ay_to_opm(const route_t* r, uint8_t addr, uint8_t data) { (void)r; ay_to_opm_write_reg(addr, data); }
+static void route_sn_to_ay(const route_t* r, uint8_t addr, uint8_t data) { (void)r; (void)addr; sn_to_ay_write_reg(data); }
+static void route_ws_to_opm(const route_t* r, uint8_t addr, uint8_t data) { ws_to_opm_write_reg(r->port, addr, data); }
+
+static void route_none(const route_t* r, uint8_t addr, uint8_t data) { (void)r; (void)addr; (void)data; }
+
+static route_t route_make(route_write_func_t write, uint8_t slot, uint8_t port) {
+    route_t route = { write, slot, port };
+    return route;
+}
+
+route_t route_drop(void) {
+    return route_make(route_none, 0xFF, 0);
+}
+
+route_t route_to_chip_instance(chip_type_t chip, int instance, uint8_t port) {
+    const chip_driver_t* driver = chip_driver_get(chip);
+    if (!driver || port >= driver->ports) return route_drop();
+    uint8_t slot = get_slot_for_chip_instance(chip, instance);
+    if (slot == 0xFF) return route_drop();
+    return route_make(driver->write, slot, port);
+}
+
+route_t route_to_chip(chip_type_t chip, uint8_t port) {
+    return route_to_chip_instance(chip, 0, port);
+}
+
+route_t route_to_converter(chip_type_t source, uint8_t port) {
+    switch (source) {
+        case CHIP_TYPE_YM2612:
+        case CHIP_TYPE_YM2203:
+        case CHIP_TYPE_YM2608:  return route_make(route_opn_to_opm, 0xFF, port);
+        case CHIP_TYPE_AY8910:  return route_make(route_ay_to_opm, 0xFF, port);
+        case CHIP_TYPE_SN76489: return route_make(route_sn_to_ay, 0xFF, port);
+        case CHIP_TYPE_WSWAN:   return route_make(route_ws_to_opm, 0xFF, port);
+        default: return route_drop();
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef ROUTE_H
+#define ROUTE_H
+
+#include <stdint.h>
+#include "chiptype.h"
+
+// Write routing.
+// Where the writes of a track go is worked out once when it starts: each source chip
+// (a VGM command, an S98 device) gets a route with the slot, port and the function
+// that sends the write, either a chip driver or a converter. The player then only
+// does one table load and one call per write, instead of looking up the slot and
+// picking the driver every time.
+
+typedef struct route route_t;
+
+// Single-operand chips (SN76489) take the data byte and ignore addr
+typedef void (*route_write_func_t)(const route_t* route, uint8_t addr, uint8_t data);
+
+struct route {
+    route_write_func_t write;
+    uint8_t slot;
+    uint8_t port;
+};
+
+// Sends the writes to the installed chip of this type. Drops them if there is none.
+route_t route_to_chip(chip_type_t chip, uint8_t port);
+// Sends the writes to the n-th installed chip of this type (0: the first), for tracks with two of it.
+route_t route_to_chip_instance(chip_type_t chip, int instance, uint8_t port);
+// Sends the writes of a source chip through its converter to the YM2151 (or AY8910 for SN76489).
+route_t route_to_converter(chip_type_t source, uint8_t port);
+// Ignores the writes.
+route_t route_drop(void);
+
+#endif // ROUTE_H
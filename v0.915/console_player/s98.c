@@ -8,180 +8,334 @@
 #include "error.h"
 #include "play.h"
 #include "chiptype.h"
+#include "vgm.h"
+#include "vgm_convert.h"
+#include "cache_index.h"
+#include "route.h"
+#include "spfm_stream.h"
 
-#define S98_SYNC_NTSC 1
-#define S98_SYNC_PAL 2
+extern volatile int g_vgm_loop_count;
+extern volatile cache_mode_t g_cache_mode;
+extern int g_cache_compiled;
 
-static bool s98_play_loop(S98* s98, int timer_mode, const char *filename);
-static uint32_t s98_get_val(S98* s98);
+static bool s98_play_loop(S98* s98, const char *filename);
+static int s98_step(void* ctx);
 
-bool s98_load(S98* s98, FILE* fp) {
-    if (!fp) {
-        return false;
-    }
-
-    fseek(fp, 0, SEEK_END);
-    s98->size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-
-    s98->buffer = (uint8_t*)malloc(s98->size);
-    if (!s98->buffer) {
-        fclose(fp);
-        return false;
-    }
-
-    if (fread(s98->buffer, 1, s98->size, fp) != s98->size) {
-        free(s98->buffer);
-        s98->buffer = NULL;
-        return false;
-    }
-
-    return true;
+bool s98_play(S98* s98, const char *filename) {
+    s98->pos = s98->offset_to_dump;
+    return s98_play_loop(s98, filename);
 }
 
-bool s98_parse_header(S98* s98) {
-    if (s98->size < 0x20 || memcmp(s98->buffer, "S98", 3) != 0) {
-        return false;
-    }
-    s98->version = s98->buffer[3];
-    s98->timer_info = read_le32(s98->buffer + 4);
-    s98->timer_info2 = read_le32(s98->buffer + 8);
-    s98->compressing = read_le32(s98->buffer + 12);
-    s98->offset_to_dump = read_le32(s98->buffer + 16);
-    s98->offset_to_loop = read_le32(s98->buffer + 20);
-    s98->device_count = read_le32(s98->buffer + 24); // S98v3 only
+// Player state behind the shared sample clock (play_clock_run)
+typedef struct {
+    S98* s98;
+    uint32_t next_sync; // Index entry of the next sync command
+    int loop_counter;   // Passes started, as for VGM
+    route_t routes[S98_COMMAND_COUNT];
+} s98_player_t;
 
-    s98->pos = s98->offset_to_dump;
-    return true;
-}
+static bool s98_play_loop(S98* s98, const char *filename) {
+    extern volatile int g_play_mode;
 
-bool s98_play(S98* s98, const char *filename) {
-    if (!s98_parse_header(s98)) {
-        logging(LOG_LEVEL_ERROR, "S98 header parse error.\n");
-        return false;
-    }
-    int timer_mode = S98_SYNC_NTSC;
-    if (s98->timer_info != 0 && s98->timer_info2 != 0) {
-        if (s98->timer_info2 == 198) { // A common PAL value
-            timer_mode = S98_SYNC_PAL;
-        }
-    }
-    return s98_play_loop(s98, timer_mode, filename);
-}
+    update_ui(s98_total_samples(s98), filename, false, g_play_mode, AY_STEREO_ABC, CACHE_MODE_NORMAL);
 
-void s98_release(S98* s98) {
-    if (s98 && s98->buffer) {
-        free(s98->buffer);
-        s98->buffer = NULL;
+    s98_player_t player = { s98, 0, 1, {{0}} };
+    // Writes for a chip that is not installed are dropped rather than sent to another slot
+    for (int cmd = 0; cmd < S98_COMMAND_COUNT; cmd++) {
+        const s98_command_t* command = &s98->commands[cmd];
+        player.routes[cmd] = command->chip != CHIP_TYPE_NONE ? route_to_chip(command->chip, command->port) : route_drop();
     }
+    g_is_playing = true;
+    // Same clock as VGM: syncs become sample deadlines, and the writes of every sync
+    // that falls due within one timer tick are sent together
+    return play_clock_run(s98_step, &player);
 }
 
-static bool s98_play_loop(S98* s98, int timer_mode, const char *filename) {
-    uint32_t sync_count = 0;
-    uint32_t sync_wait = (timer_mode == S98_SYNC_PAL) ? 20000 : 10000;
-    extern volatile bool g_is_paused, g_next_track_flag, g_prev_track_flag, g_quit_flag;
-    extern volatile int g_play_mode;
-    extern volatile double g_speed_multiplier;
-
-    // S98 doesn't have a total time in the header, so we pass 0.
-    update_ui(0, filename, false, g_play_mode, AY_STEREO_ABC, CACHE_MODE_NORMAL);
+// Sends the writes up to the next sync and returns its wait in samples
+static int s98_step(void* ctx) {
+    s98_player_t* player = (s98_player_t*)ctx;
+    S98* s98 = player->s98;
 
-    while (g_is_playing && s98->pos < s98->size && !g_next_track_flag && !g_prev_track_flag && !g_stop_current_song && !g_quit_flag) {
-        while (g_is_paused && !g_next_track_flag && !g_prev_track_flag && g_is_playing && !g_stop_current_song && !g_quit_flag) {
-            yasp_usleep(100000); // Sleep 100ms
+    while (g_is_playing) {
+        if (s98->pos >= s98->size) {
+            g_is_playing = false;
+            break;
+        }
+        uint8_t cmd = s98_read_byte(s98);
+        if (cmd < S98_COMMAND_COUNT) {
+            const s98_command_t* command = &s98->commands[cmd];
+            uint8_t addr = command->length == 2 ? s98_read_byte(s98) : 0;
+            uint8_t data = command->length >= 1 ? s98_read_byte(s98) : 0;
+            const route_t* route = &player->routes[cmd];
+            route->write(route, addr, data);
+            continue;
         }
-
-        uint8_t cmd = s98->buffer[s98->pos++];
         switch (cmd) {
-            case 0x00: // YM2151 (OPM)
-            case 0x01: // YM2203 (OPN)
-            case 0x02: // YM2612 (OPN2)
-            case 0x03: // YM2608 (OPNA)
-            case 0x04: // YM2413 (OPLL)
-            case 0x05: // YM3812 (OPL2)
-            case 0x06: // YM3526 (OPL)
-            case 0x07: // Y8950 (MSX-AUDIO)
-            case 0x08: // YMF262 (OPL3)
-            {
-                uint8_t addr = s98->buffer[s98->pos++];
-                uint8_t data = s98->buffer[s98->pos++];
-                // This is a simplified mapping. A more robust player would use the S98v3 device info block.
-                if (cmd == 0x00) spfm_write_reg(get_slot_for_chip(CHIP_TYPE_YM2151), 0, addr, data);
-                else if (cmd == 0x01) spfm_write_reg(get_slot_for_chip(CHIP_TYPE_YM2203), 0, addr, data);
-                else if (cmd == 0x02) spfm_write_reg(get_slot_for_chip(CHIP_TYPE_YM2612), (addr & 0x100) ? 1 : 0, addr & 0xff, data);
-                else if (cmd == 0x03) spfm_write_reg(get_slot_for_chip(CHIP_TYPE_YM2608), (addr & 0x100) ? 1 : 0, addr & 0xff, data);
-                else if (cmd == 0x04) spfm_write_reg(get_slot_for_chip(CHIP_TYPE_YM2413), 0, addr, data);
-                else if (cmd == 0x05) spfm_write_reg(get_slot_for_chip(CHIP_TYPE_YM3812), 0, addr, data);
-                else if (cmd == 0x06) spfm_write_reg(get_slot_for_chip(CHIP_TYPE_YM3526), 0, addr, data);
-                else if (cmd == 0x07) spfm_write_reg(get_slot_for_chip(CHIP_TYPE_Y8950), 0, addr, data);
-                else if (cmd == 0x08) spfm_write_reg(get_slot_for_chip(CHIP_TYPE_YMF262), (addr & 0x100) ? 1 : 0, addr & 0xff, data);
-                break;
-            }
-            case 0x10: // AY-3-8910 (PSG)
-            {
-                uint8_t addr = s98->buffer[s98->pos++];
-                uint8_t data = s98->buffer[s98->pos++];
-                spfm_write_reg(get_slot_for_chip(CHIP_TYPE_AY8910), 0, addr, data);
-                break;
-            }
-            case 0x11: // SN76489 (DCSG)
-            {
-                uint8_t data = s98->buffer[s98->pos++];
-                spfm_write_data(get_slot_for_chip(CHIP_TYPE_SN76489), data);
-                break;
-            }
             case 0xFF: // sync
-                spfm_flush();
-                sync_count = s98_get_val(s98) + 1;
-                // Use 64-bit integers for calculation to prevent overflow
-                spfm_wait_and_write_reg((uint32_t)(((uint64_t)sync_count * sync_wait * 44100) / (1000000 * g_speed_multiplier)), 0, 0, 0, 0);
-                break;
-            case 0xFE: // sync (variable)
-                spfm_flush();
-                sync_count = s98_get_val(s98); // Value is the number of milliseconds
-                if (sync_count > 0) {
-                    // Wait for 'sync_count' milliseconds
-                    spfm_wait_and_write_reg((uint32_t)(((uint64_t)sync_count * 1000 * 44100) / (1000000 * g_speed_multiplier)), 0, 0, 0, 0);
+            case 0xFE: // sync (n + 2)
+            {
+                if (player->next_sync >= s98->sync_count) { // Not reachable from the dump start
+                    g_is_playing = false;
+                    return 0;
                 }
-                break;
-            case 0xFD: // loop
-                if (s98->offset_to_loop != 0) {
+                // The wait comes from the index, the sync itself is not decoded again
+                const s98_sync_t* sync = &s98->syncs[player->next_sync];
+                uint64_t start = player->next_sync > 0 ? s98->syncs[player->next_sync - 1].time_us : 0;
+                s98->pos = sync->pos;
+                player->next_sync++;
+                return (int)(s98_time_to_samples(sync->time_us) - s98_time_to_samples(start));
+            }
+            case 0xFD: // loop, or end if there is no loop point or the loops are played
+                if (s98->offset_to_loop != 0 && (player->loop_counter < g_vgm_loop_count || g_vgm_loop_count == 0)) {
+                    player->loop_counter++;
                     s98->pos = s98->offset_to_loop;
+                    player->next_sync = s98_sync_after(s98, s98->offset_to_loop);
+                    // A loop without a sync in it would never give the clock a wait
+                    if (player->next_sync >= s98->sync_count) g_is_playing = false;
+                } else {
+                    g_is_playing = false;
                 }
                 break;
             case 0xFC: // end
                 g_is_playing = false; // End of song
                 break;
             default:
-                // Unsupported chip, but we continue parsing for syncs
-                if (cmd >= 0x10 && cmd <= 0x1F) { // PSG
-                    s98->pos += 1;
-                } else if (cmd >= 0x80) { // Other devices often have 2 params
-                    s98->pos += 2;
-                }
+                // Reserved command, skip its arguments
+                s98->pos += s98_write_length(s98, cmd);
                 break;
         }
     }
-    spfm_flush();
-    g_is_playing = false; // Signal that playback for this file is complete
-    return true;
+    return 0;
 }
 
-static uint32_t s98_get_val(S98* s98) {
-    uint32_t val = 0;
-    int shift = 0;
-    uint8_t b;
+// --- Conversion ---
+// Songs for a chip that is not installed are written out as VGM and played through
+// vgm_play(), which converts them for the YM2151 and caches the result like any VGM.
+// With compiled device streams on, songs played directly take the same way, so their
+// device bytes are recorded and replayed by vgm_play().
+
+#define S98_VGM_HEADER_SIZE 0x100
+#define S98_VGM_BUF_SIZE (64 * 1024)
+
+chip_type_t s98_primary_chip(const S98* s98) {
+    static const chip_type_t order[] = {
+        CHIP_TYPE_YM2608, CHIP_TYPE_YM2612, CHIP_TYPE_YM2203, CHIP_TYPE_YM2151,
+        CHIP_TYPE_AY8910, CHIP_TYPE_SN76489, CHIP_TYPE_YM2413, CHIP_TYPE_YM3812,
+        CHIP_TYPE_YM3526, CHIP_TYPE_Y8950, CHIP_TYPE_YMF262,
+    };
+    for (size_t i = 0; i < sizeof(order) / sizeof(order[0]); i++) {
+        if (s98->chips & (1u << order[i])) return order[i];
+    }
+    return CHIP_TYPE_NONE;
+}
+
+bool s98_needs_conversion(const S98* s98) {
+    chip_type_t chip = s98_primary_chip(s98);
+    return vgm_chip_converts_to_opm(chip)
+        && get_slot_for_chip(chip) == 0xFF
+        && get_slot_for_chip(CHIP_TYPE_YM2151) != 0xFF;
+}
+
+bool s98_plays_as_vgm(const S98* s98) {
+    return s98_needs_conversion(s98) || (g_cache_compiled && spfm_get_device_count() > 0);
+}
+
+// VGM command and header clock field of each chip and port an S98 dump can write to
+static bool s98_vgm_chip(chip_type_t chip, uint8_t port, uint8_t* vgm_cmd, uint32_t* clock_field) {
+    if (port != 0) {
+        // Only these chips have a second port, on the next VGM command
+        if (chip != CHIP_TYPE_YM2612 && chip != CHIP_TYPE_YM2608 && chip != CHIP_TYPE_YMF262) return false;
+        if (!s98_vgm_chip(chip, 0, vgm_cmd, clock_field)) return false;
+        (*vgm_cmd)++;
+        return true;
+    }
+    switch (chip) {
+        case CHIP_TYPE_SN76489: *vgm_cmd = 0x50; *clock_field = 0x0C; return true;
+        case CHIP_TYPE_YM2413:  *vgm_cmd = 0x51; *clock_field = 0x10; return true;
+        case CHIP_TYPE_YM2612:  *vgm_cmd = 0x52; *clock_field = 0x2C; return true;
+        case CHIP_TYPE_YM2151:  *vgm_cmd = 0x54; *clock_field = 0x30; return true;
+        case CHIP_TYPE_YM2203:  *vgm_cmd = 0x55; *clock_field = 0x44; return true;
+        case CHIP_TYPE_YM2608:  *vgm_cmd = 0x56; *clock_field = 0x48; return true;
+        case CHIP_TYPE_YM3812:  *vgm_cmd = 0x5A; *clock_field = 0x50; return true;
+        case CHIP_TYPE_YM3526:  *vgm_cmd = 0x5B; *clock_field = 0x54; return true;
+        case CHIP_TYPE_Y8950:   *vgm_cmd = 0x5C; *clock_field = 0x58; return true;
+        case CHIP_TYPE_YMF262:  *vgm_cmd = 0x5E; *clock_field = 0x5C; return true;
+        case CHIP_TYPE_AY8910:  *vgm_cmd = 0xA0; *clock_field = 0x74; return true;
+        default: return false;
+    }
+}
+
+typedef struct {
+    FILE* fp;
+    uint8_t* buf;
+    size_t len;
+    uint32_t written;   // Bytes in the file so far, buffered ones included
+    bool ok;
+} s98_vgm_writer_t;
+
+static void write_le32(uint8_t* data, uint32_t value) {
+    data[0] = value & 0xFF;
+    data[1] = (value >> 8) & 0xFF;
+    data[2] = (value >> 16) & 0xFF;
+    data[3] = (value >> 24) & 0xFF;
+}
+
+static void s98_vgm_put(s98_vgm_writer_t* w, const uint8_t* bytes, size_t size) {
+    if (w->len + size > S98_VGM_BUF_SIZE) {
+        w->ok = w->ok && fwrite(w->buf, 1, w->len, w->fp) == w->len;
+        w->len = 0;
+    }
+    memcpy(w->buf + w->len, bytes, size);
+    w->len += size;
+    w->written += (uint32_t)size;
+}
+
+static void s98_vgm_wait(s98_vgm_writer_t* w, uint64_t samples) {
+    while (samples > 0) {
+        uint32_t n = samples > 0xFFFF ? 0xFFFF : (uint32_t)samples;
+        uint8_t cmd[3] = {0x61, n & 0xFF, n >> 8};
+        s98_vgm_put(w, cmd, 3);
+        samples -= n;
+    }
+}
+
+// Fills in the VGM header of a file of size bytes with its loop at loop_offset, 0 for none
+static void s98_vgm_header(const S98* s98, uint8_t* header, uint32_t size, uint32_t loop_offset) {
+    uint32_t total_samples = s98_total_samples(s98);
+    memcpy(header, "Vgm ", 4);
+    write_le32(header + 0x04, size - 4);
+    write_le32(header + 0x08, 0x151);
+    write_le32(header + 0x18, total_samples);
+    if (loop_offset != 0) {
+        write_le32(header + 0x1C, loop_offset - 0x1C);
+        write_le32(header + 0x20, total_samples - (uint32_t)s98_time_to_samples(s98->loop_us));
+    }
+    write_le32(header + 0x34, S98_VGM_HEADER_SIZE - 0x34);
+    for (int chip = 0; chip < CHIP_TYPE_COUNT; chip++) {
+        uint8_t vgm_cmd;
+        uint32_t clock_field;
+        if ((s98->chips & (1u << chip)) && s98_vgm_chip((chip_type_t)chip, 0, &vgm_cmd, &clock_field)) {
+            uint32_t clock = s98->clocks[chip] ? s98->clocks[chip] : get_chip_default_clock((chip_type_t)chip);
+            write_le32(header + clock_field, clock);
+        }
+    }
+}
+
+bool s98_write_vgm(S98* s98, FILE* out) {
+    s98_vgm_writer_t w = { out, malloc(S98_VGM_BUF_SIZE), 0, 0, true };
+    if (!w.buf) return false;
+
+    uint8_t header[S98_VGM_HEADER_SIZE] = {0};
+    s98_vgm_put(&w, header, sizeof(header)); // Filled in at the end
+
+    uint32_t loop_offset = 0;
+    uint32_t next_sync = 0;
+    uint32_t pos = s98->offset_to_dump;
+    s98->pos = pos;
+    // Walks the dump like s98_step, up to the end command
     while (s98->pos < s98->size) {
-        b = s98->buffer[s98->pos++];
-        val |= (uint32_t)(b & 0x7F) << shift;
-        if (!(b & 0x80)) {
-            return val;
+        if (s98->offset_to_loop != 0 && loop_offset == 0 && s98->pos >= s98->offset_to_loop) {
+            loop_offset = w.written;
+        }
+        uint8_t cmd = s98_read_byte(s98);
+        if (cmd == 0xFF || cmd == 0xFE) {
+            if (next_sync >= s98->sync_count) break;
+            const s98_sync_t* sync = &s98->syncs[next_sync];
+            uint64_t start = next_sync > 0 ? s98->syncs[next_sync - 1].time_us : 0;
+            s98_vgm_wait(&w, s98_time_to_samples(sync->time_us) - s98_time_to_samples(start));
+            s98->pos = sync->pos;
+            next_sync++;
+            continue;
         }
-        shift += 7;
-        // Prevent infinite loops and overflows on malformed data
-        if (shift >= 32) {
-            return val;
+        if (cmd == 0xFD || cmd == 0xFC) break;
+
+        uint32_t len = s98_write_length(s98, cmd);
+        const s98_command_t* command = cmd < S98_COMMAND_COUNT ? &s98->commands[cmd] : NULL;
+        uint8_t vgm_cmd;
+        uint32_t clock_field;
+        if (!command || !s98_vgm_chip(command->chip, command->port, &vgm_cmd, &clock_field)) {
+            s98->pos += len;
+            continue;
         }
+        uint8_t addr = len == 2 ? s98_read_byte(s98) : 0;
+        uint8_t data = s98_read_byte(s98);
+        if (command->chip == CHIP_TYPE_SN76489) {
+            uint8_t bytes[2] = {vgm_cmd, data};
+            s98_vgm_put(&w, bytes, 2);
+        } else {
+            uint8_t bytes[3] = {vgm_cmd, addr, data};
+            s98_vgm_put(&w, bytes, 3);
+        }
+    }
+    uint8_t end = 0x66;
+    s98_vgm_put(&w, &end, 1);
+    s98->pos = s98->offset_to_dump;
+    w.ok = w.ok && fwrite(w.buf, 1, w.len, w.fp) == w.len;
+    free(w.buf);
+
+    s98_vgm_header(s98, header, w.written, loop_offset);
+    return w.ok && fseek(out, 0, SEEK_SET) == 0 && fwrite(header, 1, sizeof(header), out) == sizeof(header)
+        && fflush(out) == 0 && fseek(out, 0, SEEK_SET) == 0;
+}
+
+// True if vgm_play() will find the song in the cache, as a conversion or as a compiled
+// device stream. The conversion only counts if the song is converted. With only a header
+// to go on, a cache file that turns out to be missing makes vgm_play() stop at "no command
+// data" instead of caching an empty song.
+static bool s98_cached(const S98* s98, const char* filename, const char* cache_filename, bool force_reconvert) {
+    if (g_cache_mode != CACHE_MODE_NORMAL || force_reconvert) return false;
+    if (s98_needs_conversion(s98) && cache_index_lookup(cache_filename, filename, VGM_CONVERTER_VERSION)) return true;
+    if (!g_cache_compiled || spfm_get_device_count() == 0) return false;
+    char compiled_name[MAX_PATH_LEN];
+    char compiled_filename[MAX_PATH_LEN];
+    spfm_stream_cache_name(filename, spfm_stream_key(), compiled_name, sizeof(compiled_name));
+    cache_index_path(compiled_name, compiled_filename, sizeof(compiled_filename));
+    return cache_index_lookup(compiled_filename, filename, VGM_CONVERTER_VERSION);
+}
+
+bool s98_play_converted(S98* s98, const char* filename, const char* cache_filename, bool force_reconvert) {
+    // The VGM version of the song is only needed while it plays. It is written next to the
+    // cache as a .tmp file, which the cache index leaves out, and vgm_play() takes it over
+    // like any VGM file.
+    const char* base_name = strrchr(filename, '/');
+    const char* base_name2 = strrchr(filename, '\\');
+    if (base_name2 > base_name) base_name = base_name2;
+    base_name = base_name ? base_name + 1 : filename;
+    char vgm_name[MAX_PATH_LEN];
+    char vgm_path[MAX_PATH_LEN];
+    snprintf(vgm_name, sizeof(vgm_name), "%s.s98.tmp", base_name);
+    cache_index_path(vgm_name, vgm_path, sizeof(vgm_path));
+
+    FILE* vgm_fp = fopen(vgm_path, "w+b");
+    if (!vgm_fp) {
+        logging(LOG_LEVEL_ERROR, "Failed to create %s", vgm_path);
+        return false;
+    }
+    // When vgm_play() will play from the conversion cache or a compiled stream, it only
+    // reads the header of the song, so the dump is not written out again
+    bool ok;
+    if (s98_cached(s98, filename, cache_filename, force_reconvert)) {
+        uint8_t header[S98_VGM_HEADER_SIZE] = {0};
+        s98_vgm_header(s98, header, sizeof(header), 0);
+        ok = fwrite(header, 1, sizeof(header), vgm_fp) == sizeof(header) && fflush(vgm_fp) == 0 && fseek(vgm_fp, 0, SEEK_SET) == 0;
+    } else {
+        ok = s98_write_vgm(s98, vgm_fp);
     }
-    return val; // Reached end of file unexpectedly
+    if (!ok) {
+        logging(LOG_LEVEL_ERROR, "Failed to write the VGM version of %s", filename);
+        fclose(vgm_fp);
+        remove(vgm_path);
+        return false;
+    }
+    if (s98_needs_conversion(s98)) {
+        logging(LOG_LEVEL_INFO, "Playing %s as VGM, converted from %s to YM2151", filename, chip_type_to_string(s98_primary_chip(s98)));
+    } else {
+        logging(LOG_LEVEL_INFO, "Playing %s as VGM, for its compiled device stream", filename);
+    }
+
+    // vgm_play() closes the file it was given, or returns the one left for the caller to close
+    FILE* final_fp = vgm_play(vgm_fp, filename, cache_filename, force_reconvert);
+    if (final_fp) fclose(final_fp);
+    remove(vgm_path);
+    return true;
 }
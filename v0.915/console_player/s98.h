@@ -1,25 +1,84 @@
 #ifndef S98_H
 #define S98_H
 
+#include <stdio.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include "file_window.h"
+#include "chiptype.h"
 
+// One sync command of the dump: where the writes after it start, and the play time
+// at that point. Built by s98_load in one pass, so playback never decodes a sync
+// itself and the duration shown in the UI is exactly what playback waits.
 typedef struct {
-    uint8_t* buffer;
+    uint32_t pos;           // File offset right after the sync command
+    uint64_t time_us;       // Play time once its wait is over, at normal speed
+} s98_sync_t;
+
+// Commands 0x00-0x7F write to a device. In S98v3 a device has two commands, one per
+// port, in the order of the device info block. Older files use fixed commands per chip.
+#define S98_COMMAND_COUNT 0x80
+#define S98_MAX_DEVICES (S98_COMMAND_COUNT / 2)
+
+typedef struct {
+    chip_type_t chip;       // CHIP_TYPE_NONE: no device this player knows, its writes are skipped
+    uint8_t port;
+    uint8_t length;         // Argument bytes: 2 for addr and data, 1 for data only
+} s98_command_t;
+
+typedef struct {
+    file_window_t window;   // The file is read through a window, never loaded whole
     uint32_t size;
     uint32_t pos;
     uint8_t version;
     uint32_t timer_info;
     uint32_t timer_info2;
     uint32_t compressing;
+    uint32_t offset_to_tag;
     uint32_t offset_to_dump;
     uint32_t offset_to_loop;
     uint32_t device_count;
+    s98_command_t commands[S98_COMMAND_COUNT];
+    uint32_t clocks[CHIP_TYPE_COUNT]; // Clock of each chip from the device info, 0 if not given
+
+    // Sync index
+    s98_sync_t* syncs;
+    uint32_t sync_count;
+    uint32_t sync_us;       // Length of one sync, from the timer fields of the header
+    uint64_t total_us;      // Play time up to the end command
+    uint64_t loop_us;       // Play time at the loop point, valid if offset_to_loop is set
+    uint32_t chips;         // Bit (1 << chip_type_t) for every chip the dump writes to
 } S98;
 
+// Parses the header and indexes the syncs. fp must stay open until s98_release.
 bool s98_load(S98* s98, FILE *fp);
 bool s98_parse_header(S98* s98);
+// Play time of one pass through the song, in 44.1 kHz samples.
+uint32_t s98_total_samples(const S98* s98);
+// Byte at a file offset, 0 past the end.
+uint8_t s98_byte_at(S98* s98, uint32_t pos);
+// Byte at the read position, which moves past it.
+uint8_t s98_read_byte(S98* s98);
+// Argument bytes of a command that is not a sync, loop or end.
+uint32_t s98_write_length(const S98* s98, uint8_t cmd);
+// Index of the first sync after file offset pos.
+uint32_t s98_sync_after(const S98* s98, uint32_t pos);
+// Sample position of a point in play time. Waits are differences of these, so rounding never adds up.
+uint64_t s98_time_to_samples(uint64_t time_us);
 bool s98_play(S98* s98, const char *filename);
+
+// The chip the song is built around, picked like vgm_get_primary_chip.
+chip_type_t s98_primary_chip(const S98* s98);
+// True if the song's chip is not installed but can be converted for the installed YM2151.
+bool s98_needs_conversion(const S98* s98);
+// Writes the song as a VGM file, so it can go through the VGM converters and cache.
+bool s98_write_vgm(S98* s98, FILE* out);
+// True if the song is played through vgm_play(): it needs conversion, or compiled device
+// streams are on, so its device bytes are recorded and replayed like a VGM's.
+bool s98_plays_as_vgm(const S98* s98);
+// Plays the song through vgm_play(), converted to YM2151 and cached in cache_filename if
+// it needs conversion.
+bool s98_play_converted(S98* s98, const char* filename, const char* cache_filename, bool force_reconvert);
 void s98_release(S98* s98);
 
 #endif /* S98_H */
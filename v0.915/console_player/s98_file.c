@@ -0,0 +1,274 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "s98.h"
+#include "util.h"
+#include "error.h"
+
+// Loading and indexing of S98 files. Nothing here touches the hardware, so the bench
+// links it too.
+
+// Sync length when the header leaves it at 0: 10/1000 s
+#define S98_DEFAULT_TIMER_INFO 10
+#define S98_DEFAULT_TIMER_INFO2 1000
+#define S98_INITIAL_SYNC_CAPACITY 1024
+// S98v3 device info: u32 type, u32 clock, u32 pan, u32 reserved per device
+#define S98_DEVICE_INFO_OFFSET 0x20
+#define S98_DEVICE_INFO_SIZE 16
+
+static uint32_t s98_get_val(S98* s98);
+static bool s98_build_index(S98* s98);
+static bool s98_parse_devices(S98* s98);
+
+bool s98_load(S98* s98, FILE* fp) {
+    if (!fp) {
+        return false;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    s98->size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    // Only a small window of the file is kept in memory; the rest is read as playback reaches it
+    if (!file_window_open(&s98->window, fp, 0, s98->size, FILE_WINDOW_DEFAULT_SIZE)) {
+        return false;
+    }
+    if (!s98_parse_header(s98) || !s98_build_index(s98)) {
+        s98_release(s98);
+        return false;
+    }
+    return true;
+}
+
+uint8_t s98_byte_at(S98* s98, uint32_t pos) {
+    const uint8_t* p = file_window_get(&s98->window, pos, 1);
+    return p ? *p : 0;
+}
+
+uint8_t s98_read_byte(S98* s98) {
+    return s98_byte_at(s98, s98->pos++);
+}
+
+bool s98_parse_header(S98* s98) {
+    const uint8_t* header = file_window_get(&s98->window, 0, 0x20);
+    if (!header || memcmp(header, "S98", 3) != 0) {
+        return false;
+    }
+    s98->version = header[3];
+    s98->timer_info = read_le32(header + 4);
+    s98->timer_info2 = read_le32(header + 8);
+    s98->compressing = read_le32(header + 12);
+    s98->offset_to_tag = read_le32(header + 16);
+    s98->offset_to_dump = read_le32(header + 20);
+    s98->offset_to_loop = read_le32(header + 24);
+    s98->device_count = read_le32(header + 28); // S98v3 only
+
+    // A sync lasts timer_info / timer_info2 seconds. Version 1 has no timer_info2.
+    uint32_t num = s98->timer_info ? s98->timer_info : S98_DEFAULT_TIMER_INFO;
+    uint32_t den = (s98->version >= '2' && s98->timer_info2) ? s98->timer_info2 : S98_DEFAULT_TIMER_INFO2;
+    s98->sync_us = (uint32_t)((uint64_t)num * 1000000 / den);
+    if (s98->sync_us == 0) s98->sync_us = 1;
+
+    if (!s98_parse_devices(s98)) {
+        return false;
+    }
+    s98->pos = s98->offset_to_dump;
+    return true;
+}
+
+// Chip of an S98v3 device type
+static chip_type_t s98_device_chip(uint32_t type) {
+    switch (type) {
+        case 1:  return CHIP_TYPE_AY8910;  // YM2149, register compatible
+        case 2:  return CHIP_TYPE_YM2203;
+        case 3:  return CHIP_TYPE_YM2612;
+        case 4:  return CHIP_TYPE_YM2608;
+        case 5:  return CHIP_TYPE_YM2151;
+        case 6:  return CHIP_TYPE_YM2413;
+        case 7:  return CHIP_TYPE_YM3526;
+        case 8:  return CHIP_TYPE_YM3812;
+        case 9:  return CHIP_TYPE_YMF262;
+        case 15: return CHIP_TYPE_AY8910;
+        case 16: return CHIP_TYPE_SN76489;
+        default: return CHIP_TYPE_NONE;
+    }
+}
+
+static void s98_set_command(S98* s98, uint8_t cmd, chip_type_t chip, uint8_t port, uint8_t length) {
+    s98->commands[cmd].chip = chip;
+    s98->commands[cmd].port = port;
+    s98->commands[cmd].length = length;
+}
+
+// Fills in which chip and port every write command goes to
+static bool s98_parse_devices(S98* s98) {
+    memset(s98->commands, 0, sizeof(s98->commands));
+    memset(s98->clocks, 0, sizeof(s98->clocks));
+
+    if (s98->version < '3') {
+        // No device info: the fixed commands this player has always used
+        static const chip_type_t fixed[] = {
+            CHIP_TYPE_YM2151, CHIP_TYPE_YM2203, CHIP_TYPE_YM2612, CHIP_TYPE_YM2608, CHIP_TYPE_YM2413,
+            CHIP_TYPE_YM3812, CHIP_TYPE_YM3526, CHIP_TYPE_Y8950, CHIP_TYPE_YMF262,
+        };
+        for (uint8_t cmd = 0; cmd < sizeof(fixed) / sizeof(fixed[0]); cmd++) {
+            s98_set_command(s98, cmd, fixed[cmd], 0, 2);
+        }
+        s98_set_command(s98, 0x10, CHIP_TYPE_AY8910, 0, 2);
+        s98_set_command(s98, 0x11, CHIP_TYPE_SN76489, 0, 1);
+        for (uint8_t cmd = 0x12; cmd <= 0x1F; cmd++) {
+            s98_set_command(s98, cmd, CHIP_TYPE_NONE, 0, 1);
+        }
+        return true;
+    }
+
+    // A v3 file without device info has a single YM2608
+    if (s98->device_count == 0) {
+        for (uint8_t cmd = 0; cmd < S98_COMMAND_COUNT; cmd++) {
+            s98_set_command(s98, cmd, CHIP_TYPE_NONE, 0, 2);
+        }
+        s98_set_command(s98, 0x00, CHIP_TYPE_YM2608, 0, 2);
+        s98_set_command(s98, 0x01, CHIP_TYPE_YM2608, 1, 2);
+        return true;
+    }
+    if (s98->device_count > S98_MAX_DEVICES) {
+        logging(LOG_LEVEL_ERROR, "S98 file lists %u devices, at most %d are possible.", s98->device_count, S98_MAX_DEVICES);
+        return false;
+    }
+    const uint8_t* info = file_window_get(&s98->window, S98_DEVICE_INFO_OFFSET, s98->device_count * S98_DEVICE_INFO_SIZE);
+    if (!info) {
+        return false;
+    }
+    // Every command of a v3 file has an address and a data byte, devices this player does not know included
+    for (uint8_t cmd = 0; cmd < S98_COMMAND_COUNT; cmd++) {
+        s98_set_command(s98, cmd, CHIP_TYPE_NONE, 0, 2);
+    }
+    uint32_t seen = 0;
+    for (uint32_t i = 0; i < s98->device_count; i++) {
+        const uint8_t* device = info + i * S98_DEVICE_INFO_SIZE;
+        uint32_t type = read_le32(device);
+        chip_type_t chip = s98_device_chip(type);
+        if (chip == CHIP_TYPE_NONE) {
+            logging(LOG_LEVEL_WARN, "S98 device %u has unsupported type %u, its writes are skipped.", i, type);
+            continue;
+        }
+        // There is one slot per chip type, so a second device of the same type has nowhere to go
+        if (seen & (1u << chip)) {
+            logging(LOG_LEVEL_WARN, "S98 device %u is a second %s, its writes are skipped.", i, chip_type_to_string(chip));
+            continue;
+        }
+        seen |= 1u << chip;
+        s98->clocks[chip] = read_le32(device + 4);
+        s98_set_command(s98, (uint8_t)(i * 2), chip, 0, 2);
+        s98_set_command(s98, (uint8_t)(i * 2 + 1), chip, 1, 2);
+    }
+    return true;
+}
+
+// Argument bytes of a command that is not a sync, loop or end
+uint32_t s98_write_length(const S98* s98, uint8_t cmd) {
+    if (cmd < S98_COMMAND_COUNT) return s98->commands[cmd].length;
+    return 2;
+}
+
+// Walks the dump once, up to the end command, and records every sync
+static bool s98_build_index(S98* s98) {
+    uint32_t capacity = S98_INITIAL_SYNC_CAPACITY;
+    uint64_t time_us = 0;
+
+    // The dump starts after the header, and a loop point outside the dump is no loop
+    if (s98->offset_to_dump < 0x20 || s98->offset_to_dump >= s98->size) {
+        logging(LOG_LEVEL_ERROR, "S98 dump offset 0x%X is outside the file.", s98->offset_to_dump);
+        return false;
+    }
+    if (s98->offset_to_loop != 0 && (s98->offset_to_loop < s98->offset_to_dump || s98->offset_to_loop >= s98->size)) {
+        logging(LOG_LEVEL_WARN, "S98 loop offset 0x%X is outside the dump, the song plays once.", s98->offset_to_loop);
+        s98->offset_to_loop = 0;
+    }
+
+    s98->syncs = malloc(sizeof(s98_sync_t) * capacity);
+    if (!s98->syncs) return false;
+    s98->sync_count = 0;
+
+    s98->pos = s98->offset_to_dump;
+    while (s98->pos < s98->size) {
+        uint8_t cmd = s98_read_byte(s98);
+        if (cmd == 0xFF || cmd == 0xFE) {
+            // 0xFF: one sync, 0xFE n: n + 2 syncs
+            uint32_t count = (cmd == 0xFF) ? 1 : s98_get_val(s98) + 2;
+            time_us += (uint64_t)count * s98->sync_us;
+            if (s98->sync_count == capacity) {
+                s98_sync_t* syncs = realloc(s98->syncs, sizeof(s98_sync_t) * capacity * 2);
+                if (!syncs) return false;
+                s98->syncs = syncs;
+                capacity *= 2;
+            }
+            s98->syncs[s98->sync_count].pos = s98->pos;
+            s98->syncs[s98->sync_count].time_us = time_us;
+            s98->sync_count++;
+        } else if (cmd == 0xFD || cmd == 0xFC) {
+            break;
+        } else {
+            chip_type_t chip = cmd < S98_COMMAND_COUNT ? s98->commands[cmd].chip : CHIP_TYPE_NONE;
+            if (chip != CHIP_TYPE_NONE) s98->chips |= 1u << chip;
+            s98->pos += s98_write_length(s98, cmd);
+        }
+    }
+    s98->total_us = time_us;
+    s98->pos = s98->offset_to_dump;
+
+    if (s98->offset_to_loop != 0) {
+        uint32_t first = s98_sync_after(s98, s98->offset_to_loop);
+        s98->loop_us = first > 0 ? s98->syncs[first - 1].time_us : 0;
+    }
+    logging(LOG_LEVEL_DEBUG, "S98 index: %u syncs, %u ms", s98->sync_count, (unsigned)(s98->total_us / 1000));
+    return true;
+}
+
+// Index of the first sync after file offset pos
+uint32_t s98_sync_after(const S98* s98, uint32_t pos) {
+    uint32_t lo = 0, hi = s98->sync_count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (s98->syncs[mid].pos <= pos) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Sample position of a point in play time. Waits are differences of these, so rounding never adds up.
+uint64_t s98_time_to_samples(uint64_t time_us) {
+    return time_us * 44100 / 1000000;
+}
+
+uint32_t s98_total_samples(const S98* s98) {
+    return (uint32_t)s98_time_to_samples(s98->total_us);
+}
+
+void s98_release(S98* s98) {
+    if (s98) {
+        file_window_close(&s98->window);
+        free(s98->syncs);
+        s98->syncs = NULL;
+        s98->sync_count = 0;
+    }
+}
+
+static uint32_t s98_get_val(S98* s98) {
+    uint32_t val = 0;
+    int shift = 0;
+    uint8_t b;
+    while (s98->pos < s98->size) {
+        b = s98_read_byte(s98);
+        val |= (uint32_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            return val;
+        }
+        shift += 7;
+        // Prevent infinite loops and overflows on malformed data
+        if (shift >= 32) {
+            return val;
+        }
+    }
+    return val; // Reached end of file unexpectedly
+}
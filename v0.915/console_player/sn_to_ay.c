@@ -3,14 +3,8 @@
 #include <math.h>
 
 // --- Internal State (based on sn76489-to-ay8910-converter.ts) ---
-static uint16_t _freq[4];
-static uint8_t _ch;      // channel number latched
-static uint8_t _type;    // register type latched (0 for freq, 1 for att)
-static uint8_t _atts[4]; // channel attenuations
-static int _mixChannel = 2;
-static bool _periodic;
-static uint8_t _noiseFreq;
-static ay_write_func_t _write_func;
+static YASP_THREAD_LOCAL sn_to_ay_state_t _st = {.mixChannel = 2};
+static YASP_THREAD_LOCAL reg_batch_t* _out;
 
 // --- Constants ---
 static const int voltbl[] = {15, 14, 14, 13, 12, 12, 11, 10, 10, 9, 8, 8, 7, 6, 6, 0};
@@ -19,15 +13,15 @@ static const int _noisePitchMap[] = {7, 15, 31};
 // --- Helper Functions ---
 // This function will write to the *next* converter in the chain (ay_to_opm)
 static void _y(uint8_t addr, uint8_t data) {
-    if (_write_func) {
-        _write_func(addr, data);
+    if (_out) {
+        REG_BATCH_ADD(_out, REG_BATCH_CMD_AY, addr, data);
     }
 }
 
 static void _updateSharedChannel() {
-    int noiseChannel = _mixChannel;
-    bool enableTone = _atts[noiseChannel] != 0xf;
-    bool enableNoise = _atts[3] != 0xf;
+    int noiseChannel = _st.mixChannel;
+    bool enableTone = _st.atts[noiseChannel] != 0xf;
+    bool enableNoise = _st.atts[3] != 0xf;
     int att;
 
     // Simple mix resolver: if both are enabled, noise wins.
@@ -36,11 +30,11 @@ static void _updateSharedChannel() {
     }
 
     if (enableTone) {
-        att = _atts[noiseChannel];
+        att = _st.atts[noiseChannel];
     } else if (enableNoise) {
-        att = _atts[3];
+        att = _st.atts[3];
     } else {
-        att = _atts[noiseChannel];
+        att = _st.atts[noiseChannel];
     }
 
     const uint8_t toneMask = enableTone ? 0 : (1 << noiseChannel);
@@ -50,21 +44,21 @@ static void _updateSharedChannel() {
 }
 
 static void _updateAttenuation(int ch, int rawAtt) {
-    _atts[ch] = rawAtt & 0xF;
-    if (_mixChannel >= 0 && (ch == _mixChannel || ch == 3)) {
+    _st.atts[ch] = rawAtt & 0xF;
+    if (_st.mixChannel >= 0 && (ch == _st.mixChannel || ch == 3)) {
         _updateSharedChannel();
     } else if (ch < 3) {
-        _y(8 + ch, voltbl[_atts[ch]]);
+        _y(8 + ch, voltbl[_st.atts[ch]]);
     }
 }
 
 static void _updateNoise(uint8_t data) {
-    _periodic = (data & 4) ? false : true;
-    _noiseFreq = data & 3;
+    _st.periodic = (data & 4) ? false : true;
+    _st.noiseFreq = data & 3;
     _updateSharedChannel();
 
     if ((data & 3) == 3) {
-        _y(6, _freq[2] & 31);
+        _y(6, _st.freq[2] & 31);
     } else {
         _y(6, _noisePitchMap[data & 3]);
     }
@@ -72,24 +66,23 @@ static void _updateNoise(uint8_t data) {
 
 static void _updateFreq(int ch) {
     if (ch < 3) {
-        uint16_t freq = _freq[ch];
+        uint16_t freq = _st.freq[ch];
         _y(ch * 2, freq & 0xff);
         _y(ch * 2 + 1, (freq >> 8) & 0x0f);
     }
 }
 
 // --- Public API ---
-void sn_to_ay_init(chip_type_t source_chip_type, uint32_t source_clock, ay_write_func_t write_func) {
+void sn_to_ay_init(chip_type_t source_chip_type, uint32_t source_clock, reg_batch_t* out) {
     (void)source_chip_type; // Unused
     (void)source_clock;   // Unused
-    _write_func = write_func;
+    _out = out;
 
-    memset(_freq, 0, sizeof(_freq));
-    _ch = 0;
-    _type = 0;
-    for(int i=0; i<4; i++) _atts[i] = 0xf;
-    _periodic = false;
-    _noiseFreq = 0;
+    memset(&_st, 0, sizeof(_st));
+    _st.mixChannel = 2;
+    for(int i=0; i<4; i++) _st.atts[i] = 0xf;
+    _st.periodic = false;
+    _st.noiseFreq = 0;
 
     // Initial AY8910 state
     _y(7, 0x38); // Disable I/O, enable Tone channels 0,1,2, disable noise
@@ -97,23 +90,32 @@ void sn_to_ay_init(chip_type_t source_chip_type, uint32_t source_clock, ay_write
 
 void sn_to_ay_write_reg(uint8_t data) {
     if (data & 0x80) {
-        _ch = (data >> 5) & 3;
-        _type = (data >> 4) & 1;
-        if (_type) { // Attenuation
-            _updateAttenuation(_ch, data & 0xf);
+        _st.ch = (data >> 5) & 3;
+        _st.type = (data >> 4) & 1;
+        if (_st.type) { // Attenuation
+            _updateAttenuation(_st.ch, data & 0xf);
         } else { // Frequency (lower 4 bits)
-            if (_ch < 3) {
-                _freq[_ch] = (_freq[_ch] & 0x3f0) | (data & 0xf);
+            if (_st.ch < 3) {
+                _st.freq[_st.ch] = (_st.freq[_st.ch] & 0x3f0) | (data & 0xf);
             } else {
                 _updateNoise(data);
             }
-            _updateFreq(_ch);
+            _updateFreq(_st.ch);
         }
     } else { // Data byte (upper 6 bits of frequency)
-        if (_type == 0 && _ch < 3) {
-            _freq[_ch] = ((data & 0x3f) << 4) | (_freq[_ch] & 0xf);
-            _updateFreq(_ch);
+        if (_st.type == 0 && _st.ch < 3) {
+            _st.freq[_st.ch] = ((data & 0x3f) << 4) | (_st.freq[_st.ch] & 0xf);
+            _updateFreq(_st.ch);
         }
         // Data bytes for attenuation are ignored, as per SN76489 behavior
     }
 }
+
+void sn_to_ay_save(sn_to_ay_state_t* state) {
+    memcpy(state, &_st, sizeof(_st));
+}
+
+void sn_to_ay_restore(const sn_to_ay_state_t* state, reg_batch_t* out) {
+    memcpy(&_st, state, sizeof(_st));
+    _out = out;
+}
@@ -2,12 +2,27 @@
 #define SN_TO_AY_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "chiptype.h"
+#include "reg_batch.h"
+#include "thread.h"
 
-// Callback function pointer for writing AY8910 data
-typedef void (*ay_write_func_t)(uint8_t addr, uint8_t data);
+// Converter state. Each thread has its own, so tracks can be converted on several threads at once.
+typedef struct {
+    uint16_t freq[4];
+    uint8_t ch;      // channel number latched
+    uint8_t type;    // register type latched (0 for freq, 1 for att)
+    uint8_t atts[4]; // channel attenuations
+    int mixChannel;
+    bool periodic;
+    uint8_t noiseFreq;
+} sn_to_ay_state_t;
 
-void sn_to_ay_init(chip_type_t source_chip_type, uint32_t source_clock, ay_write_func_t write_func);
+// Converted AY8910 writes are appended to out, for ay_to_opm_write_batch to consume.
+void sn_to_ay_init(chip_type_t source_chip_type, uint32_t source_clock, reg_batch_t* out);
 void sn_to_ay_write_reg(uint8_t data);
+// Copies the state of this thread's converter, or replaces it and sets where its writes go.
+void sn_to_ay_save(sn_to_ay_state_t* state);
+void sn_to_ay_restore(const sn_to_ay_state_t* state, reg_batch_t* out);
 
 #endif /* SN_TO_AY_H */
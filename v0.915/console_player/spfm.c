@@ -3,45 +3,280 @@
 #include "util.h"
 #include "ftd2xx.h"
 #include "chiptype.h"
-#include "ym2151.h"
-#include "ym2612.h"
-#include "ym2203.h"
-#include "ym2413.h"
-#include "sn76489.h"
-#include "ay8910.h"
-#include "y8950.h"
-#include "ym3526.h"
-#include "ym3812.h"
-#include "ymf262.h"
-#include "ym2608.h"
+#include "chip_driver.h"
+#include "ym2608_upload.h"
+#include "spfm_stream.h"
+#include "thread.h"
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 
-static FT_HANDLE ftHandle = NULL;
-static SPFM_TYPE spfm_type = SPFM_TYPE_UNKNOWN;
-static int g_selected_dev_idx = -1;
+// --- Bus timing ---
+// The device gets its bytes at the baud rate and writes each register as its command
+// arrives, so the bytes queued between two writes to a chip give it time to get ready.
+// Where they are not enough, waits go in between. The times each chip needs are in
+// its driver entry (chip_driver.h).
+#define SPFM_BAUD_RATE 1500000
+#define SPFM_BYTE_NS (10ull * 1000000000ull / SPFM_BAUD_RATE) // 8N1
+#define SPFM_WAIT_NS (1000000000ull / 44100)                 // One SPFM_Light wait (0x80)
+// Longer than any chip needs. A chip whose last write was played out this long ago is ready.
+#define SPFM_READY_MARGIN_US 100
 
-static uint8_t spfm_write_buf[SPFM_WRITE_BUF_SIZE];
-static DWORD spfm_write_buf_ptr = 0;
+// Device type handshake
+#define SPFM_IDENTIFY_TRIES 3
+#define SPFM_IDENTIFY_TIMEOUT_MS 50
 
-static bool spfm_identify();
+// Reconnect after a failed transfer: tries every interval until the timeout, then once
+// per retry period on later flushes
+#define SPFM_RECONNECT_TIMEOUT_MS 3000
+#define SPFM_RECONNECT_INTERVAL_MS 50
+#define SPFM_RECONNECT_RETRY_MS 1000
+
+// Flushes remembered for the transmit queue estimate (spfm_get_queued_us)
+#define SPFM_QUEUE_MARKS 64
+
+// Last value written to each register of one slot, decoded from the bytes sent to the
+// device, so the chip can be brought back after the device is opened again
+typedef struct {
+    uint8_t regs[2][256];
+    uint8_t written[2][32];   // One bit per register
+    uint8_t latch[8][2];      // Data-only chips (SN76489): latch byte of each register and the byte after it
+    uint8_t latch_size[8];
+    int8_t last_latch;        // Register of the last latch byte, -1 if none
+} spfm_shadow_t;
+
+typedef struct {
+    const chip_driver_t* driver; // NULL: no chip, no timing
+    uint64_t cycle_ns_q16;       // Length of one chip cycle, 16.16 fixed point
+    uint64_t written_ns;         // Device time of its last write
+    uint64_t ready_ns;           // Device time from which it takes the next write
+} spfm_slot_timing_t;
+
+// Where one flush ended: bytes handed to the USB driver since the device was opened, and
+// the device time they take
+typedef struct {
+    uint64_t bytes;
+    uint64_t time_ns;
+} spfm_queue_mark_t;
+
+// One open SPFM unit
+typedef struct {
+    FT_HANDLE handle;
+    SPFM_TYPE type;
+    int index;                  // FTDI device index
+    int slots;                  // SPFM_SLOTS or SPFM_LIGHT_SLOTS
+    uint8_t buf[SPFM_WRITE_BUF_SIZE];
+    DWORD ptr;
+    // Writer thread, only started when more than one device is open
+    yasp_thread_t thread;
+    bool thread_running;
+    bool pending;               // buf is handed to the writer
+    bool ok;                    // Result of the last write
+    // Bus timing. Device time is the wire time of everything queued since it was opened.
+    uint64_t time_ns;
+    uint64_t flushed_ns;        // Device time at the last flush
+    uint64_t drain_us;          // Host time when the device has played every flushed byte
+    uint64_t sent_bytes;        // Bytes flushed since it was opened
+    spfm_queue_mark_t marks[SPFM_QUEUE_MARKS]; // Last flushes, a ring
+    uint32_t mark_count;        // Flushes marked, the newest at mark_count - 1
+    spfm_slot_timing_t timing[SPFM_SLOTS];
+    uint8_t pad_slot;           // Empty slot the SPFM writes to in place of a wait, 0xFF if none
+    char serial[16];
+    spfm_transport_t transport;
+    // Register shadow, and the command being decoded into it
+    spfm_shadow_t shadow[SPFM_SLOTS];
+    uint8_t cmd[4];
+    uint8_t cmd_size;
+    bool lost;                  // A transfer failed and the device is not open again yet
+    uint64_t lost_us;           // Host time of the failure
+    uint64_t retry_us;          // Host time of the next reconnect try after giving up
+    // Virtual device in place of the FTDI handle (spfm_virtual.h), NULL for hardware
+    spfm_virtual_t* virt;
+    FILE* trace;
+} spfm_device_t;
+
+// Transport settings kept for each device serial number
+typedef struct {
+    char serial[16];
+    spfm_transport_t transport;
+} spfm_transport_profile_t;
+
+static spfm_transport_profile_t spfm_transport_profiles[SPFM_TRANSPORT_PROFILES];
+static int spfm_transport_profile_count = 0;
+
+static spfm_device_t spfm_devices[SPFM_MAX_DEVICES];
+static int spfm_device_count = 0;
+static bool spfm_writers_quit = false;
+static yasp_mutex_t spfm_writer_lock;
+static yasp_cond_t spfm_writer_cond;
+
+static spfm_telemetry_t spfm_telemetry;
+static bool spfm_reconnecting = false;
+
+static spfm_stream_t* spfm_capture_stream = NULL;
+static spfm_blob_t* spfm_record_blob = NULL;
+// Bus timing of every device from before a recording, put back when it ends
+static uint64_t spfm_record_time_ns[SPFM_MAX_DEVICES];
+static spfm_slot_timing_t spfm_record_timing[SPFM_MAX_DEVICES][SPFM_SLOTS];
+
+static bool spfm_identify(FT_HANDLE handle, SPFM_TYPE* type);
+static bool spfm_device_write(spfm_device_t* dev);
+
+// Device a slot is on, NULL if there is no such device or slot
+static spfm_device_t* spfm_slot_device(uint8_t slot) {
+    int device = SPFM_SLOT_DEVICE(slot);
+    if (device >= spfm_device_count || SPFM_SLOT_INDEX(slot) >= spfm_devices[device].slots) return NULL;
+    return &spfm_devices[device];
+}
+
+static void spfm_blob_append(spfm_blob_t* blob, const uint8_t* bytes, size_t size) {
+    if (blob->failed) return;
+    if (blob->size + size > blob->capacity) {
+        size_t capacity = blob->capacity ? blob->capacity * 2 : 1024;
+        while (capacity < blob->size + size) capacity *= 2;
+        uint8_t* data = realloc(blob->data, capacity);
+        if (!data) {
+            blob->failed = true;
+            return;
+        }
+        blob->data = data;
+        blob->capacity = capacity;
+    }
+    memcpy(blob->data + blob->size, bytes, size);
+    blob->size += size;
+}
+
+static void spfm_shadow_data(spfm_shadow_t* shadow, uint8_t data) {
+    if (data & 0x80) {
+        int reg = (data >> 4) & 7;
+        shadow->latch[reg][0] = data;
+        shadow->latch_size[reg] = 1;
+        shadow->last_latch = (int8_t)reg;
+    } else if (shadow->last_latch >= 0) {
+        shadow->latch[shadow->last_latch][1] = data;
+        shadow->latch_size[shadow->last_latch] = 2;
+    }
+}
+
+// Decodes the commands in bytes queued for a device into its register shadow
+static void spfm_shadow_feed(spfm_device_t* dev, const uint8_t* bytes, size_t size) {
+    bool light = dev->type == SPFM_TYPE_SPFM_LIGHT;
+    for (size_t i = 0; i < size; i++) {
+        if (light && dev->cmd_size == 0 && bytes[i] == 0x80) continue; // Wait
+        dev->cmd[dev->cmd_size++] = bytes[i];
+        // SPFM_Light: slot, port << 1, address, data, or slot, 0x20, data. SPFM: slot << 4 | port, address, data.
+        size_t need = light ? (dev->cmd_size >= 2 && dev->cmd[1] == 0x20 ? 3 : 4) : 3;
+        if (dev->cmd_size < need) continue;
+        dev->cmd_size = 0;
+
+        uint8_t slot, port, addr, data;
+        if (light) {
+            slot = dev->cmd[0] & 1;
+            if (dev->cmd[1] == 0x20) {
+                spfm_shadow_data(&dev->shadow[slot], dev->cmd[2]);
+                continue;
+            }
+            port = (dev->cmd[1] >> 1) & 7;
+            addr = dev->cmd[2];
+            data = dev->cmd[3];
+        } else {
+            slot = (dev->cmd[0] >> 4) & 7;
+            port = dev->cmd[0] & 3;
+            addr = dev->cmd[1];
+            data = dev->cmd[2];
+        }
+        spfm_shadow_t* shadow = &dev->shadow[slot];
+        if (dev->timing[slot].driver && dev->timing[slot].driver->data_only) {
+            // The SPFM has no data-only command, the data goes in a write to address 0
+            spfm_shadow_data(shadow, data);
+        } else if (port < 2) {
+            shadow->regs[port][addr] = data;
+            shadow->written[port][addr >> 3] |= (uint8_t)(1 << (addr & 7));
+        }
+    }
+}
+
+// Queues bytes for a device, and records them if a capture is running
+static void spfm_buf_append(spfm_device_t* dev, const uint8_t* bytes, size_t size) {
+    dev->time_ns += size * SPFM_BYTE_NS;
+    if (spfm_record_blob) {
+        spfm_blob_append(spfm_record_blob, bytes, size);
+        return;
+    }
+    if (dev->ptr + size > SPFM_WRITE_BUF_SIZE) {
+        spfm_flush();
+    }
+    memcpy(dev->buf + dev->ptr, bytes, size);
+    dev->ptr += size;
+    spfm_shadow_feed(dev, bytes, size);
+    if (spfm_capture_stream) spfm_stream_data(spfm_capture_stream, (uint8_t)(dev - spfm_devices), bytes, size);
+}
+
+// Queues count SPFM_Light single-sample hardware waits (0x80)
+static void spfm_buf_append_waits(spfm_device_t* dev, uint32_t count) {
+    uint8_t waits[64];
+    memset(waits, 0x80, sizeof(waits));
+    while (count > 0) {
+        uint32_t n = count < sizeof(waits) ? count : (uint32_t)sizeof(waits);
+        spfm_buf_append(dev, waits, n);
+        dev->time_ns += n * SPFM_WAIT_NS;
+        count -= n;
+    }
+}
+
+// Queues what the chip in slot still needs before a write whose address reaches it lead_ns
+// into the command: SPFM_Light waits, or on the SPFM, which has no wait command, writes to
+// an empty slot. With every slot taken, the write goes out in a transfer of its own.
+static void spfm_wait_for_chip(spfm_device_t* dev, spfm_slot_timing_t* t, uint64_t lead_ns) {
+    if (!t->driver || dev->time_ns + lead_ns >= t->ready_ns) return;
+    // Its last write went out in an earlier transfer that the device has long played
+    if (!spfm_record_blob && t->written_ns <= dev->flushed_ns
+        && get_current_time_us() >= dev->drain_us + SPFM_READY_MARGIN_US) {
+        t->ready_ns = dev->time_ns;
+        return;
+    }
+    uint64_t missing = t->ready_ns - dev->time_ns - lead_ns;
+    if (dev->type == SPFM_TYPE_SPFM_LIGHT) {
+        // Each wait is one byte and one sample
+        uint64_t step = SPFM_BYTE_NS + SPFM_WAIT_NS;
+        spfm_buf_append_waits(dev, (uint32_t)((missing + step - 1) / step));
+    } else if (dev->pad_slot != 0xFF) {
+        uint8_t pad[3] = { (uint8_t)(dev->pad_slot << 4), 0, 0 };
+        for (uint64_t n = (missing + sizeof(pad) * SPFM_BYTE_NS - 1) / (sizeof(pad) * SPFM_BYTE_NS); n > 0; n--) {
+            spfm_buf_append(dev, pad, sizeof(pad));
+        }
+    } else if (!spfm_record_blob) {
+        spfm_flush();
+        t->ready_ns = dev->time_ns;
+    }
+}
+
+// Notes a write to the chip in slot, which is busy for the cycles its register needs
+static void spfm_chip_written(spfm_device_t* dev, spfm_slot_timing_t* t, uint16_t cycles) {
+    if (!t->driver) return;
+    t->written_ns = dev->time_ns;
+    t->ready_ns = dev->time_ns + ((cycles * t->cycle_ns_q16) >> 16);
+}
+
+static spfm_slot_timing_t* spfm_slot_timing(spfm_device_t* dev, uint8_t slot) {
+    return &dev->timing[SPFM_SLOT_INDEX(slot)];
+}
 
 // New function to handle waiting and writing
 void spfm_wait_and_write_reg(uint32_t wait_samples, uint8_t slot, uint8_t port, uint8_t addr, uint8_t data) {
-    // Threshold for using hardware waits (in samples).
-    // Based on analysis, hardware waits are precise for very short durations.
-    const uint32_t HW_WAIT_THRESHOLD = 10;
-
     if (wait_samples > 0) {
         // SPFM_Light supports precise, low-CPU hardware waits for single samples (0x80 command).
-        // This is ideal for very short delays.
-        if (spfm_type == SPFM_TYPE_SPFM_LIGHT && wait_samples < HW_WAIT_THRESHOLD) {
-            if (spfm_write_buf_ptr + wait_samples > SPFM_WRITE_BUF_SIZE) {
-                spfm_flush();
-            }
-            for (uint32_t i = 0; i < wait_samples; i++) {
-                spfm_write_buf[spfm_write_buf_ptr++] = 0x80;
-            }
+        // This is ideal for very short delays. Up to which length depends on the host and the
+        // device (spfm_transport_t); with several devices the lowest threshold counts.
+        // Every device waits, so chips on different units stay in step.
+        bool all_light = true;
+        uint32_t hw_wait_threshold = UINT32_MAX;
+        for (int i = 0; i < spfm_device_count; i++) {
+            all_light = all_light && spfm_devices[i].type == SPFM_TYPE_SPFM_LIGHT;
+            if (spfm_devices[i].transport.hw_wait_threshold < hw_wait_threshold) hw_wait_threshold = spfm_devices[i].transport.hw_wait_threshold;
+        }
+        if (all_light && wait_samples < hw_wait_threshold) {
+            for (int i = 0; i < spfm_device_count; i++) spfm_buf_append_waits(&spfm_devices[i], wait_samples);
         } else {
             // For longer delays or other devices, use the high-resolution software timer.
             // This keeps CPU usage low while maintaining good accuracy.
@@ -61,60 +296,166 @@ void spfm_wait_and_write_reg(uint32_t wait_samples, uint8_t slot, uint8_t port,
 }
 
 
-bool spfm_flush(void) {
+// Sends what is queued for one device
+static bool spfm_device_write(spfm_device_t* dev) {
     DWORD total_written = 0;
     DWORD bytes_to_write = 0;
     DWORD bytes_written_this_chunk = 0;
     FT_STATUS ftStatus;
 
-    if (!ftHandle || spfm_write_buf_ptr == 0) {
-        return true;
+    // The shadow has what these bytes would have written, and a reconnect puts it back
+    if (dev->lost) {
+        dev->ptr = 0;
+        return false;
+    }
+    if (dev->virt) {
+        uint64_t now_ns = get_current_time_us() * 1000;
+        bool ok = spfm_virtual_write(dev->virt, now_ns, dev->buf, dev->ptr);
+        spfm_virtual_run(dev->virt, now_ns);
+        dev->ptr = 0;
+        return ok;
     }
 
-    while (total_written < spfm_write_buf_ptr) {
-        bytes_to_write = spfm_write_buf_ptr - total_written;
-        if (bytes_to_write > 4096) {
-            bytes_to_write = 4096;
+    while (total_written < dev->ptr) {
+        bytes_to_write = dev->ptr - total_written;
+        if (bytes_to_write > dev->transport.chunk_size) {
+            bytes_to_write = dev->transport.chunk_size;
         }
 
-        ftStatus = FT_Write(ftHandle, spfm_write_buf + total_written, bytes_to_write, &bytes_written_this_chunk);
+        ftStatus = FT_Write(dev->handle, dev->buf + total_written, bytes_to_write, &bytes_written_this_chunk);
 
         if (ftStatus != FT_OK) {
             logging(LOG_LEVEL_ERROR, "FT_Write failed in spfm_flush. FT_Status=%d\n", (int)ftStatus);
-            spfm_write_buf_ptr = 0; // Clear buffer on error
+            dev->ptr = 0; // Clear buffer on error
+            dev->lost = true;
             return false;
         }
 
         if (bytes_written_this_chunk != bytes_to_write) {
             logging(LOG_LEVEL_ERROR, "SPFM flush failed. Wrote %lu of %lu bytes in a chunk.\n", bytes_written_this_chunk, bytes_to_write);
-            spfm_write_buf_ptr = 0;
+            dev->ptr = 0;
+            dev->lost = true;
             return false;
         }
 
         total_written += bytes_written_this_chunk;
     }
 
-    spfm_write_buf_ptr = 0;
+    dev->ptr = 0;
     return true;
 }
 
+// Each device has a writer while several are open, so their transfers of one flush
+// go out side by side instead of one after the other.
+static void spfm_writer_thread(void* arg) {
+    spfm_device_t* dev = (spfm_device_t*)arg;
+    yasp_mutex_lock(&spfm_writer_lock);
+    while (!spfm_writers_quit) {
+        if (!dev->pending) {
+            yasp_cond_wait(&spfm_writer_cond, &spfm_writer_lock, 100);
+            continue;
+        }
+        yasp_mutex_unlock(&spfm_writer_lock);
+        bool ok = spfm_device_write(dev);
+        yasp_mutex_lock(&spfm_writer_lock);
+        dev->ok = ok;
+        dev->pending = false;
+        yasp_cond_broadcast(&spfm_writer_cond);
+    }
+    yasp_mutex_unlock(&spfm_writer_lock);
+}
 
-int spfm_init(int dev_idx) {
-    FT_STATUS ftStatus;
-    g_selected_dev_idx = dev_idx;
+static void spfm_stop_writers(void) {
+    yasp_mutex_lock(&spfm_writer_lock);
+    spfm_writers_quit = true;
+    yasp_cond_broadcast(&spfm_writer_cond);
+    yasp_mutex_unlock(&spfm_writer_lock);
+    for (int i = 0; i < spfm_device_count; i++) {
+        if (spfm_devices[i].thread_running) yasp_thread_join(&spfm_devices[i].thread);
+        spfm_devices[i].thread_running = false;
+    }
+    spfm_writers_quit = false;
+}
 
-    ftStatus = FT_Open(dev_idx, &ftHandle);
-    if (ftStatus != FT_OK) {
-        logging(LOG_LEVEL_ERROR, "FT_Open failed for device index %d, error code: %d\n", dev_idx, (int)ftStatus);
-        return -1;
+static bool spfm_start_writers(void) {
+    for (int i = 0; i < spfm_device_count; i++) {
+        spfm_device_t* dev = &spfm_devices[i];
+        if (dev->thread_running) continue;
+        dev->pending = false;
+        if (!yasp_thread_start(&dev->thread, spfm_writer_thread, dev)) {
+            logging(LOG_LEVEL_ERROR, "Could not start the writer for SPFM device %d.\n", i);
+            spfm_stop_writers();
+            return false;
+        }
+        dev->thread_running = true;
+    }
+    return true;
+}
+
+static bool spfm_recover(void);
+
+bool spfm_flush(void) {
+    if (spfm_device_count == 0 || spfm_record_blob) {
+        return true;
+    }
+    // The device plays the bytes after whatever it still has from earlier transfers
+    uint64_t now_us = get_current_time_us();
+    for (int i = 0; i < spfm_device_count; i++) {
+        spfm_device_t* dev = &spfm_devices[i];
+        if (dev->ptr == 0) continue;
+        dev->drain_us = (dev->drain_us > now_us ? dev->drain_us : now_us) + (dev->time_ns - dev->flushed_ns) / 1000;
+        dev->flushed_ns = dev->time_ns;
+        dev->sent_bytes += dev->ptr;
+        spfm_queue_mark_t* mark = &dev->marks[dev->mark_count++ % SPFM_QUEUE_MARKS];
+        mark->bytes = dev->sent_bytes;
+        mark->time_ns = dev->time_ns;
+    }
+    if (spfm_device_count == 1) {
+        bool ok = (spfm_devices[0].ptr == 0 && !spfm_devices[0].lost) || spfm_device_write(&spfm_devices[0]);
+        return ok || spfm_recover();
     }
 
-    // Configure and try to identify
-    FT_SetBaudRate(ftHandle, 1500000);
+    // Hand every buffer to its writer at once, then wait for all of them
+    bool ok = true;
+    yasp_mutex_lock(&spfm_writer_lock);
+    for (int i = 0; i < spfm_device_count; i++) {
+        if (spfm_devices[i].ptr > 0) spfm_devices[i].pending = true;
+    }
+    yasp_cond_broadcast(&spfm_writer_cond);
+    for (int i = 0; i < spfm_device_count; i++) {
+        while (spfm_devices[i].pending) yasp_cond_wait(&spfm_writer_cond, &spfm_writer_lock, 100);
+        ok = ok && spfm_devices[i].ok && !spfm_devices[i].lost;
+        spfm_devices[i].ok = true;
+    }
+    yasp_mutex_unlock(&spfm_writer_lock);
+    return ok || spfm_recover();
+}
+
+
+// One device being opened by spfm_open_devices
+typedef struct {
+    int index;
+    SPFM_TYPE type;
+    FT_HANDLE handle;
+    FT_STATUS status;   // Of FT_Open
+    bool answered;      // It answered the handshake
+    yasp_thread_t thread;
+    bool threaded;
+} spfm_probe_t;
+
+// Opens and configures one device, and asks for its type if it is not known yet
+static void spfm_probe_thread(void* arg) {
+    spfm_probe_t* probe = (spfm_probe_t*)arg;
+    FT_HANDLE ftHandle = NULL;
+
+    probe->status = FT_Open(probe->index, &ftHandle);
+    if (probe->status != FT_OK) return;
+
+    FT_SetBaudRate(ftHandle, SPFM_BAUD_RATE);
     FT_SetDataCharacteristics(ftHandle, FT_BITS_8, FT_STOP_BITS_1, FT_PARITY_NONE);
     FT_SetFlowControl(ftHandle, FT_FLOW_NONE, 0, 0);
-    FT_SetTimeouts(ftHandle, 100, 100); // Increase timeout for identification
-    FT_SetLatencyTimer(ftHandle, 2);
+    spfm_transport_t transport = SPFM_TRANSPORT_DEFAULT;
+    FT_SetLatencyTimer(ftHandle, transport.latency_ms);
     FT_Purge(ftHandle, FT_PURGE_RX | FT_PURGE_TX);
     FT_SetDtr(ftHandle);
     FT_SetRts(ftHandle);
@@ -128,261 +469,642 @@ int spfm_init(int dev_idx) {
     FT_ClrRts(ftHandle);
     yasp_usleep(100);
 
-    // HACK: Bypass identification as per user feedback. Assume SPFM_Light.
-    // The spfm_identify() function seems to fail on this specific hardware setup,
-    // even though the device is correctly enumerated. By skipping this step,
-    // we avoid the handshake that causes the failure.
-    logging(LOG_LEVEL_WARN, "Bypassing SPFM identification. Assuming device is SPFM_Light.\n");
-    spfm_type = SPFM_TYPE_SPFM_LIGHT;
-    /*
-    if (!spfm_identify()) {
-        logging(LOG_ERROR, "Could not identify SPFM device at index %d.\n", dev_idx);
-        FT_Close(ftHandle);
-        ftHandle = NULL;
-        return -1;
+    if (probe->type == SPFM_TYPE_UNKNOWN) {
+        // The handshake tells the original SPFM from the SPFM Light, and so how many slots
+        // there are. Some units do not answer it; those are taken for an SPFM Light.
+        probe->answered = spfm_identify(ftHandle, &probe->type);
+        if (!probe->answered) probe->type = SPFM_TYPE_SPFM_LIGHT;
     }
-    */
 
     // Re-configure timeouts for playback. A slightly longer read timeout improves stability.
     FT_SetTimeouts(ftHandle, 100, 100);
     // Set a larger USB transfer buffer, similar to node-spfm, to improve bulk write performance.
     // 64KB is a common and safe maximum for D2XX.
-    FT_SetUSBParameters(ftHandle, 65536, 65536);
-    logging(LOG_LEVEL_INFO, "SPFM device at index %d initialized successfully. Type: %s\n", dev_idx, spfm_type == SPFM_TYPE_SPFM_LIGHT ? "SPFM_Light" : "SPFM");
-    
+    FT_SetUSBParameters(ftHandle, SPFM_TRANSPORT_MAX_CHUNK, SPFM_TRANSPORT_MAX_CHUNK);
+    probe->handle = ftHandle;
+}
+
+int spfm_open_devices(const int* dev_indices, SPFM_TYPE* types, int count) {
+    if (spfm_device_count + count > SPFM_MAX_DEVICES) {
+        logging(LOG_LEVEL_ERROR, "Only %d SPFM devices can be open at once.\n", SPFM_MAX_DEVICES);
+        return -1;
+    }
+
+    // Each device is opened on a thread of its own, so the handshakes run side by side
+    spfm_probe_t probes[SPFM_MAX_DEVICES];
+    memset(probes, 0, sizeof(probes));
+    for (int i = 0; i < count; i++) {
+        probes[i].index = dev_indices[i];
+        probes[i].type = types[i];
+        probes[i].threaded = count > 1 && yasp_thread_start(&probes[i].thread, spfm_probe_thread, &probes[i]);
+        if (!probes[i].threaded) spfm_probe_thread(&probes[i]);
+    }
+    bool ok = true;
+    for (int i = 0; i < count; i++) {
+        if (probes[i].threaded) yasp_thread_join(&probes[i].thread);
+        if (!probes[i].handle) {
+            logging(LOG_LEVEL_ERROR, "FT_Open failed for device index %d, error code: %d\n", probes[i].index, (int)probes[i].status);
+            ok = false;
+        } else if (types[i] == SPFM_TYPE_UNKNOWN && !probes[i].answered) {
+            logging(LOG_LEVEL_WARN, "SPFM device at index %d did not answer the handshake. Assuming SPFM_Light.\n", probes[i].index);
+        }
+    }
+    if (!ok) {
+        for (int i = 0; i < count; i++) {
+            if (probes[i].handle) FT_Close(probes[i].handle);
+        }
+        return -1;
+    }
+
+    // Everything queued so far goes out before a device joins, so buffers start aligned
+    spfm_flush();
+    if (spfm_device_count == 0) {
+        yasp_mutex_init(&spfm_writer_lock);
+        yasp_cond_init(&spfm_writer_cond);
+    }
+    for (int i = 0; i < count; i++) {
+        spfm_device_t* dev = &spfm_devices[spfm_device_count];
+        memset(dev, 0, sizeof(spfm_device_t));
+        dev->handle = probes[i].handle;
+        dev->type = probes[i].type;
+        dev->index = probes[i].index;
+        dev->slots = dev->type == SPFM_TYPE_SPFM ? SPFM_SLOTS : SPFM_LIGHT_SLOTS;
+        dev->pad_slot = 0xFF;
+        dev->ok = true;
+        for (int slot = 0; slot < SPFM_SLOTS; slot++) dev->shadow[slot].last_latch = -1;
+        if (FT_GetDeviceInfoDetail(dev->index, NULL, NULL, NULL, NULL, dev->serial, NULL, NULL) != FT_OK) dev->serial[0] = '\0';
+        // The latency timer was set to the default when it was opened
+        spfm_transport_t transport = SPFM_TRANSPORT_DEFAULT;
+        dev->transport = transport;
+        types[i] = dev->type;
+        spfm_device_count++;
+        for (int p = 0; p < spfm_transport_profile_count; p++) {
+            if (dev->serial[0] && strcmp(spfm_transport_profiles[p].serial, dev->serial) == 0
+                && spfm_set_transport(spfm_device_count - 1, &spfm_transport_profiles[p].transport)) {
+                logging(LOG_LEVEL_INFO, "SPFM device %s: chunk %u bytes, latency %d ms, hardware waits below %u samples\n", dev->serial,
+                        (unsigned)dev->transport.chunk_size, dev->transport.latency_ms, (unsigned)dev->transport.hw_wait_threshold);
+            }
+        }
+        logging(LOG_LEVEL_INFO, "SPFM device %d at index %d initialized successfully. Type: %s, %d slots\n", spfm_device_count - 1, dev->index,
+                dev->type == SPFM_TYPE_SPFM_LIGHT ? "SPFM_Light" : "SPFM", dev->slots);
+    }
+    if (spfm_device_count > 1 && !spfm_start_writers()) {
+        for (int i = 0; i < count; i++) {
+            spfm_device_count--;
+            FT_Close(spfm_devices[spfm_device_count].handle);
+        }
+        return -1;
+    }
     return 0;
 }
 
-void spfm_init_chips() {
-    // Initialize chips based on the global configuration
-    DWORD i;
-    for (i = 0; i < CHIP_TYPE_COUNT; i++) {
-        if (g_chip_config[i].type != CHIP_TYPE_NONE && g_chip_config[i].slot != 0xFF) {
-            logging(LOG_LEVEL_INFO, "Initializing chip type %d in slot %d\n", g_chip_config[i].type, g_chip_config[i].slot);
-            switch (g_chip_config[i].type) {
-                case CHIP_TYPE_YM2608:
-                    ym2608_init(g_chip_config[i].slot);
-                    break;
-                case CHIP_TYPE_YM2151:
-                    ym2151_init(g_chip_config[i].slot);
-                    break;
-                case CHIP_TYPE_YM2612:
-                    ym2612_init(g_chip_config[i].slot);
-                    break;
-                case CHIP_TYPE_YM2203:
-                    ym2203_init(g_chip_config[i].slot);
-                    break;
-                case CHIP_TYPE_YM2413:
-                    ym2413_init(g_chip_config[i].slot);
-                    break;
-                case CHIP_TYPE_SN76489:
-                    sn76489_init(g_chip_config[i].slot);
-                    break;
-                case CHIP_TYPE_AY8910:
-                    ay8910_init(g_chip_config[i].slot);
-                    break;
-                case CHIP_TYPE_Y8950:
-                    y8950_init(g_chip_config[i].slot);
-                    break;
-                case CHIP_TYPE_YM3526:
-                    ym3526_init(g_chip_config[i].slot);
-                    break;
-                case CHIP_TYPE_YM3812:
-                    ym3812_init(g_chip_config[i].slot);
-                    break;
-                case CHIP_TYPE_YMF262:
-                    ymf262_init(g_chip_config[i].slot);
-                    break;
-                default:
-                    // Do nothing for unhandled or NONE types
-                    break;
+// FTDI index of the device with serial, -1 if it is not connected
+static int spfm_find_serial(const char* serial) {
+    DWORD count;
+    if (FT_CreateDeviceInfoList(&count) != FT_OK) return -1;
+    for (DWORD i = 0; i < count; i++) {
+        char serial_number[16];
+        if (FT_GetDeviceInfoDetail(i, NULL, NULL, NULL, NULL, serial_number, NULL, NULL) == FT_OK && strcmp(serial_number, serial) == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+// Brings the chips of a device that was opened again back to where they were: each one
+// gets its init sequence, then the registers in its shadow are written again. The
+// per-track start is not run, the shadow already holds what it wrote.
+static void spfm_replay(int device) {
+    spfm_device_t* dev = &spfm_devices[device];
+    spfm_shadow_t* saved = malloc(sizeof(dev->shadow));
+    if (!saved) return;
+    memcpy(saved, dev->shadow, sizeof(dev->shadow));
+    for (int c = 0; c < g_chip_config_count; c++) {
+        const chip_config_t* chip = &g_chip_config[c];
+        const chip_driver_t* driver = chip_driver_get(chip->type);
+        if (!driver || SPFM_SLOT_DEVICE(chip->slot) != device) continue;
+        chip_driver_reset(chip->type, chip->slot);
+        const spfm_shadow_t* shadow = &saved[SPFM_SLOT_INDEX(chip->slot)];
+        if (driver->data_only) {
+            for (int reg = 0; reg < 8; reg++) {
+                for (int i = 0; i < shadow->latch_size[reg]; i++) spfm_write_data(chip->slot, shadow->latch[reg][i]);
+            }
+            continue;
+        }
+        for (uint8_t port = 0; port < driver->ports && port < 2; port++) {
+            for (uint16_t i = 0; i < driver->registers; i++) {
+                int addr = chip_driver_replay_addr(driver, port, i);
+                if (addr < 0 || !(shadow->written[port][addr >> 3] & (1 << (addr & 7)))) continue;
+                spfm_write_reg(chip->slot, port, (uint8_t)addr, shadow->regs[port][addr]);
             }
         }
     }
+    free(saved);
+}
+
+// Opens a lost device again, by serial number, and puts its chips back
+static bool spfm_reconnect(int device) {
+    spfm_device_t* dev = &spfm_devices[device];
+    if (dev->handle) {
+        FT_Close(dev->handle);
+        dev->handle = NULL;
+    }
+    spfm_probe_t probe;
+    memset(&probe, 0, sizeof(probe));
+    probe.index = dev->serial[0] ? spfm_find_serial(dev->serial) : dev->index;
+    probe.type = dev->type;
+    if (probe.index < 0) return false;
+    spfm_probe_thread(&probe);
+    if (!probe.handle) return false;
+
+    dev->handle = probe.handle;
+    dev->index = probe.index;
+    FT_SetLatencyTimer(dev->handle, dev->transport.latency_ms);
+    dev->ptr = 0;
+    dev->cmd_size = 0;
+    dev->lost = false;
+    // The device starts out with nothing left to play
+    dev->flushed_ns = dev->time_ns;
+    dev->drain_us = get_current_time_us();
+    dev->sent_bytes = 0;
+    dev->mark_count = 0;
+    for (int slot = 0; slot < SPFM_SLOTS; slot++) dev->timing[slot].ready_ns = 0;
+
+    spfm_replay(device);
+    return spfm_flush() && !dev->lost;
+}
+
+// Reconnects every device whose transfer failed. The first time, it keeps trying for a
+// while; after that, once per retry period, so a device that stays away does not hold
+// up every flush.
+static bool spfm_recover(void) {
+    if (spfm_reconnecting) return false;
+    spfm_reconnecting = true;
+    bool ok = true;
+    for (int i = 0; i < spfm_device_count; i++) {
+        spfm_device_t* dev = &spfm_devices[i];
+        if (!dev->lost) continue;
+        uint64_t now_us = get_current_time_us();
+        bool first = dev->lost_us == 0;
+        if (first) {
+            dev->lost_us = now_us;
+            spfm_telemetry.failures++;
+            logging(LOG_LEVEL_WARN, "SPFM device %d (SN: %s) stopped taking data, reconnecting.\n", i, dev->serial);
+            // The writes of the outage are missing from a recording in progress
+            if (spfm_capture_stream) spfm_capture_stream->failed = true;
+            // The ADPCM RAM may have been lost with the device
+            ym2608_upload_forget();
+        } else if (now_us < dev->retry_us) {
+            ok = false;
+            continue;
+        }
+
+        uint64_t deadline_us = now_us + (uint64_t)SPFM_RECONNECT_TIMEOUT_MS * 1000;
+        bool back = spfm_reconnect(i);
+        while (!back && first && get_current_time_us() < deadline_us) {
+            yasp_usleep(SPFM_RECONNECT_INTERVAL_MS * 1000);
+            back = spfm_reconnect(i);
+        }
+        if (!back) {
+            dev->lost = true;
+            dev->retry_us = get_current_time_us() + (uint64_t)SPFM_RECONNECT_RETRY_MS * 1000;
+            if (first) logging(LOG_LEVEL_ERROR, "SPFM device %d (SN: %s) could not be reopened, retrying every %d ms.\n", i, dev->serial, SPFM_RECONNECT_RETRY_MS);
+            ok = false;
+            continue;
+        }
+        uint64_t outage_us = get_current_time_us() - dev->lost_us;
+        dev->lost_us = 0;
+        spfm_telemetry.reconnects++;
+        spfm_telemetry.outage_us += outage_us;
+        spfm_telemetry.last_outage_us = outage_us;
+        logging(LOG_LEVEL_WARN, "SPFM device %d (SN: %s) reconnected, chip state restored after %u ms.\n", i, dev->serial, (unsigned)(outage_us / 1000));
+    }
+    spfm_reconnecting = false;
+    return ok;
+}
+
+void spfm_get_telemetry(spfm_telemetry_t* telemetry) {
+    *telemetry = spfm_telemetry;
+}
+
+// Plays what is left on a virtual device and reports what happened on it
+static void spfm_close_virtual(spfm_device_t* dev) {
+    spfm_virtual_finish(dev->virt);
+    spfm_virtual_stats_t stats;
+    spfm_virtual_get_stats(dev->virt, &stats);
+    logging(LOG_LEVEL_INFO, "Virtual SPFM device: %llu bytes, %llu writes, %llu waits, %llu resets, FIFO peak %u, "
+            "%llu underruns (%llu us starved), %llu bytes overrun\n", (unsigned long long)stats.bytes,
+            (unsigned long long)stats.writes, (unsigned long long)stats.waits, (unsigned long long)stats.resets, (unsigned)stats.fifo_peak,
+            (unsigned long long)stats.underruns, (unsigned long long)(stats.starved_ns / 1000), (unsigned long long)stats.overruns);
+    spfm_virtual_close(dev->virt);
+    dev->virt = NULL;
+    if (dev->trace) fclose(dev->trace);
+    dev->trace = NULL;
+}
+
+int spfm_open_virtual(SPFM_TYPE type, const char* trace_path) {
+    if (spfm_device_count == SPFM_MAX_DEVICES || type == SPFM_TYPE_UNKNOWN) return -1;
+    FILE* trace = NULL;
+    if (trace_path) {
+        trace = fopen(trace_path, "w");
+        if (!trace) {
+            logging(LOG_LEVEL_ERROR, "Could not open %s for the virtual device trace.\n", trace_path);
+            return -1;
+        }
+    }
+    spfm_virtual_t* virt = spfm_virtual_open(type == SPFM_TYPE_SPFM_LIGHT, SPFM_VIRTUAL_FIFO_DEPTH,
+                                             trace ? spfm_virtual_trace_file : NULL, trace);
+    if (!virt) {
+        if (trace) fclose(trace);
+        return -1;
+    }
 
     spfm_flush();
+    if (spfm_device_count == 0) {
+        yasp_mutex_init(&spfm_writer_lock);
+        yasp_cond_init(&spfm_writer_cond);
+    }
+    spfm_device_t* dev = &spfm_devices[spfm_device_count];
+    memset(dev, 0, sizeof(spfm_device_t));
+    spfm_transport_t transport = SPFM_TRANSPORT_DEFAULT;
+    dev->type = type;
+    dev->index = -1;
+    dev->slots = type == SPFM_TYPE_SPFM ? SPFM_SLOTS : SPFM_LIGHT_SLOTS;
+    dev->pad_slot = 0xFF;
+    dev->ok = true;
+    dev->transport = transport;
+    dev->virt = virt;
+    dev->trace = trace;
+    for (int slot = 0; slot < SPFM_SLOTS; slot++) dev->shadow[slot].last_latch = -1;
+    snprintf(dev->serial, sizeof(dev->serial), "VIRTUAL%d", spfm_device_count);
+    spfm_device_count++;
+    logging(LOG_LEVEL_INFO, "Virtual SPFM device %d opened. Type: %s, %d slots\n", spfm_device_count - 1,
+            type == SPFM_TYPE_SPFM_LIGHT ? "SPFM_Light" : "SPFM", dev->slots);
+    if (spfm_device_count > 1 && !spfm_start_writers()) {
+        spfm_device_count--;
+        spfm_close_virtual(dev);
+        return -1;
+    }
+    return 0;
 }
 
-static bool spfm_identify() {
-    DWORD bytesWritten, bytesRead;
+bool spfm_get_virtual_stats(int device, spfm_virtual_stats_t* stats) {
+    if (device >= spfm_device_count || !spfm_devices[device].virt) return false;
+    spfm_virtual_run(spfm_devices[device].virt, get_current_time_us() * 1000);
+    spfm_virtual_get_stats(spfm_devices[device].virt, stats);
+    return true;
+}
+
+int spfm_init(int dev_idx) {
+    SPFM_TYPE type = SPFM_TYPE_UNKNOWN;
+    return spfm_open_devices(&dev_idx, &type, 1);
+}
+
+// Sets up the bus timing of every installed chip
+static void spfm_init_timing(void) {
+    for (int i = 0; i < spfm_device_count; i++) {
+        memset(spfm_devices[i].timing, 0, sizeof(spfm_devices[i].timing));
+        spfm_devices[i].pad_slot = 0xFF;
+    }
+    for (int i = 0; i < g_chip_config_count; i++) {
+        const chip_config_t* chip = &g_chip_config[i];
+        spfm_device_t* dev = spfm_slot_device(chip->slot);
+        const chip_driver_t* driver = chip_driver_get(chip->type);
+        if (!dev || !driver || chip->clock == 0) continue;
+        spfm_slot_timing_t* t = spfm_slot_timing(dev, chip->slot);
+        t->driver = driver;
+        t->cycle_ns_q16 = (1000000000ull << 16) / chip->clock;
+        // The data byte follows the address byte on the wire, which has to cover the address time
+        if (((driver->addr_cycles * t->cycle_ns_q16) >> 16) > SPFM_BYTE_NS) {
+            logging(LOG_LEVEL_WARN, "%s in slot %d needs more time after the address than the device gives it.\n",
+                    chip_type_to_string(chip->type), chip->slot);
+        }
+    }
+    // The SPFM pads with writes to the last slot that has no chip
+    for (int i = 0; i < spfm_device_count; i++) {
+        spfm_device_t* dev = &spfm_devices[i];
+        for (int slot = dev->slots - 1; slot >= 0 && dev->pad_slot == 0xFF; slot--) {
+            bool used = false;
+            for (int c = 0; c < g_chip_config_count; c++) used = used || g_chip_config[c].slot == SPFM_SLOT(i, slot);
+            if (!used) dev->pad_slot = (uint8_t)slot;
+        }
+    }
+}
+
+void spfm_init_chips() {
+    spfm_init_timing();
+
+    // Initialize chips based on the global configuration
+    for (int i = 0; i < g_chip_config_count; i++) {
+        logging(LOG_LEVEL_INFO, "Initializing chip type %d in slot %d\n", g_chip_config[i].type, g_chip_config[i].slot);
+        chip_driver_init(g_chip_config[i].type, g_chip_config[i].slot);
+    }
+
+    spfm_flush();
+}
+
+// Asks the device for its type: to 0xFF the SPFM_Light answers "LT" and the SPFM "OK".
+// Every try purges both directions first, so a late answer to an earlier try, or bytes
+// left from a previous session, are not taken for the answer.
+static bool spfm_identify(FT_HANDLE ftHandle, SPFM_TYPE* type) {
     uint8_t write_buf[1] = { 0xFF };
-    char read_buf[3] = {0};
-    FT_STATUS ftStatus;
     uint8_t reset_cmd[] = { 0xFE };
-    int outer_retries = 3; // Add an outer loop for more robustness
+    DWORD bytesWritten, bytesRead;
+    FT_STATUS ftStatus;
 
-    for (int i = 0; i < outer_retries; i++) {
+    // FT_Read returns as soon as the answer is there, so this only bounds a silent device
+    FT_SetTimeouts(ftHandle, SPFM_IDENTIFY_TIMEOUT_MS, SPFM_IDENTIFY_TIMEOUT_MS);
+    for (int i = 0; i < SPFM_IDENTIFY_TRIES; i++) {
         FT_Purge(ftHandle, FT_PURGE_RX | FT_PURGE_TX);
-        
+
         ftStatus = FT_Write(ftHandle, write_buf, 1, &bytesWritten);
-        if (ftStatus != FT_OK || bytesWritten != 1) {
-            yasp_usleep(50000); // Shorter wait
-            continue;
+        if (ftStatus != FT_OK || bytesWritten != 1) continue;
+
+        char read_buf[2];
+        DWORD got = 0;
+        while (got < sizeof(read_buf)) {
+            ftStatus = FT_Read(ftHandle, read_buf + got, sizeof(read_buf) - got, &bytesRead);
+            if (ftStatus != FT_OK || bytesRead == 0) break;
+            got += bytesRead;
         }
+        if (got < sizeof(read_buf)) continue;
 
-        yasp_usleep(100000); // Wait 100ms for a response
-
-        ftStatus = FT_Read(ftHandle, read_buf, 2, &bytesRead);
-        if (ftStatus == FT_OK && bytesRead >= 2) {
-            if (strncmp(read_buf, "LT", 2) == 0) {
-                spfm_type = SPFM_TYPE_SPFM_LIGHT;
-                ftStatus = FT_Write(ftHandle, reset_cmd, sizeof(reset_cmd), &bytesWritten);
-                if (ftStatus != FT_OK) {
-                    logging(LOG_LEVEL_WARN, "FT_Write for SPFM_Light reset failed with status %d\n", (int)ftStatus);
-                }
-                return true;
-            } else if (strncmp(read_buf, "OK", 2) == 0) {
-                spfm_type = SPFM_TYPE_SPFM;
-                return true;
+        if (strncmp(read_buf, "LT", 2) == 0) {
+            *type = SPFM_TYPE_SPFM_LIGHT;
+            ftStatus = FT_Write(ftHandle, reset_cmd, sizeof(reset_cmd), &bytesWritten);
+            if (ftStatus != FT_OK) {
+                logging(LOG_LEVEL_WARN, "FT_Write for SPFM_Light reset failed with status %d\n", (int)ftStatus);
             }
+            return true;
+        } else if (strncmp(read_buf, "OK", 2) == 0) {
+            *type = SPFM_TYPE_SPFM;
+            return true;
         }
-        yasp_usleep(50000); // Shorter wait before next outer retry
     }
-    
+
     return false;
 }
 
 
 void spfm_chip_reset() {
-    int i;
-    uint8_t slot;
-
     // Reset all configured chips
-    for (i = 0; i < CHIP_TYPE_COUNT; i++) {
-        if (g_chip_config[i].type != CHIP_TYPE_NONE && g_chip_config[i].slot != 0xFF) {
-            slot = g_chip_config[i].slot;
-            logging(LOG_LEVEL_INFO, "Resetting chip type %d in slot %d\n", g_chip_config[i].type, slot);
-            switch (g_chip_config[i].type) {
-                case CHIP_TYPE_YM2608:
-                    ym2608_mute(slot);
-                    break;
-                case CHIP_TYPE_YM2151:
-                    ym2151_mute(slot);
-                    break;
-                case CHIP_TYPE_YM2612:
-                    ym2612_mute(slot);
-                    break;
-                case CHIP_TYPE_YM2203:
-                    ym2203_mute(slot);
-                    break;
-                case CHIP_TYPE_YM2413:
-                    ym2413_mute(slot);
-                    break;
-                case CHIP_TYPE_SN76489:
-                    sn76489_mute(slot);
-                    break;
-                case CHIP_TYPE_AY8910:
-                    ay8910_mute(slot);
-                    break;
-                case CHIP_TYPE_Y8950:
-                    y8950_mute(slot);
-                    break;
-                case CHIP_TYPE_YM3526:
-                    ym3526_mute(slot);
-                    break;
-                case CHIP_TYPE_YM3812:
-                    ym3812_mute(slot);
-                    break;
-                case CHIP_TYPE_YMF262:
-                    ymf262_mute(slot);
-                    break;
-                default:
-                    break;
-            }
-        }
+    for (int i = 0; i < g_chip_config_count; i++) {
+        logging(LOG_LEVEL_INFO, "Resetting chip type %d in slot %d\n", g_chip_config[i].type, g_chip_config[i].slot);
+        chip_driver_mute(g_chip_config[i].type, g_chip_config[i].slot);
     }
     spfm_flush();
 }
 
 void spfm_cleanup() {
-    if (ftHandle) {
+    if (spfm_device_count > 0) {
         spfm_chip_reset();
         spfm_reset();
-        FT_Close(ftHandle);
-        ftHandle = NULL;
+        spfm_stop_writers();
+        for (int i = 0; i < spfm_device_count; i++) {
+            if (spfm_devices[i].virt) spfm_close_virtual(&spfm_devices[i]);
+            if (spfm_devices[i].handle) FT_Close(spfm_devices[i].handle);
+            spfm_devices[i].handle = NULL;
+        }
+        spfm_device_count = 0;
+        yasp_cond_destroy(&spfm_writer_cond);
+        yasp_mutex_destroy(&spfm_writer_lock);
+        chip_driver_release();
+        ym2608_upload_forget();
         logging(LOG_LEVEL_INFO, "SPFM device closed.\n");
     }
 }
 
 FT_HANDLE spfm_get_handle() {
-    return ftHandle;
+    return spfm_device_count > 0 ? spfm_devices[0].handle : NULL;
 }
 
 SPFM_TYPE spfm_get_type() {
-    return spfm_type;
+    return spfm_device_count > 0 ? spfm_devices[0].type : SPFM_TYPE_UNKNOWN;
 }
 
-void spfm_reset() {
-    if (!ftHandle) return;
-    spfm_flush();
-    uint8_t cmd_buf[1];
-    if (spfm_type == SPFM_TYPE_SPFM_LIGHT) {
-        cmd_buf[0] = 0xFE;
-        spfm_write_reg(0, 0, cmd_buf[0], 0);
-    } else if (spfm_type == SPFM_TYPE_SPFM) {
-        cmd_buf[0] = 0xFF;
-        spfm_write_reg(0, 0, cmd_buf[0], 0);
+int spfm_get_device_count(void) {
+    return spfm_device_count;
+}
+
+SPFM_TYPE spfm_get_device_type(int device) {
+    return device < spfm_device_count ? spfm_devices[device].type : SPFM_TYPE_UNKNOWN;
+}
+
+const char* spfm_get_device_serial(int device) {
+    return device < spfm_device_count ? spfm_devices[device].serial : "";
+}
+
+int spfm_get_device_slots(int device) {
+    return device < spfm_device_count ? spfm_devices[device].slots : 0;
+}
+
+int spfm_get_device_index(int device) {
+    return device < spfm_device_count ? spfm_devices[device].index : -1;
+}
+
+void spfm_get_transport(int device, spfm_transport_t* transport) {
+    spfm_transport_t defaults = SPFM_TRANSPORT_DEFAULT;
+    *transport = device < spfm_device_count ? spfm_devices[device].transport : defaults;
+}
+
+bool spfm_set_transport(int device, const spfm_transport_t* transport) {
+    if (device >= spfm_device_count || transport->chunk_size == 0 || transport->chunk_size > SPFM_TRANSPORT_MAX_CHUNK
+        || transport->latency_ms < 1 || transport->hw_wait_threshold == 0) {
+        return false;
     }
+    spfm_device_t* dev = &spfm_devices[device];
     spfm_flush();
+    FT_STATUS ftStatus = dev->virt ? FT_OK : FT_SetLatencyTimer(dev->handle, transport->latency_ms);
+    if (ftStatus != FT_OK) {
+        logging(LOG_LEVEL_WARN, "FT_SetLatencyTimer(%d) failed for SPFM device %d with status %d\n", transport->latency_ms, device, (int)ftStatus);
+        return false;
+    }
+    dev->transport = *transport;
+    return true;
 }
 
-void spfm_write_reg(uint8_t slot, uint8_t port, uint8_t addr, uint8_t data) {
-    if (!ftHandle) return;
+void spfm_transport_remember(const char* serial, const spfm_transport_t* transport) {
+    if (!serial[0]) return;
+    int n = 0;
+    while (n < spfm_transport_profile_count && strcmp(spfm_transport_profiles[n].serial, serial) != 0) n++;
+    if (n == SPFM_TRANSPORT_PROFILES) {
+        logging(LOG_LEVEL_WARN, "Only %d transport profiles are kept, %s is dropped.\n", SPFM_TRANSPORT_PROFILES, serial);
+        return;
+    }
+    if (n == spfm_transport_profile_count) spfm_transport_profile_count++;
+    strncpy(spfm_transport_profiles[n].serial, serial, sizeof(spfm_transport_profiles[n].serial) - 1);
+    spfm_transport_profiles[n].transport = *transport;
+    for (int i = 0; i < spfm_device_count; i++) {
+        if (strcmp(spfm_devices[i].serial, serial) == 0) spfm_set_transport(i, transport);
+    }
+}
 
-    size_t cmd_size = 0;
-    uint8_t cmd_buf[4];
+bool spfm_transport_profile(int n, const char** serial, spfm_transport_t* transport) {
+    if (n < 0 || n >= spfm_transport_profile_count) return false;
+    *serial = spfm_transport_profiles[n].serial;
+    *transport = spfm_transport_profiles[n].transport;
+    return true;
+}
+
+bool spfm_device_drain(int device, uint32_t timeout_ms) {
+    if (device >= spfm_device_count) return false;
+    uint64_t deadline_us = get_current_time_us() + (uint64_t)timeout_ms * 1000;
+    for (;;) {
+        DWORD rx_bytes, tx_bytes, event;
+        if (spfm_devices[device].virt) {
+            tx_bytes = spfm_virtual_run(spfm_devices[device].virt, get_current_time_us() * 1000);
+        } else if (FT_GetStatus(spfm_devices[device].handle, &rx_bytes, &tx_bytes, &event) != FT_OK) {
+            return false;
+        }
+        if (tx_bytes == 0) return true;
+        if (get_current_time_us() >= deadline_us) return false;
+        yasp_usleep(100);
+    }
+}
+
+// Device time of the bytes of dev the USB driver has not handed over yet. The driver
+// counts them; the marks of the flushes they came from tell how long they take to play,
+// waits included.
+static uint64_t spfm_device_queued_ns(spfm_device_t* dev) {
+    DWORD rx_bytes, tx_bytes, event;
+    if (dev->lost || dev->mark_count == 0) return 0;
+    if (dev->virt) {
+        tx_bytes = spfm_virtual_run(dev->virt, get_current_time_us() * 1000);
+    } else if (FT_GetStatus(dev->handle, &rx_bytes, &tx_bytes, &event) != FT_OK) {
+        return 0;
+    }
+    if (tx_bytes == 0) return 0;
+    if (tx_bytes > dev->sent_bytes) tx_bytes = (DWORD)dev->sent_bytes;
+    uint64_t handed = dev->sent_bytes - tx_bytes;
 
-    if (spfm_type == SPFM_TYPE_SPFM_LIGHT) {
+    // The flush the next byte to go belongs to. Past the oldest mark the bytes are
+    // counted at the baud rate.
+    uint32_t oldest = dev->mark_count > SPFM_QUEUE_MARKS ? dev->mark_count - SPFM_QUEUE_MARKS : 0;
+    uint32_t n = dev->mark_count - 1;
+    while (n > oldest && dev->marks[(n - 1) % SPFM_QUEUE_MARKS].bytes > handed) n--;
+    const spfm_queue_mark_t* end = &dev->marks[n % SPFM_QUEUE_MARKS];
+    uint64_t start_bytes = handed;
+    uint64_t back_ns = (end->bytes - handed) * SPFM_BYTE_NS;
+    uint64_t start_ns = end->time_ns > back_ns ? end->time_ns - back_ns : 0;
+    if (n > oldest) {
+        start_bytes = dev->marks[(n - 1) % SPFM_QUEUE_MARKS].bytes;
+        start_ns = dev->marks[(n - 1) % SPFM_QUEUE_MARKS].time_ns;
+    }
+    // Within a flush its waits are spread over its bytes
+    uint64_t handed_ns = start_ns;
+    if (end->bytes > start_bytes && handed > start_bytes) {
+        handed_ns += (end->time_ns - start_ns) * (handed - start_bytes) / (end->bytes - start_bytes);
+    }
+    return dev->flushed_ns > handed_ns ? dev->flushed_ns - handed_ns : 0;
+}
+
+uint32_t spfm_get_queued_us(void) {
+    uint64_t queued_ns = 0;
+    for (int i = 0; i < spfm_device_count; i++) {
+        uint64_t ns = spfm_device_queued_ns(&spfm_devices[i]);
+        if (ns > queued_ns) queued_ns = ns;
+    }
+    return (uint32_t)(queued_ns / 1000);
+}
+
+void spfm_reset() {
+    if (spfm_device_count == 0) return;
+    spfm_flush();
+    for (int i = 0; i < spfm_device_count; i++) {
+        if (spfm_devices[i].type == SPFM_TYPE_SPFM_LIGHT) {
+            spfm_write_reg(SPFM_SLOT(i, 0), 0, 0xFE, 0);
+        } else if (spfm_devices[i].type == SPFM_TYPE_SPFM) {
+            spfm_write_reg(SPFM_SLOT(i, 0), 0, 0xFF, 0);
+        }
+    }
+    spfm_flush();
+}
+
+// Encodes one register write in the protocol of the device. Returns its size, 0 if there is no device type.
+static size_t spfm_encode_reg(const spfm_device_t* dev, uint8_t slot, uint8_t port, uint8_t addr, uint8_t data, uint8_t* cmd_buf) {
+    slot = SPFM_SLOT_INDEX(slot);
+    if (dev->type == SPFM_TYPE_SPFM_LIGHT) {
         cmd_buf[0] = slot & 1;
         cmd_buf[1] = (port & 7) << 1;
         cmd_buf[2] = addr;
         cmd_buf[3] = data;
-        cmd_size = 4;
-    } else if (spfm_type == SPFM_TYPE_SPFM) {
+        return 4;
+    } else if (dev->type == SPFM_TYPE_SPFM) {
         cmd_buf[0] = ((slot & 7) << 4) | (port & 3);
         cmd_buf[1] = addr;
         cmd_buf[2] = data;
-        cmd_size = 3;
-    } else {
-        return;
+        return 3;
     }
+    return 0;
+}
 
-    if (spfm_write_buf_ptr + cmd_size > SPFM_WRITE_BUF_SIZE) {
-        spfm_flush();
-    }
+void spfm_write_reg(uint8_t slot, uint8_t port, uint8_t addr, uint8_t data) {
+    spfm_device_t* dev = spfm_slot_device(slot);
+    if (!dev) return;
+
+    uint8_t cmd_buf[4];
+    size_t cmd_size = spfm_encode_reg(dev, slot, port, addr, data, cmd_buf);
+    if (cmd_size == 0) return;
 
-    memcpy(spfm_write_buf + spfm_write_buf_ptr, cmd_buf, cmd_size);
-    spfm_write_buf_ptr += cmd_size;
+    // The device writes the address when the byte after it starts to arrive
+    spfm_slot_timing_t* t = spfm_slot_timing(dev, slot);
+    spfm_wait_for_chip(dev, t, (cmd_size - 1) * SPFM_BYTE_NS);
+    spfm_buf_append(dev, cmd_buf, cmd_size);
+    if (t->driver) spfm_chip_written(dev, t, chip_driver_data_cycles(t->driver, port, addr));
+}
+
+void spfm_write_reg_run(uint8_t slot, uint8_t port, uint8_t addr, const uint8_t* data, size_t size) {
+    spfm_device_t* dev = spfm_slot_device(slot);
+    if (!dev) return;
+
+    uint8_t cmd_buf[4];
+    size_t cmd_size = spfm_encode_reg(dev, slot, port, addr, 0, cmd_buf);
+    if (cmd_size == 0) return;
+
+    // The writes only differ in their last byte, so they are encoded in blocks and queued together.
+    // A memory data port is paced by the device bytes alone.
+    spfm_slot_timing_t* t = spfm_slot_timing(dev, slot);
+    spfm_wait_for_chip(dev, t, 0);
+    uint8_t run_buf[4096];
+    size_t per_block = sizeof(run_buf) / cmd_size;
+    while (size > 0) {
+        size_t n = size < per_block ? size : per_block;
+        for (size_t i = 0; i < n; i++) {
+            memcpy(run_buf + i * cmd_size, cmd_buf, cmd_size - 1);
+            run_buf[i * cmd_size + cmd_size - 1] = data[i];
+        }
+        spfm_buf_append(dev, run_buf, n * cmd_size);
+        data += n;
+        size -= n;
+    }
+    if (t->driver) spfm_chip_written(dev, t, t->driver->data_cycles);
 }
 
 void spfm_write_regs(uint8_t slot, const spfm_reg_t* regs, uint32_t count, uint32_t write_wait) {
-    if (!ftHandle) return;
+    spfm_device_t* dev = spfm_slot_device(slot);
+    if (!dev) return;
 
     for (uint32_t i = 0; i < count; i++) {
         spfm_write_reg(slot, regs[i].port, regs[i].addr, regs[i].data);
         if (write_wait > 0) {
-            if (spfm_write_buf_ptr + write_wait > SPFM_WRITE_BUF_SIZE) {
-                spfm_flush();
-            }
-            for (uint32_t j = 0; j < write_wait; j++) {
-                spfm_write_buf[spfm_write_buf_ptr++] = 0x80;
-            }
+            spfm_buf_append_waits(dev, write_wait);
         }
     }
 }
 
 void spfm_write_data(uint8_t slot, uint8_t data) {
-    if (!ftHandle) return;
+    spfm_device_t* dev = spfm_slot_device(slot);
+    if (!dev) return;
 
     size_t cmd_size = 0;
     uint8_t cmd_buf[3];
 
-    if (spfm_type == SPFM_TYPE_SPFM_LIGHT) {
-        cmd_buf[0] = slot & 1;
+    if (dev->type == SPFM_TYPE_SPFM_LIGHT) {
+        cmd_buf[0] = SPFM_SLOT_INDEX(slot) & 1;
         cmd_buf[1] = 0x20; // Simplified command for data-only writes (e.g., SN76489)
         cmd_buf[2] = data;
         cmd_size = 3;
-    } else if (spfm_type == SPFM_TYPE_SPFM) {
+    } else if (dev->type == SPFM_TYPE_SPFM) {
         // SPFM (standard) does not support this simplified command.
         // Fallback to a regular write with dummy address/port, though this is not ideal.
         // The primary use case is for SPFM_Light with SN76489.
@@ -392,61 +1114,62 @@ void spfm_write_data(uint8_t slot, uint8_t data) {
         return;
     }
 
-    if (spfm_write_buf_ptr + cmd_size > SPFM_WRITE_BUF_SIZE) {
-        spfm_flush();
+    spfm_slot_timing_t* t = spfm_slot_timing(dev, slot);
+    spfm_wait_for_chip(dev, t, (cmd_size - 1) * SPFM_BYTE_NS);
+    spfm_buf_append(dev, cmd_buf, cmd_size);
+    if (t->driver) spfm_chip_written(dev, t, t->driver->data_cycles);
+}
+
+void spfm_write_raw(uint8_t device, const uint8_t* bytes, size_t size) {
+    if (device >= spfm_device_count) return;
+    spfm_device_t* dev = &spfm_devices[device];
+    while (size > 0) {
+        size_t n = size < SPFM_WRITE_BUF_SIZE ? size : SPFM_WRITE_BUF_SIZE;
+        spfm_buf_append(dev, bytes, n);
+        bytes += n;
+        size -= n;
     }
+}
+
+void spfm_capture(struct spfm_stream* stream) {
+    spfm_capture_stream = stream;
+}
+
+void spfm_write_raw_slot(uint8_t slot, const uint8_t* bytes, size_t size) {
+    spfm_device_t* dev = spfm_slot_device(slot);
+    if (!dev) return;
+    spfm_slot_timing_t* t = spfm_slot_timing(dev, slot);
+    spfm_wait_for_chip(dev, t, 0);
+    spfm_write_raw((uint8_t)SPFM_SLOT_DEVICE(slot), bytes, size);
+    if (t->driver) spfm_chip_written(dev, t, t->driver->data_cycles);
+}
+
+void spfm_record(spfm_blob_t* blob) {
+    // A recording is sent later as one piece, so its waits only depend on its own writes
+    if (blob && !spfm_record_blob) {
+        for (int i = 0; i < spfm_device_count; i++) {
+            spfm_record_time_ns[i] = spfm_devices[i].time_ns;
+            memcpy(spfm_record_timing[i], spfm_devices[i].timing, sizeof(spfm_devices[i].timing));
+            for (int slot = 0; slot < SPFM_SLOTS; slot++) spfm_devices[i].timing[slot].ready_ns = 0;
+        }
+    } else if (!blob && spfm_record_blob) {
+        for (int i = 0; i < spfm_device_count; i++) {
+            spfm_devices[i].time_ns = spfm_record_time_ns[i];
+            memcpy(spfm_devices[i].timing, spfm_record_timing[i], sizeof(spfm_devices[i].timing));
+        }
+    }
+    spfm_record_blob = blob;
+}
 
-    memcpy(spfm_write_buf + spfm_write_buf_ptr, cmd_buf, cmd_size);
-    spfm_write_buf_ptr += cmd_size;
+void spfm_blob_free(spfm_blob_t* blob) {
+    free(blob->data);
+    memset(blob, 0, sizeof(spfm_blob_t));
 }
 
 int spfm_get_selected_device_index(void) {
-    return g_selected_dev_idx;
+    return spfm_get_device_index(0);
 }
 
 int spfm_get_dev_index(void) {
-    return g_selected_dev_idx;
-}
-
-void spfm_write_ym2608_ram(uint8_t slot, uint32_t address, uint32_t size, const uint8_t* data) {
-    uint32_t start = address;
-    uint32_t stop = start + size - 1;
-    // The limit seems to be the end of the ADPCM-A RAM area.
-    uint32_t limit = (stop < 0x3FFFF) ? stop : 0x3FFFF; 
-    uint32_t i;
-    const uint32_t chunk_size = 256;
-
-    if (!ftHandle) return;
-
-    // Crucial step from node-spfm: addresses are shifted.
-    start >>= 2;
-    stop >>= 2;
-    limit >>= 2;
-
-    // Setup memory write mode, matching node-spfm
-    spfm_write_reg(slot, 1, 0x10, 0x80); // Reset Flags
-    spfm_write_reg(slot, 1, 0x00, 0x60); // Memory Write command
-    spfm_write_reg(slot, 1, 0x01, 0x00); // Memory Type
-
-    // Set addresses
-    spfm_write_reg(slot, 1, 0x02, start & 0xff);
-    spfm_write_reg(slot, 1, 0x03, (start >> 8) & 0xff);
-    spfm_write_reg(slot, 1, 0x04, stop & 0xff);
-    spfm_write_reg(slot, 1, 0x05, (stop >> 8) & 0xff);
-    spfm_write_reg(slot, 1, 0x0c, limit & 0xff);
-    spfm_write_reg(slot, 1, 0x0d, (limit >> 8) & 0xff);
-    
-    // Write data in chunks. The flush at the end of the loop provides
-    // the necessary flow control, equivalent to 'await' in the TS code.
-    for (i = 0; i < size; i++) {
-        spfm_write_reg(slot, 1, 0x08, data[i]);
-        if ((i + 1) % chunk_size == 0) {
-            spfm_flush(); 
-        }
-    }
-
-    // End memory write mode
-    spfm_write_reg(slot, 1, 0x00, 0x00);
-    spfm_write_reg(slot, 1, 0x10, 0x80); // Reset Flags again
-    spfm_flush(); // Flush the final commands
+    return spfm_get_device_index(0);
 }
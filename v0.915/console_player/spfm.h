@@ -9,9 +9,11 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #include "ftd2xx.h"
 #include "error.h"
+#include "spfm_virtual.h"
 
 typedef FT_HANDLE SPFM_HANDLE;
 
@@ -30,28 +32,121 @@ typedef struct {
 #define OPNA_SLOT_NUM 0
 #define OPM_SLOT_NUM  1
 
+// Device bytes kept to be queued later in one piece, such as a chip's init sequence
+typedef struct {
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+    bool failed;            // Ran out of memory while recording
+} spfm_blob_t;
+
 #define BUFSIZE 256
 #define SPFM_WRITE_BUF_SIZE (1024 * 64)
 
+// Several SPFM units can be open at once. A slot number holds the device in its upper
+// bits: device n has slots SPFM_SLOT(n, 0) to SPFM_SLOT(n, 7). 0xFF stays "no slot".
+#define SPFM_MAX_DEVICES 4
+#define SPFM_SLOT(device, slot) ((uint8_t)(((device) << 3) | ((slot) & 7)))
+#define SPFM_SLOT_DEVICE(slot) ((slot) >> 3)
+#define SPFM_SLOT_INDEX(slot) ((slot) & 7)
+// Slots of each device type. Writes to a slot past the count are dropped.
+#define SPFM_SLOTS 8
+#define SPFM_LIGHT_SLOTS 2
+
+// How the bytes of a device are handed to the USB driver. The best values depend on the
+// host USB controller and the device, so they can be measured (spfm_calibrate.h) and are
+// kept for each device serial number.
+typedef struct {
+    uint32_t chunk_size;        // Bytes per FT_Write
+    uint8_t latency_ms;         // FTDI latency timer
+    uint32_t hw_wait_threshold; // Waits shorter than this many samples go to an SPFM_Light as 0x80
+} spfm_transport_t;
+#define SPFM_TRANSPORT_DEFAULT { 4096, 2, 10 }
+// Largest chunk, the USB transfer size set when a device is opened
+#define SPFM_TRANSPORT_MAX_CHUNK 65536
+#define SPFM_TRANSPORT_PROFILES 8
+
+// Transfer failures and the reconnects that followed. A failed device is opened again by
+// serial number, its chips are initialized and their registers written back.
+typedef struct {
+    uint32_t failures;          // Devices that stopped taking data
+    uint32_t reconnects;        // Devices opened again with their chip state restored
+    uint64_t outage_us;         // Time from the failures to the restored state, summed
+    uint64_t last_outage_us;
+} spfm_telemetry_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// Opens one more device. Its number is the count of devices opened before it.
 int spfm_init(int dev_idx);
+// Opens several more devices at once, by FTDI index. Their handshakes run side by side.
+// A type of SPFM_TYPE_UNKNOWN is asked from the device, a known one (saved from an earlier
+// start) skips the handshake. types receives the type of each device.
+int spfm_open_devices(const int* dev_indices, SPFM_TYPE* types, int count);
+// Opens a virtual device of type in place of a unit (spfm_virtual.h). Every command it
+// plays goes to trace_path with its time, if not NULL. Its serial number is "VIRTUAL<n>".
+int spfm_open_virtual(SPFM_TYPE type, const char* trace_path);
+// Statistics of a virtual device up to now. Returns false if device is not virtual.
+bool spfm_get_virtual_stats(int device, spfm_virtual_stats_t* stats);
 int spfm_get_selected_device_index(void);
 void spfm_init_chips(void);
 void spfm_cleanup(void);
+// Handle and type of the first device
 SPFM_HANDLE spfm_get_handle(void);
 SPFM_TYPE spfm_get_type(void);
+int spfm_get_device_count(void);
+SPFM_TYPE spfm_get_device_type(int device);
+// Slots of an open device, found out from its type when it was opened. 0 if there is none.
+int spfm_get_device_slots(int device);
+// Serial number of an open device, "" if there is none
+const char* spfm_get_device_serial(int device);
+// FTDI device index of an open device, -1 if there is none
+int spfm_get_device_index(int device);
+// Transport settings of an open device
+void spfm_get_transport(int device, spfm_transport_t* transport);
+// Changes the transport settings of an open device. What is queued goes out first.
+bool spfm_set_transport(int device, const spfm_transport_t* transport);
+// Keeps the settings for the device with serial, and applies them to it if it is open.
+// A device opened later with that serial starts with them.
+void spfm_transport_remember(const char* serial, const spfm_transport_t* transport);
+// Settings kept by spfm_transport_remember, n from 0. Returns false past the last one.
+bool spfm_transport_profile(int n, const char** serial, spfm_transport_t* transport);
+// Waits until the USB driver has handed every byte sent to device over to it, at most
+// timeout_ms. Returns false on timeout or error.
+bool spfm_device_drain(int device, uint32_t timeout_ms);
+// Device time still waiting in the USB driver's transmit queue, in microseconds: the
+// most of any device. The driver's count of queued bytes (FT_GetStatus), or what is still
+// on the line of a virtual device, is turned into time with the waits among those bytes.
+uint32_t spfm_get_queued_us(void);
 void spfm_reset(void);
 void spfm_chip_reset(void);
 void spfm_write_reg(uint8_t slot, uint8_t port, uint8_t addr, uint8_t data);
 void spfm_write_regs(uint8_t slot, const spfm_reg_t* regs, uint32_t count, uint32_t write_wait);
 void spfm_write_data(uint8_t slot, uint8_t data);
+// Writes every byte of data to the same register, as for a chip's memory data port
+void spfm_write_reg_run(uint8_t slot, uint8_t port, uint8_t addr, const uint8_t* data, size_t size);
+// Queues bytes that are already in the protocol of device, such as a compiled stream (spfm_stream.h).
+// They are sent as they are, with the waits they hold.
+void spfm_write_raw(uint8_t device, const uint8_t* bytes, size_t size);
+// Queues bytes in the protocol of the device of slot that only write to the chip in slot,
+// such as its init sequence. They start once the chip is ready for them.
+void spfm_write_raw_slot(uint8_t slot, const uint8_t* bytes, size_t size);
+// Records every byte queued for the device into stream from now on. NULL stops recording.
+// The waits the bus timing adds are recorded with them.
+struct spfm_stream;
+void spfm_capture(struct spfm_stream* stream);
+// Encodes everything queued for the device into blob instead of sending it, until called
+// with NULL. Flushes do nothing meanwhile.
+void spfm_record(spfm_blob_t* blob);
+void spfm_blob_free(spfm_blob_t* blob);
 void spfm_wait_and_write_reg(uint32_t wait_samples, uint8_t slot, uint8_t port, uint8_t addr, uint8_t data);
+// Sends what is queued for every device. With several devices their transfers start together.
+// A device whose transfer fails is reconnected before it returns. Returns false if one
+// is still missing.
 bool spfm_flush(void);
-void spfm_write_ym2608_ram(uint8_t slot, uint32_t address, uint32_t size, const uint8_t* data);
-void spfm_write_ym2608_ram_timed(uint8_t slot, uint32_t address, uint32_t size, const uint8_t* data);
+void spfm_get_telemetry(spfm_telemetry_t* telemetry);
 int spfm_get_dev_index(void);
 
 #ifdef __cplusplus
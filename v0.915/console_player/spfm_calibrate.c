@@ -0,0 +1,155 @@
+#include "spfm_calibrate.h"
+#include "chiptype.h"
+#include "chip_driver.h"
+#include "util.h"
+#include "error.h"
+
+#define CALIBRATE_COUNT(a) (int)(sizeof(a) / sizeof((a)[0]))
+
+static const uint32_t s_chunk_sizes[] = { 512, 1024, 4096, 16384, 65536 };
+static const uint8_t s_latencies[] = { 1, 2, 4, 16 };
+static const uint32_t s_wait_thresholds[] = { 2, 5, 10, 20, 40 };
+// Waits between the frames of the pacing pattern, in samples
+static const uint32_t s_frame_waits[] = { 1, 2, 3, 5, 8, 13, 21, 34, 55, 89 };
+
+#define CALIBRATE_THROUGHPUT_WRITES 8192 // 32 KB on the SPFM_Light, half the transmit buffer
+#define CALIBRATE_FRAMES 200
+#define CALIBRATE_FRAME_WRITES 4
+#define CALIBRATE_DRAIN_TIMEOUT_MS 2000
+// Settings within this share of the best throughput count as fast enough, in percent
+#define CALIBRATE_THROUGHPUT_SHARE 97
+
+// Slot the pattern writes to: an empty one if the device has it, else its first chip
+static uint8_t calibrate_slot(int device, chip_type_t* chip) {
+    uint8_t chip_slot = 0xFF;
+    *chip = CHIP_TYPE_NONE;
+    for (int index = 0; index < spfm_get_device_slots(device); index++) {
+        uint8_t slot = SPFM_SLOT(device, index);
+        const chip_config_t* installed = NULL;
+        for (int i = 0; i < g_chip_config_count; i++) {
+            if (g_chip_config[i].slot == slot) installed = &g_chip_config[i];
+        }
+        if (!installed) {
+            *chip = CHIP_TYPE_NONE;
+            return slot;
+        }
+        if (chip_slot == 0xFF) {
+            chip_slot = slot;
+            *chip = installed->type;
+        }
+    }
+    return chip_slot;
+}
+
+// Bytes per second of a long run of writes, 0 if they could not be sent
+static uint32_t calibrate_throughput(int device, uint8_t slot) {
+    spfm_flush();
+    spfm_device_drain(device, CALIBRATE_DRAIN_TIMEOUT_MS);
+
+    uint32_t bytes = CALIBRATE_THROUGHPUT_WRITES * (spfm_get_device_type(device) == SPFM_TYPE_SPFM_LIGHT ? 4 : 3);
+    uint64_t start_us = get_current_time_us();
+    for (uint32_t i = 0; i < CALIBRATE_THROUGHPUT_WRITES; i++) {
+        spfm_write_reg(slot, 0, 0x00, (uint8_t)i);
+    }
+    if (!spfm_flush() || !spfm_device_drain(device, CALIBRATE_DRAIN_TIMEOUT_MS)) return 0;
+    uint64_t elapsed_us = get_current_time_us() - start_us;
+    return elapsed_us ? (uint32_t)((uint64_t)bytes * 1000000 / elapsed_us) : 0;
+}
+
+// Mean time the frames of the pacing pattern land behind their schedule. Landing ahead
+// of it only means the driver holds the bytes, so that does not count.
+static uint32_t calibrate_pacing(int device, uint8_t slot) {
+    spfm_flush();
+    spfm_device_drain(device, CALIBRATE_DRAIN_TIMEOUT_MS);
+
+    uint64_t start_us = get_current_time_us();
+    uint64_t samples = 0;
+    uint64_t late_us = 0;
+    for (int frame = 0; frame < CALIBRATE_FRAMES; frame++) {
+        for (int i = 0; i < CALIBRATE_FRAME_WRITES - 1; i++) {
+            spfm_write_reg(slot, 0, 0x00, (uint8_t)frame);
+        }
+        uint32_t wait = s_frame_waits[frame % CALIBRATE_COUNT(s_frame_waits)];
+        spfm_wait_and_write_reg(wait, slot, 0, 0x00, 0x01);
+        // Command-level flushing, as the player does
+        spfm_flush();
+        samples += wait;
+        uint64_t due_us = start_us + samples * 1000000 / 44100;
+        uint64_t now_us = get_current_time_us();
+        if (now_us > due_us) late_us += now_us - due_us;
+    }
+    // The last frame is done when the device has every byte
+    spfm_device_drain(device, CALIBRATE_DRAIN_TIMEOUT_MS);
+    uint64_t due_us = start_us + samples * 1000000 / 44100;
+    uint64_t now_us = get_current_time_us();
+    if (now_us > due_us) late_us += now_us - due_us;
+    return (uint32_t)(late_us / (CALIBRATE_FRAMES + 1));
+}
+
+bool spfm_calibrate(int device, spfm_calibration_t* best, spfm_calibrate_progress_t progress) {
+    if (device >= spfm_get_device_count()) return false;
+    chip_type_t chip;
+    uint8_t slot = calibrate_slot(device, &chip);
+    if (slot == 0xFF) return false;
+
+    spfm_transport_t saved;
+    spfm_get_transport(device, &saved);
+    bool light = spfm_get_device_type(device) == SPFM_TYPE_SPFM_LIGHT;
+    int steps = CALIBRATE_COUNT(s_chunk_sizes) * CALIBRATE_COUNT(s_latencies) + (light ? CALIBRATE_COUNT(s_wait_thresholds) : 0);
+    int step = 0;
+
+    // Chunk size and latency timer
+    spfm_calibration_t results[CALIBRATE_COUNT(s_chunk_sizes) * CALIBRATE_COUNT(s_latencies)];
+    int count = 0;
+    uint32_t fastest = 0;
+    for (int c = 0; c < CALIBRATE_COUNT(s_chunk_sizes); c++) {
+        for (int l = 0; l < CALIBRATE_COUNT(s_latencies); l++) {
+            spfm_calibration_t* r = &results[count];
+            r->transport = saved;
+            r->transport.chunk_size = s_chunk_sizes[c];
+            r->transport.latency_ms = s_latencies[l];
+            step++;
+            if (!spfm_set_transport(device, &r->transport)) continue;
+            r->bytes_per_sec = calibrate_throughput(device, slot);
+            r->pacing_error_us = calibrate_pacing(device, slot);
+            if (r->bytes_per_sec > fastest) fastest = r->bytes_per_sec;
+            if (progress) progress(step, steps, r);
+            count++;
+        }
+    }
+    if (fastest == 0) {
+        logging(LOG_LEVEL_ERROR, "Calibration of SPFM device %d failed: nothing could be sent.\n", device);
+        spfm_set_transport(device, &saved);
+        return false;
+    }
+    const spfm_calibration_t* winner = NULL;
+    for (int i = 0; i < count; i++) {
+        if ((uint64_t)results[i].bytes_per_sec * 100 < (uint64_t)fastest * CALIBRATE_THROUGHPUT_SHARE) continue;
+        if (!winner || results[i].pacing_error_us < winner->pacing_error_us) winner = &results[i];
+    }
+    *best = *winner;
+
+    // Hardware wait threshold, which only the SPFM_Light has
+    if (light) {
+        spfm_calibration_t threshold_best = *best;
+        threshold_best.pacing_error_us = UINT32_MAX;
+        for (int t = 0; t < CALIBRATE_COUNT(s_wait_thresholds); t++) {
+            spfm_calibration_t r = *best;
+            r.transport.hw_wait_threshold = s_wait_thresholds[t];
+            step++;
+            if (!spfm_set_transport(device, &r.transport)) continue;
+            r.pacing_error_us = calibrate_pacing(device, slot);
+            if (progress) progress(step, steps, &r);
+            if (r.pacing_error_us < threshold_best.pacing_error_us) threshold_best = r;
+        }
+        if (threshold_best.pacing_error_us != UINT32_MAX) *best = threshold_best;
+    }
+
+    spfm_set_transport(device, &best->transport);
+    if (chip != CHIP_TYPE_NONE) chip_driver_mute(chip, slot);
+    spfm_flush();
+    logging(LOG_LEVEL_INFO, "SPFM device %d calibrated: chunk %u bytes, latency %d ms, hardware waits below %u samples, %u bytes/s, %u us pacing error\n",
+            device, (unsigned)best->transport.chunk_size, best->transport.latency_ms, (unsigned)best->transport.hw_wait_threshold,
+            (unsigned)best->bytes_per_sec, (unsigned)best->pacing_error_us);
+    return true;
+}
@@ -0,0 +1,34 @@
+#ifndef SPFM_CALIBRATE_H
+#define SPFM_CALIBRATE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "spfm.h"
+
+// Transport calibration.
+// Plays a fixed write pattern on an open device with each candidate set of transport
+// settings (spfm_transport_t) and measures two things:
+//   - throughput: bytes per second of a long run of register writes, until the USB
+//     driver has handed them all to the device;
+//   - pacing error: how far the frames of a pattern of writes and waits of varied
+//     length land from their schedule, on average.
+// The chunk size and latency timer are swept first. Of those that reach nearly the best
+// throughput, the one with the lowest pacing error wins. The SPFM_Light wait threshold
+// is then swept with the winner.
+//
+// The pattern writes to a slot without a chip when the device has one. Otherwise it
+// writes register 0 of the first chip on the device, which is muted afterwards.
+
+typedef struct {
+    spfm_transport_t transport;
+    uint32_t bytes_per_sec;
+    uint32_t pacing_error_us;
+} spfm_calibration_t;
+
+typedef void (*spfm_calibrate_progress_t)(int step, int steps, const spfm_calibration_t* result);
+
+// Calibrates an open device, after its chips are initialized. The best settings are put
+// in best and applied to the device. Returns false if the device could not be measured.
+bool spfm_calibrate(int device, spfm_calibration_t* best, spfm_calibrate_progress_t progress);
+
+#endif // SPFM_CALIBRATE_H
@@ -0,0 +1,188 @@
+#include "spfm_stream.h"
+#include "cache_pack.h"
+#include "chiptype.h"
+#include "spfm.h"
+#include "vgm_convert.h"
+#include "error.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SPFM_STREAM_INITIAL_CAPACITY (256 * 1024)
+
+static void put_le16(uint8_t* p, uint32_t v) {
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+}
+
+static void put_le32(uint8_t* p, uint32_t v) {
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = (v >> 24) & 0xFF;
+}
+
+static uint32_t get_le32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Makes room for n more bytes. Gives up on the capture past SPFM_STREAM_MAX_SIZE.
+static bool spfm_stream_reserve(spfm_stream_t* s, size_t n) {
+    if (s->failed || s->ended) return false;
+    if (s->size + n <= s->capacity) return true;
+    if (s->size + n > SPFM_STREAM_MAX_SIZE) {
+        logging(LOG_LEVEL_WARN, "Compiled stream is over %u MB, it will not be cached.", SPFM_STREAM_MAX_SIZE / (1024 * 1024));
+        s->failed = true;
+        return false;
+    }
+    size_t capacity = s->capacity * 2;
+    while (capacity < s->size + n) capacity *= 2;
+    uint8_t* data = realloc(s->data, capacity);
+    if (!data) {
+        s->failed = true;
+        return false;
+    }
+    s->data = data;
+    s->capacity = capacity;
+    return true;
+}
+
+bool spfm_stream_init(spfm_stream_t* s, uint32_t key) {
+    memset(s, 0, sizeof(spfm_stream_t));
+    s->data = malloc(SPFM_STREAM_INITIAL_CAPACITY);
+    if (!s->data) return false;
+    s->capacity = SPFM_STREAM_INITIAL_CAPACITY;
+    memcpy(s->data, SPFM_STREAM_MAGIC, 4);
+    put_le32(s->data + 4, SPFM_STREAM_FORMAT);
+    put_le32(s->data + 8, key);
+    put_le32(s->data + 12, 0);
+    s->size = SPFM_STREAM_HEADER_SIZE;
+    return true;
+}
+
+void spfm_stream_free(spfm_stream_t* s) {
+    free(s->data);
+    memset(s, 0, sizeof(spfm_stream_t));
+}
+
+void spfm_stream_data(spfm_stream_t* s, uint8_t device, const uint8_t* data, size_t size) {
+    if (device != s->device && size > 0) {
+        if (!spfm_stream_reserve(s, 2)) return;
+        s->data[s->size++] = SPFM_STREAM_DEVICE;
+        s->data[s->size++] = device;
+        s->device = device;
+        s->chunk = 0;
+    }
+    while (size > 0) {
+        // Writes between two waits end up in one record
+        size_t used = s->chunk ? s->size - s->chunk - 3 : SPFM_STREAM_MAX_CHUNK;
+        if (used == SPFM_STREAM_MAX_CHUNK) {
+            if (!spfm_stream_reserve(s, 3)) return;
+            s->chunk = s->size;
+            s->data[s->size] = SPFM_STREAM_DATA;
+            s->size += 3;
+            used = 0;
+        }
+        size_t n = SPFM_STREAM_MAX_CHUNK - used;
+        if (n > size) n = size;
+        if (!spfm_stream_reserve(s, n)) return;
+        memcpy(s->data + s->size, data, n);
+        s->size += n;
+        put_le16(s->data + s->chunk + 1, (uint32_t)(used + n));
+        data += n;
+        size -= n;
+    }
+}
+
+void spfm_stream_wait(spfm_stream_t* s, uint32_t samples) {
+    while (samples > 0) {
+        uint32_t n = samples > 0xFFFF ? 0xFFFF : samples;
+        if (!spfm_stream_reserve(s, 3)) return;
+        s->data[s->size] = SPFM_STREAM_WAIT;
+        put_le16(s->data + s->size + 1, n);
+        s->size += 3;
+        s->chunk = 0;
+        samples -= n;
+    }
+}
+
+void spfm_stream_param(spfm_stream_t* s, uint8_t cmd, uint8_t addr, uint8_t data) {
+    if (!spfm_stream_reserve(s, 4)) return;
+    s->data[s->size++] = SPFM_STREAM_PARAM;
+    s->data[s->size++] = cmd;
+    s->data[s->size++] = addr;
+    s->data[s->size++] = data;
+    s->chunk = 0;
+}
+
+void spfm_stream_mark_loop(spfm_stream_t* s) {
+    if (s->failed || s->ended || s->loop_offset) return;
+    s->loop_offset = (uint32_t)s->size;
+    put_le32(s->data + 12, s->loop_offset);
+    s->chunk = 0; // Playback has to be able to jump to a record boundary here
+    s->device = 0xFF; // and is told the device again after the jump
+}
+
+void spfm_stream_end(spfm_stream_t* s) {
+    if (!spfm_stream_reserve(s, 1)) return;
+    s->data[s->size++] = SPFM_STREAM_END;
+    s->chunk = 0;
+    s->ended = true;
+}
+
+bool spfm_stream_save(const spfm_stream_t* s, const char* path) {
+    if (!s->ended || s->failed) return false;
+    FILE* fp = fopen(path, "wb");
+    if (!fp) {
+        logging(LOG_LEVEL_ERROR, "Failed to open compiled stream for writing: %s", path);
+        return false;
+    }
+    cache_pack_stats_t stats;
+    bool ok = cache_pack_write(fp, s->data, s->size, &stats);
+    fclose(fp);
+    if (!ok) {
+        logging(LOG_LEVEL_ERROR, "Failed to write compiled stream: %s", path);
+        remove(path);
+        return false;
+    }
+    logging(LOG_LEVEL_INFO, "Compiled stream written to %s (%u -> %u bytes)", path, (unsigned)stats.raw_size, (unsigned)stats.packed_size);
+    return true;
+}
+
+static uint32_t fnv1a(uint32_t h, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        h ^= (v >> (i * 8)) & 0xFF;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+uint32_t spfm_stream_key(void) {
+    uint32_t h = 2166136261u;
+    h = fnv1a(h, SPFM_STREAM_FORMAT);
+    h = fnv1a(h, VGM_CONVERTER_VERSION);
+    for (int i = 0; i < spfm_get_device_count(); i++) {
+        h = fnv1a(h, (uint32_t)spfm_get_device_type(i));
+    }
+    for (int i = 0; i < g_chip_config_count; i++) {
+        h = fnv1a(h, ((uint32_t)g_chip_config[i].type << 8) | g_chip_config[i].slot);
+    }
+    return h;
+}
+
+void spfm_stream_cache_name(const char* source_path, uint32_t key, char* name, size_t name_size) {
+    const char* base = strrchr(source_path, '/');
+    const char* base2 = strrchr(source_path, '\\');
+    if (base2 > base) base = base2;
+    base = base ? base + 1 : source_path;
+    snprintf(name, name_size, "%s.%08x.spfm", base, (unsigned)key);
+}
+
+bool spfm_stream_parse_header(const uint8_t* head, uint32_t key, uint32_t* loop_offset) {
+    if (memcmp(head, SPFM_STREAM_MAGIC, 4) != 0 || get_le32(head + 4) != SPFM_STREAM_FORMAT || get_le32(head + 8) != key) {
+        return false;
+    }
+    *loop_offset = get_le32(head + 12);
+    return *loop_offset == 0 || *loop_offset >= SPFM_STREAM_HEADER_SIZE;
+}
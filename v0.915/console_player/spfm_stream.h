@@ -0,0 +1,67 @@
+#ifndef SPFM_STREAM_H
+#define SPFM_STREAM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Compiled device streams.
+// The bytes a track sends to the SPFM device are recorded the first time it plays
+// through, together with the waits between them, and kept in the cache. Later plays
+// copy the recorded bytes into the transmit buffer instead of going through the chip
+// drivers, the slot lookup and the protocol encoding for every write.
+// The bytes depend on the device types and on which chip sits in which slot, so both
+// are part of the file name and of the header.
+//
+// Content, little endian, stored in a cache_pack container:
+//   "YSPS", u32 format, u32 device key, u32 loop offset (0: no loop), then records:
+#define SPFM_STREAM_DATA  0x01 // u16 length, device bytes
+#define SPFM_STREAM_WAIT  0x02 // u16 samples
+#define SPFM_STREAM_PARAM 0x03 // cmd addr data: tagged OPM write, resolved when played (opm_param.h)
+#define SPFM_STREAM_END   0x04 // End of the track, playback continues at the loop offset
+#define SPFM_STREAM_DEVICE 0x05 // u8 device: the data records after it go to this device.
+                                // Data goes to device 0 until the first one.
+
+#define SPFM_STREAM_MAGIC "YSPS"
+#define SPFM_STREAM_FORMAT 4
+#define SPFM_STREAM_HEADER_SIZE 16
+// Longest data record. Playback copies a record at a time through a buffer this size.
+#define SPFM_STREAM_MAX_CHUNK 4096
+// A capture that grows past this is dropped rather than cached
+#define SPFM_STREAM_MAX_SIZE (64 * 1024 * 1024)
+
+typedef struct spfm_stream {
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+    size_t chunk;          // Offset of the open data record, 0 if none
+    uint8_t device;        // Device the data records go to, 0xFF after the loop mark
+    uint32_t loop_offset;  // 0 until the loop point is reached
+    bool ended;            // Reached the end of the track, so it can be saved
+    bool failed;           // Ran out of memory or grew too large
+} spfm_stream_t;
+
+// Starts a capture for the device described by key.
+bool spfm_stream_init(spfm_stream_t* stream, uint32_t key);
+void spfm_stream_free(spfm_stream_t* stream);
+
+// Appends bytes that were sent to device.
+void spfm_stream_data(spfm_stream_t* stream, uint8_t device, const uint8_t* data, size_t size);
+void spfm_stream_wait(spfm_stream_t* stream, uint32_t samples);
+void spfm_stream_param(spfm_stream_t* stream, uint8_t cmd, uint8_t addr, uint8_t data);
+// Marks the next record as the loop point. Only the first mark counts.
+void spfm_stream_mark_loop(spfm_stream_t* stream);
+void spfm_stream_end(spfm_stream_t* stream);
+
+// Writes a finished capture to path.
+bool spfm_stream_save(const spfm_stream_t* stream, const char* path);
+
+// Identifies the device bytes a capture depends on: the type of every open device,
+// the installed chips and their slots, and the converter version.
+uint32_t spfm_stream_key(void);
+// Cache file name for source_path played on the device described by key.
+void spfm_stream_cache_name(const char* source_path, uint32_t key, char* name, size_t name_size);
+// Checks the header of a compiled stream. Returns false if it is damaged or for another device.
+bool spfm_stream_parse_header(const uint8_t* head, uint32_t key, uint32_t* loop_offset);
+
+#endif // SPFM_STREAM_H
@@ -0,0 +1,188 @@
+#include "spfm_virtual.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define VIRTUAL_BYTE_NS (10ull * 1000000000ull / SPFM_VIRTUAL_BAUD_RATE) // 8N1
+#define VIRTUAL_WAIT_NS (1000000000ull / 44100)
+
+typedef struct {
+    uint8_t byte;
+    uint64_t time_ns;       // When it is in the FIFO
+} virtual_byte_t;
+
+struct spfm_virtual {
+    bool light;
+    spfm_virtual_trace_t trace;
+    void* ctx;
+    // Bytes on the line, in the order they go out
+    virtual_byte_t* line;
+    size_t line_head;
+    size_t line_size;
+    size_t line_capacity;
+    uint64_t line_end_ns;   // When the last byte on the line is in
+    // Receive FIFO, a ring
+    virtual_byte_t* fifo;
+    uint32_t fifo_depth;
+    uint32_t fifo_head;
+    uint32_t fifo_count;
+    uint64_t free_ns;       // When the unit takes the next command
+    bool after_wait;        // The last command played was a wait
+    spfm_virtual_stats_t stats;
+};
+
+spfm_virtual_t* spfm_virtual_open(bool light, uint32_t fifo_depth, spfm_virtual_trace_t trace, void* ctx) {
+    if (fifo_depth == 0) return NULL;
+    spfm_virtual_t* v = calloc(1, sizeof(spfm_virtual_t));
+    if (!v) return NULL;
+    v->fifo = malloc(fifo_depth * sizeof(virtual_byte_t));
+    if (!v->fifo) {
+        free(v);
+        return NULL;
+    }
+    v->light = light;
+    v->fifo_depth = fifo_depth;
+    v->trace = trace;
+    v->ctx = ctx;
+    return v;
+}
+
+void spfm_virtual_close(spfm_virtual_t* v) {
+    if (!v) return;
+    free(v->line);
+    free(v->fifo);
+    free(v);
+}
+
+bool spfm_virtual_write(spfm_virtual_t* v, uint64_t host_ns, const uint8_t* bytes, size_t size) {
+    if (v->line_size + size > v->line_capacity) {
+        // Drop what has gone out before growing
+        memmove(v->line, v->line + v->line_head, (v->line_size - v->line_head) * sizeof(virtual_byte_t));
+        v->line_size -= v->line_head;
+        v->line_head = 0;
+    }
+    if (v->line_size + size > v->line_capacity) {
+        size_t capacity = v->line_capacity ? v->line_capacity * 2 : 4096;
+        while (capacity < v->line_size + size) capacity *= 2;
+        virtual_byte_t* line = realloc(v->line, capacity * sizeof(virtual_byte_t));
+        if (!line) return false;
+        v->line = line;
+        v->line_capacity = capacity;
+    }
+    uint64_t t = v->line_end_ns > host_ns ? v->line_end_ns : host_ns;
+    for (size_t i = 0; i < size; i++) {
+        t += VIRTUAL_BYTE_NS;
+        v->line[v->line_size].byte = bytes[i];
+        v->line[v->line_size].time_ns = t;
+        v->line_size++;
+    }
+    v->line_end_ns = t;
+    return true;
+}
+
+static const virtual_byte_t* virtual_fifo_at(const spfm_virtual_t* v, uint32_t i) {
+    return &v->fifo[(v->fifo_head + i) % v->fifo_depth];
+}
+
+// Bytes of the command at the head of the FIFO, as far as they tell. 0 if it is empty.
+static uint32_t virtual_command_size(const spfm_virtual_t* v) {
+    if (v->fifo_count == 0) return 0;
+    uint8_t first = virtual_fifo_at(v, 0)->byte;
+    if (first == 0xFE || first == 0xFF) return 1;
+    if (!v->light) return 3;
+    if (first == 0x80) return 1;
+    if (v->fifo_count < 2) return 4;
+    return virtual_fifo_at(v, 1)->byte == 0x20 ? 3 : 4;
+}
+
+// Plays the command at the head of the FIFO at time_ns
+static void virtual_play(spfm_virtual_t* v, uint32_t size, uint64_t time_ns) {
+    // The unit kept time with waits and then had nothing to go on with
+    const virtual_byte_t* first = virtual_fifo_at(v, 0);
+    if (v->after_wait && first->time_ns > v->free_ns) {
+        v->stats.underruns++;
+        v->stats.starved_ns += first->time_ns - v->free_ns;
+    }
+
+    uint8_t cmd[4];
+    for (uint32_t i = 0; i < size; i++) cmd[i] = virtual_fifo_at(v, i)->byte;
+    v->fifo_head = (v->fifo_head + size) % v->fifo_depth;
+    v->fifo_count -= size;
+
+    spfm_virtual_event_t event = { time_ns, 0, 0, 0, 0 };
+    bool wait = false;
+    if (size == 1 && cmd[0] == 0x80) {
+        wait = true;
+        v->stats.waits++;
+    } else if (size == 1) {
+        event.port = SPFM_VIRTUAL_RESET;
+        event.addr = cmd[0];
+        v->stats.resets++;
+    } else if (v->light && size == 3) {
+        event.slot = cmd[0];
+        event.port = SPFM_VIRTUAL_DATA_ONLY;
+        event.data = cmd[2];
+        v->stats.writes++;
+    } else if (v->light) {
+        event.slot = cmd[0];
+        event.port = cmd[1] >> 1;
+        event.addr = cmd[2];
+        event.data = cmd[3];
+        v->stats.writes++;
+    } else {
+        event.slot = cmd[0] >> 4;
+        event.port = cmd[0] & 0x0F;
+        event.addr = cmd[1];
+        event.data = cmd[2];
+        v->stats.writes++;
+    }
+    if (!wait && v->trace) v->trace(v->ctx, &event);
+    v->free_ns = time_ns + (wait ? VIRTUAL_WAIT_NS : 0);
+    v->after_wait = wait;
+}
+
+uint32_t spfm_virtual_run(spfm_virtual_t* v, uint64_t now_ns) {
+    for (;;) {
+        // The next command is played once its bytes are in and the unit is free,
+        // unless a byte comes in before that
+        uint32_t size = virtual_command_size(v);
+        bool ready = size && v->fifo_count >= size;
+        uint64_t play_ns = 0;
+        if (ready) {
+            uint64_t last_ns = virtual_fifo_at(v, size - 1)->time_ns;
+            play_ns = v->free_ns > last_ns ? v->free_ns : last_ns;
+        }
+        bool arriving = v->line_head < v->line_size;
+        uint64_t arrive_ns = arriving ? v->line[v->line_head].time_ns : 0;
+
+        if (ready && play_ns <= now_ns && (!arriving || play_ns <= arrive_ns)) {
+            virtual_play(v, size, play_ns);
+        } else if (arriving && arrive_ns <= now_ns) {
+            const virtual_byte_t* in = &v->line[v->line_head++];
+            if (v->fifo_count == v->fifo_depth) {
+                v->stats.overruns++;
+                continue;
+            }
+            v->fifo[(v->fifo_head + v->fifo_count) % v->fifo_depth] = *in;
+            v->fifo_count++;
+            v->stats.bytes++;
+            if (v->fifo_count > v->stats.fifo_peak) v->stats.fifo_peak = v->fifo_count;
+        } else {
+            break;
+        }
+    }
+    return (uint32_t)(v->line_size - v->line_head);
+}
+
+uint64_t spfm_virtual_finish(spfm_virtual_t* v) {
+    spfm_virtual_run(v, UINT64_MAX);
+    return v->free_ns;
+}
+
+void spfm_virtual_get_stats(const spfm_virtual_t* v, spfm_virtual_stats_t* stats) {
+    *stats = v->stats;
+}
+
+void spfm_virtual_trace_file(void* ctx, const spfm_virtual_event_t* event) {
+    fprintf((FILE*)ctx, "%llu %u %u %02x %02x\n", (unsigned long long)event->time_ns, event->slot, event->port, event->addr, event->data);
+}
@@ -0,0 +1,71 @@
+#ifndef SPFM_VIRTUAL_H
+#define SPFM_VIRTUAL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Virtual SPFM device.
+// Takes the bytes the player would send to a unit and plays them the way the unit
+// would, without hardware. The bytes cross the serial line at 1.5 Mbaud, 10 bits each,
+// into a receive FIFO of fixed depth. The unit takes one command at a time from the
+// FIFO: a register write is applied once its last byte is in, and an SPFM_Light wait
+// (0x80) holds the unit for one sample. There is no flow control, so a byte that
+// arrives while the FIFO is full is lost, as on the real unit.
+//
+// Commands: SPFM_Light slot, port << 1, address, data, or slot, 0x20, data for
+// data-only chips; SPFM slot << 4 | port, address, data. A 0xFE or 0xFF where a command
+// starts is a reset (SPFM_Light 0xFE) or a type query.
+//
+// Every command played is reported with the host time, in nanoseconds, at which the
+// unit would apply it. The statistics count underruns: the FIFO running dry after a
+// wait, so the unit stops keeping time until the host sends more. They also count
+// overruns, bytes lost to a full FIFO.
+
+#define SPFM_VIRTUAL_BAUD_RATE 1500000
+#define SPFM_VIRTUAL_FIFO_DEPTH 256
+// Ports of events that are not register writes
+#define SPFM_VIRTUAL_DATA_ONLY 0xFF // SPFM_Light data-only write, in data
+#define SPFM_VIRTUAL_RESET     0xFE // Reset or type query, the command byte in addr
+
+typedef struct {
+    uint64_t time_ns;
+    uint8_t slot;
+    uint8_t port;
+    uint8_t addr;
+    uint8_t data;
+} spfm_virtual_event_t;
+
+typedef struct {
+    uint64_t bytes;         // Bytes that reached the FIFO
+    uint64_t writes;        // Register and data-only writes applied
+    uint64_t waits;         // SPFM_Light waits played
+    uint64_t resets;
+    uint64_t underruns;
+    uint64_t starved_ns;    // Time the unit waited for bytes in those underruns
+    uint64_t overruns;      // Bytes lost to a full FIFO
+    uint32_t fifo_peak;     // Most bytes in the FIFO at once
+} spfm_virtual_stats_t;
+
+typedef void (*spfm_virtual_trace_t)(void* ctx, const spfm_virtual_event_t* event);
+
+typedef struct spfm_virtual spfm_virtual_t;
+
+// light selects the SPFM_Light protocol, else the original SPFM's. trace, if not NULL,
+// gets every command played.
+spfm_virtual_t* spfm_virtual_open(bool light, uint32_t fifo_depth, spfm_virtual_trace_t trace, void* ctx);
+void spfm_virtual_close(spfm_virtual_t* v);
+
+// Bytes handed over by the host at host_ns. They go on the line after the ones before them.
+bool spfm_virtual_write(spfm_virtual_t* v, uint64_t host_ns, const uint8_t* bytes, size_t size);
+// Plays what the unit would have played by now_ns. Returns the bytes still on the line.
+uint32_t spfm_virtual_run(spfm_virtual_t* v, uint64_t now_ns);
+// Plays everything left. Returns the time the unit is done.
+uint64_t spfm_virtual_finish(spfm_virtual_t* v);
+void spfm_virtual_get_stats(const spfm_virtual_t* v, spfm_virtual_stats_t* stats);
+
+// Trace to the FILE* in ctx, one "time_ns slot port addr data" line per command
+void spfm_virtual_trace_file(void* ctx, const spfm_virtual_event_t* event);
+
+#endif // SPFM_VIRTUAL_H
@@ -0,0 +1,136 @@
+#include "thread.h"
+
+#include <stdlib.h>
+
+#ifndef _WIN32
+#include <time.h>
+#include <unistd.h>
+#endif
+
+typedef struct {
+    yasp_thread_func_t func;
+    void* arg;
+} thread_start_t;
+
+#ifdef _WIN32
+static DWORD WINAPI thread_entry(LPVOID param) {
+#else
+static void* thread_entry(void* param) {
+#endif
+    thread_start_t start = *(thread_start_t*)param;
+    free(param);
+    start.func(start.arg);
+    return 0;
+}
+
+bool yasp_thread_start(yasp_thread_t* thread, yasp_thread_func_t func, void* arg) {
+    thread_start_t* start = malloc(sizeof(thread_start_t));
+    if (!start) return false;
+    start->func = func;
+    start->arg = arg;
+#ifdef _WIN32
+    *thread = CreateThread(NULL, 0, thread_entry, start, 0, NULL);
+    if (*thread == NULL) {
+        free(start);
+        return false;
+    }
+#else
+    if (pthread_create(thread, NULL, thread_entry, start) != 0) {
+        free(start);
+        return false;
+    }
+#endif
+    return true;
+}
+
+void yasp_thread_join(yasp_thread_t* thread) {
+#ifdef _WIN32
+    WaitForSingleObject(*thread, INFINITE);
+    CloseHandle(*thread);
+#else
+    pthread_join(*thread, NULL);
+#endif
+}
+
+int yasp_cpu_count(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    int count = (int)info.dwNumberOfProcessors;
+#else
+    int count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return count > 0 ? count : 1;
+}
+
+void yasp_mutex_init(yasp_mutex_t* mutex) {
+#ifdef _WIN32
+    InitializeCriticalSection(mutex);
+#else
+    pthread_mutex_init(mutex, NULL);
+#endif
+}
+
+void yasp_mutex_destroy(yasp_mutex_t* mutex) {
+#ifdef _WIN32
+    DeleteCriticalSection(mutex);
+#else
+    pthread_mutex_destroy(mutex);
+#endif
+}
+
+void yasp_mutex_lock(yasp_mutex_t* mutex) {
+#ifdef _WIN32
+    EnterCriticalSection(mutex);
+#else
+    pthread_mutex_lock(mutex);
+#endif
+}
+
+void yasp_mutex_unlock(yasp_mutex_t* mutex) {
+#ifdef _WIN32
+    LeaveCriticalSection(mutex);
+#else
+    pthread_mutex_unlock(mutex);
+#endif
+}
+
+void yasp_cond_init(yasp_cond_t* cond) {
+#ifdef _WIN32
+    InitializeConditionVariable(cond);
+#else
+    pthread_cond_init(cond, NULL);
+#endif
+}
+
+void yasp_cond_destroy(yasp_cond_t* cond) {
+#ifdef _WIN32
+    (void)cond; // Win32 condition variables need no cleanup
+#else
+    pthread_cond_destroy(cond);
+#endif
+}
+
+void yasp_cond_wait(yasp_cond_t* cond, yasp_mutex_t* mutex, uint32_t timeout_ms) {
+#ifdef _WIN32
+    SleepConditionVariableCS(cond, mutex, timeout_ms);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout_ms / 1000;
+    ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(cond, mutex, &ts);
+#endif
+}
+
+void yasp_cond_broadcast(yasp_cond_t* cond) {
+#ifdef _WIN32
+    WakeAllConditionVariable(cond);
+#else
+    pthread_cond_broadcast(cond);
+#endif
+}
@@ -0,0 +1,45 @@
+#ifndef THREAD_H
+#define THREAD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <windows.h>
+typedef HANDLE yasp_thread_t;
+typedef CRITICAL_SECTION yasp_mutex_t;
+typedef CONDITION_VARIABLE yasp_cond_t;
+#else
+#include <pthread.h>
+typedef pthread_t yasp_thread_t;
+typedef pthread_mutex_t yasp_mutex_t;
+typedef pthread_cond_t yasp_cond_t;
+#endif
+
+typedef void (*yasp_thread_func_t)(void* arg);
+
+// Module state that every thread keeps its own copy of
+#ifdef _MSC_VER
+#define YASP_THREAD_LOCAL __declspec(thread)
+#else
+#define YASP_THREAD_LOCAL __thread
+#endif
+
+// Thin wrappers over Win32 threads and pthreads, for modules that need a worker thread.
+bool yasp_thread_start(yasp_thread_t* thread, yasp_thread_func_t func, void* arg);
+void yasp_thread_join(yasp_thread_t* thread);
+// Number of processors available to the process, at least 1.
+int yasp_cpu_count(void);
+
+void yasp_mutex_init(yasp_mutex_t* mutex);
+void yasp_mutex_destroy(yasp_mutex_t* mutex);
+void yasp_mutex_lock(yasp_mutex_t* mutex);
+void yasp_mutex_unlock(yasp_mutex_t* mutex);
+
+void yasp_cond_init(yasp_cond_t* cond);
+void yasp_cond_destroy(yasp_cond_t* cond);
+// Waits at most timeout_ms. The caller re-checks its condition afterwards.
+void yasp_cond_wait(yasp_cond_t* cond, yasp_mutex_t* mutex, uint32_t timeout_ms);
+void yasp_cond_broadcast(yasp_cond_t* cond);
+
+#endif // THREAD_H
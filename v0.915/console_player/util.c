@@ -5,6 +5,8 @@
 #include <mmsystem.h>
 #include <conio.h>
 #else
+#include <stdlib.h>
+#include <time.h>
 #include <termios.h>
 #include <fcntl.h>
 #endif
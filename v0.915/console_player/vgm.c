@@ -20,22 +20,30 @@
 #include "ay_to_opm.h"
 #include "sn_to_ay.h"
 #include "ws_to_opm.h"
+#include "vgm_convert.h"
+#include "opm_param.h"
+#include "vgm_stream.h"
+#include "thread.h"
+#include "file_window.h"
+#include "opm_peephole.h"
+#include "cache_index.h"
+#include "cache_pack.h"
+#include "spfm_stream.h"
+#include "route.h"
+#include "ym2608_upload.h"
+#include "pcm_offload.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <stddef.h>
 
-#ifdef _WIN32
-#include <direct.h> // For _mkdir
-#else
-#include <sys/stat.h> // For mkdir
-#endif
-
 extern volatile int g_flush_mode;
 extern volatile int g_vgm_loop_count;
 extern int g_current_song_total_samples;
 extern volatile cache_mode_t g_cache_mode;
+extern int g_cache_compress;
+extern int g_cache_compiled;
 
 // --- Conversion State ---
 bool g_opn_to_opm_conversion_enabled = false;
@@ -43,48 +51,61 @@ bool g_ay_to_opm_conversion_enabled = false;
 bool g_sn_to_ay_conversion_enabled = false;
 bool g_ws_to_opm_conversion_enabled = false;
 volatile bool g_is_playing_from_cache = false;
-static bool g_is_conversion_active = false;
-static uint32_t g_original_loop_offset = 0;
-static uint32_t g_converted_loop_offset = 0;
 chip_type_t g_vgm_chip_type = CHIP_TYPE_NONE;
 chip_type_t g_original_vgm_chip_type = CHIP_TYPE_NONE; // To store the chip type of the original file
 uint32_t g_original_vgm_chip_clock = 0; // To store the clock of the original chip
 vgm_header_t g_vgm_header;
 
-// --- OPM Writer Callbacks ---
-static FILE* g_cache_fp = NULL;
-
-static void spfm_opm_writer(uint8_t addr, uint8_t data) {
-    spfm_write_reg(get_slot_for_chip(CHIP_TYPE_YM2151), 0, addr, data);
-}
-
-static void vgm_cache_opm_writer(uint8_t addr, uint8_t data) {
-    if (g_cache_fp) {
-        fputc(0x54, g_cache_fp); // YM2151 write
-        fputc(addr, g_cache_fp);
-        fputc(data, g_cache_fp);
+// --- Write Routing ---
+// Where each chip write command of the current track goes, set by vgm_build_routes
+static route_t s_vgm_routes[256];
+// The second AY8910 shares command 0xA0 with the first, it is told apart by bit 7 of the address
+static route_t s_vgm_ay2_route;
+
+// Works out once per track which driver or converter each write command goes to.
+// Commands without a route are dropped.
+static void vgm_build_routes(void) {
+    for (int i = 0; i < 256; i++) s_vgm_routes[i] = route_drop();
+
+    bool opn_to_opm = g_opn_to_opm_conversion_enabled;
+    s_vgm_routes[0x50] = g_sn_to_ay_conversion_enabled ? route_to_converter(CHIP_TYPE_SN76489, 0) : route_to_chip(CHIP_TYPE_SN76489, 0);
+    s_vgm_routes[0xA0] = g_ay_to_opm_conversion_enabled ? route_to_converter(CHIP_TYPE_AY8910, 0) : route_to_chip(CHIP_TYPE_AY8910, 0);
+    s_vgm_routes[0x54] = route_to_chip(CHIP_TYPE_YM2151, 0);
+    s_vgm_routes[0x55] = (opn_to_opm && g_vgm_chip_type == CHIP_TYPE_YM2203) ? route_to_converter(CHIP_TYPE_YM2203, 0) : route_to_chip(CHIP_TYPE_YM2203, 0);
+    for (uint8_t port = 0; port < 2; port++) {
+        s_vgm_routes[0x52 + port] = (opn_to_opm && g_vgm_chip_type == CHIP_TYPE_YM2612) ? route_to_converter(CHIP_TYPE_YM2612, port) : route_to_chip(CHIP_TYPE_YM2612, port);
+        s_vgm_routes[0x56 + port] = (opn_to_opm && g_vgm_chip_type == CHIP_TYPE_YM2608) ? route_to_converter(CHIP_TYPE_YM2608, port) : route_to_chip(CHIP_TYPE_YM2608, port);
     }
+    // There is no WonderSwan to send to, its writes are only played converted
+    if (g_ws_to_opm_conversion_enabled) s_vgm_routes[0xBC] = route_to_converter(CHIP_TYPE_WSWAN, 0);
+    s_vgm_routes[0x51] = route_to_chip(CHIP_TYPE_YM2413, 0);
+    s_vgm_routes[0x5A] = route_to_chip(CHIP_TYPE_YM3812, 0);
+    s_vgm_routes[0x5B] = route_to_chip(CHIP_TYPE_YM3526, 0);
+    s_vgm_routes[0x5C] = route_to_chip(CHIP_TYPE_Y8950, 0);
+    s_vgm_routes[0x5E] = route_to_chip(CHIP_TYPE_YMF262, 0);
+    s_vgm_routes[0x5F] = route_to_chip(CHIP_TYPE_YMF262, 1);
+
+    // The second chip of a type goes to the second one installed. A conversion only
+    // covers the first chip.
+    s_vgm_routes[0x30] = g_sn_to_ay_conversion_enabled ? route_drop() : route_to_chip_instance(CHIP_TYPE_SN76489, 1, 0);
+    s_vgm_ay2_route = g_ay_to_opm_conversion_enabled ? route_drop() : route_to_chip_instance(CHIP_TYPE_AY8910, 1, 0);
+    s_vgm_routes[0xA1] = route_to_chip_instance(CHIP_TYPE_YM2413, 1, 0);
+    s_vgm_routes[0xA4] = route_to_chip_instance(CHIP_TYPE_YM2151, 1, 0);
+    s_vgm_routes[0xA5] = opn_to_opm ? route_drop() : route_to_chip_instance(CHIP_TYPE_YM2203, 1, 0);
+    for (uint8_t port = 0; port < 2; port++) {
+        s_vgm_routes[0xA2 + port] = opn_to_opm ? route_drop() : route_to_chip_instance(CHIP_TYPE_YM2612, 1, port);
+        s_vgm_routes[0xA6 + port] = opn_to_opm ? route_drop() : route_to_chip_instance(CHIP_TYPE_YM2608, 1, port);
+        s_vgm_routes[0xAE + port] = route_to_chip_instance(CHIP_TYPE_YMF262, 1, port);
+    }
+    s_vgm_routes[0xAA] = route_to_chip_instance(CHIP_TYPE_YM3812, 1, 0);
+    s_vgm_routes[0xAB] = route_to_chip_instance(CHIP_TYPE_YM3526, 1, 0);
+    s_vgm_routes[0xAC] = route_to_chip_instance(CHIP_TYPE_Y8950, 1, 0);
 }
 
-// --- Chained Converters for Caching ---
-static void sn_to_ay_bridge(uint8_t addr, uint8_t data) {
-    ay_to_opm_write_reg(addr, data);
-}
-
-static bool vgm_convert_and_cache_from_mem(const uint8_t* vgm_data, size_t vgm_data_size, const vgm_header_t* original_header);
-static chip_type_t get_primary_chip_from_header(const vgm_header_t* header);
-static uint32_t get_clock_from_header(const vgm_header_t* header, chip_type_t chip_type);
-
-
-// Helper to read little-endian 16-bit integer
-static uint16_t read_le16(const uint8_t* data) {
-    return data[0] | (data[1] << 8);
-}
-
-// Helper to read a relative offset
-static uint32_t read_rel_ofs(const uint8_t* data, uint32_t base_ofs) {
-    uint32_t ofs = read_le32(data + base_ofs);
-    return ofs ? (base_ofs + ofs) : 0;
+// --- OPM Writer Callbacks ---
+static void spfm_opm_writer(uint8_t addr, uint8_t data) {
+    const route_t* route = &s_vgm_routes[0x54];
+    route->write(route, addr, data);
 }
 
 // Helper to write little-endian 32-bit integer
@@ -95,185 +116,351 @@ static void write_le32(uint8_t* data, uint32_t value) {
     data[3] = (value >> 24) & 0xFF;
 }
 
-// Helper function to read a UTF-16LE string from the GD3 tag
-static void read_gd3_string(FILE* f, long end_pos, wchar_t* dest, size_t max_len) {
-    long initial_pos = ftell(f);
-    size_t i = 0;
-    while (ftell(f) < end_pos && i < max_len - 1) {
-        uint16_t ch;
-        if (fread(&ch, 2, 1, f) != 1) break;
-        if (ch == 0) break;
-        dest[i++] = (wchar_t)ch;
-    }
-    dest[i] = L'\0';
-    if (i == 0) {
-        fseek(f, initial_pos + 2, SEEK_SET);
-    }
+// --- Progressive Conversion ---
+// Play time converted before playback starts. The converter runs far faster than
+// real time, so it stays ahead of the player from there on.
+#define VGM_CONVERSION_LEAD_SAMPLES (VGM_SAMPLE_RATE * 3 / 10)
+// Converted output grows from here as needed. It no longer scales with the source file,
+// whose size is mostly PCM that the conversion drops.
+#define VGM_CONVERSION_INITIAL_CAPACITY (256 * 1024)
+
+typedef struct vgm_conversion {
+    vgm_stream_t stream;        // 0x100 byte header placeholder, then the converted commands
+    FILE* input_fp;             // The original file, read through input
+    file_window_t input;        // Window over the command data of the original file
+    vgm_header_t* header;       // Header of the original file
+    uint32_t loop_offset;       // Loop point in the stream, valid once the stream is finished
+    bool completed;
+    yasp_thread_t thread;
+} vgm_conversion_t;
+
+static void vgm_conversion_thread(void* arg) {
+    vgm_conversion_t* conv = (vgm_conversion_t*)arg;
+    conv->completed = vgm_convert_to_opm(&conv->stream, &conv->input, conv->header, &conv->loop_offset);
 }
 
-bool vgm_parse_header(FILE* fp, vgm_header_t* header) {
-    uint8_t hdr_buf[0x100];
-    memset(header, 0, sizeof(vgm_header_t));
-
-    if (fseek(fp, 0, SEEK_SET) != 0 || fread(hdr_buf, 1, 0x40, fp) != 0x40) {
-        logging(LOG_LEVEL_ERROR, "Could not read first 0x40 bytes of header.\n");
+// Writes a finished conversion to the cache file, with a proper header and the original GD3 tag.
+static bool vgm_write_cache_file(vgm_conversion_t* conv, const char* cache_filename) {
+    FILE* cache_fp = fopen(cache_filename, "wb");
+    if (!cache_fp) {
+        logging(LOG_LEVEL_ERROR, "Failed to open cache file for writing: %s", cache_filename);
         return false;
     }
 
-    if (memcmp(hdr_buf, "Vgm ", 4) != 0) {
-        logging(LOG_LEVEL_ERROR, "Invalid VGM signature.\n");
-        return false;
-    }
-    memcpy(header->ident, hdr_buf, 4);
-
-    header->version = read_le32(hdr_buf + 0x08);
-    
-    size_t header_size_to_read = 0;
-    if (header->version >= 0x171) header_size_to_read = 0xE4;
-    else if (header->version >= 0x170) header_size_to_read = 0xC0;
-    else if (header->version >= 0x161) header_size_to_read = 0xB8;
-    else if (header->version >= 0x151) header_size_to_read = 0x80;
-    else header_size_to_read = 0x40;
-
-    if (header_size_to_read > 0x40) {
-        if (fread(hdr_buf + 0x40, 1, header_size_to_read - 0x40, fp) != (header_size_to_read - 0x40)) {
-            logging(LOG_LEVEL_WARN, "Could not read full extended header. Some data may be missing.\n");
+    // GD3 block follows the converted data. The converter is done with the original file by now.
+    uint8_t* gd3 = NULL;
+    uint32_t total_gd3_size = 0;
+    if (conv->header->gd3_offset > 0) {
+        uint8_t gd3_head[12];
+        fseek(conv->input_fp, conv->header->gd3_offset, SEEK_SET);
+        if (fread(gd3_head, 1, 12, conv->input_fp) == 12 && memcmp(gd3_head, "Gd3 ", 4) == 0) {
+            uint32_t gd3_length = read_le32(gd3_head + 8);
+            gd3 = malloc(12 + (size_t)gd3_length);
+            if (gd3) {
+                memcpy(gd3, gd3_head, 12);
+                if (fread(gd3 + 12, 1, gd3_length, conv->input_fp) == gd3_length) {
+                    total_gd3_size = 12 + gd3_length;
+                } else {
+                    free(gd3);
+                    gd3 = NULL;
+                }
+            }
         }
+        if (!gd3) logging(LOG_LEVEL_WARN, "Failed to read the GD3 tag, the cache will be written without it.");
     }
 
-    header->eof_offset = read_le32(hdr_buf + 0x04);
-    header->total_samples = read_le32(hdr_buf + 0x18);
-    header->loop_offset = read_rel_ofs(hdr_buf, 0x1C);
-    header->loop_samples = read_le32(hdr_buf + 0x20);
-    
-    if (header->version >= 0x150) {
-        header->vgm_data_offset = read_rel_ofs(hdr_buf, 0x34);
+    // Tidy up the converted stream before it goes to disk. The optimiser writes a new
+    // buffer; if it gives up, the header below goes straight into conv->stream, which the
+    // player thread, finished by now, no longer reads.
+    uint32_t loop_offset = conv->loop_offset;
+    size_t data_size = conv->stream.size;
+    opm_peephole_stats_t stats;
+    uint8_t* optimized = opm_peephole_optimize(conv->stream.data, conv->stream.size, 0x100, &loop_offset, &data_size, &stats);
+    if (optimized) {
+        logging(LOG_LEVEL_INFO, "Cache optimised: %u -> %u bytes, %u -> %u writes",
+                (unsigned)stats.bytes_in, (unsigned)stats.bytes_out, stats.writes_in, stats.writes_out);
+    } else {
+        logging(LOG_LEVEL_WARN, "Cache optimiser skipped, writing the stream as converted.");
+        loop_offset = conv->loop_offset;
+        data_size = conv->stream.size;
+    }
+    uint8_t* data = optimized ? optimized : conv->stream.data;
+
+    long data_start_offset = 0x100;
+    long gd3_start_in_cache = gd3 ? (long)data_size : 0;
+    long final_file_size = (long)data_size + total_gd3_size;
+
+    // Finalize the real header in place of the placeholder
+    uint8_t* header_buf = data;
+    const vgm_header_t* header = conv->header;
+    memset(header_buf, 0, 0x100);
+    memcpy(header_buf, "Vgm ", 4);
+    write_le32(header_buf + 0x04, final_file_size - 4);
+    write_le32(header_buf + 0x08, header->version);
+    if (gd3_start_in_cache > 0) write_le32(header_buf + 0x14, gd3_start_in_cache - 0x14);
+    write_le32(header_buf + 0x18, header->total_samples); // This might need recalculation
+    // --- Copy loop data to cached file ---
+    if (loop_offset > 0 && g_vgm_loop_count != 1) {
+         write_le32(header_buf + 0x1C, loop_offset - 0x1C);
+         write_le32(header_buf + 0x20, header->loop_samples);
     } else {
-        header->vgm_data_offset = 0x40;
+         write_le32(header_buf + 0x1C, 0);
+         write_le32(header_buf + 0x20, 0);
+    }
+    write_le32(header_buf + 0x24, header->rate);
+    write_le32(header_buf + 0x30, get_chip_default_clock(CHIP_TYPE_YM2151));
+    if (header->version >= 0x150) write_le32(header_buf + 0x34, data_start_offset - 0x34);
+
+    bool ok;
+    if (g_cache_compress) {
+        // The container holds the whole file, GD3 included
+        size_t file_size = data_size + total_gd3_size;
+        uint8_t* whole = gd3 ? malloc(file_size) : data;
+        ok = whole != NULL;
+        if (ok && gd3) {
+            memcpy(whole, data, data_size);
+            memcpy(whole + data_size, gd3, total_gd3_size);
+        }
+        cache_pack_stats_t pack_stats;
+        ok = ok && cache_pack_write(cache_fp, whole, file_size, &pack_stats);
+        if (ok) {
+            logging(LOG_LEVEL_INFO, "Cache compressed: %u -> %u bytes", (unsigned)pack_stats.raw_size, (unsigned)pack_stats.packed_size);
+        }
+        if (whole != data) free(whole);
+    } else {
+        ok = fwrite(data, 1, data_size, cache_fp) == data_size;
+        if (gd3) ok = ok && fwrite(gd3, 1, total_gd3_size, cache_fp) == total_gd3_size;
+    }
+    fclose(cache_fp);
+    free(gd3);
+    free(optimized);
+    if (!ok) {
+        logging(LOG_LEVEL_ERROR, "Failed to write cache file: %s", cache_filename);
+        remove(cache_filename);
     }
-    if (header->vgm_data_offset == 0) header->vgm_data_offset = 0x40;
+    return ok;
+}
 
-    header->sn76489_clock = read_le32(hdr_buf + 0x0C);
-    header->ym2413_clock = read_le32(hdr_buf + 0x10);
+// --- Command Source ---
+static size_t vgm_source_read(vgm_source_t* src, void* buf, size_t size) {
+    if (src->pack) {
+        size_t n = cache_pack_read(src->pack, src->pos, buf, size);
+        src->pos += n;
+        return n;
+    }
+    if (src->conversion) {
+        size_t n = vgm_stream_read(&src->conversion->stream, src->pos, buf, size);
+        src->pos += n;
+        return n;
+    }
+    return fread(buf, 1, size, src->fp);
+}
 
-    if (header->version >= 0x101) header->rate = read_le32(hdr_buf + 0x24);
-    if (header->version >= 0x110) {
-        header->sn76489_feedback = read_le16(hdr_buf + 0x28);
-        header->sn76489_shift_width = hdr_buf[0x2A];
-        header->ym2612_clock = read_le32(hdr_buf + 0x2C);
-        header->ym2151_clock = read_le32(hdr_buf + 0x30);
+static bool vgm_source_seek(vgm_source_t* src, uint32_t offset) {
+    if (src->conversion || src->pack) {
+        src->pos = offset;
+        return true;
     }
-    if (header->version >= 0x151) {
-        header->ym2203_clock = read_le32(hdr_buf + 0x44);
-        header->ym2608_clock = read_le32(hdr_buf + 0x48);
-        header->ay8910_clock = read_le32(hdr_buf + 0x74);
+    return fseek(src->fp, (long)offset, SEEK_SET) == 0;
+}
+
+static size_t vgm_source_tell(vgm_source_t* src) {
+    if (src->conversion || src->pack) return src->pos;
+    long pos = ftell(src->fp);
+    return pos < 0 ? 0 : (size_t)pos;
+}
+
+static uint32_t vgm_source_loop_offset(vgm_source_t* src) {
+    if (src->conversion) {
+        // The loop point is known once the converter is done, which is right behind the end command
+        vgm_stream_wait_samples(&src->conversion->stream, UINT32_MAX);
+        return src->conversion->loop_offset;
     }
-    if (header->version >= 0x161) {
-        header->wonderswan_clock = read_le32(hdr_buf + 0xC0);
+    return g_vgm_header.loop_offset;
+}
+
+// Plays one record of a compiled device stream
+static int vgm_process_compiled(vgm_source_t* src, int* loop_counter) {
+    uint8_t op, buf[SPFM_STREAM_MAX_CHUNK];
+    int wait_samples = 0;
+
+    if (vgm_source_read(src, &op, 1) != 1) {
+        g_is_playing = false;
+        return 0;
     }
-    
-    uint32_t gd3_offset = read_rel_ofs(hdr_buf, 0x14);
-    if (gd3_offset > 0) {
-        if (fseek(fp, gd3_offset, SEEK_SET) == 0) {
-            char gd3_sig[4];
-            if (fread(gd3_sig, 1, 4, fp) == 4 && memcmp(gd3_sig, "Gd3 ", 4) == 0) {
-                uint32_t gd3_version, gd3_length;
-                fread(&gd3_version, 4, 1, fp);
-                fread(&gd3_length, 4, 1, fp);
-                long end_pos = ftell(fp) + gd3_length;
-                read_gd3_string(fp, end_pos, header->track_name_en, 256);
-                read_gd3_string(fp, end_pos, header->track_name_jp, 256);
-                read_gd3_string(fp, end_pos, header->game_name_en, 256);
-                read_gd3_string(fp, end_pos, header->game_name_jp, 256);
-                read_gd3_string(fp, end_pos, header->system_name_en, 256);
-                read_gd3_string(fp, end_pos, header->system_name_jp, 256);
-                read_gd3_string(fp, end_pos, header->author_en, 256);
-                read_gd3_string(fp, end_pos, header->author_jp, 256);
-                read_gd3_string(fp, end_pos, header->release_date, 256);
-                read_gd3_string(fp, end_pos, header->vgm_creator, 256);
-                read_gd3_string(fp, end_pos, header->notes, 256);
-            }
+    opm_param_sync(spfm_opm_writer);
+
+    switch (op) {
+        case SPFM_STREAM_DATA: {
+            if (vgm_source_read(src, buf, 2) != 2) { g_is_playing = false; return 0; }
+            size_t len = buf[0] | (buf[1] << 8);
+            if (len > sizeof(buf) || vgm_source_read(src, buf, len) != len) { g_is_playing = false; return 0; }
+            spfm_write_raw(src->compiled_device, buf, len);
+            if (g_flush_mode == 2) spfm_flush();
+            break;
         }
+        case SPFM_STREAM_WAIT:
+            if (vgm_source_read(src, buf, 2) != 2) { g_is_playing = false; return 0; }
+            wait_samples = buf[0] | (buf[1] << 8);
+            break;
+        case SPFM_STREAM_PARAM:
+            if (vgm_source_read(src, buf, 3) != 3) { g_is_playing = false; return 0; }
+            opm_param_write(buf[0], buf[1], buf[2], spfm_opm_writer);
+            if (g_flush_mode == 2) spfm_flush();
+            break;
+        case SPFM_STREAM_DEVICE:
+            if (vgm_source_read(src, &src->compiled_device, 1) != 1) { g_is_playing = false; return 0; }
+            break;
+        case SPFM_STREAM_END:
+            if (src->compiled_loop > 0 && (*loop_counter < g_vgm_loop_count || g_vgm_loop_count == 0)) {
+                src->pos = src->compiled_loop;
+                (*loop_counter)++;
+            } else g_is_playing = false;
+            break;
+        default:
+            logging(LOG_LEVEL_ERROR, "Compiled stream is damaged at offset %u.", (unsigned)(src->pos - 1));
+            g_is_playing = false;
+            break;
     }
-
-    fseek(fp, header->vgm_data_offset, SEEK_SET);
-    return true;
+    return wait_samples;
 }
 
-int vgm_process_command(FILE *input_fp, int* vgm_wait1, int* vgm_wait2, int* loop_counter) {
+int vgm_process_command(vgm_source_t* src, int* vgm_wait1, int* vgm_wait2, int* loop_counter) {
     uint8_t op, buf[2];
     uint16_t u16_tmp;
     int wait_samples = 0;
 
-    if (fread(&op, 1, 1, input_fp) != 1) {
+    if (src->compiled) return vgm_process_compiled(src, loop_counter);
+
+    if (src->capture && g_vgm_header.loop_offset > 0 && vgm_source_tell(src) == g_vgm_header.loop_offset) {
+        spfm_stream_mark_loop(src->capture);
+    }
+
+    if (vgm_source_read(src, &op, 1) != 1) {
         g_is_playing = false;
         return 0;
     }
 
+    // Apply LFO amplitude or AY stereo changes made since the tagged writes were sent.
+    // A capture leaves them out, playing it back syncs on its own.
+    if (g_is_playing_from_cache) {
+        spfm_capture(NULL);
+        opm_param_sync(spfm_opm_writer);
+        spfm_capture(src->capture);
+    }
+
     switch (op) {
-        case 0x50:
-            if (fread(buf, 1, 1, input_fp) != 1) { g_is_playing = false; return 0; }
-            if (g_sn_to_ay_conversion_enabled) sn_to_ay_write_reg(buf[0]);
-            else sn76489_write_reg(get_slot_for_chip(CHIP_TYPE_SN76489), buf[0]);
+        case 0x50: case 0x30: {
+            if (vgm_source_read(src, buf, 1) != 1) { g_is_playing = false; return 0; }
+            const route_t* route = &s_vgm_routes[op];
+            route->write(route, 0, buf[0]);
             break;
-        case 0xA0:
-            if (fread(buf, 1, 2, input_fp) != 2) { g_is_playing = false; return 0; }
-            if (g_ay_to_opm_conversion_enabled) ay_to_opm_write_reg(buf[0], buf[1]);
-            else ay8910_write_reg(get_slot_for_chip(CHIP_TYPE_AY8910), buf[0], buf[1]);
-            break;
-        case 0x52: case 0x53:
-            if (fread(buf, 1, 2, input_fp) != 2) { g_is_playing = false; return 0; }
-            if (g_opn_to_opm_conversion_enabled && g_vgm_chip_type == CHIP_TYPE_YM2612) opn_to_opm_write_reg(buf[0], buf[1], (op == 0x52) ? 0 : 1);
-            else ym2612_write_reg(get_slot_for_chip(CHIP_TYPE_YM2612), (op == 0x52) ? 0 : 1, buf[0], buf[1]);
+        }
+        case 0xA0: {
+            if (vgm_source_read(src, buf, 2) != 2) { g_is_playing = false; return 0; }
+            const route_t* route = (buf[0] & 0x80) ? &s_vgm_ay2_route : &s_vgm_routes[op];
+            route->write(route, buf[0] & 0x7F, buf[1]);
             break;
-        case 0x54:
-            if (fread(buf, 1, 2, input_fp) != 2) { g_is_playing = false; return 0; }
-            ym2151_write_reg(get_slot_for_chip(CHIP_TYPE_YM2151), buf[0], buf[1]);
+        }
+        case VGM_CMD_OPM_PMS: case VGM_CMD_OPM_AY_PAN: // Tagged OPM writes from the conversion cache
+            if (vgm_source_read(src, buf, 2) != 2) { g_is_playing = false; return 0; }
+            if (src->capture) {
+                // Recorded unresolved, so the settings at playback time apply
+                spfm_stream_param(src->capture, op, buf[0], buf[1]);
+                spfm_capture(NULL);
+            }
+            opm_param_write(op, buf[0], buf[1], spfm_opm_writer);
+            spfm_capture(src->capture);
             break;
-        case 0x55:
-            if (fread(buf, 1, 2, input_fp) != 2) { g_is_playing = false; return 0; }
-            if (g_opn_to_opm_conversion_enabled && g_vgm_chip_type == CHIP_TYPE_YM2203) opn_to_opm_write_reg(buf[0], buf[1], 0);
-            else ym2203_write_reg(get_slot_for_chip(CHIP_TYPE_YM2203), buf[0], buf[1]);
+        case 0x67: { // Data block
+            uint8_t head[6];
+            if (vgm_source_read(src, head, sizeof(head)) != sizeof(head)) { g_is_playing = false; return 0; }
+            uint32_t size = read_le32(head + 2);
+            size_t next = vgm_source_tell(src) + size;
+            uint8_t slot = s_vgm_routes[0x57].slot;
+            if (head[1] == VGM_DATA_YM2608_DELTAT && slot != 0xFF && size <= YM2608_UPLOAD_MAX_BLOCK) {
+                uint8_t* payload = malloc(size ? size : 1);
+                if (payload && vgm_source_read(src, payload, size) == size) {
+                    // The upload is not part of the track's timing, so it stays out of a capture.
+                    // A capture that needed one is incomplete without it.
+                    spfm_capture(NULL);
+                    if (ym2608_upload_block(slot, payload, size, update_upload_progress) && src->capture) src->capture->failed = true;
+                    spfm_capture(src->capture);
+                }
+                free(payload);
+            }
+            if (!vgm_source_seek(src, (uint32_t)next)) g_is_playing = false;
             break;
-        case 0x56: case 0x57:
-            if (fread(buf, 1, 2, input_fp) != 2) { g_is_playing = false; return 0; }
-            if (g_opn_to_opm_conversion_enabled && g_vgm_chip_type == CHIP_TYPE_YM2608) opn_to_opm_write_reg(buf[0], buf[1], (op == 0x56) ? 0 : 1);
-            else ym2608_write_reg(get_slot_for_chip(CHIP_TYPE_YM2608), (op == 0x56) ? 0 : 1, buf[0], buf[1]);
+        }
+        case 0x90: case 0x91: case 0x92: case 0x93: case 0x94: case 0x95: { // DAC stream control
+            static const uint8_t lengths[] = {4, 4, 5, 10, 1, 4};
+            uint8_t args[10];
+            size_t len = lengths[op - 0x90];
+            if (vgm_source_read(src, args, len) != len) { g_is_playing = false; return 0; }
+            pcm_offload_command(op, args);
             break;
-        case 0xBC: // WonderSwan
-            {
-                uint8_t addr, data;
-                if (fread(&addr, 1, 1, input_fp) != 1) { g_is_playing = false; return 0; }
-                if (fread(&data, 1, 1, input_fp) != 1) { g_is_playing = false; return 0; }
-                if (g_ws_to_opm_conversion_enabled) ws_to_opm_write_reg(0, addr, data);
-            }
+        }
+        case 0xE0: { // PCM data seek, only used by 0x8n
+            uint8_t offset[4];
+            if (vgm_source_read(src, offset, sizeof(offset)) != sizeof(offset)) { g_is_playing = false; return 0; }
             break;
+        }
         case 0x61:
-            if (fread(&u16_tmp, 1, 2, input_fp) != 2) { g_is_playing = false; return 0; }
+            if (vgm_source_read(src, &u16_tmp, 2) != 2) { g_is_playing = false; return 0; }
             wait_samples = u16_tmp;
             break;
         case 0x62: wait_samples = *vgm_wait1; break;
         case 0x63: wait_samples = *vgm_wait2; break;
-        case 0x66:
-            if (g_vgm_header.loop_offset > 0 && (*loop_counter < g_vgm_loop_count || g_vgm_loop_count == 0)) {
-                if (fseek(input_fp, (long)(g_vgm_header.loop_offset), SEEK_SET) != 0) g_is_playing = false;
+        case 0x66: {
+            if (src->capture) {
+                // One pass is all a capture needs, the loop point is marked in it
+                spfm_stream_end(src->capture);
+                spfm_capture(NULL);
+                src->capture = NULL;
+            }
+            uint32_t loop_offset = vgm_source_loop_offset(src);
+            if (loop_offset > 0 && (*loop_counter < g_vgm_loop_count || g_vgm_loop_count == 0)) {
+                if (!vgm_source_seek(src, loop_offset)) g_is_playing = false;
                 (*loop_counter)++;
             } else g_is_playing = false;
             break;
+        }
         default:
             if (0x70 <= op && op <= 0x7F) wait_samples = (op & 0x0F) + 1;
+            // A YM2612 DAC write from the data bank is not sent, its wait is kept
+            else if (0x80 <= op && op <= 0x8F) wait_samples = op & 0x0F;
+            else if ((0x51 <= op && op <= 0x5F) || (0xA1 <= op && op <= 0xBF)) {
+                // Register writes: chips without a route are dropped
+                if (vgm_source_read(src, buf, 2) != 2) { g_is_playing = false; return 0; }
+                const route_t* route = &s_vgm_routes[op];
+                route->write(route, buf[0], buf[1]);
+            } else {
+                // Commands of chips the player has no use for are skipped by their length
+                uint8_t skip[4];
+                size_t len = 0;
+                if (0x31 <= op && op <= 0x3F) len = 1;
+                else if (0x40 <= op && op <= 0x4E) len = 2;
+                else if (op == 0x4F) len = 1;
+                else if (0xC0 <= op && op <= 0xDF) len = 3;
+                else if (0xE1 <= op) len = 4;
+                if (len && vgm_source_read(src, skip, len) != len) { g_is_playing = false; return 0; }
+            }
             break;
     }
     if (g_flush_mode == 2) spfm_flush();
+    if (src->capture && wait_samples > 0) spfm_stream_wait(src->capture, (uint32_t)wait_samples);
     return wait_samples;
 }
 
 FILE* vgm_play(FILE *input_fp, const char *filename, const char *cache_filename, bool force_reconvert) {
-    (void)filename;
     extern volatile bool g_next_track_flag, g_prev_track_flag, g_quit_flag, g_stop_current_song;
     
     FILE* current_fp = input_fp;
-    bool is_realtime_conversion = false;
+    vgm_conversion_t* conversion = NULL;
+    cache_pack_reader_t* pack = NULL;
+    bool compiled = false;
+    uint32_t compiled_loop = 0;
+    spfm_stream_t* capture = NULL;
 
     // Always parse the header of the original file first to get original chip type and GD3.
     if (!vgm_parse_header(current_fp, &g_vgm_header)) {
@@ -281,8 +468,8 @@ FILE* vgm_play(FILE *input_fp, const char *filename, const char *cache_filename,
         return current_fp; // Return original fp to be closed by caller
     }
     g_current_song_total_samples = g_vgm_header.total_samples;
-    g_original_vgm_chip_type = get_primary_chip_from_header(&g_vgm_header);
-    g_original_vgm_chip_clock = get_clock_from_header(&g_vgm_header, g_original_vgm_chip_type);
+    g_original_vgm_chip_type = vgm_get_primary_chip(&g_vgm_header);
+    g_original_vgm_chip_clock = vgm_get_chip_clock(&g_vgm_header, g_original_vgm_chip_type);
     g_vgm_chip_type = g_original_vgm_chip_type;
     
     bool needs_opn_conversion = (g_vgm_chip_type == CHIP_TYPE_YM2612 || g_vgm_chip_type == CHIP_TYPE_YM2203 || g_vgm_chip_type == CHIP_TYPE_YM2608);
@@ -293,23 +480,79 @@ FILE* vgm_play(FILE *input_fp, const char *filename, const char *cache_filename,
     g_ay_to_opm_conversion_enabled = false;
     g_sn_to_ay_conversion_enabled = false;
     g_ws_to_opm_conversion_enabled = false;
-    g_is_conversion_active = false;
 
     bool needs_ay_conversion = (g_vgm_chip_type == CHIP_TYPE_AY8910);
     bool needs_sn_conversion = (g_vgm_chip_type == CHIP_TYPE_SN76489);
     bool needs_ws_conversion = (g_vgm_chip_type == CHIP_TYPE_WSWAN);
 
-    if ((needs_opn_conversion || needs_ay_conversion || needs_sn_conversion || needs_ws_conversion) && opm_available) {
-        g_is_conversion_active = true; // Mark that some conversion is happening
+    // A track whose chip is installed plays on it, together with the other chips it uses
+    bool primary_installed = get_slot_for_chip(g_vgm_chip_type) != 0xFF;
+    bool needs_conversion = (needs_opn_conversion || needs_ay_conversion || needs_sn_conversion || needs_ws_conversion) && opm_available && !primary_installed;
+    if (needs_conversion) {
         // Set global flags for UI display
         if (needs_opn_conversion) g_opn_to_opm_conversion_enabled = true;
         if (needs_ay_conversion) g_ay_to_opm_conversion_enabled = true;
         if (needs_sn_conversion) g_sn_to_ay_conversion_enabled = true;
         if (needs_ws_conversion) g_ws_to_opm_conversion_enabled = true;
+    }
+
+    // Samples the YM2608 plays from its RAM go in before the first note. Blocks already
+    // loaded by an earlier track are not sent again.
+    uint8_t ym2608_slot = get_slot_for_chip(CHIP_TYPE_YM2608);
+    if (!needs_conversion && ym2608_slot != 0xFF && g_vgm_header.ym2608_clock && spfm_get_device_count() > 0) {
+        ym2608_upload_preload(ym2608_slot, input_fp, &g_vgm_header, update_upload_progress);
+    }
+    // A free YM2608 plays the DAC streams of the track from its RAM instead
+    if (spfm_get_device_count() > 0) {
+        pcm_offload_open(input_fp, &g_vgm_header, filename, g_cache_mode == CACHE_MODE_NORMAL && !force_reconvert);
+    }
 
+    // --- COMPILED DEVICE STREAM ---
+    // Holds the bytes the device got the last time the track played, for this device and slot setup
+    uint32_t compiled_key = spfm_stream_key();
+    char compiled_name[MAX_PATH_LEN];
+    char compiled_filename[MAX_PATH_LEN];
+    spfm_stream_cache_name(filename, compiled_key, compiled_name, sizeof(compiled_name));
+    cache_index_path(compiled_name, compiled_filename, sizeof(compiled_filename));
+    bool compiled_enabled = g_cache_compiled && spfm_get_device_count() > 0;
+
+    FILE* compiled_fp = NULL;
+    if (compiled_enabled && g_cache_mode == CACHE_MODE_NORMAL && !force_reconvert
+        && cache_index_lookup(compiled_filename, filename, VGM_CONVERTER_VERSION)) {
+        compiled_fp = fopen(compiled_filename, "rb");
+        if (!compiled_fp) cache_index_remove(compiled_filename);
+    }
+    if (compiled_fp) {
+        uint8_t head[SPFM_STREAM_HEADER_SIZE];
+        pack = calloc(1, sizeof(cache_pack_reader_t));
+        if (!pack || !cache_pack_detect(compiled_fp) || !cache_pack_open(pack, compiled_fp)
+            || cache_pack_read(pack, 0, head, sizeof(head)) != sizeof(head)
+            || !spfm_stream_parse_header(head, compiled_key, &compiled_loop)) {
+            logging(LOG_LEVEL_WARN, "Compiled stream is damaged, playing without it: %s", compiled_filename);
+            if (pack) cache_pack_close(pack);
+            free(pack);
+            pack = NULL;
+            fclose(compiled_fp);
+            cache_index_remove(compiled_filename);
+        } else {
+            logging(LOG_LEVEL_INFO, "Found compiled stream: %s. Playing from it.", compiled_filename);
+            fclose(current_fp); // Close original file
+            current_fp = compiled_fp;
+            compiled = true;
+            if (needs_conversion) {
+                // Recorded from the conversion cache
+                g_is_playing_from_cache = true;
+                g_vgm_chip_type = CHIP_TYPE_YM2151;
+            }
+        }
+    }
+
+    if (needs_conversion && !compiled) {
         FILE* cache_fp_read = NULL;
-        if (g_cache_mode == CACHE_MODE_NORMAL && !force_reconvert) {
+        if (g_cache_mode == CACHE_MODE_NORMAL && !force_reconvert
+            && cache_index_lookup(cache_filename, filename, VGM_CONVERTER_VERSION)) {
             cache_fp_read = fopen(cache_filename, "rb");
+            if (!cache_fp_read) cache_index_remove(cache_filename);
         }
 
         if (cache_fp_read) {
@@ -318,478 +561,173 @@ FILE* vgm_play(FILE *input_fp, const char *filename, const char *cache_filename,
             fclose(current_fp); // Close original file
             current_fp = cache_fp_read;
             g_is_playing_from_cache = true;
-            if (!vgm_parse_header(current_fp, &g_vgm_header)) { 
+            if (cache_pack_detect(current_fp)) {
+                // Compressed cache: blocks are decompressed ahead of the player on a helper thread
+                uint8_t hdr_buf[0x100];
+                pack = calloc(1, sizeof(cache_pack_reader_t));
+                if (!pack || !cache_pack_open(pack, current_fp) || cache_pack_read(pack, 0, hdr_buf, sizeof(hdr_buf)) != sizeof(hdr_buf)
+                    || memcmp(hdr_buf, "Vgm ", 4) != 0) {
+                    logging(LOG_LEVEL_ERROR, "Compressed cache file is damaged: %s", cache_filename);
+                    if (pack) cache_pack_close(pack);
+                    free(pack);
+                    g_current_song_total_samples = 0;
+                    return current_fp;
+                }
+                // The GD3 tag is the one already read from the original file
+                vgm_parse_header_fields(hdr_buf, &g_vgm_header);
+            } else if (!vgm_parse_header(current_fp, &g_vgm_header)) { 
                 // Don't close current_fp here, let the caller do it.
                 g_current_song_total_samples = 0;
                 return current_fp; 
             }
             g_current_song_total_samples = g_vgm_header.total_samples;
-            g_vgm_chip_type = get_primary_chip_from_header(&g_vgm_header);
+            g_vgm_chip_type = vgm_get_primary_chip(&g_vgm_header);
         } else {
-            // --- CACHE DOES NOT EXIST, CREATE IT ---
+            // --- CACHE DOES NOT EXIST, CONVERT WHILE PLAYING ---
             logging(LOG_LEVEL_INFO, "Cache not found. Converting %s to OPM...", chip_type_to_string(g_vgm_chip_type));
 
-#ifdef _WIN32
-            _mkdir("console_player/cache");
-#else
-            mkdir("console_player/cache", 0755);
-#endif
-            
-            // 1. Read entire original file into memory
-            fseek(input_fp, 0, SEEK_END);
-            long original_file_size = ftell(input_fp);
-            fseek(input_fp, 0, SEEK_SET);
-            uint8_t* original_file_data = malloc(original_file_size);
-            if (!original_file_data || fread(original_file_data, 1, original_file_size, input_fp) != original_file_size) {
-                logging(LOG_LEVEL_ERROR, "Failed to read original VGM file into memory.");
-                if (original_file_data) free(original_file_data);
-                // Don't close input_fp here, it's already closed or invalid.
-                // Return the original pointer for the caller to attempt cleanup.
+            // 1. Read the original file through a small window instead of loading it.
+            // PCM data blocks are skipped over, so even huge files only cost the window.
+            if (g_vgm_header.eof_offset + 4 <= g_vgm_header.vgm_data_offset) {
+                logging(LOG_LEVEL_ERROR, "VGM file has no command data.");
+                return input_fp; // Return original fp to be closed by caller
+            }
+            conversion = calloc(1, sizeof(vgm_conversion_t));
+            if (!conversion) {
+                logging(LOG_LEVEL_ERROR, "Failed to allocate the conversion.");
+                return input_fp;
+            }
+            size_t vgm_data_size = (g_vgm_header.eof_offset + 4) - g_vgm_header.vgm_data_offset;
+            if (!file_window_open(&conversion->input, input_fp, g_vgm_header.vgm_data_offset, vgm_data_size, FILE_WINDOW_DEFAULT_SIZE)) {
+                logging(LOG_LEVEL_ERROR, "Failed to allocate the read window for the original VGM file.");
+                free(conversion);
                 return input_fp;
             }
-            // We are done with the original file, close it. The caller no longer needs to.
-            fclose(input_fp); 
-
-            // 2. Open cache file for writing
-            g_cache_fp = fopen(cache_filename, "wb");
-            if (!g_cache_fp) {
-                logging(LOG_LEVEL_ERROR, "Failed to open cache file for writing: %s", cache_filename);
-                free(original_file_data);
+            // The conversion owns the original file from here on. The caller no longer needs to close it.
+            conversion->input_fp = input_fp;
+            current_fp = NULL;
+
+            // 2. Start converting on a separate thread, behind a placeholder header
+            if (!vgm_stream_init(&conversion->stream, VGM_CONVERSION_INITIAL_CAPACITY)) {
+                logging(LOG_LEVEL_ERROR, "Failed to allocate the conversion stream.");
+                file_window_close(&conversion->input);
+                fclose(input_fp);
+                free(conversion);
                 return NULL; // Return NULL as we couldn't proceed.
             }
-
-            // 3. Write placeholder header and convert data
             uint8_t header_buf[0x100] = {0};
-            fwrite(header_buf, 1, 0x100, g_cache_fp);
-            long data_start_offset = ftell(g_cache_fp);
-
-            const uint8_t* vgm_data_ptr = original_file_data + g_vgm_header.vgm_data_offset;
-            size_t vgm_data_size = (g_vgm_header.eof_offset + 4) - g_vgm_header.vgm_data_offset;
-            vgm_convert_and_cache_from_mem(vgm_data_ptr, vgm_data_size, &g_vgm_header);
-
-            // 4. Write GD3 block from memory to cache
-            long gd3_start_in_cache = 0;
-            uint32_t gd3_offset_in_header = read_le32(original_file_data + 0x14);
-            if (gd3_offset_in_header > 0) {
-                uint32_t gd3_abs_offset = 0x14 + gd3_offset_in_header;
-                uint32_t gd3_length = read_le32(original_file_data + gd3_abs_offset + 8);
-                uint32_t total_gd3_size = 12 + gd3_length;
-                
-                gd3_start_in_cache = ftell(g_cache_fp);
-                fwrite(original_file_data + gd3_abs_offset, 1, total_gd3_size, g_cache_fp);
+            vgm_stream_write(&conversion->stream, header_buf, 0x100);
+            conversion->header = &g_vgm_header;
+            if (!yasp_thread_start(&conversion->thread, vgm_conversion_thread, conversion)) {
+                logging(LOG_LEVEL_ERROR, "Failed to start the conversion thread.");
+                vgm_stream_free(&conversion->stream);
+                file_window_close(&conversion->input);
+                fclose(input_fp);
+                free(conversion);
+                return NULL;
             }
 
-            // 5. Finalize and write the real header
-            long final_file_size = ftell(g_cache_fp);
-            memset(header_buf, 0, 0x100);
-            memcpy(header_buf, "Vgm ", 4);
-            write_le32(header_buf + 0x04, final_file_size - 4);
-            write_le32(header_buf + 0x08, g_vgm_header.version);
-            if (gd3_start_in_cache > 0) write_le32(header_buf + 0x14, gd3_start_in_cache - 0x14);
-            write_le32(header_buf + 0x18, g_vgm_header.total_samples); // This might need recalculation
-            // --- Copy loop data to cached file ---
-            if (g_converted_loop_offset > 0 && g_vgm_loop_count != 1) {
-                 write_le32(header_buf + 0x1C, g_converted_loop_offset - 0x1C);
-                 write_le32(header_buf + 0x20, g_vgm_header.loop_samples);
-            } else {
-                 write_le32(header_buf + 0x1C, 0);
-                 write_le32(header_buf + 0x20, 0);
-            }
-            write_le32(header_buf + 0x24, g_vgm_header.rate);
-            write_le32(header_buf + 0x30, get_chip_default_clock(CHIP_TYPE_YM2151));
-            if (g_vgm_header.version >= 0x150) write_le32(header_buf + 0x34, data_start_offset - 0x34);
-
-            fseek(g_cache_fp, 0, SEEK_SET);
-            fwrite(header_buf, 1, 0x100, g_cache_fp);
-            fclose(g_cache_fp);
-            g_cache_fp = NULL;
-            free(original_file_data);
-
-            // 6. Re-open the newly created cache file for playing
-            current_fp = fopen(cache_filename, "rb");
-            if (!current_fp) { 
-                logging(LOG_LEVEL_ERROR, "Failed to open newly created cache file!"); 
-                return NULL; // Return NULL, caller has nothing to close.
-            }
+            // 3. Play as soon as the first few hundred milliseconds are converted
+            vgm_stream_wait_samples(&conversion->stream, VGM_CONVERSION_LEAD_SAMPLES);
             g_is_playing_from_cache = true;
-            if (!vgm_parse_header(current_fp, &g_vgm_header)) { 
-                // Let caller close the fp
-                return current_fp; 
-            }
-            g_current_song_total_samples = g_vgm_header.total_samples;
-            g_vgm_chip_type = get_primary_chip_from_header(&g_vgm_header);
         }
     }
 
-    if (!is_realtime_conversion) {
+    vgm_source_t src = {0};
+    src.fp = current_fp;
+    src.conversion = conversion;
+    src.pack = pack;
+    src.compiled = compiled;
+    src.compiled_loop = compiled_loop;
+    if (conversion) {
+        src.pos = 0x100;
+    } else if (compiled) {
+        src.pos = SPFM_STREAM_HEADER_SIZE;
+    } else if (pack) {
+        src.pos = g_vgm_header.vgm_data_offset;
+    } else {
         fseek(current_fp, g_vgm_header.vgm_data_offset, SEEK_SET);
     }
 
+    // Record what the device gets on this play. A running conversion has no loop point
+    // to mark yet, so only files are recorded.
+    if (compiled_enabled && !compiled && !conversion) {
+        capture = malloc(sizeof(spfm_stream_t));
+        if (capture && !spfm_stream_init(capture, compiled_key)) {
+            free(capture);
+            capture = NULL;
+        }
+        src.capture = capture;
+    }
+
+    vgm_build_routes();
     g_is_playing = true;
+    opm_param_reset();
+    spfm_capture(capture);
     
     #ifdef _WIN32
-    HANDLE h_thread = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)vgm_player_thread, current_fp, 0, NULL);
+    HANDLE h_thread = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)vgm_player_thread, &src, 0, NULL);
     if (h_thread) {
         while (g_is_playing && !g_next_track_flag && !g_prev_track_flag && !g_stop_current_song && !g_quit_flag) {
             if (WaitForSingleObject(h_thread, 16) == WAIT_OBJECT_0) break;
         }
+        // The player reads src, so it has to be gone before src goes out of scope
+        WaitForSingleObject(h_thread, INFINITE);
         CloseHandle(h_thread);
     }
     #else
-    vgm_player_thread(current_fp);
+    vgm_player_thread(&src);
     #endif
+    spfm_capture(NULL);
 
-    return current_fp;
-}
-
-DWORD WINAPI vgm_player_thread(LPVOID lpParam) {
-    FILE* input_fp = (FILE*)lpParam;
-    extern volatile int g_timer_mode;
-
-    // VGMPlay Mode (most accurate, uses multimedia timer)
-    if (g_timer_mode == 3) {
-        int vgm_wait1 = VGM_DEFAULT_WAIT1, vgm_wait2 = VGM_DEFAULT_WAIT2;
-        int loop_counter = 1;
-        extern volatile bool g_is_paused, g_next_track_flag, g_prev_track_flag, g_quit_flag, g_stop_current_song;
-        extern volatile double g_speed_multiplier;
-
-        LARGE_INTEGER g_freq, g_last_counter;
-        QueryPerformanceFrequency(&g_freq);
-        
-        HANDLE mm_timer_event = CreateEvent(NULL, FALSE, FALSE, NULL);
-        MMRESULT timer_id = timeSetEvent(1, 1, (LPTIMECALLBACK)mm_timer_event, 0, TIME_PERIODIC | TIME_CALLBACK_EVENT_SET);
-        if (timer_id == 0) {
-            logging(LOG_LEVEL_ERROR, "Failed to create multimedia timer for VGMPlay mode.\n");
-            if(mm_timer_event) CloseHandle(mm_timer_event);
-            g_is_playing = false;
-            return 1;
+    if (capture) {
+        // Only a capture that reached the end of the track is kept
+        if (capture->ended && spfm_stream_save(capture, compiled_filename)) {
+            cache_index_add(compiled_filename, filename, VGM_CONVERTER_VERSION);
         }
+        spfm_stream_free(capture);
+        free(capture);
+    }
 
-        QueryPerformanceCounter(&g_last_counter);
-        double samples_per_tick = (double)VGM_SAMPLE_RATE / g_freq.QuadPart;
-        double samples_to_process = 0;
-
-        while (g_is_playing && !g_next_track_flag && !g_prev_track_flag && !g_stop_current_song && !g_quit_flag) {
-            WaitForSingleObject(mm_timer_event, INFINITE);
-
-            while (g_is_paused && !g_next_track_flag && !g_prev_track_flag && !g_stop_current_song && !g_quit_flag) {
-                yasp_usleep(100000);
-                QueryPerformanceCounter(&g_last_counter);
-            }
-
-            LARGE_INTEGER current_counter;
-            QueryPerformanceCounter(&current_counter);
-            samples_to_process += (current_counter.QuadPart - g_last_counter.QuadPart) * samples_per_tick * g_speed_multiplier;
-            g_last_counter = current_counter;
-
-            int samples_processed_this_loop = 0;
-            while (samples_processed_this_loop < (int)samples_to_process) {
-                int samples = vgm_process_command(input_fp, &vgm_wait1, &vgm_wait2, &loop_counter);
-                if (samples > 0) {
-                    samples_processed_this_loop += samples;
-                }
-                if (!g_is_playing) break;
-            }
-            samples_to_process -= samples_processed_this_loop;
-        }
-
-        timeKillEvent(timer_id);
-        CloseHandle(mm_timer_event);
-    } 
-    // Compensated Sleep Mode (less accurate but good fallback for other modes)
-    else {
-        int vgm_wait1 = VGM_DEFAULT_WAIT1, vgm_wait2 = VGM_DEFAULT_WAIT2;
-        int loop_counter = 1;
-        extern volatile bool g_is_paused, g_next_track_flag, g_prev_track_flag, g_quit_flag, g_stop_current_song;
-        extern volatile double g_speed_multiplier;
-
-        LARGE_INTEGER g_freq, g_last_counter;
-        QueryPerformanceFrequency(&g_freq);
-        QueryPerformanceCounter(&g_last_counter);
-        double samples_per_tick = (double)VGM_SAMPLE_RATE / g_freq.QuadPart;
-        double samples_to_process = 0;
-
-        while (g_is_playing && !g_next_track_flag && !g_prev_track_flag && !g_stop_current_song && !g_quit_flag) {
-            while (g_is_paused && !g_next_track_flag && !g_prev_track_flag && !g_stop_current_song && !g_quit_flag) {
-                yasp_usleep(100000);
-                QueryPerformanceCounter(&g_last_counter); // Reset timer after pause
-            }
-
-            LARGE_INTEGER current_counter;
-            QueryPerformanceCounter(&current_counter);
-            samples_to_process += (current_counter.QuadPart - g_last_counter.QuadPart) * samples_per_tick * g_speed_multiplier;
-            g_last_counter = current_counter;
-
-            int samples_to_run = (int)samples_to_process;
-            if (samples_to_run > 0) {
-                int samples_run_this_cycle = 0;
-                while(samples_run_this_cycle < samples_to_run) {
-                    int s = vgm_process_command(input_fp, &vgm_wait1, &vgm_wait2, &loop_counter);
-                    if (s > 0) {
-                        samples_run_this_cycle += s;
-                    }
-                    if (!g_is_playing) break;
-                }
-                samples_to_process -= samples_run_this_cycle;
+    if (conversion) {
+        // 4. Let the converter finish and commit the stream to the cache.
+        // Quitting abandons it; a partial stream is never cached.
+        if (g_quit_flag) vgm_stream_cancel(&conversion->stream);
+        yasp_thread_join(&conversion->thread);
+        if (conversion->completed) {
+            if (vgm_write_cache_file(conversion, cache_filename)) {
+                logging(LOG_LEVEL_INFO, "Conversion finished. Cache written to %s", cache_filename);
+                cache_index_add(cache_filename, filename, VGM_CONVERTER_VERSION);
+                // A stream compiled from the previous conversion is out of date
+                cache_index_remove(compiled_filename);
             }
-            
-            yasp_usleep(1000); // Sleep 1ms to yield CPU
         }
+        vgm_stream_free(&conversion->stream);
+        file_window_close(&conversion->input);
+        fclose(conversion->input_fp);
+        free(conversion);
     }
-
-    spfm_flush();
-    g_is_playing = false;
-    return 0;
-}
-
-static bool vgm_convert_and_cache_from_mem(const uint8_t* vgm_data, size_t vgm_data_size, const vgm_header_t* original_header) {
-    chip_type_t original_chip_type = get_primary_chip_from_header(original_header);
-    uint32_t original_clock = get_clock_from_header(original_header, original_chip_type);
-
-    g_original_loop_offset = original_header->loop_offset;
-    g_converted_loop_offset = 0;
-
-    // Setup the conversion chain
-    if (g_opn_to_opm_conversion_enabled) {
-        opn_to_opm_init(original_chip_type, original_clock, vgm_cache_opm_writer);
-    } else if (g_ay_to_opm_conversion_enabled) {
-        ay_to_opm_init(original_chip_type, original_clock, vgm_cache_opm_writer);
-    } else if (g_ws_to_opm_conversion_enabled) {
-        ws_to_opm_init(original_chip_type, original_clock, vgm_cache_opm_writer);
-    } else if (g_sn_to_ay_conversion_enabled) {
-        ay_to_opm_init(CHIP_TYPE_AY8910, get_chip_default_clock(CHIP_TYPE_AY8910), vgm_cache_opm_writer);
-        sn_to_ay_init(original_chip_type, original_clock, sn_to_ay_bridge);
+    if (pack) {
+        cache_pack_close(pack);
+        free(pack);
     }
 
-    size_t pos = 0;
-    while (pos < vgm_data_size) {
-        // Check for loop point
-        if (g_original_loop_offset > 0 && (original_header->vgm_data_offset + pos) >= g_original_loop_offset && g_converted_loop_offset == 0) {
-            g_converted_loop_offset = ftell(g_cache_fp);
-        }
-
-        uint8_t op = vgm_data[pos++];
-        uint8_t d1, d2;
-
-        switch (op) {
-            // --- Convertible Chips ---
-            case 0x52: case 0x53: { // YM2612
-                if (pos + 2 > vgm_data_size) goto end_convert_loop;
-                d1 = vgm_data[pos++]; d2 = vgm_data[pos++];
-                if (g_opn_to_opm_conversion_enabled && original_chip_type == CHIP_TYPE_YM2612) {
-                    opn_to_opm_write_reg(d1, d2, (op == 0x52) ? 0 : 1);
-                } else {
-                    fputc(op, g_cache_fp); fputc(d1, g_cache_fp); fputc(d2, g_cache_fp);
-                }
-                break;
-            }
-            case 0x55: { // YM2203
-                if (pos + 2 > vgm_data_size) goto end_convert_loop;
-                d1 = vgm_data[pos++]; d2 = vgm_data[pos++];
-                if (g_opn_to_opm_conversion_enabled && original_chip_type == CHIP_TYPE_YM2203) {
-                    opn_to_opm_write_reg(d1, d2, 0);
-                } else {
-                    fputc(op, g_cache_fp); fputc(d1, g_cache_fp); fputc(d2, g_cache_fp);
-                }
-                break;
-            }
-            case 0x56: case 0x57: { // YM2608
-                if (pos + 2 > vgm_data_size) goto end_convert_loop;
-                d1 = vgm_data[pos++]; d2 = vgm_data[pos++];
-                if (g_opn_to_opm_conversion_enabled && original_chip_type == CHIP_TYPE_YM2608) {
-                    opn_to_opm_write_reg(d1, d2, (op == 0x56) ? 0 : 1);
-                } else {
-                    fputc(op, g_cache_fp); fputc(d1, g_cache_fp); fputc(d2, g_cache_fp);
-                }
-                break;
-            }
-            case 0xA0: { // AY8910
-                if (pos + 2 > vgm_data_size) goto end_convert_loop;
-                d1 = vgm_data[pos++]; d2 = vgm_data[pos++];
-                if (g_ay_to_opm_conversion_enabled && original_chip_type == CHIP_TYPE_AY8910) {
-                    ay_to_opm_write_reg(d1, d2);
-                } else if (!g_is_conversion_active) { // Passthrough only if no conversion is active
-                    fputc(op, g_cache_fp); fputc(d1, g_cache_fp); fputc(d2, g_cache_fp);
-                }
-                // Otherwise, drop the command if we are converting another chip to OPM
-                break;
-            }
-            case 0x50: { // SN76489
-                if (pos + 1 > vgm_data_size) goto end_convert_loop;
-                d1 = vgm_data[pos++];
-                if (g_sn_to_ay_conversion_enabled && original_chip_type == CHIP_TYPE_SN76489) {
-                    sn_to_ay_write_reg(d1);
-                } else if (!g_is_conversion_active) { // Passthrough only if no conversion is active
-                    fputc(op, g_cache_fp); fputc(d1, g_cache_fp);
-                }
-                // Otherwise, drop the command
-                break;
-            }
-            case 0xBC: { // WonderSwan - Format: BC aa dd
-                if (pos + 2 > vgm_data_size) goto end_convert_loop;
-                uint8_t addr = vgm_data[pos++];
-                uint8_t data = vgm_data[pos++];
-                if (g_ws_to_opm_conversion_enabled && original_chip_type == CHIP_TYPE_WSWAN) {
-                    ws_to_opm_write_reg(0, addr, data);
-                } else {
-                    // Passthrough if not converting
-                    fputc(op, g_cache_fp);
-                    fputc(addr, g_cache_fp);
-                    fputc(data, g_cache_fp);
-                }
-                break;
-            }
-
-            // --- Non-Convertible Chips (Drop if conversion is active) ---
-            case 0x54: // YM2151
-            case 0x51: // YM2413
-            case 0x58: case 0x59: case 0x5A: case 0x5B: // YM3812, YM3526, Y8950, YMZ280B
-            case 0x5C: case 0x5D: case 0x5E: case 0x5F: // YMF262
-            case 0xB0: case 0xB1: case 0xB2: case 0xB3: // RF5C68, RF5C164, PWM, GB DMG
-            case 0xB4: case 0xB5: case 0xB6: case 0xB7: // NES APU, MultiPCM, uPD7759, OKIM6258
-            case 0xB8: // OKIM6295
-                if (pos + 2 > vgm_data_size) goto end_convert_loop;
-                if (!g_is_conversion_active) {
-                    d1 = vgm_data[pos]; d2 = vgm_data[pos+1];
-                    fputc(op, g_cache_fp); fputc(d1, g_cache_fp); fputc(d2, g_cache_fp);
-                }
-                pos += 2;
-                break;
-            
-            case 0xC0: case 0xC1: case 0xC2: // SegaPCM, RF5C68, RF5C164 mem write
-            case 0xD0: case 0xD1: case 0xD2: // YMF278B, YMF271, SCC1
-                if (pos + 3 > vgm_data_size) goto end_convert_loop;
-                if (!g_is_conversion_active) {
-                    fwrite(&vgm_data[pos-1], 1, 4, g_cache_fp);
-                }
-                pos += 3;
-                break;
-
-            case 0x4F: // GG Stereo
-            case 0x95: // DAC Stream Stop
-                if (pos + 1 > vgm_data_size) goto end_convert_loop;
-                if (!g_is_conversion_active) {
-                    fwrite(&vgm_data[pos-1], 1, 2, g_cache_fp);
-                }
-                pos += 1;
-                break;
-
-            case 0x90: case 0x91: case 0x92: case 0x93: case 0x94: // DAC Stream Control
-                // These are complex and should be dropped during conversion
-                if (op == 0x90 && pos + 4 <= vgm_data_size) pos += 4;
-                else if (op == 0x91 && pos + 4 <= vgm_data_size) pos += 4;
-                else if (op == 0x92 && pos + 5 <= vgm_data_size) pos += 5;
-                else if (op == 0x93 && pos + 10 <= vgm_data_size) pos += 10;
-                else if (op == 0x94 && pos + 1 <= vgm_data_size) pos += 1;
-                else goto end_convert_loop; // Invalid format
-                break;
-
-            // --- Common Commands (Passthrough) ---
-            case 0x61: {
-                if (pos + 2 > vgm_data_size) goto end_convert_loop;
-                uint16_t wait = read_le16(&vgm_data[pos]);
-                pos += 2;
-                if (g_ay_to_opm_conversion_enabled) {
-                    for (int i = 0; i < wait; i++) {
-                        ay_to_opm_update_envelope();
-                    }
-                }
-                if (g_ws_to_opm_conversion_enabled) {
-                    ws_to_opm_update(wait);
-                }
-                fputc(op, g_cache_fp);
-                fwrite(&wait, 2, 1, g_cache_fp);
-                break;
-            }
-            case 0x62: case 0x63: case 0x66:
-                fputc(op, g_cache_fp);
-                break;
-
-            // --- Commands to properly parse and skip ---
-            case 0x67: { // Data block
-                if (pos + 6 > vgm_data_size) goto end_convert_loop;
-                // Skip the command byte (0x67), the type byte, and the 4-byte size
-                uint32_t block_size = read_le32(&vgm_data[pos + 2]);
-                pos += 6 + block_size;
-                break;
-            }
-            case 0xE0: // PCM data seek
-                if (pos + 4 > vgm_data_size) goto end_convert_loop;
-                pos += 4;
-                break;
-            
-            // --- Special Handling ---
-            default:
-                // During conversion, drop all unknown or unhandled commands.
-                if (g_is_conversion_active) {
-                    // The only commands we let through are waits and end.
-                    // All other commands are assumed to be for chips we are replacing.
-                    // We just need to advance the position pointer correctly.
-                    if (op >= 0x30 && op <= 0x3F) pos += 1;
-                    else if (op >= 0x40 && op <= 0x4E) pos += 2;
-                    else if (op >= 0xA1 && op <= 0xBF) pos += 2;
-                    else if (op >= 0xC0 && op <= 0xCF) pos += 3;
-                    else if (op >= 0xD0 && op <= 0xDF) pos += 3;
-                    else if (op >= 0xE1 && op <= 0xFF) pos += 4;
-                    // Let the main loop handle the pos++ for single-byte commands.
-                }
-
-                if (op >= 0x70 && op <= 0x7F) { // Wait n+1 samples
-                    uint16_t wait = (op & 0x0F) + 1;
-                    if (g_ay_to_opm_conversion_enabled) {
-                        for (int i = 0; i < wait; i++) {
-                            ay_to_opm_update_envelope();
-                        }
-                    }
-                    if (g_ws_to_opm_conversion_enabled) {
-                        ws_to_opm_update(wait);
-                    }
-                    fputc(op, g_cache_fp);
-                } else if (op >= 0x80 && op <= 0x8F) { // PCM wait
-                    // During conversion, we drop the PCM write and just keep the wait.
-                    uint8_t n_wait = op & 0x0F;
-                    if (n_wait > 0) {
-                        if (g_ay_to_opm_conversion_enabled) {
-                            for (int i = 0; i < n_wait; i++) ay_to_opm_update_envelope();
-                        }
-                        if (g_ws_to_opm_conversion_enabled) {
-                            ws_to_opm_update(n_wait);
-                        }
-                        fputc(0x70 | (n_wait - 1), g_cache_fp);
-                    }
-                    pos++; // Skip the data byte for the PCM write.
-                }
-                // Any other unknown command is simply dropped if conversion is active.
-                break;
-        }
-    }
-end_convert_loop:;
-    fputc(0x66, g_cache_fp); // Write final END command
-    return true;
+    return current_fp;
 }
 
-static chip_type_t get_primary_chip_from_header(const vgm_header_t* header) {
-    if (header->ym2608_clock > 0) return CHIP_TYPE_YM2608;
-    if (header->ym2612_clock > 0) return CHIP_TYPE_YM2612;
-    if (header->ym2203_clock > 0) return CHIP_TYPE_YM2203;
-    if (header->ym2151_clock > 0) return CHIP_TYPE_YM2151;
-    if (header->ay8910_clock > 0) return CHIP_TYPE_AY8910;
-    if (header->sn76489_clock > 0) return CHIP_TYPE_SN76489;
-    if (header->wonderswan_clock > 0) return CHIP_TYPE_WSWAN;
-    if (header->ym2413_clock > 0) return CHIP_TYPE_YM2413;
-    return CHIP_TYPE_NONE;
+// Player state behind the shared sample clock (play_clock_run)
+typedef struct {
+    vgm_source_t* src;
+    int wait1, wait2;
+    int loop_counter;
+} vgm_player_t;
+
+static int vgm_player_step(void* ctx) {
+    vgm_player_t* player = (vgm_player_t*)ctx;
+    return vgm_process_command(player->src, &player->wait1, &player->wait2, &player->loop_counter);
 }
 
-static uint32_t get_clock_from_header(const vgm_header_t* header, chip_type_t chip_type) {
-    switch (chip_type) {
-        case CHIP_TYPE_WSWAN: return header->wonderswan_clock;
-        case CHIP_TYPE_YM2608: return header->ym2608_clock;
-        case CHIP_TYPE_YM2612: return header->ym2612_clock;
-        case CHIP_TYPE_YM2203: return header->ym2203_clock;
-        case CHIP_TYPE_YM2151: return header->ym2151_clock;
-        case CHIP_TYPE_AY8910: return header->ay8910_clock;
-        case CHIP_TYPE_SN76489: return header->sn76489_clock;
-        case CHIP_TYPE_YM2413: return header->ym2413_clock;
-        default: return 0;
-    }
+DWORD WINAPI vgm_player_thread(LPVOID lpParam) {
+    vgm_player_t player = { (vgm_source_t*)lpParam, VGM_DEFAULT_WAIT1, VGM_DEFAULT_WAIT2, 1 };
+    return play_clock_run(vgm_player_step, &player) ? 0 : 1;
 }
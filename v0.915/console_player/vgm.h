@@ -104,9 +104,31 @@ extern chip_type_t g_original_vgm_chip_type;
 extern uint32_t g_original_vgm_chip_clock;
 extern vgm_header_t g_vgm_header;
 
+// Where the player reads commands from: a VGM file, a compressed cache file,
+// a compiled device stream or a conversion that is still running
+struct vgm_conversion;
+struct cache_pack_reader;
+struct spfm_stream;
+typedef struct {
+    FILE* fp;
+    struct vgm_conversion* conversion;
+    struct cache_pack_reader* pack;
+    size_t pos;                   // Read position in the conversion stream or the compressed cache
+    bool compiled;                // pack holds a compiled device stream instead of VGM commands
+    uint32_t compiled_loop;       // Loop offset of the compiled stream, 0 if none
+    uint8_t compiled_device;      // Device the data records of the compiled stream go to
+    struct spfm_stream* capture;  // Records the device bytes of this play, NULL if not recording
+} vgm_source_t;
+
 bool vgm_parse_header(FILE* fp, vgm_header_t* header);
+void vgm_parse_header_fields(const uint8_t* hdr_buf, vgm_header_t* header);
+// Bytes of the command at cmd, opcode included, by the VGM command table. 0 if the command
+// is not in the table or runs past the avail bytes.
+size_t vgm_command_size(const uint8_t* cmd, size_t avail);
 FILE* vgm_play(FILE *input_fp, const char *filename, const char *cache_filename, bool force_reconvert);
-int vgm_process_command(FILE *input_fp, int* vgm_wait1, int* vgm_wait2, int* loop_counter);
+int vgm_process_command(vgm_source_t* src, int* vgm_wait1, int* vgm_wait2, int* loop_counter);
+#ifdef _WIN32
 DWORD WINAPI vgm_player_thread(LPVOID lpParam);
+#endif
 
 #endif // VGM_H
@@ -0,0 +1,622 @@
+#include "vgm_convert.h"
+#include "util.h"
+#include "opn_to_opm.h"
+#include "ay_to_opm.h"
+#include "sn_to_ay.h"
+#include "ws_to_opm.h"
+#include "reg_batch.h"
+#include "file_window.h"
+#include "thread.h"
+#include "error.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+// Longest VGM command with a fixed length (0x93 DAC stream start), and enough for a data block header
+#define VGM_MAX_CMD_LEN 16
+
+// --- Converter Output Batches ---
+// One source command rarely produces more than a few writes. Chip init writes
+// more, and those flush the batch when it fills up.
+#define OPM_BATCH_SIZE 256
+#define AY_BATCH_SIZE 64
+
+// Kept per thread, like the converter state, so segments can be converted in parallel
+static YASP_THREAD_LOCAL vgm_stream_t* g_out = NULL;
+static YASP_THREAD_LOCAL reg_write_t g_opm_writes[OPM_BATCH_SIZE];
+static YASP_THREAD_LOCAL reg_write_t g_ay_writes[AY_BATCH_SIZE];
+static YASP_THREAD_LOCAL reg_batch_t g_opm_batch;
+static YASP_THREAD_LOCAL reg_batch_t g_ay_batch;
+
+// Writes OPM writes to the cache as they are. Settings-dependent writes stay
+// tagged and are resolved by the player.
+static void vgm_cache_batch_sink(reg_batch_t* batch) {
+    if (!g_out) return;
+    for (size_t i = 0; i < batch->count; i++) {
+        const reg_write_t* w = &batch->writes[i];
+        uint8_t bytes[3] = {w->cmd, w->addr, w->data};
+        vgm_stream_write(g_out, bytes, 3);
+    }
+}
+
+// --- Chained Converters for Caching ---
+static void sn_to_ay_batch_sink(reg_batch_t* batch) {
+    ay_to_opm_write_batch(batch);
+}
+
+// Direct writes to the cache. Nothing is written while only the state is tracked.
+static void vgm_cache_write(const uint8_t* bytes, size_t size) {
+    if (g_out) vgm_stream_write(g_out, bytes, size);
+}
+
+static void vgm_cache_putc(uint8_t byte) {
+    if (g_out) vgm_stream_putc(g_out, byte);
+}
+
+// Pushes everything converted so far through the chain into the cache.
+// Called before anything is written to the cache directly, to keep the order.
+static void vgm_cache_flush(void) {
+    reg_batch_flush(&g_ay_batch);
+    reg_batch_flush(&g_opm_batch);
+}
+
+// Helper to read little-endian 16-bit integer
+static uint16_t read_le16(const uint8_t* data) {
+    return data[0] | (data[1] << 8);
+}
+
+chip_type_t vgm_get_primary_chip(const vgm_header_t* header) {
+    if (header->ym2608_clock > 0) return CHIP_TYPE_YM2608;
+    if (header->ym2612_clock > 0) return CHIP_TYPE_YM2612;
+    if (header->ym2203_clock > 0) return CHIP_TYPE_YM2203;
+    if (header->ym2151_clock > 0) return CHIP_TYPE_YM2151;
+    if (header->ay8910_clock > 0) return CHIP_TYPE_AY8910;
+    if (header->sn76489_clock > 0) return CHIP_TYPE_SN76489;
+    if (header->wonderswan_clock > 0) return CHIP_TYPE_WSWAN;
+    if (header->ym2413_clock > 0) return CHIP_TYPE_YM2413;
+    if (header->ymf262_clock > 0) return CHIP_TYPE_YMF262;
+    if (header->ym3812_clock > 0) return CHIP_TYPE_YM3812;
+    if (header->ym3526_clock > 0) return CHIP_TYPE_YM3526;
+    if (header->y8950_clock > 0) return CHIP_TYPE_Y8950;
+    return CHIP_TYPE_NONE;
+}
+
+uint32_t vgm_get_chip_clock(const vgm_header_t* header, chip_type_t chip_type) {
+    switch (chip_type) {
+        case CHIP_TYPE_WSWAN: return header->wonderswan_clock;
+        case CHIP_TYPE_YM2608: return header->ym2608_clock;
+        case CHIP_TYPE_YM2612: return header->ym2612_clock;
+        case CHIP_TYPE_YM2203: return header->ym2203_clock;
+        case CHIP_TYPE_YM2151: return header->ym2151_clock;
+        case CHIP_TYPE_AY8910: return header->ay8910_clock;
+        case CHIP_TYPE_SN76489: return header->sn76489_clock;
+        case CHIP_TYPE_YM2413: return header->ym2413_clock;
+        case CHIP_TYPE_YMF262: return header->ymf262_clock;
+        case CHIP_TYPE_YM3812: return header->ym3812_clock;
+        case CHIP_TYPE_YM3526: return header->ym3526_clock;
+        case CHIP_TYPE_Y8950: return header->y8950_clock;
+        default: return 0;
+    }
+}
+
+bool vgm_chip_converts_to_opm(chip_type_t chip_type) {
+    switch (chip_type) {
+        case CHIP_TYPE_YM2612:
+        case CHIP_TYPE_YM2203:
+        case CHIP_TYPE_YM2608:
+        case CHIP_TYPE_AY8910:
+        case CHIP_TYPE_SN76489:
+        case CHIP_TYPE_WSWAN:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// --- Segmented Conversion ---
+// A long track is split at command boundaries into segments that are converted on
+// separate threads. A scan thread walks the track with the converters tracking only
+// their state, which is much cheaper than converting, and starts a worker for each
+// segment from the state at its start. The output is reconciled in order: a worker's
+// output is used only if the state it started from matches the state the previous
+// segment really ended in. Otherwise the segment is converted again, so the result is
+// always identical to converting the track in one go.
+
+// Source data per segment below which splitting a track is not worth a thread
+#define VGM_CONVERT_MIN_SEGMENT_SIZE (1024 * 1024)
+#define VGM_CONVERT_MAX_SEGMENTS 8
+
+// State of the conversion chain between two commands
+typedef struct {
+    size_t pos;              // Source position of the next command
+    uint32_t sample_time;
+    opn_to_opm_state_t opn;
+    ay_to_opm_state_t ay;
+    sn_to_ay_state_t sn;
+    ws_to_opm_state_t ws;
+} vgm_convert_state_t;
+
+typedef enum {
+    VGM_RANGE_SPLIT,      // Stopped at the first command at or after the split position
+    VGM_RANGE_END,        // Reached the end of the data
+    VGM_RANGE_CANCELLED,  // The output stream was cancelled
+} vgm_range_result_t;
+
+struct vgm_convert_job;
+
+typedef struct {
+    struct vgm_convert_job* job;
+    size_t split;                 // The segment ends at the first command at or after this
+    vgm_convert_state_t start;    // Seeded by the scan
+    vgm_convert_state_t end;      // Where the worker really ended
+    vgm_stream_t stream;          // Converted output of this segment only
+    bool started;
+    vgm_range_result_t result;
+    bool loop_found;
+    uint32_t loop_offset;         // In stream
+    yasp_thread_t thread;
+} vgm_segment_t;
+
+typedef struct vgm_convert_job {
+    file_window_t* in;
+    const vgm_header_t* header;
+    chip_type_t chip_type;
+    uint32_t clock;
+    bool is_opn, is_ay, is_ws;
+    int segment_count;
+    int segments_found;           // Segments the scan got to, valid once it is joined
+    vgm_segment_t segments[VGM_CONVERT_MAX_SEGMENTS];
+    bool cancelled;
+    yasp_mutex_t lock;
+} vgm_convert_job_t;
+
+static bool vgm_job_cancelled(vgm_convert_job_t* job) {
+    yasp_mutex_lock(&job->lock);
+    bool cancelled = job->cancelled;
+    yasp_mutex_unlock(&job->lock);
+    return cancelled;
+}
+
+static void vgm_job_cancel(vgm_convert_job_t* job) {
+    yasp_mutex_lock(&job->lock);
+    job->cancelled = true;
+    yasp_mutex_unlock(&job->lock);
+}
+
+// Sets up this thread's conversion chain. With output, converted writes go to g_out;
+// without, the converters only track their state.
+static void vgm_chain_init(const vgm_convert_job_t* job, bool output) {
+    reg_batch_t* opm_out = output ? &g_opm_batch : NULL;
+    reg_batch_init(&g_opm_batch, g_opm_writes, OPM_BATCH_SIZE, vgm_cache_batch_sink);
+    reg_batch_init(&g_ay_batch, g_ay_writes, AY_BATCH_SIZE, sn_to_ay_batch_sink);
+
+    if (job->is_opn) {
+        opn_to_opm_init(job->chip_type, job->clock, opm_out);
+    } else if (job->is_ay) {
+        ay_to_opm_init(job->chip_type, job->clock, opm_out);
+    } else if (job->is_ws) {
+        ws_to_opm_init(job->chip_type, job->clock, opm_out);
+    } else {
+        ay_to_opm_init(CHIP_TYPE_AY8910, get_chip_default_clock(CHIP_TYPE_AY8910), opm_out);
+        sn_to_ay_init(job->chip_type, job->clock, &g_ay_batch);
+    }
+}
+
+static void vgm_chain_save(const vgm_convert_job_t* job, size_t pos, uint32_t sample_time, vgm_convert_state_t* state) {
+    memset(state, 0, sizeof(vgm_convert_state_t)); // States are compared with memcmp
+    state->pos = pos;
+    state->sample_time = sample_time;
+    if (job->is_opn) {
+        opn_to_opm_save(&state->opn);
+    } else if (job->is_ay) {
+        ay_to_opm_save(&state->ay);
+    } else if (job->is_ws) {
+        ws_to_opm_save(&state->ws);
+    } else {
+        ay_to_opm_save(&state->ay);
+        sn_to_ay_save(&state->sn);
+    }
+}
+
+static void vgm_chain_restore(const vgm_convert_job_t* job, const vgm_convert_state_t* state) {
+    reg_batch_init(&g_opm_batch, g_opm_writes, OPM_BATCH_SIZE, vgm_cache_batch_sink);
+    reg_batch_init(&g_ay_batch, g_ay_writes, AY_BATCH_SIZE, sn_to_ay_batch_sink);
+    if (job->is_opn) {
+        opn_to_opm_restore(&state->opn, &g_opm_batch);
+    } else if (job->is_ay) {
+        ay_to_opm_restore(&state->ay, &g_opm_batch);
+    } else if (job->is_ws) {
+        ws_to_opm_restore(&state->ws, &g_opm_batch);
+    } else {
+        ay_to_opm_restore(&state->ay, &g_opm_batch);
+        sn_to_ay_restore(&state->sn, &g_ay_batch);
+    }
+}
+
+// Runs the AY envelope over a wait. While only the state is tracked there are no volume
+// writes to make, so it is moved on in one go instead of sample by sample.
+static void vgm_chain_envelope(uint32_t samples) {
+    if (!g_out) {
+        ay_to_opm_skip_envelope(samples);
+        return;
+    }
+    for (uint32_t i = 0; i < samples; i++) ay_to_opm_update_envelope();
+}
+
+// Converts commands with this thread's chain, from *pos until the first command at or
+// after split_pos, writing to g_out (if any). commit makes the progress visible to the
+// readers of g_out as it goes. The loop point is reported the first time it is passed.
+static vgm_range_result_t vgm_convert_range(vgm_convert_job_t* job, file_window_t* in, size_t split_pos, bool commit,
+                                            size_t* pos_io, uint32_t* sample_time_io, bool* loop_found, uint32_t* loop_offset) {
+    size_t vgm_data_size = in->size;
+    chip_type_t original_chip_type = job->chip_type;
+    bool is_ay = job->is_ay;
+    bool is_ws = job->is_ws;
+    uint32_t original_loop_offset = job->header->loop_offset;
+
+    vgm_range_result_t result = VGM_RANGE_END;
+    size_t pos = *pos_io;
+    uint32_t sample_time = *sample_time_io;
+    uint32_t committed_time = sample_time;
+    while (pos < vgm_data_size) {
+        // Hand the writes of the previous command to the cache, then stamp the next ones
+        vgm_cache_flush();
+        if (pos >= split_pos) {
+            result = VGM_RANGE_SPLIT;
+            break;
+        }
+        g_opm_batch.time = sample_time;
+        g_ay_batch.time = sample_time;
+
+        // Let the player have everything up to the current time
+        if (sample_time != committed_time) {
+            bool cancelled = commit ? !vgm_stream_commit(g_out, sample_time) : vgm_job_cancelled(job);
+            if (cancelled) { // Playback was stopped
+                if (commit) vgm_job_cancel(job);
+                result = VGM_RANGE_CANCELLED;
+                break;
+            }
+            committed_time = sample_time;
+        }
+
+        // Check for loop point
+        if (g_out && original_loop_offset > 0 && (job->header->vgm_data_offset + pos) >= original_loop_offset && !*loop_found) {
+            *loop_found = true;
+            *loop_offset = (uint32_t)vgm_stream_tell(g_out);
+        }
+
+        // Fetch the command through the window. Data blocks are skipped without being read.
+        size_t cmd_len = vgm_data_size - pos;
+        if (cmd_len > VGM_MAX_CMD_LEN) cmd_len = VGM_MAX_CMD_LEN;
+        const uint8_t* cmd = file_window_get(in, pos, cmd_len);
+        if (!cmd) break;
+        size_t n = 0;
+
+        uint8_t op = cmd[n++];
+        uint8_t d1, d2;
+
+        switch (op) {
+            // --- Convertible Chips ---
+            case 0x52: case 0x53: { // YM2612
+                if (pos + n + 2 > vgm_data_size) goto end_convert_loop;
+                d1 = cmd[n++]; d2 = cmd[n++];
+                if (original_chip_type == CHIP_TYPE_YM2612) {
+                    opn_to_opm_write_reg(d1, d2, (op == 0x52) ? 0 : 1);
+                } else {
+                    { uint8_t bytes[3] = {op, d1, d2}; vgm_cache_write(bytes, 3); }
+                }
+                break;
+            }
+            case 0x55: { // YM2203
+                if (pos + n + 2 > vgm_data_size) goto end_convert_loop;
+                d1 = cmd[n++]; d2 = cmd[n++];
+                if (original_chip_type == CHIP_TYPE_YM2203) {
+                    opn_to_opm_write_reg(d1, d2, 0);
+                } else {
+                    { uint8_t bytes[3] = {op, d1, d2}; vgm_cache_write(bytes, 3); }
+                }
+                break;
+            }
+            case 0x56: case 0x57: { // YM2608
+                if (pos + n + 2 > vgm_data_size) goto end_convert_loop;
+                d1 = cmd[n++]; d2 = cmd[n++];
+                if (original_chip_type == CHIP_TYPE_YM2608) {
+                    opn_to_opm_write_reg(d1, d2, (op == 0x56) ? 0 : 1);
+                } else {
+                    { uint8_t bytes[3] = {op, d1, d2}; vgm_cache_write(bytes, 3); }
+                }
+                break;
+            }
+            case 0xA0: { // AY8910
+                if (pos + n + 2 > vgm_data_size) goto end_convert_loop;
+                d1 = cmd[n++]; d2 = cmd[n++];
+                if (is_ay) {
+                    ay_to_opm_write_reg(d1, d2);
+                }
+                // Otherwise, drop the command if we are converting another chip to OPM
+                break;
+            }
+            case 0x50: { // SN76489
+                if (pos + n + 1 > vgm_data_size) goto end_convert_loop;
+                d1 = cmd[n++];
+                if (original_chip_type == CHIP_TYPE_SN76489) {
+                    sn_to_ay_write_reg(d1);
+                }
+                // Otherwise, drop the command
+                break;
+            }
+            case 0xBC: { // WonderSwan - Format: BC aa dd
+                if (pos + n + 2 > vgm_data_size) goto end_convert_loop;
+                uint8_t addr = cmd[n++];
+                uint8_t data = cmd[n++];
+                if (is_ws) {
+                    ws_to_opm_write_reg(0, addr, data);
+                } else {
+                    // Passthrough if not converting
+                    uint8_t bytes[3] = {op, addr, data};
+                    vgm_cache_write(bytes, 3);
+                }
+                break;
+            }
+
+            // --- Non-Convertible Chips (Dropped, conversion is active) ---
+            case 0x54: // YM2151
+            case 0x51: // YM2413
+            case 0x58: case 0x59: case 0x5A: case 0x5B: // YM3812, YM3526, Y8950, YMZ280B
+            case 0x5C: case 0x5D: case 0x5E: case 0x5F: // YMF262
+            case 0xB0: case 0xB1: case 0xB2: case 0xB3: // RF5C68, RF5C164, PWM, GB DMG
+            case 0xB4: case 0xB5: case 0xB6: case 0xB7: // NES APU, MultiPCM, uPD7759, OKIM6258
+            case 0xB8: // OKIM6295
+                if (pos + n + 2 > vgm_data_size) goto end_convert_loop;
+                n += 2;
+                break;
+
+            case 0xC0: case 0xC1: case 0xC2: // SegaPCM, RF5C68, RF5C164 mem write
+            case 0xD0: case 0xD1: case 0xD2: // YMF278B, YMF271, SCC1
+                if (pos + n + 3 > vgm_data_size) goto end_convert_loop;
+                n += 3;
+                break;
+
+            case 0x4F: // GG Stereo
+                if (pos + n + 1 > vgm_data_size) goto end_convert_loop;
+                n += 1;
+                break;
+
+            case 0x90: case 0x91: case 0x92: case 0x93: case 0x94: case 0x95: { // DAC Stream Control
+                // Passed through, the player can offload the streams to a YM2608
+                static const uint8_t lengths[] = {4, 4, 5, 10, 1, 4};
+                if (pos + n + lengths[op - 0x90] > vgm_data_size) goto end_convert_loop;
+                n += lengths[op - 0x90];
+                vgm_cache_write(cmd, n);
+                break;
+            }
+
+            // --- Common Commands (Passthrough) ---
+            case 0x61: {
+                if (pos + n + 2 > vgm_data_size) goto end_convert_loop;
+                uint16_t wait = read_le16(&cmd[n]);
+                n += 2;
+                if (is_ay) vgm_chain_envelope(wait);
+                if (is_ws) {
+                    ws_to_opm_update(wait);
+                }
+                vgm_cache_flush();
+                uint8_t bytes[3] = {op, wait & 0xFF, wait >> 8};
+                vgm_cache_write(bytes, 3);
+                sample_time += wait;
+                break;
+            }
+            case 0x62: case 0x63: case 0x66:
+                vgm_cache_putc(op);
+                if (op == 0x62) sample_time += VGM_DEFAULT_WAIT1;
+                if (op == 0x63) sample_time += VGM_DEFAULT_WAIT2;
+                break;
+
+            // --- Commands to properly parse and skip ---
+            case 0x67: { // Data block
+                if (pos + n + 6 > vgm_data_size) goto end_convert_loop;
+                // Skip the command byte (0x67), the type byte, and the 4-byte size
+                uint32_t block_size = read_le32(&cmd[n + 2]);
+                n += 6 + block_size;
+                break;
+            }
+            case 0xE0: // PCM data seek
+                if (pos + n + 4 > vgm_data_size) goto end_convert_loop;
+                n += 4;
+                break;
+
+            // --- Special Handling ---
+            default:
+                // During conversion, drop all unknown or unhandled commands.
+                // The only commands we let through are waits and end.
+                // All other commands are assumed to be for chips we are replacing.
+                // We just need to advance the position pointer correctly.
+                if (op >= 0x30 && op <= 0x3F) n += 1;
+                else if (op >= 0x40 && op <= 0x4E) n += 2;
+                else if (op >= 0xA1 && op <= 0xBF) n += 2;
+                else if (op >= 0xC0 && op <= 0xCF) n += 3;
+                else if (op >= 0xD0 && op <= 0xDF) n += 3;
+                else if (op >= 0xE1) n += 4;
+                // Single-byte commands have already been consumed.
+
+                if (op >= 0x70 && op <= 0x7F) { // Wait n+1 samples
+                    uint16_t wait = (op & 0x0F) + 1;
+                    if (is_ay) vgm_chain_envelope(wait);
+                    if (is_ws) {
+                        ws_to_opm_update(wait);
+                    }
+                    vgm_cache_flush();
+                    vgm_cache_putc(op);
+                    sample_time += wait;
+                } else if (op >= 0x80 && op <= 0x8F) { // PCM write and wait, no operand
+                    // During conversion, we drop the PCM write and just keep the wait.
+                    uint8_t n_wait = op & 0x0F;
+                    if (n_wait > 0) {
+                        if (is_ay) vgm_chain_envelope(n_wait);
+                        if (is_ws) {
+                            ws_to_opm_update(n_wait);
+                        }
+                        vgm_cache_flush();
+                        vgm_cache_putc(0x70 | (n_wait - 1));
+                        sample_time += n_wait;
+                    }
+                }
+                // Any other unknown command is simply dropped.
+                break;
+        }
+        pos += n;
+    }
+end_convert_loop:;
+    vgm_cache_flush();
+    *pos_io = pos;
+    *sample_time_io = sample_time;
+    return result;
+}
+
+// Walks the track with state-only converters and starts a worker at each split position.
+static void vgm_scan_thread(void* arg);
+
+// Converts one segment into its own stream, starting from the state the scan seeded.
+static void vgm_segment_thread(void* arg) {
+    vgm_segment_t* seg = (vgm_segment_t*)arg;
+    vgm_convert_job_t* job = seg->job;
+    file_window_t in;
+    seg->result = VGM_RANGE_CANCELLED; // Unless it gets to run
+    if (!file_window_open_copy(&in, job->in)) return;
+    if (!vgm_stream_init(&seg->stream, 0)) {
+        file_window_close(&in);
+        return;
+    }
+    g_out = &seg->stream;
+    vgm_chain_restore(job, &seg->start);
+    size_t pos = seg->start.pos;
+    uint32_t sample_time = seg->start.sample_time;
+    seg->result = vgm_convert_range(job, &in, seg->split, false, &pos, &sample_time, &seg->loop_found, &seg->loop_offset);
+    vgm_chain_save(job, pos, sample_time, &seg->end);
+    g_out = NULL;
+    file_window_close(&in);
+}
+
+static void vgm_scan_thread(void* arg) {
+    vgm_convert_job_t* job = (vgm_convert_job_t*)arg;
+    file_window_t in;
+    if (!file_window_open_copy(&in, job->in)) return;
+    g_out = NULL;
+    vgm_chain_init(job, false);
+    size_t pos = 0;
+    uint32_t sample_time = 0;
+    bool loop_found = false;
+    uint32_t loop_offset = 0;
+    for (int k = 1; k < job->segment_count; k++) {
+        // Segment k starts where segment k - 1 is split off
+        vgm_segment_t* seg = &job->segments[k];
+        if (vgm_convert_range(job, &in, job->segments[k - 1].split, false, &pos, &sample_time, &loop_found, &loop_offset) != VGM_RANGE_SPLIT) break;
+        vgm_chain_save(job, pos, sample_time, &seg->start);
+        seg->job = job;
+        seg->started = yasp_thread_start(&seg->thread, vgm_segment_thread, seg);
+        job->segments_found = k + 1;
+    }
+    file_window_close(&in);
+}
+
+// Number of segments worth converting a source of this size in.
+static int vgm_convert_segment_count(size_t size) {
+    int segments = (int)(size / VGM_CONVERT_MIN_SEGMENT_SIZE);
+    int cpus = yasp_cpu_count() - 1; // Leave a core to the player
+    if (segments > cpus) segments = cpus;
+    if (segments > VGM_CONVERT_MAX_SEGMENTS) segments = VGM_CONVERT_MAX_SEGMENTS;
+    return segments > 1 ? segments : 1;
+}
+
+bool vgm_convert_to_opm(vgm_stream_t* out, file_window_t* in, const vgm_header_t* original_header, uint32_t* converted_loop_offset) {
+    return vgm_convert_to_opm_segmented(out, in, original_header, converted_loop_offset, vgm_convert_segment_count(in->size));
+}
+
+bool vgm_convert_to_opm_segmented(vgm_stream_t* out, file_window_t* in, const vgm_header_t* original_header, uint32_t* converted_loop_offset, int segment_count) {
+    *converted_loop_offset = 0;
+    chip_type_t original_chip_type = vgm_get_primary_chip(original_header);
+    if (!vgm_chip_converts_to_opm(original_chip_type)) {
+        return false;
+    }
+    vgm_convert_job_t* job = calloc(1, sizeof(vgm_convert_job_t));
+    if (!job) return false;
+    job->in = in;
+    job->header = original_header;
+    job->chip_type = original_chip_type;
+    job->clock = vgm_get_chip_clock(original_header, original_chip_type);
+    job->is_opn = (original_chip_type == CHIP_TYPE_YM2612 || original_chip_type == CHIP_TYPE_YM2203 || original_chip_type == CHIP_TYPE_YM2608);
+    job->is_ay = (original_chip_type == CHIP_TYPE_AY8910);
+    job->is_ws = (original_chip_type == CHIP_TYPE_WSWAN);
+    yasp_mutex_init(&job->lock);
+
+    if (segment_count < 1) segment_count = 1;
+    if (segment_count > VGM_CONVERT_MAX_SEGMENTS) segment_count = VGM_CONVERT_MAX_SEGMENTS;
+    job->segment_count = segment_count;
+    job->segments_found = 1;
+    for (int k = 0; k < segment_count; k++) {
+        job->segments[k].split = (k + 1 < segment_count) ? (size_t)((uint64_t)in->size * (k + 1) / segment_count) : SIZE_MAX;
+    }
+
+    yasp_thread_t scan_thread;
+    bool scanning = segment_count > 1 && yasp_thread_start(&scan_thread, vgm_scan_thread, job);
+
+    // The first segment is converted right here, straight into out, so the player can start on it
+    g_out = out;
+    vgm_chain_init(job, true);
+    size_t pos = 0;
+    uint32_t sample_time = 0;
+    bool loop_found = false;
+    uint32_t loop_offset = 0;
+    vgm_range_result_t result = vgm_convert_range(job, in, scanning ? job->segments[0].split : SIZE_MAX, true,
+                                                  &pos, &sample_time, &loop_found, &loop_offset);
+    if (scanning) yasp_thread_join(&scan_thread);
+
+    // Reconcile the other segments in order
+    vgm_convert_state_t state;
+    vgm_chain_save(job, pos, sample_time, &state);
+    for (int k = 1; k < job->segments_found; k++) {
+        vgm_segment_t* seg = &job->segments[k];
+        if (seg->started) yasp_thread_join(&seg->thread);
+        if (result != VGM_RANGE_SPLIT) { // Cancelled, nothing more to append
+            vgm_stream_free(&seg->stream);
+            continue;
+        }
+        if (seg->started && seg->result != VGM_RANGE_CANCELLED && memcmp(&seg->start, &state, sizeof(state)) == 0) {
+            size_t base = vgm_stream_tell(out);
+            vgm_stream_write(out, seg->stream.data, seg->stream.size);
+            if (!loop_found && seg->loop_found) {
+                loop_found = true;
+                loop_offset = (uint32_t)(base + seg->loop_offset);
+            }
+            result = seg->result;
+            state = seg->end;
+            if (!vgm_stream_commit(out, state.sample_time)) result = VGM_RANGE_CANCELLED;
+        } else {
+            // The worker started from the wrong state (or not at all): convert the segment again here
+            logging(LOG_LEVEL_DEBUG, "Segment %d of %d needs converting again.", k + 1, segment_count);
+            vgm_chain_restore(job, &state);
+            pos = state.pos;
+            sample_time = state.sample_time;
+            result = vgm_convert_range(job, in, seg->split, true, &pos, &sample_time, &loop_found, &loop_offset);
+            vgm_chain_save(job, pos, sample_time, &state);
+        }
+        vgm_stream_free(&seg->stream);
+        if (result == VGM_RANGE_CANCELLED) vgm_job_cancel(job);
+    }
+    if (result == VGM_RANGE_SPLIT) {
+        // The scan did not get to the later segments, so convert the rest here
+        vgm_chain_restore(job, &state);
+        pos = state.pos;
+        sample_time = state.sample_time;
+        result = vgm_convert_range(job, in, SIZE_MAX, true, &pos, &sample_time, &loop_found, &loop_offset);
+    }
+    yasp_mutex_destroy(&job->lock);
+    free(job);
+
+    vgm_cache_flush();
+    vgm_stream_putc(out, 0x66); // Write final END command
+    vgm_stream_finish(out);
+    g_out = NULL;
+    *converted_loop_offset = loop_found ? loop_offset : 0;
+    return result != VGM_RANGE_CANCELLED;
+}
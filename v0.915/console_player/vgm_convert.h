@@ -0,0 +1,37 @@
+#ifndef VGM_CONVERT_H
+#define VGM_CONVERT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "vgm.h"
+#include "vgm_stream.h"
+#include "file_window.h"
+
+// Version of the converted output. Bump it when the converters change what they write,
+// so cache files written by an older version are converted again.
+#define VGM_CONVERTER_VERSION 2
+
+// The chip a VGM file is built around, judged by which clocks are set in the header.
+chip_type_t vgm_get_primary_chip(const vgm_header_t* header);
+uint32_t vgm_get_chip_clock(const vgm_header_t* header, chip_type_t chip_type);
+
+// True if the chip can be played on a YM2151 through one of the converters.
+bool vgm_chip_converts_to_opm(chip_type_t chip_type);
+
+// Converts the command stream of a VGM file to YM2151 commands and appends them to out.
+// Progress is committed to out as it goes and out is finished at the end, so the
+// player can read it from another thread. Stops early if the stream is cancelled.
+// This does not touch the hardware, so it can also be driven by offline tools.
+// The input window covers the command data (from vgm_data_offset to the end of the file),
+// so only a small part of the source is in memory at a time.
+// converted_loop_offset receives the offset of the loop point in out (0 if none).
+bool vgm_convert_to_opm(vgm_stream_t* out, file_window_t* in, const vgm_header_t* header, uint32_t* converted_loop_offset);
+
+// Same, with the track split into segment_count segments that are converted on separate threads.
+// The output is identical to a conversion in one piece. vgm_convert_to_opm picks the number of
+// segments from the size of the source and the number of processors.
+bool vgm_convert_to_opm_segmented(vgm_stream_t* out, file_window_t* in, const vgm_header_t* header, uint32_t* converted_loop_offset, int segment_count);
+
+#endif // VGM_CONVERT_H
@@ -0,0 +1,159 @@
+#include "vgm.h"
+#include "error.h"
+#include "util.h"
+
+#include <string.h>
+
+// Helper to read little-endian 16-bit integer
+static uint16_t read_le16(const uint8_t* data) {
+    return data[0] | (data[1] << 8);
+}
+
+// Helper to read a chip clock. Bit 30 marks a second chip of the type and bit 31 a
+// chip variant, neither is part of the clock.
+static uint32_t read_clock(const uint8_t* data, uint32_t ofs) {
+    return read_le32(data + ofs) & 0x3FFFFFFF;
+}
+
+// Helper to read a relative offset
+static uint32_t read_rel_ofs(const uint8_t* data, uint32_t base_ofs) {
+    uint32_t ofs = read_le32(data + base_ofs);
+    return ofs ? (base_ofs + ofs) : 0;
+}
+
+// Helper function to read a UTF-16LE string from the GD3 tag
+static void read_gd3_string(FILE* f, long end_pos, wchar_t* dest, size_t max_len) {
+    long initial_pos = ftell(f);
+    size_t i = 0;
+    while (ftell(f) < end_pos && i < max_len - 1) {
+        uint16_t ch;
+        if (fread(&ch, 2, 1, f) != 1) break;
+        if (ch == 0) break;
+        dest[i++] = (wchar_t)ch;
+    }
+    dest[i] = L'\0';
+    if (i == 0) {
+        fseek(f, initial_pos + 2, SEEK_SET);
+    }
+}
+
+// Reads the header fields from the first 0x100 bytes of a VGM file. Fields past the
+// header size of the file's version must be zero. The GD3 strings are left alone.
+void vgm_parse_header_fields(const uint8_t* hdr_buf, vgm_header_t* header) {
+    memcpy(header->ident, hdr_buf, 4);
+    header->version = read_le32(hdr_buf + 0x08);
+    header->eof_offset = read_le32(hdr_buf + 0x04);
+    header->total_samples = read_le32(hdr_buf + 0x18);
+    header->gd3_offset = read_rel_ofs(hdr_buf, 0x14);
+    header->loop_offset = read_rel_ofs(hdr_buf, 0x1C);
+    header->loop_samples = read_le32(hdr_buf + 0x20);
+
+    if (header->version >= 0x150) {
+        header->vgm_data_offset = read_rel_ofs(hdr_buf, 0x34);
+    } else {
+        header->vgm_data_offset = 0x40;
+    }
+    if (header->vgm_data_offset == 0) header->vgm_data_offset = 0x40;
+
+    header->sn76489_clock = read_clock(hdr_buf, 0x0C);
+    header->ym2413_clock = read_clock(hdr_buf, 0x10);
+
+    if (header->version >= 0x101) header->rate = read_le32(hdr_buf + 0x24);
+    if (header->version >= 0x110) {
+        header->sn76489_feedback = read_le16(hdr_buf + 0x28);
+        header->sn76489_shift_width = hdr_buf[0x2A];
+        header->ym2612_clock = read_clock(hdr_buf, 0x2C);
+        header->ym2151_clock = read_clock(hdr_buf, 0x30);
+    }
+    if (header->version >= 0x151) {
+        header->ym2203_clock = read_clock(hdr_buf, 0x44);
+        header->ym2608_clock = read_clock(hdr_buf, 0x48);
+        header->ym3812_clock = read_clock(hdr_buf, 0x50);
+        header->ym3526_clock = read_clock(hdr_buf, 0x54);
+        header->y8950_clock = read_clock(hdr_buf, 0x58);
+        header->ymf262_clock = read_clock(hdr_buf, 0x5C);
+        header->ay8910_clock = read_clock(hdr_buf, 0x74);
+    }
+    if (header->version >= 0x161) {
+        header->okim6258_clock = read_clock(hdr_buf, 0x90);
+        header->wonderswan_clock = read_clock(hdr_buf, 0xC0);
+    }
+}
+
+bool vgm_parse_header(FILE* fp, vgm_header_t* header) {
+    uint8_t hdr_buf[0x100] = {0};
+    memset(header, 0, sizeof(vgm_header_t));
+
+    if (fseek(fp, 0, SEEK_SET) != 0 || fread(hdr_buf, 1, 0x40, fp) != 0x40) {
+        logging(LOG_LEVEL_ERROR, "Could not read first 0x40 bytes of header.\n");
+        return false;
+    }
+
+    if (memcmp(hdr_buf, "Vgm ", 4) != 0) {
+        logging(LOG_LEVEL_ERROR, "Invalid VGM signature.\n");
+        return false;
+    }
+    header->version = read_le32(hdr_buf + 0x08);
+
+    size_t header_size_to_read = 0;
+    if (header->version >= 0x171) header_size_to_read = 0xE4;
+    else if (header->version >= 0x170) header_size_to_read = 0xC0;
+    else if (header->version >= 0x161) header_size_to_read = 0xB8;
+    else if (header->version >= 0x151) header_size_to_read = 0x80;
+    else header_size_to_read = 0x40;
+
+    if (header_size_to_read > 0x40) {
+        if (fread(hdr_buf + 0x40, 1, header_size_to_read - 0x40, fp) != (header_size_to_read - 0x40)) {
+            logging(LOG_LEVEL_WARN, "Could not read full extended header. Some data may be missing.\n");
+        }
+    }
+
+    vgm_parse_header_fields(hdr_buf, header);
+
+    uint32_t gd3_offset = read_rel_ofs(hdr_buf, 0x14);
+    if (gd3_offset > 0) {
+        if (fseek(fp, gd3_offset, SEEK_SET) == 0) {
+            char gd3_sig[4];
+            if (fread(gd3_sig, 1, 4, fp) == 4 && memcmp(gd3_sig, "Gd3 ", 4) == 0) {
+                uint32_t gd3_version, gd3_length;
+                fread(&gd3_version, 4, 1, fp);
+                fread(&gd3_length, 4, 1, fp);
+                long end_pos = ftell(fp) + gd3_length;
+                read_gd3_string(fp, end_pos, header->track_name_en, 256);
+                read_gd3_string(fp, end_pos, header->track_name_jp, 256);
+                read_gd3_string(fp, end_pos, header->game_name_en, 256);
+                read_gd3_string(fp, end_pos, header->game_name_jp, 256);
+                read_gd3_string(fp, end_pos, header->system_name_en, 256);
+                read_gd3_string(fp, end_pos, header->system_name_jp, 256);
+                read_gd3_string(fp, end_pos, header->author_en, 256);
+                read_gd3_string(fp, end_pos, header->author_jp, 256);
+                read_gd3_string(fp, end_pos, header->release_date, 256);
+                read_gd3_string(fp, end_pos, header->vgm_creator, 256);
+                read_gd3_string(fp, end_pos, header->notes, 256);
+            }
+        }
+    }
+
+    fseek(fp, header->vgm_data_offset, SEEK_SET);
+    return true;
+}
+
+size_t vgm_command_size(const uint8_t* cmd, size_t avail) {
+    static const uint8_t DAC_SIZES[] = {5, 5, 6, 11, 2, 5};
+    if (avail == 0) return 0;
+    uint8_t op = cmd[0];
+    size_t size = 0;
+    if (op >= 0x30 && op <= 0x3F) size = 2;
+    else if (op == 0x4F || op == 0x50) size = 2;
+    else if (op >= 0x40 && op <= 0x5F) size = 3;
+    else if (op == 0x61) size = 3;
+    else if (op == 0x62 || op == 0x63 || op == 0x66) size = 1;
+    else if (op == 0x67) size = avail >= 7 ? 7 + (size_t)read_le32(cmd + 3) : 7;
+    else if (op == 0x68) size = 12;
+    else if (op >= 0x70 && op <= 0x8F) size = 1;
+    else if (op >= 0x90 && op <= 0x95) size = DAC_SIZES[op - 0x90];
+    else if (op >= 0xA0 && op <= 0xBF) size = 3;
+    else if (op >= 0xC0 && op <= 0xDF) size = 4;
+    else if (op >= 0xE0) size = 5;
+    return size <= avail ? size : 0;
+}
@@ -0,0 +1,100 @@
+#include "vgm_stream.h"
+#include "error.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+bool vgm_stream_init(vgm_stream_t* stream, size_t initial_capacity) {
+    memset(stream, 0, sizeof(vgm_stream_t));
+    if (initial_capacity < 4096) initial_capacity = 4096;
+    stream->data = malloc(initial_capacity);
+    if (!stream->data) return false;
+    stream->capacity = initial_capacity;
+    yasp_mutex_init(&stream->lock);
+    yasp_cond_init(&stream->cond);
+    return true;
+}
+
+void vgm_stream_free(vgm_stream_t* stream) {
+    if (!stream->data) return;
+    free(stream->data);
+    stream->data = NULL;
+    yasp_cond_destroy(&stream->cond);
+    yasp_mutex_destroy(&stream->lock);
+}
+
+void vgm_stream_write(vgm_stream_t* stream, const void* data, size_t size) {
+    if (stream->size + size > stream->capacity) {
+        size_t new_capacity = stream->capacity * 2;
+        while (new_capacity < stream->size + size) new_capacity *= 2;
+        // Readers copy out of data under the lock, so it may only move while we hold it
+        yasp_mutex_lock(&stream->lock);
+        uint8_t* new_data = realloc(stream->data, new_capacity);
+        if (new_data) {
+            stream->data = new_data;
+            stream->capacity = new_capacity;
+        }
+        yasp_mutex_unlock(&stream->lock);
+        if (!new_data) {
+            logging(LOG_LEVEL_ERROR, "Out of memory while growing the conversion stream.");
+            return;
+        }
+    }
+    // Bytes past the committed size are never read, so they are written without the lock
+    memcpy(stream->data + stream->size, data, size);
+    stream->size += size;
+}
+
+void vgm_stream_putc(vgm_stream_t* stream, uint8_t byte) {
+    vgm_stream_write(stream, &byte, 1);
+}
+
+size_t vgm_stream_tell(const vgm_stream_t* stream) {
+    return stream->size;
+}
+
+bool vgm_stream_commit(vgm_stream_t* stream, uint32_t samples) {
+    yasp_mutex_lock(&stream->lock);
+    stream->committed = stream->size;
+    stream->committed_samples = samples;
+    bool cancelled = stream->cancelled;
+    yasp_cond_broadcast(&stream->cond);
+    yasp_mutex_unlock(&stream->lock);
+    return !cancelled;
+}
+
+void vgm_stream_finish(vgm_stream_t* stream) {
+    yasp_mutex_lock(&stream->lock);
+    stream->committed = stream->size;
+    stream->finished = true;
+    yasp_cond_broadcast(&stream->cond);
+    yasp_mutex_unlock(&stream->lock);
+}
+
+size_t vgm_stream_read(vgm_stream_t* stream, size_t offset, void* buf, size_t size) {
+    yasp_mutex_lock(&stream->lock);
+    while (offset + size > stream->committed && !stream->finished && !stream->cancelled) {
+        // The player caught up with the converter
+        yasp_cond_wait(&stream->cond, &stream->lock, 100);
+    }
+    size_t available = (offset < stream->committed) ? stream->committed - offset : 0;
+    if (size > available) size = available;
+    memcpy(buf, stream->data + offset, size);
+    yasp_mutex_unlock(&stream->lock);
+    return size;
+}
+
+void vgm_stream_wait_samples(vgm_stream_t* stream, uint32_t samples) {
+    yasp_mutex_lock(&stream->lock);
+    while (stream->committed_samples < samples && !stream->finished && !stream->cancelled) {
+        yasp_cond_wait(&stream->cond, &stream->lock, 100);
+    }
+    yasp_mutex_unlock(&stream->lock);
+}
+
+void vgm_stream_cancel(vgm_stream_t* stream) {
+    yasp_mutex_lock(&stream->lock);
+    stream->cancelled = true;
+    yasp_cond_broadcast(&stream->cond);
+    yasp_mutex_unlock(&stream->lock);
+}
@@ -0,0 +1,47 @@
+#ifndef VGM_STREAM_H
+#define VGM_STREAM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "thread.h"
+
+// Append-only in-memory VGM stream.
+// The converter writes to it from its own thread while the player reads what has
+// been committed so far, so playback can start before the conversion is done.
+typedef struct {
+    uint8_t* data;
+    size_t size;                 // Bytes written by the producer
+    size_t capacity;
+    size_t committed;            // Bytes the readers may see
+    uint32_t committed_samples;  // Play time covered by the committed bytes
+    bool finished;               // No more data will be written
+    bool cancelled;              // The readers have gone, the producer may stop early
+    yasp_mutex_t lock;
+    yasp_cond_t cond;
+} vgm_stream_t;
+
+bool vgm_stream_init(vgm_stream_t* stream, size_t initial_capacity);
+void vgm_stream_free(vgm_stream_t* stream);
+
+// --- Producer side ---
+void vgm_stream_write(vgm_stream_t* stream, const void* data, size_t size);
+void vgm_stream_putc(vgm_stream_t* stream, uint8_t byte);
+size_t vgm_stream_tell(const vgm_stream_t* stream);
+// Makes everything written so far visible to the readers. samples is the play time it covers.
+// Returns false once the stream has been cancelled.
+bool vgm_stream_commit(vgm_stream_t* stream, uint32_t samples);
+// Commits the rest and marks the stream complete.
+void vgm_stream_finish(vgm_stream_t* stream);
+
+// --- Reader side ---
+// Copies up to size bytes from offset, waiting for the producer if they are not committed yet.
+// Returns fewer bytes only at the end of a finished stream.
+size_t vgm_stream_read(vgm_stream_t* stream, size_t offset, void* buf, size_t size);
+// Waits until at least samples of play time are committed, or the stream is finished.
+void vgm_stream_wait_samples(vgm_stream_t* stream, uint32_t samples);
+// Tells the producer nobody is reading any more.
+void vgm_stream_cancel(vgm_stream_t* stream);
+
+#endif // VGM_STREAM_H
@@ -1,42 +1,23 @@
 #include "ws_to_opm.h"
-#include "spfm.h"
 #include "chiptype.h"
 #include "error.h"
 #include <math.h>
 #include <stdio.h>
 #include <string.h>
 
-#define NUM_WS_CHANNELS 4
-
 // --- OPM Constants ---
 #define OPM_PAN_LEFT  0x40
 #define OPM_PAN_RIGHT 0x80
 #define OPM_PAN_CENTER 0xC0
 
 // --- Internal State ---
-typedef struct {
-    uint16_t period;
-    uint8_t vol_left;
-    uint8_t vol_right;
-    bool enabled;
-    bool active; // Note is currently playing
-    uint32_t note_on_time; // in samples
-    uint8_t last_opm_kc;
-    uint8_t last_opm_kf;
-} ws_channel_state_t;
-
-static ws_channel_state_t _ch_state[NUM_WS_CHANNELS];
-static uint8_t _regs[0x20]; // WS sound registers are from 0x80 to 0x9F
-static uint32_t _total_samples = 0;
-static double _clock_ratio;
-static uint32_t _source_clock;
-static chip_type_t _source_chip;
-static opm_write_func_t _write_func;
+static YASP_THREAD_LOCAL ws_to_opm_state_t _st;
+static YASP_THREAD_LOCAL reg_batch_t* _out;
 
 // --- Helper Functions ---
 static void _y(uint8_t addr, uint8_t data) {
-    if (_write_func) {
-        _write_func(addr, data);
+    if (_out) {
+        REG_BATCH_ADD(_out, REG_BATCH_CMD_OPM, addr, data);
     }
 }
 
@@ -68,23 +49,20 @@ static void _update_channel(int ch);
 
 // --- Public API ---
 
-void ws_to_opm_init(chip_type_t source_chip_type, uint32_t source_clock, opm_write_func_t write_func) {
+void ws_to_opm_init(chip_type_t source_chip_type, uint32_t source_clock, reg_batch_t* out) {
     logging(LOG_LEVEL_DEBUG, "ws_to_opm_init called.");
     
-    _source_chip = source_chip_type;
-    _source_clock = source_clock;
-    _write_func = write_func;
+    memset(&_st, 0, sizeof(_st));
+    _st.source_chip = source_chip_type;
+    _st.source_clock = source_clock;
+    _out = out;
 
     const double OPM_CLOCK = get_chip_default_clock(CHIP_TYPE_YM2151);
-    _clock_ratio = (double)source_clock / OPM_CLOCK;
-
-    memset(_regs, 0, sizeof(_regs));
-    memset(_ch_state, 0, sizeof(_ch_state));
-    _total_samples = 0;
+    _st.clock_ratio = (double)source_clock / OPM_CLOCK;
 
     // Initialize OPM channels 4,5,6,7 for WS tones
     for (int i = 0; i < NUM_WS_CHANNELS; i++) {
-        _ch_state[i].enabled = true; // Assume channels are enabled by default
+        _st.ch_state[i].enabled = true; // Assume channels are enabled by default
         int opmCh = i + 4;
         _y(0x20 + opmCh, OPM_PAN_CENTER | 0x3C); // Pan Center, FB=7, ALG=4
         _y(0x40 + opmCh, 0x02); // M1: DT=0 ML=2
@@ -118,35 +96,35 @@ void ws_to_opm_write_reg(uint8_t port, uint8_t addr, uint8_t data) {
     // For WS S-DSP, 'addr' is the register 0x00-0x1F.
     if (addr > 0x1F) return; // S-DSP registers are 0x00-0x1F
 
-    _regs[addr] = data;
+    _st.regs[addr] = data;
 
     uint16_t period;
     switch (addr) {
         case 0x00: case 0x01: // Ch1 Freq
-            period = ((_regs[0x01] & 0x07) << 8) | _regs[0x00];
-            _ch_state[0].period = (period == 0x7FF) ? 2048 : period;
+            period = ((_st.regs[0x01] & 0x07) << 8) | _st.regs[0x00];
+            _st.ch_state[0].period = (period == 0x7FF) ? 2048 : period;
             _update_channel(0);
             break;
         case 0x02: case 0x03: // Ch2 Freq
-            period = ((_regs[0x03] & 0x07) << 8) | _regs[0x02];
-            _ch_state[1].period = (period == 0x7FF) ? 2048 : period;
+            period = ((_st.regs[0x03] & 0x07) << 8) | _st.regs[0x02];
+            _st.ch_state[1].period = (period == 0x7FF) ? 2048 : period;
             _update_channel(1);
             break;
         case 0x04: case 0x05: // Ch3 Freq
-            period = ((_regs[0x05] & 0x07) << 8) | _regs[0x04];
-            _ch_state[2].period = (period == 0x7FF) ? 2048 : period;
+            period = ((_st.regs[0x05] & 0x07) << 8) | _st.regs[0x04];
+            _st.ch_state[2].period = (period == 0x7FF) ? 2048 : period;
             _update_channel(2);
             break;
         case 0x06: case 0x07: // Ch4 Freq
-            period = ((_regs[0x07] & 0x07) << 8) | _regs[0x06];
-            _ch_state[3].period = (period == 0x7FF) ? 2048 : period;
+            period = ((_st.regs[0x07] & 0x07) << 8) | _st.regs[0x06];
+            _st.ch_state[3].period = (period == 0x7FF) ? 2048 : period;
             _update_channel(3);
             break;
 
-        case 0x08: _ch_state[0].vol_right = data & 0x0F; _ch_state[0].vol_left = data >> 4; _update_channel(0); break;
-        case 0x09: _ch_state[1].vol_right = data & 0x0F; _ch_state[1].vol_left = data >> 4; _update_channel(1); break;
-        case 0x0A: _ch_state[2].vol_right = data & 0x0F; _ch_state[2].vol_left = data >> 4; _update_channel(2); break;
-        case 0x0B: _ch_state[3].vol_right = data & 0x0F; _ch_state[3].vol_left = data >> 4; _update_channel(3); break;
+        case 0x08: _st.ch_state[0].vol_right = data & 0x0F; _st.ch_state[0].vol_left = data >> 4; _update_channel(0); break;
+        case 0x09: _st.ch_state[1].vol_right = data & 0x0F; _st.ch_state[1].vol_left = data >> 4; _update_channel(1); break;
+        case 0x0A: _st.ch_state[2].vol_right = data & 0x0F; _st.ch_state[2].vol_left = data >> 4; _update_channel(2); break;
+        case 0x0B: _st.ch_state[3].vol_right = data & 0x0F; _st.ch_state[3].vol_left = data >> 4; _update_channel(3); break;
 
         case 0x0E: // Noise control - affects channel 3 if in noise mode
             _update_channel(3);
@@ -157,7 +135,7 @@ void ws_to_opm_write_reg(uint8_t port, uint8_t addr, uint8_t data) {
 
         case 0x10: // Channel Control (Enable bits, PCM/Noise mode)
             for (int i = 0; i < 4; ++i) {
-                _ch_state[i].enabled = (data & (1 << i)) != 0;
+                _st.ch_state[i].enabled = (data & (1 << i)) != 0;
             }
             // This register also controls noise mode for ch3, so update it.
             _update_channel(0);
@@ -169,11 +147,11 @@ void ws_to_opm_write_reg(uint8_t port, uint8_t addr, uint8_t data) {
 }
 
 static void _update_channel(int ch) {
-    ws_channel_state_t* state = &_ch_state[ch];
+    ws_channel_state_t* state = &_st.ch_state[ch];
     
     // Determine if channel 3 is in noise mode.
     // This is the ONLY channel that can be noise.
-    bool is_noise_mode = (ch == 3) && (_regs[0x10] & 0x80);
+    bool is_noise_mode = (ch == 3) && (_st.regs[0x10] & 0x80);
 
     bool should_be_on = state->enabled && (state->vol_left > 0 || state->vol_right > 0);
 
@@ -239,14 +217,14 @@ static void _update_channel(int ch) {
 
     if (should_be_on && !state->active) { // Key On
         state->active = true;
-        state->note_on_time = _total_samples;
+        state->note_on_time = _st.total_samples;
 
         double freq = period_to_freq(state->period);
         if (freq == 0.0) { // Don't key on if frequency is 0
             state->active = false;
             return;
         }
-        freqToOPMNote(freq, _clock_ratio, &state->last_opm_kc, &state->last_opm_kf);
+        freqToOPMNote(freq, _st.clock_ratio, &state->last_opm_kc, &state->last_opm_kf);
 
         _y(0x28 + opmCh, state->last_opm_kc);
         _y(0x30 + opmCh, state->last_opm_kf << 2);
@@ -276,11 +254,11 @@ static void _update_channel(int ch) {
         const uint32_t VIBRATO_DELAY_SAMPLES = 4410; // 100ms at 44.1kHz
 
         // Update frequency only after a delay to stabilize initial note recognition
-        if (_total_samples >= state->note_on_time + VIBRATO_DELAY_SAMPLES) {
+        if (_st.total_samples >= state->note_on_time + VIBRATO_DELAY_SAMPLES) {
             double freq = period_to_freq(state->period);
             if (freq > 0) {
                 uint8_t new_kc, new_kf;
-                freqToOPMNote(freq, _clock_ratio, &new_kc, &new_kf);
+                freqToOPMNote(freq, _st.clock_ratio, &new_kc, &new_kf);
                 if (new_kc != state->last_opm_kc || new_kf != state->last_opm_kf) {
                     state->last_opm_kc = new_kc;
                     state->last_opm_kf = new_kf;
@@ -306,10 +284,18 @@ static void _update_channel(int ch) {
     }
 }
 
-
 void ws_to_opm_update(uint32_t samples) {
-    _total_samples += samples;
+    _st.total_samples += samples;
     // The main logic is in _update_channel, called from ws_to_opm_write_reg.
     // This function just keeps track of time.
     (void)samples;
 }
+
+void ws_to_opm_save(ws_to_opm_state_t* state) {
+    memcpy(state, &_st, sizeof(_st));
+}
+
+void ws_to_opm_restore(const ws_to_opm_state_t* state, reg_batch_t* out) {
+    memcpy(&_st, state, sizeof(_st));
+    _out = out;
+}
@@ -2,13 +2,40 @@
 #define WS_TO_OPM_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "chiptype.h"
+#include "reg_batch.h"
+#include "thread.h"
 
-// Callback function pointer for writing OPM data
-typedef void (*opm_write_func_t)(uint8_t addr, uint8_t data);
+#define NUM_WS_CHANNELS 4
 
-void ws_to_opm_init(chip_type_t source_chip_type, uint32_t source_clock, opm_write_func_t write_func);
+typedef struct {
+    uint16_t period;
+    uint8_t vol_left;
+    uint8_t vol_right;
+    bool enabled;
+    bool active; // Note is currently playing
+    uint32_t note_on_time; // in samples
+    uint8_t last_opm_kc;
+    uint8_t last_opm_kf;
+} ws_channel_state_t;
+
+// Converter state. Each thread has its own, so tracks can be converted on several threads at once.
+typedef struct {
+    ws_channel_state_t ch_state[NUM_WS_CHANNELS];
+    uint8_t regs[0x20]; // WS sound registers are from 0x80 to 0x9F
+    uint32_t total_samples;
+    double clock_ratio;
+    uint32_t source_clock;
+    chip_type_t source_chip;
+} ws_to_opm_state_t;
+
+// Converted writes are appended to out. Without an output batch only the state is updated.
+void ws_to_opm_init(chip_type_t source_chip_type, uint32_t source_clock, reg_batch_t* out);
 void ws_to_opm_write_reg(uint8_t port, uint8_t addr, uint8_t data);
 void ws_to_opm_update(uint32_t samples); // For time-based updates if needed
+// Copies the state of this thread's converter, or replaces it and sets where its writes go.
+void ws_to_opm_save(ws_to_opm_state_t* state);
+void ws_to_opm_restore(const ws_to_opm_state_t* state, reg_batch_t* out);
 
 #endif /* WS_TO_OPM_H */
@@ -5,9 +5,9 @@
 #include "vgm.h"      // For g_vgm_header
 #include "util.h" // For yasp_uspin
 #include <math.h> // For log2
+#include <string.h>
 
 // YM2151 a.k.a OPM
-extern volatile int g_flush_mode;
 extern vgm_header_t g_vgm_header;
 extern bool g_opn_to_opm_conversion_enabled;
 
@@ -50,7 +50,6 @@ void ym2151_write_reg(uint8_t slot, uint8_t addr, uint8_t data) {
             spfm_write_reg(slot, 0, 0x28 + ch, okc);
             const uint8_t kf = newKey & 0xfc;
             spfm_write_reg(slot, 0, 0x30 + ch, kf);
-            if (g_flush_mode == 1) spfm_flush();
             return; // We've sent modified commands
         } else if (addr == 0x0f) { // Noise frequency
             const int nfrq = fmin(0x1f, round((data & 0x1f) * g_ym2151_clock_ratio));
@@ -62,58 +61,31 @@ void ym2151_write_reg(uint8_t slot, uint8_t addr, uint8_t data) {
     }
 
     spfm_write_reg(slot, 0, addr, data);
-    if (g_flush_mode == 1) { // Register-level flush
-        spfm_flush();
-    }
 }
 
 void ym2151_mute(uint8_t slot) {
     int i;
-    // A buffer large enough for all mute commands.
-    // (0xFF-0xE0+1) for SL/RR + 8 for Key-Off + 256 for zeroing = 32 + 8 + 256 = 296
-    spfm_reg_t regs[300];
-    int count = 0;
+    // Sent from a recording (chip_driver.c), so it is built once per device and slot
 
     // 1. Set SL=15, RR=15 for all operators
     for (i = 0xE0; i <= 0xFF; i++) {
-        regs[count++] = (spfm_reg_t){0, (uint8_t)i, 0xFF};
+        spfm_write_reg(slot, 0, (uint8_t)i, 0xFF);
     }
 
     // 2. Key off all channels
     for (i = 0; i < 8; i++) {
-        regs[count++] = (spfm_reg_t){0, 0x08, (uint8_t)i};
+        spfm_write_reg(slot, 0, 0x08, (uint8_t)i);
     }
 
     // 3. Zero all registers for a full reset
     for (i = 0; i <= 0xFF; i++) {
-        regs[count++] = (spfm_reg_t){0, (uint8_t)i, 0x00};
+        spfm_write_reg(slot, 0, (uint8_t)i, 0x00);
     }
-
-    // Write all commands in a single batch
-    spfm_write_regs(slot, regs, count, 0);
 }
 
 void ym2151_init(uint8_t slot) {
-    // Reset clock conversion state
-    g_ym2151_clock_ratio = 1.0;
-    g_ym2151_key_diff = 0;
-    g_ym2151_lfo_diff = 0;
-
-    if (!g_opn_to_opm_conversion_enabled) {
-        uint32_t vgm_clock = g_vgm_header.ym2151_clock;
-        uint32_t hardware_clock = get_chip_default_clock(CHIP_TYPE_YM2151);
-        if (vgm_clock > 0 && vgm_clock != hardware_clock) {
-            g_ym2151_clock_ratio = (double)hardware_clock / vgm_clock;
-            g_ym2151_key_diff = round(12 * log2(1.0 / g_ym2151_clock_ratio) * 256);
-            g_ym2151_lfo_diff = round(16 * log2(1.0 / g_ym2151_clock_ratio));
-            logging(LOG_LEVEL_INFO, "YM2151 clock mismatch. VGM: %dHz, HW: %dHz. Applying conversion.\n", vgm_clock, hardware_clock);
-        }
-    }
-    
-    // Full reset
+    // Full reset. Don't use converted writes here, just reset the chip.
     for (int i = 0; i <= 0xFF; i++) {
-        g_ym2151_regs[i] = 0;
-        // Don't use converted write here, just reset the chip state
         spfm_write_reg(slot, 0, (uint8_t)i, 0x00);
     }
     
@@ -128,12 +100,31 @@ void ym2151_init(uint8_t slot) {
     for (int i = 0x60; i <= 0x7F; i++) {
         spfm_write_reg(slot, 0, (uint8_t)i, 0x7F);
     }
+    
+    spfm_flush();
+}
+
+void ym2151_start(uint8_t slot) {
+    // Reset clock conversion state
+    g_ym2151_clock_ratio = 1.0;
+    g_ym2151_key_diff = 0;
+    g_ym2151_lfo_diff = 0;
+    memset(g_ym2151_regs, 0, sizeof(g_ym2151_regs));
+
+    if (!g_opn_to_opm_conversion_enabled) {
+        uint32_t vgm_clock = g_vgm_header.ym2151_clock;
+        uint32_t hardware_clock = get_clock_for_chip(CHIP_TYPE_YM2151);
+        if (vgm_clock > 0 && vgm_clock != hardware_clock) {
+            g_ym2151_clock_ratio = (double)hardware_clock / vgm_clock;
+            g_ym2151_key_diff = round(12 * log2(1.0 / g_ym2151_clock_ratio) * 256);
+            g_ym2151_lfo_diff = round(16 * log2(1.0 / g_ym2151_clock_ratio));
+            logging(LOG_LEVEL_INFO, "YM2151 clock mismatch. VGM: %dHz, HW: %dHz. Applying conversion.\n", vgm_clock, hardware_clock);
+        }
+    }
 
     // Apply initial LFO diff if needed
     if (g_ym2151_clock_ratio != 1.0 && !g_opn_to_opm_conversion_enabled) {
         const int lfrq = fmax(0, fmin(255, round(g_ym2151_lfo_diff)));
         spfm_write_reg(slot, 0, 0x18, lfrq);
     }
-    
-    spfm_flush();
 }
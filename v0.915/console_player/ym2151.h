@@ -6,5 +6,7 @@
 void ym2151_write_reg(uint8_t slot, uint8_t addr, uint8_t data);
 void ym2151_mute(uint8_t slot);
 void ym2151_init(uint8_t slot);
+// Sets up the clock conversion for the current file. Called after the init sequence.
+void ym2151_start(uint8_t slot);
 
 #endif /* YM2151_H */
@@ -49,5 +49,40 @@ void ym2608_mute(uint8_t slot) {
     ym2608_write_reg(slot, 0, 0x1d, 0x1f); // RYM
 
     // ADPCM mute
+    ym2608_write_reg(slot, 1, 0x00, 0x01); // Reset stops playback
+    ym2608_write_reg(slot, 1, 0x00, 0x00);
     ym2608_write_reg(slot, 1, 0x0b, 0x00);
 }
+
+// ADPCM RAM writes go through port 1, following node-spfm
+void ym2608_ram_begin(uint8_t slot, uint32_t address, uint32_t size) {
+    uint32_t start = address;
+    uint32_t stop = start + size - 1;
+    // The limit seems to be the end of the ADPCM-A RAM area.
+    uint32_t limit = (stop < 0x3FFFF) ? stop : 0x3FFFF;
+
+    // Addresses are shifted, as node-spfm does
+    start >>= 2;
+    stop >>= 2;
+    limit >>= 2;
+
+    ym2608_write_reg(slot, 1, 0x10, 0x80); // Reset flags
+    ym2608_write_reg(slot, 1, 0x00, 0x60); // Memory write command
+    ym2608_write_reg(slot, 1, 0x01, 0x00); // Memory type
+
+    ym2608_write_reg(slot, 1, 0x02, start & 0xff);
+    ym2608_write_reg(slot, 1, 0x03, (start >> 8) & 0xff);
+    ym2608_write_reg(slot, 1, 0x04, stop & 0xff);
+    ym2608_write_reg(slot, 1, 0x05, (stop >> 8) & 0xff);
+    ym2608_write_reg(slot, 1, 0x0c, limit & 0xff);
+    ym2608_write_reg(slot, 1, 0x0d, (limit >> 8) & 0xff);
+}
+
+void ym2608_ram_write(uint8_t slot, const uint8_t* data, size_t size) {
+    spfm_write_reg_run(slot, 1, 0x08, data, size);
+}
+
+void ym2608_ram_end(uint8_t slot) {
+    ym2608_write_reg(slot, 1, 0x00, 0x00); // End memory write mode
+    ym2608_write_reg(slot, 1, 0x10, 0x80); // Reset flags again
+}
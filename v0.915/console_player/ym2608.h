@@ -2,9 +2,15 @@
 #define YM2608_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 void ym2608_write_reg(uint8_t slot, uint8_t port, uint8_t addr, uint8_t data);
 void ym2608_init(uint8_t slot);
 void ym2608_mute(uint8_t slot);
 
+// Writes size bytes into ADPCM RAM from address: begin, the data in any number of pieces, end.
+void ym2608_ram_begin(uint8_t slot, uint32_t address, uint32_t size);
+void ym2608_ram_write(uint8_t slot, const uint8_t* data, size_t size);
+void ym2608_ram_end(uint8_t slot);
+
 #endif // YM2608_H
@@ -0,0 +1,115 @@
+#include "ym2608_upload.h"
+#include "ym2608.h"
+#include "spfm.h"
+#include "util.h"
+#include "error.h"
+
+#include <stdlib.h>
+
+// Bytes sent between two progress reports. Each is flushed, which also paces the upload.
+#define YM2608_UPLOAD_PIECE (16 * 1024)
+#define YM2608_RESIDENT_MAX 32
+
+// Blocks known to be in the chip's RAM
+typedef struct {
+    uint32_t address;
+    uint32_t size;
+    uint32_t hash;
+} ym2608_resident_t;
+
+static ym2608_resident_t s_resident[YM2608_RESIDENT_MAX];
+static int s_resident_count = 0;
+
+static uint32_t ym2608_upload_hash(const uint8_t* data, uint32_t size) {
+    uint32_t h = 2166136261u;
+    for (uint32_t i = 0; i < size; i++) {
+        h ^= data[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static bool ym2608_is_resident(uint32_t address, uint32_t size, uint32_t hash) {
+    for (int i = 0; i < s_resident_count; i++) {
+        if (s_resident[i].address == address && s_resident[i].size == size && s_resident[i].hash == hash) return true;
+    }
+    return false;
+}
+
+// Records a block as sent. Blocks it overwrote, even in part, are no longer in RAM.
+static void ym2608_set_resident(uint32_t address, uint32_t size, uint32_t hash) {
+    int n = 0;
+    for (int i = 0; i < s_resident_count; i++) {
+        const ym2608_resident_t* r = &s_resident[i];
+        if (r->address + r->size <= address || address + size <= r->address) s_resident[n++] = *r;
+    }
+    if (n == YM2608_RESIDENT_MAX) {
+        // Forget the oldest
+        for (int i = 1; i < n; i++) s_resident[i - 1] = s_resident[i];
+        n--;
+    }
+    s_resident[n].address = address;
+    s_resident[n].size = size;
+    s_resident[n].hash = hash;
+    s_resident_count = n + 1;
+}
+
+void ym2608_upload_forget(void) {
+    s_resident_count = 0;
+}
+
+bool ym2608_upload_block(uint8_t slot, const uint8_t* payload, uint32_t size, ym2608_upload_progress_t progress) {
+    if (size <= 8) return false;
+    uint32_t address = read_le32(payload + 4);
+    const uint8_t* data = payload + 8;
+    uint32_t data_size = size - 8;
+
+    uint32_t hash = ym2608_upload_hash(data, data_size);
+    if (ym2608_is_resident(address, data_size, hash)) {
+        logging(LOG_LEVEL_DEBUG, "YM2608 ADPCM block at 0x%06x (%u bytes) is already loaded.", address, data_size);
+        return false;
+    }
+
+    uint64_t start_us = get_current_time_us();
+    ym2608_ram_begin(slot, address, data_size);
+    uint32_t done = 0;
+    while (done < data_size) {
+        uint32_t n = data_size - done < YM2608_UPLOAD_PIECE ? data_size - done : YM2608_UPLOAD_PIECE;
+        ym2608_ram_write(slot, data + done, n);
+        spfm_flush();
+        done += n;
+        if (progress) {
+            uint64_t elapsed_us = get_current_time_us() - start_us;
+            progress(done, data_size, elapsed_us ? (uint32_t)((uint64_t)done * 1000000 / elapsed_us) : 0);
+        }
+    }
+    ym2608_ram_end(slot);
+    spfm_flush();
+    ym2608_set_resident(address, data_size, hash);
+
+    uint64_t elapsed_us = get_current_time_us() - start_us;
+    logging(LOG_LEVEL_INFO, "YM2608 ADPCM block at 0x%06x loaded: %u bytes in %u ms (%u KB/s)", address, data_size,
+            (unsigned)(elapsed_us / 1000), elapsed_us ? (unsigned)((uint64_t)data_size * 1000000 / elapsed_us / 1024) : 0);
+    return true;
+}
+
+void ym2608_upload_preload(uint8_t slot, FILE* fp, const vgm_header_t* header, ym2608_upload_progress_t progress) {
+    long saved = ftell(fp);
+    uint32_t pos = header->vgm_data_offset;
+
+    // Data blocks come first in the stream. The walk stops at the first other command.
+    uint8_t head[7];
+    while (fseek(fp, (long)pos, SEEK_SET) == 0 && fread(head, 1, sizeof(head), fp) == sizeof(head)
+           && head[0] == 0x67 && head[1] == 0x66) {
+        uint32_t size = read_le32(head + 3);
+        if (head[2] == VGM_DATA_YM2608_DELTAT && size <= YM2608_UPLOAD_MAX_BLOCK) {
+            uint8_t* payload = malloc(size ? size : 1);
+            if (payload && fread(payload, 1, size, fp) == size) {
+                ym2608_upload_block(slot, payload, size, progress);
+            }
+            free(payload);
+        }
+        pos += sizeof(head) + size;
+    }
+    fseek(fp, saved, SEEK_SET);
+}
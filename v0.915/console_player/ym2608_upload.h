@@ -0,0 +1,33 @@
+#ifndef YM2608_UPLOAD_H
+#define YM2608_UPLOAD_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "vgm.h"
+
+// YM2608 ADPCM RAM uploads.
+// VGM data blocks of type 0x81 hold an image of the YM2608 ADPCM RAM. They are streamed
+// to the chip through the transmit buffer in large pieces, and the progress is reported
+// as they go. Every block sent is remembered by address and content, so a block that is
+// already in the chip's RAM is not sent again. Tracks from one game usually share their
+// samples, so only the first of them has to wait for the upload.
+
+#define VGM_DATA_YM2608_DELTAT 0x81
+// Larger blocks are not a YM2608 RAM image
+#define YM2608_UPLOAD_MAX_BLOCK (16 * 1024 * 1024)
+
+typedef void (*ym2608_upload_progress_t)(uint32_t done, uint32_t total, uint32_t bytes_per_sec);
+
+// Uploads the payload of a 0x81 data block: u32 RAM size, u32 start address, data.
+// Returns true if it was sent, false if it was in RAM already or is not valid.
+bool ym2608_upload_block(uint8_t slot, const uint8_t* payload, uint32_t size, ym2608_upload_progress_t progress);
+
+// Uploads the data blocks at the start of the command stream of a VGM file, before
+// playback starts. The position of fp is kept.
+void ym2608_upload_preload(uint8_t slot, FILE* fp, const vgm_header_t* header, ym2608_upload_progress_t progress);
+
+// Forgets what is in the RAM, such as when the device is opened again.
+void ym2608_upload_forget(void);
+
+#endif // YM2608_UPLOAD_H